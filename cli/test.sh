@@ -12,9 +12,10 @@ fi
 
 # Set up some variables, e.g. paths and what programs to run:
 CWD=`pwd`
-UNIT_TEST_PROGS="../build/test/test_event_main
+UNIT_TEST_PROGS="../build/test/test_event_main ../build/test/test_event_posix
 ../build/test/test_protocol_main
-../build/test/test_transport_main ../build/test/test_resend_posix"
+../build/test/test_transport_main ../build/test/test_resend_posix
+../build/test/test_reactor_posix"
 UNIT_TEST_ROOT_PROGS="../build/test/test_transport_eth_posix_main
 ../build/test/test_transport_eth_posix_main"
 
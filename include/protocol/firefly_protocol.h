@@ -78,6 +78,24 @@ struct firefly_memory_funcs {
  */
 void firefly_channel_open(struct firefly_connection *conn);
 
+/**
+ * @brief Creates and offers an event to open a channel with forward error
+ * correction on the provided connection.
+ *
+ * After every \p group_size data samples of at most one fragment a parity
+ * sample is sent, from which the receiver rebuilds any single sample of the
+ * group that is lost instead of waiting for the transport layer to resend it.
+ * The remote node may lower the group size or turn the correction off when
+ * it accepts the channel.
+ *
+ * @param conn The connection to open a channel on.
+ * @param group_size The number of data samples protected by each parity
+ * sample, at most 16. 0 opens a channel without forward error correction.
+ * @see firefly_channel_open()
+ */
+void firefly_channel_open_fec(struct firefly_connection *conn,
+		unsigned int group_size);
+
 /**
  * @brief Creates and offers first a close event for the channel and
  * then a closed event for the same.
@@ -85,6 +103,8 @@ void firefly_channel_open(struct firefly_connection *conn);
  * The close event will send a firefly_protocol_channel_close packet.
  * The closed event will free the channel's memory and remove it from
  * the connection's chan_list.
+ * Data samples written on the channel before it is closed are sent
+ * first, whatever the priority class of the channel.
  *
  * @param chan The channel to close and free.
  * @return The ID of the event freeing the channel.
@@ -154,6 +174,17 @@ typedef void (* firefly_channel_restrict_info_f)(struct firefly_channel *chan,
 typedef void (* firefly_channel_error_f)(struct firefly_channel *chan,
 		enum firefly_error reason, const char *message);
 
+/**
+ * @brief A prototype of the callback used when data samples written on a
+ * channel are dropped because their deadline passed before they were sent.
+ *
+ * @param chan The channel the samples were written on.
+ * @param nbr_expired The number of samples of the channel dropped so far.
+ * @see firefly_channel_set_deadline()
+ */
+typedef void (* firefly_channel_expired_f)(struct firefly_channel *chan,
+		unsigned int nbr_expired);
+
 /**
  * @brief A prototype of the callback used when an error occurs on the
  * provided connection.
@@ -196,6 +227,7 @@ struct firefly_connection_actions {
 	firefly_channel_error_f		channel_error;		/**< Called when an error occurs on a channel. */
 	firefly_connection_error_f	connection_error;	/**< Called when an error occurs on a connection. */
 	firefly_connection_opened_f connection_opened;	/**< Called when a connection is opened.  */
+	firefly_channel_expired_f	channel_expired;	/**< Called when data samples are dropped past their deadline. */
 };
 
 
@@ -269,8 +301,7 @@ struct labcomm_decoder *firefly_protocol_get_input_stream(
 /**
  * @brief The number of channels in the connection.
  *
- * The complexity of this function is O(n) where n is the number of
- * channels.
+ * The complexity of this function is O(1).
  *
  * @param conn The connection to count channels on.
  * @return The number of channels open on this connection.
@@ -286,6 +317,94 @@ size_t firefly_number_channels_in_connection(struct firefly_connection *conn);
 struct firefly_connection *firefly_channel_get_connection(
 		struct firefly_channel *chan);
 
+/**
+ * @brief The priority classes of the traffic of a channel.
+ */
+enum firefly_channel_priority {
+	FIREFLY_CHANNEL_PRIORITY_BULK, /**< Throughput traffic, e.g. logging,
+									 which yields to the other classes. */
+	FIREFLY_CHANNEL_PRIORITY_NORMAL, /**< The class of a new channel. */
+	FIREFLY_CHANNEL_PRIORITY_CONTROL /**< Latency critical traffic, e.g. a
+									   control loop. */
+};
+
+/**
+ * @brief Sets the priority class of a channel.
+ *
+ * The class decides the priority of the events sending the data samples of
+ * the channel and, since each sample carries it, of the events delivering
+ * them on the remote node. Link layer ports supporting it also map the class
+ * onto the priority of the frames on the network.
+ *
+ * Must be called from an event of the connection, typically the
+ * channel_recv or channel_opened callback when the channel is opened.
+ *
+ * @param chan The channel.
+ * @param priority The priority class of the channel.
+ */
+void firefly_channel_set_priority(struct firefly_channel *chan,
+		enum firefly_channel_priority priority);
+
+/**
+ * @brief Gets the priority class of a channel.
+ *
+ * @param chan The channel.
+ * @return The priority class of the channel.
+ */
+enum firefly_channel_priority firefly_channel_get_priority(
+		struct firefly_channel *chan);
+
+/**
+ * @brief Makes a channel send only the newest data sample of each type.
+ *
+ * A data sample written while an older one of the same type still waits to
+ * be sent replaces it, so the samples queued for the channel are bounded by
+ * its number of types rather than by the rate they are written at. Intended
+ * for state-style data, e.g. telemetry, where only the latest value matters.
+ * Signatures are never conflated.
+ *
+ * Must be called from an event of the connection, like
+ * firefly_channel_set_priority().
+ *
+ * @param chan The channel.
+ * @param conflate If the channel conflates its data samples.
+ * @param min_interval The least number of milliseconds between two sends of
+ * a conflating channel, samples written in between are conflated. 0 sends as
+ * soon as possible.
+ */
+void firefly_channel_set_conflate(struct firefly_channel *chan, bool conflate,
+		unsigned int min_interval);
+
+/**
+ * @brief Gives the data samples written on a channel a deadline.
+ *
+ * A data sample not sent within \p ttl milliseconds of being written is
+ * dropped rather than sent late, e.g. a control setpoint stuck in the event
+ * queue. Samples with a deadline are never packed into frames the link layer
+ * resends, so no retransmission carries them late either. Drops are counted
+ * and reported to the channel_expired action of the connection. The time is
+ * read from the clock of the event queue of the connection, see
+ * firefly_event_queue_now().
+ *
+ * Must be called from an event of the connection, like
+ * firefly_channel_set_priority().
+ *
+ * @param chan The channel.
+ * @param ttl The number of milliseconds each data sample may wait to be
+ * sent, 0 if forever.
+ */
+void firefly_channel_set_deadline(struct firefly_channel *chan,
+		unsigned int ttl);
+
+/**
+ * @brief Gets the number of data samples of a channel dropped because their
+ * deadline passed.
+ *
+ * @param chan The channel.
+ * @return The number of dropped samples.
+ */
+unsigned int firefly_channel_get_expired(struct firefly_channel *chan);
+
 /**
  * @brief Gets the context of the connection.
  *
@@ -312,6 +431,80 @@ void firefly_connection_set_context(struct firefly_connection * const conn,
 struct firefly_event_queue *firefly_connection_get_event_queue(
 	       struct firefly_connection *conn);
 
+/**
+ * @brief Pack consecutive unimportant messages of the connection into shared
+ * datagrams.
+ *
+ * Messages are sent when the events queued for the connection have been
+ * executed, when the next message would not fit in \p mtu bytes or, at the
+ * latest, after \p max_delay_us microseconds. The delay is rounded up to the
+ * millisecond resolution of the timed events of the queue and is only
+ * enforced by queues supporting timed events. Important messages are never
+ * packed, they flush the pending messages and are sent on their own, possibly
+ * along with the acks delayed by firefly_connection_set_delayed_ack().
+ *
+ * @param conn The connection to set the coalescing of.
+ * @param mtu The maximum number of bytes to pack into one datagram, at most
+ * the size of a transport frame. Coalescing is disabled if 0, which is the
+ * default.
+ * @param max_delay_us The maximum time a message may wait for more messages,
+ * 0 to only wait for the queued events.
+ * @return The ID of the event changing the setting.
+ * @retval A negative value upon error.
+ */
+int64_t firefly_connection_set_tx_coalescing(struct firefly_connection *conn,
+		size_t mtu, unsigned int max_delay_us);
+
+/**
+ * @brief Delay the acks of important packets received on the connection so
+ * that several acks are sent in one message.
+ *
+ * The acks of all channels of the connection are sent together when the next
+ * data sample is sent on the connection, in the same datagram, or at the
+ * latest after \p max_delay_us microseconds. An ack tells the sender the
+ * highest packet received in order and which of the following ones have been
+ * received. The delay is rounded up to milliseconds and must be well below the
+ * resend timeout of the transport, or the sender resends packets already
+ * received. Queues not supporting timed events send the acks once the events
+ * queued for the connection have been executed.
+ *
+ * @param conn The connection to set the ack delay of.
+ * @param max_delay_us The maximum time an ack may be delayed. Acks are sent
+ * immediately if 0, which is the default, and any delayed acks are sent.
+ * @return The ID of the event changing the setting.
+ * @retval A negative value upon error.
+ */
+int64_t firefly_connection_set_delayed_ack(struct firefly_connection *conn,
+		unsigned int max_delay_us);
+
+/**
+ * @brief The state of the congestion window of a connection.
+ *
+ * The window limits the bytes of important samples in flight on all channels
+ * of the connection, counting only the packets the transport layer resends.
+ * It grows as packets are acked and is halved when the transport layer resends
+ * a packet that was not acked in time.
+ */
+struct firefly_congestion_state {
+	size_t cwnd; /**< The number of bytes that may be in flight. */
+	size_t ssthresh; /**< The window up to which it grows exponentially,
+					   above it grows linearly. */
+	size_t in_flight; /**< The number of bytes sent and not yet acked. */
+	unsigned int backoffs; /**< The number of times the window was cut. */
+};
+
+/**
+ * @brief Get the state of the congestion window of the connection.
+ *
+ * The state is updated by the events of the connection. It is only
+ * consistent if read from an event of the connection or while none runs.
+ *
+ * @param conn The connection to get the state of.
+ * @param state Set to the state of the congestion window.
+ */
+void firefly_connection_get_congestion(struct firefly_connection *conn,
+		struct firefly_congestion_state *state);
+
 /**
  * @brief Request restriction of reliability and type registration on
  * encoders on channel. The agreement is not in effect until the
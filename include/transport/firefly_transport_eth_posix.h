@@ -4,11 +4,26 @@
 #include <transport/firefly_transport.h>
 #include <sys/time.h>
 
+#include <utils/firefly_reactor_posix.h>
+
 /**
- * @brief The default interval between resending important packets.
+ * @brief The default interval between resending important packets, used until
+ * the round trip time of the connection is measured.
  */
 #define FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_TIMEOUT (500)
 
+/**
+ * @brief The shortest interval in ms between resending important packets
+ * estimated from the round trip time.
+ */
+#define FIREFLY_TRANSPORT_ETH_POSIX_MIN_TIMEOUT (1)
+
+/**
+ * @brief The longest interval in ms between resending important packets, the
+ * interval is doubled on each resend up to this bound.
+ */
+#define FIREFLY_TRANSPORT_ETH_POSIX_MAX_TIMEOUT (5000)
+
 /**
  * @brief The default number of retries to send an important packet before
  * giving up.
@@ -41,6 +56,11 @@ typedef int64_t (*firefly_on_conn_recv_eth_posix_f)(
  * ethernet posix specific data and open an ethernet socket bound to the
  * interface with the name \a iface_name.
  *
+ * Each frame is sent with the socket priority of the highest
+ * #firefly_channel_priority of the channels it carries data of, 1 for bulk, 6
+ * for control and the default for all others, which the kernel maps onto the
+ * traffic class and VLAN priority of the frame.
+ *
  * @param iface_name The name of the interface to bind the new socket to.
  * @param on_conn_recv The callback to call when a new connection is received.
  * If it is NULL no received connections will be accepted.
@@ -125,4 +145,31 @@ int firefly_transport_eth_posix_run(struct firefly_transport_llp *llp);
  * @see #firefly_transport_eth_posix_run()
  */
 int firefly_transport_eth_posix_stop(struct firefly_transport_llp *llp);
+
+/**
+ * @brief Let a reactor read from the socket and resend important packets
+ * instead of starting the reader and resend thread with
+ * firefly_transport_eth_posix_run().
+ *
+ * @param llp The LLP to attach, must not be running.
+ * @param reactor The reactor to host the LLP.
+ * @return Integer indicating success or failure.
+ * @retval 0 if successfull.
+ * @retval <0 upon error, e.g. if the LLP is already attached.
+ * @see #firefly_transport_eth_posix_detach()
+ */
+int firefly_transport_eth_posix_attach(struct firefly_transport_llp *llp,
+		struct firefly_reactor_posix *reactor);
+
+/**
+ * @brief Detach the LLP from its reactor. Must be done before the LLP is
+ * freed.
+ *
+ * @param llp The LLP to detach.
+ * @return Integer indicating success or failure.
+ * @retval 0 if successfull.
+ * @retval <0 if the LLP is not attached.
+ * @see #firefly_transport_eth_posix_attach()
+ */
+int firefly_transport_eth_posix_detach(struct firefly_transport_llp *llp);
 #endif
@@ -13,6 +13,7 @@
 #include <protocol/firefly_protocol.h>
 #include <transport/firefly_transport.h>
 #include <utils/firefly_event_queue.h>
+#include <utils/firefly_reactor_posix.h>
 
 /**
  * @brief This callback will be called when a new connection is received.
@@ -113,6 +114,33 @@ int firefly_transport_tcp_posix_run(struct firefly_transport_llp *llp);
  */
 int firefly_transport_tcp_posix_stop(struct firefly_transport_llp *llp);
 
+/**
+ * @brief Let a reactor read from the listening and connection sockets instead
+ * of starting the reader thread with firefly_transport_tcp_posix_run().
+ * Connections accepted or opened later are added to the reactor as well.
+ *
+ * @param llp The LLP to attach, must not be running.
+ * @param reactor The reactor to host the LLP.
+ * @return Integer indicating success or failure.
+ * @retval 0 if successfull.
+ * @retval <0 upon error, e.g. if the LLP is already attached.
+ * @see #firefly_transport_tcp_posix_detach()
+ */
+int firefly_transport_tcp_posix_attach(struct firefly_transport_llp *llp,
+		struct firefly_reactor_posix *reactor);
+
+/**
+ * @brief Detach the LLP from its reactor. Must be done before the LLP is
+ * freed.
+ *
+ * @param llp The LLP to detach.
+ * @return Integer indicating success or failure.
+ * @retval 0 if successfull.
+ * @retval <0 if the LLP is not attached.
+ * @see #firefly_transport_tcp_posix_attach()
+ */
+int firefly_transport_tcp_posix_detach(struct firefly_transport_llp *llp);
+
 /**
  * @brief Read data from the #firefly_transport_llp. Any read data will be
  * included in an event pushed to the #firefly_event_queue.
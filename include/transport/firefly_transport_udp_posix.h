@@ -2,6 +2,11 @@
  * @file
  * @brief The public API of the transport UDP POSIX with specific structures and
  * functions.
+ *
+ * On posix each packet is sent with the socket priority and DSCP of the
+ * highest #firefly_channel_priority of the channels it carries data of: bulk
+ * packets with priority 1 and CS1, control packets with priority 6 and EF and
+ * all others with the defaults.
  */
 #ifndef FIREFLY_TRANSPORT_UDP_POSIX_H
 #define FIREFLY_TRANSPORT_UDP_POSIX_H
@@ -13,12 +18,28 @@
 #include <protocol/firefly_protocol.h>
 #include <transport/firefly_transport.h>
 #include <utils/firefly_event_queue.h>
+#ifndef LABCOMM_COMPAT
+#include <utils/firefly_reactor_posix.h>
+#endif
 
 /**
- * @brief The default interval between resending important packets.
+ * @brief The default interval between resending important packets, used until
+ * the round trip time of the connection is measured.
  */
 #define FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_TIMEOUT (500)
 
+/**
+ * @brief The shortest interval in ms between resending important packets
+ * estimated from the round trip time.
+ */
+#define FIREFLY_TRANSPORT_UDP_POSIX_MIN_TIMEOUT (1)
+
+/**
+ * @brief The longest interval in ms between resending important packets, the
+ * interval is doubled on each resend up to this bound.
+ */
+#define FIREFLY_TRANSPORT_UDP_POSIX_MAX_TIMEOUT (5000)
+
 /**
  * @brief The default number of retries to send an important packet before
  * giving up.
@@ -83,7 +104,11 @@ void firefly_transport_llp_udp_posix_free(struct firefly_transport_llp *llp);
  * @param llp The \c #firefly_transport_llp to associate the data with.
  * @param remote_ipaddr The IP address to connect to.
  * @param remote_port The port to connect to.
- * @param timeout The time in ms between resends.
+ * @param timeout The time in ms between resends until the round trip time of
+ * the connection is measured. The interval is then estimated from the round
+ * trip times and backed off on resends, within
+ * #FIREFLY_TRANSPORT_UDP_POSIX_MIN_TIMEOUT and
+ * #FIREFLY_TRANSPORT_UDP_POSIX_MAX_TIMEOUT.
  * @return The transport specific data ready to be supplied as argument to
  * #firefly_connection_open().
  * @retval NULL upon failure.
@@ -120,6 +145,35 @@ int firefly_transport_udp_posix_run(struct firefly_transport_llp *llp);
  */
 int firefly_transport_udp_posix_stop(struct firefly_transport_llp *llp);
 
+#ifndef LABCOMM_COMPAT
+/**
+ * @brief Let a reactor read from the socket and resend important packets
+ * instead of starting the reader and resend thread with
+ * firefly_transport_udp_posix_run().
+ *
+ * @param llp The LLP to attach, must not be running.
+ * @param reactor The reactor to host the LLP.
+ * @return Integer indicating success or failure.
+ * @retval 0 if successfull.
+ * @retval <0 upon error, e.g. if the LLP is already attached.
+ * @see #firefly_transport_udp_posix_detach()
+ */
+int firefly_transport_udp_posix_attach(struct firefly_transport_llp *llp,
+		struct firefly_reactor_posix *reactor);
+
+/**
+ * @brief Detach the LLP from its reactor. Must be done before the LLP is
+ * freed.
+ *
+ * @param llp The LLP to detach.
+ * @return Integer indicating success or failure.
+ * @retval 0 if successfull.
+ * @retval <0 if the LLP is not attached.
+ * @see #firefly_transport_udp_posix_attach()
+ */
+int firefly_transport_udp_posix_detach(struct firefly_transport_llp *llp);
+#endif
+
 /**
  * @brief Read data from the #firefly_transport_llp. Any read data will be
  * included in an event pushed to the #firefly_event_queue.
@@ -130,6 +184,11 @@ int firefly_transport_udp_posix_stop(struct firefly_transport_llp *llp);
  * If no such connection exists the #firefly_on_conn_recv_pudp will be called,
  * if it is NULL the data will be discarded.
  *
+ * If inline reading is enabled, see
+ * firefly_transport_udp_posix_set_inline_read(), data on an existing
+ * connection is processed on the calling thread when the event queue allows
+ * it.
+ *
  * This function is blocking.
  *
  * @param llp The Link Layer Port to read data from.
@@ -137,4 +196,25 @@ int firefly_transport_udp_posix_stop(struct firefly_transport_llp *llp);
  */
 void firefly_transport_udp_posix_read(struct firefly_transport_llp *llp);
 
+/**
+ * @brief Enable or disable running read data to completion on the reader
+ * thread. Disabled by default.
+ *
+ * When enabled, data read on an existing connection is decoded on the reader
+ * thread if firefly_event_run_inline() allows it, i.e. if the event queue has
+ * nothing queued and no conflicting event is executing. Unimportant data
+ * samples on open channels are then delivered to the application directly
+ * from the reader thread, saving two event queue handoffs. Control messages,
+ * important samples and data from unknown remote nodes are still handled
+ * through events, as is all data when the queue is busy.
+ *
+ * @note The application data sample handlers may then be called from the
+ * reader thread, never concurrently with the events of the connection.
+ *
+ * @param llp The LLP to configure, must not be running.
+ * @param inline_read True to enable inline reading.
+ */
+void firefly_transport_udp_posix_set_inline_read(
+		struct firefly_transport_llp *llp, bool inline_read);
+
 #endif
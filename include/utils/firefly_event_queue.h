@@ -34,6 +34,14 @@
  */
 #define FIREFLY_EVENT_QUEUE_MAX_DEPENDS (10)
 
+/**
+ * @brief The largest context in bytes copied into the event itself, larger
+ * copied contexts need an allocation of their own.
+ *
+ * @see firefly_event_offer_copy()
+ */
+#define FIREFLY_EVENT_PAYLOAD_SIZE (128)
+
 /**
  * @defgroup eq_prio Event Queue Priorities
  * @brief Defines common priorities.
@@ -105,6 +113,135 @@ typedef int64_t (*firefly_offer_event)(struct firefly_event_queue *eq,
 		unsigned char prio, firefly_event_execute_f execute, void *context,
 		unsigned int nbr_depends, const int64_t *depends);
 
+/**
+ * @brief The function implementing adding an event belonging to a strand to
+ * the event queue in a thread safe way.
+ *
+ * A strand is an opaque key, typically a firefly_connection. Executors running
+ * events on several threads guarantee that events of the same strand are
+ * executed in queue order and never concurrently. Events without a strand
+ * (NULL) are executed exclusively, no other event runs at the same time.
+ *
+ * @param eq The firefly_event_queue to add the event to.
+ * @param strand The strand of the event or NULL.
+ * @param prio The prioity of the new event.
+ * @param execute A function implementing the event to be executed.
+ * @param context The argument to the function \p execute.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids the event depends on.
+ * @return The positive id of the newly added event.
+ * @retval <0 if an error occured.
+ * @see #firefly_offer_event
+ */
+typedef int64_t (*firefly_offer_strand_event)(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, unsigned int nbr_depends, const int64_t *depends);
+
+/**
+ * @brief Describes one event of a batch added with firefly_event_add_batch().
+ */
+struct firefly_event_batch_entry {
+	void *strand; /**< The strand of the event or NULL. */
+	unsigned char prio; /**< The priority of the event. */
+	firefly_event_execute_f execute; /**< The function called when the
+										event is executed. */
+	void *context; /**< The argument passed to \a execute. */
+	size_t context_size; /**< The number of bytes of \a context to copy or 0
+						   to pass \a context as is. */
+	unsigned int nbr_depends; /**< The number of events this event depends
+								on. */
+	const int64_t *depends; /**< The IDs of the events this event depends
+							  on, copied when the event is added. */
+	int64_t id; /**< Set to the ID of the added event or a negative value if
+				  the event could not be added. */
+};
+
+/**
+ * @brief The function implementing adding a batch of events to the event
+ * queue in a thread safe way, typically taking a lock only once for the whole
+ * batch.
+ *
+ * @param eq The firefly_event_queue to add the events to.
+ * @param entries The events to add, the id of each entry is set.
+ * @param nbr_entries The number of entries.
+ * @return The number of events successfully added.
+ */
+typedef size_t (*firefly_offer_event_batch)(struct firefly_event_queue *eq,
+		struct firefly_event_batch_entry *entries, size_t nbr_entries);
+
+/**
+ * @brief The function implementing adding an event that is due after a delay
+ * to the event queue in a thread safe way.
+ *
+ * The queue is responsible for keeping time and for moving the event to the
+ * queue once it is due, see firefly_event_queue_advance().
+ *
+ * @param eq The firefly_event_queue to add the event to.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the event once it is due.
+ * @param execute A function implementing the event to be executed.
+ * @param context The argument to the function \p execute.
+ * @param delay The number of milliseconds until the event is due.
+ * @return The positive id of the newly added event.
+ * @retval <0 if an error occured.
+ */
+typedef int64_t (*firefly_offer_timed_event)(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, int64_t delay);
+
+/**
+ * @brief The function implementing cancelling an event in a thread safe way.
+ *
+ * @param eq The firefly_event_queue the event was added to.
+ * @param id The ID of the event to cancel.
+ * @return 0 if the event was cancelled.
+ * @retval <0 if no queued or timed event has the ID, e.g. if it has already
+ * been executed.
+ */
+typedef int (*firefly_cancel_event)(struct firefly_event_queue *eq,
+		int64_t id);
+
+/**
+ * @brief The function implementing executing an event directly on the calling
+ * thread, without queueing it, when that can not break the ordering and
+ * concurrency guarantees of the queue.
+ *
+ * The event may only be executed inline if no queued event could have to run
+ * before it and no event it must not run concurrently with is executing, i.e.
+ * no event of the same strand or, if \p strand is NULL, no event at all. The
+ * queue must not start any such event until \p execute returns.
+ *
+ * @param eq The firefly_event_queue the event would have been added to.
+ * @param strand The strand of the event or NULL.
+ * @param execute A function implementing the event to be executed.
+ * @param context The argument to the function \p execute.
+ * @return 0 if \p execute was called on the calling thread.
+ * @retval <0 if the event could not be executed inline, the caller should
+ * add it to the queue instead.
+ */
+typedef int (*firefly_run_inline_event)(struct firefly_event_queue *eq,
+		void *strand, firefly_event_execute_f execute, void *context);
+
+/**
+ * @brief The function implementing executing the events that are ready on the
+ * calling thread, e.g. from the event loop of the application.
+ *
+ * @param eq The firefly_event_queue to execute events from.
+ * @param budget The largest number of events to execute.
+ * @return The number of events executed.
+ */
+typedef size_t (*firefly_run_pending_events)(struct firefly_event_queue *eq,
+		size_t budget);
+
+/**
+ * @brief The function implementing reading the clock the timed events of the
+ * queue are due on. May be called from any thread.
+ *
+ * @param eq The firefly_event_queue to read the clock of.
+ * @return The current time in milliseconds.
+ */
+typedef int64_t (*firefly_event_clock)(struct firefly_event_queue *eq);
+
 /**
  * @brief Initializes and allocates a new firefly_event_queue.
  *
@@ -126,10 +263,9 @@ struct firefly_event_queue *firefly_event_queue_new(
  *
  * @warning The context of the firefly_event_queue will not be freed.
  *
- * @warning This function calls firefly_event_free() on the remaining events in
- * the queue but that function does not free the context of specific events. If
- * the events has any context that needs to be freed separately this needs to
- * be done manually to avoid memory leaks.
+ * @warning The remaining events in the queue are discarded but contexts not
+ * copied to the events are not freed. If the events has any context that needs
+ * to be freed separately this needs to be done manually to avoid memory leaks.
  *
  * @param eq
  *		A pointer to the pointer of the firefly_event_queue to be freed.
@@ -147,6 +283,225 @@ void firefly_event_queue_free(struct firefly_event_queue **eq);
 void firefly_event_queue_set_strict_pool_size(struct firefly_event_queue *eq,
 		bool strict_size);
 
+/**
+ * @brief Set the function used to add events belonging to a strand.
+ *
+ * A queue without such a function executes all events on a single thread and
+ * firefly_event_offer_strand() falls back on the #firefly_offer_event of the
+ * queue.
+ *
+ * @param eq The event queue to set the function on.
+ * @param offer_strand_cb A function implementing #firefly_offer_strand_event
+ * or NULL.
+ */
+void firefly_event_queue_set_strand_offer(struct firefly_event_queue *eq,
+		firefly_offer_strand_event offer_strand_cb);
+
+/**
+ * @brief Add an event belonging to a strand to the queue using the offer
+ * functions of the queue.
+ *
+ * @param eq The firefly_event_queue to add the event to.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the new event.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids this event depends on.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error.
+ * @see #firefly_offer_strand_event
+ */
+int64_t firefly_event_offer_strand(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, unsigned int nbr_depends, const int64_t *depends);
+
+/**
+ * @brief Add an event with a copy of its context to the queue using the offer
+ * functions of the queue.
+ *
+ * The \p context_size first bytes of \p context are copied and \p execute is
+ * called with a pointer to the copy. Copies of at most
+ * #FIREFLY_EVENT_PAYLOAD_SIZE bytes are stored inside the event when the queue
+ * has a #firefly_offer_event_batch, so adding the event needs no allocation.
+ * The copy is owned by the queue and is only valid until \p execute returns,
+ * \p execute must not free it.
+ *
+ * @param eq The firefly_event_queue to add the event to.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the new event.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument to copy.
+ * @param context_size The number of bytes to copy from \p context.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids this event depends on.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error.
+ */
+int64_t firefly_event_offer_copy(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		const void *context, size_t context_size, unsigned int nbr_depends,
+		const int64_t *depends);
+
+/**
+ * @brief Set the function used to add batches of events.
+ *
+ * A queue without such a function adds the events of a batch one by one using
+ * firefly_event_offer_strand().
+ *
+ * @param eq The event queue to set the function on.
+ * @param offer_batch_cb A function implementing #firefly_offer_event_batch or
+ * NULL.
+ */
+void firefly_event_queue_set_batch_offer(struct firefly_event_queue *eq,
+		firefly_offer_event_batch offer_batch_cb);
+
+/**
+ * @brief Set the functions used to add timed events and to cancel events.
+ *
+ * @param eq The event queue to set the functions on.
+ * @param offer_timed_cb A function implementing #firefly_offer_timed_event or
+ * NULL.
+ * @param cancel_cb A function implementing #firefly_cancel_event or NULL.
+ */
+void firefly_event_queue_set_timed_offer(struct firefly_event_queue *eq,
+		firefly_offer_timed_event offer_timed_cb,
+		firefly_cancel_event cancel_cb);
+
+/**
+ * @brief Add an event that is due after a delay using the offer functions of
+ * the queue.
+ *
+ * A queue using the default firefly_event_add() adds the event with
+ * firefly_event_add_after().
+ *
+ * @param eq The firefly_event_queue to add the event to.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the event once it is due.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param delay The number of milliseconds until the event is due.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error or if the queue does not support timed
+ * events.
+ * @see #firefly_offer_timed_event
+ */
+int64_t firefly_event_offer_after(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, int64_t delay);
+
+/**
+ * @brief Cancel a queued or timed event using the functions of the queue.
+ *
+ * The context of a cancelled event is not freed.
+ *
+ * @param eq The firefly_event_queue the event was added to.
+ * @param id The ID of the event.
+ * @return 0 if the event was cancelled.
+ * @retval A negative value if the event could not be cancelled.
+ * @see #firefly_cancel_event
+ */
+int firefly_event_offer_cancel(struct firefly_event_queue *eq, int64_t id);
+
+/**
+ * @brief Set the function used to execute events inline.
+ *
+ * @param eq The event queue to set the function on.
+ * @param run_inline_cb A function implementing #firefly_run_inline_event or
+ * NULL.
+ */
+void firefly_event_queue_set_inline_run(struct firefly_event_queue *eq,
+		firefly_run_inline_event run_inline_cb);
+
+/**
+ * @brief Execute an event on the calling thread using the inline function of
+ * the queue, if it has one and the event may run now.
+ *
+ * Used by threads producing events, e.g. the reader thread of a transport, to
+ * run short events to completion instead of waking the thread executing the
+ * queue. A queue without an inline function never executes events inline
+ * since it can not know whether another thread is executing an event.
+ *
+ * @param eq The firefly_event_queue the event would have been added to.
+ * @param strand The strand of the event or NULL.
+ * @param execute The function implementing the event.
+ * @param context The argument passed to \p execute.
+ * @return 0 if \p execute was called.
+ * @retval A negative value if the event was not executed and should be added
+ * to the queue.
+ * @see #firefly_run_inline_event
+ */
+int firefly_event_run_inline(struct firefly_event_queue *eq, void *strand,
+		firefly_event_execute_f execute, void *context);
+
+/**
+ * @brief Set the function used to execute pending events on the calling
+ * thread.
+ *
+ * @param eq The event queue to set the function on.
+ * @param run_pending_cb A function implementing #firefly_run_pending_events
+ * or NULL.
+ */
+void firefly_event_queue_set_pending_run(struct firefly_event_queue *eq,
+		firefly_run_pending_events run_pending_cb);
+
+/**
+ * @brief Execute at most \p budget of the events that are ready on the
+ * calling thread.
+ *
+ * Lets an application executing the queue from its own loop bound the work
+ * done per iteration. A queue without a pending function that only uses the
+ * default offer functions executes the events directly, it must not be
+ * executed by any other thread. Other queues execute nothing.
+ *
+ * @param eq The firefly_event_queue to execute events from.
+ * @param budget The largest number of events to execute.
+ * @return The number of events executed.
+ * @see #firefly_run_pending_events
+ */
+size_t firefly_event_queue_run_pending(struct firefly_event_queue *eq,
+		size_t budget);
+
+/**
+ * @brief Set the function used to read the clock of the queue.
+ *
+ * @param eq The event queue to set the function on.
+ * @param clock_cb A function implementing #firefly_event_clock or NULL.
+ */
+void firefly_event_queue_set_clock(struct firefly_event_queue *eq,
+		firefly_event_clock clock_cb);
+
+/**
+ * @brief Get the current time on the clock the timed events of the queue are
+ * due on, e.g. to give data a deadline.
+ *
+ * A queue without a clock function returns the time it was last advanced
+ * to, see firefly_event_queue_advance().
+ *
+ * @param eq The firefly_event_queue.
+ * @return The time in milliseconds.
+ * @see #firefly_event_clock
+ */
+int64_t firefly_event_queue_now(struct firefly_event_queue *eq);
+
+/**
+ * @brief Add several events to the queue at once, e.g. one for each datagram
+ * of a bulk receive.
+ *
+ * The events are added in order, so events of the same priority are executed
+ * in the order of \p entries. An entry can not depend on another entry of the
+ * same batch. Entries with a context size have their context copied as
+ * described for firefly_event_offer_copy().
+ *
+ * @param eq The firefly_event_queue to add the events to.
+ * @param entries The events to add, the id of each entry is set.
+ * @param nbr_entries The number of entries.
+ * @return The number of events successfully added.
+ * @see #firefly_offer_event_batch
+ */
+size_t firefly_event_add_batch(struct firefly_event_queue *eq,
+		struct firefly_event_batch_entry *entries, size_t nbr_entries);
+
 /**
  * @brief A default implementation of adding an event to the
  * firefly_event_queue. The event will be sorted into the proper position.
@@ -164,8 +519,9 @@ void firefly_event_queue_set_strict_pool_size(struct firefly_event_queue *eq,
  * @param nbr_depends The number of events this event depends on.
  * @param depends A list of event ids, as returned by this function, specifying
  * the events this event depends on. These events will inherit the priority of
- * this event and be executed before this event. This list will be copied and
- * not be referenced once this function returns.
+ * this event and be executed before this event, except timed events that are
+ * not yet due, see firefly_event_add_at(). This list will be copied and not be
+ * referenced once this function returns.
  * @return The positive ID of the newly added event.
  * @retval A negative value upon error.
  * @see #firefly_offer_event
@@ -174,6 +530,119 @@ int64_t firefly_event_add(struct firefly_event_queue *eq, unsigned char prio,
 		firefly_event_execute_f execute, void *context,
 		unsigned int nbr_depends, const int64_t *depends);
 
+/**
+ * @brief A default implementation of adding an event belonging to a strand to
+ * the firefly_event_queue.
+ *
+ * @warning This function is not thread safe, see firefly_event_add().
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the new event.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids this event depends on.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error.
+ * @see #firefly_offer_strand_event
+ */
+int64_t firefly_event_add_strand(struct firefly_event_queue *eq, void *strand,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		unsigned int nbr_depends, const int64_t *depends);
+
+/**
+ * @brief A default implementation of adding an event that is due at a given
+ * time.
+ *
+ * Timed events wait in a hierarchical timer wheel with a resolution of one
+ * millisecond until firefly_event_queue_advance() is called with a time at or
+ * after \p when, then they are queued like any other event. An event due at a
+ * time the queue has already been advanced to is queued immediately.
+ *
+ * @note A timed event can not be depended on before it is due. Such a
+ * dependency is ignored and reported as #FIREFLY_ERROR_EVENT when the
+ * depending event is queued, so the depending event may execute first.
+ *
+ * @warning This function is not thread safe, see firefly_event_add().
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the event once it is due.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param when The time in milliseconds the event is due, on the same clock as
+ * the times passed to firefly_event_queue_advance().
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error.
+ */
+int64_t firefly_event_add_at(struct firefly_event_queue *eq, void *strand,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		int64_t when);
+
+/**
+ * @brief A default implementation of adding an event that is due after a
+ * delay, counted from the time the queue was last advanced to.
+ *
+ * @warning This function is not thread safe, see firefly_event_add().
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the event once it is due.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param delay The number of milliseconds until the event is due.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error.
+ * @see firefly_event_add_at()
+ */
+int64_t firefly_event_add_after(struct firefly_event_queue *eq, void *strand,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		int64_t delay);
+
+/**
+ * @brief A default implementation of cancelling a queued or timed event. The
+ * event is removed and returned to the pool without being executed.
+ *
+ * @warning This function is not thread safe, see firefly_event_add().
+ *
+ * @param eq The firefly_event_queue the event was added to.
+ * @param id The ID of the event.
+ * @return 0 if the event was cancelled.
+ * @retval -1 if no queued or timed event has the ID.
+ */
+int firefly_event_cancel(struct firefly_event_queue *eq, int64_t id);
+
+/**
+ * @brief Move every timed event due at or before \p now to the queue.
+ *
+ * @param eq The firefly_event_queue to advance.
+ * @param now The current time in milliseconds, time never goes backwards.
+ */
+void firefly_event_queue_advance(struct firefly_event_queue *eq, int64_t now);
+
+/**
+ * @brief Get the time the queue must be advanced to next for timed events to
+ * be queued in time.
+ *
+ * The time is exact for events due within 64 milliseconds and otherwise a
+ * lower bound, advancing to it may not make any event due.
+ *
+ * @param eq The firefly_event_queue.
+ * @return The time in milliseconds.
+ * @retval -1 if there are no timed events.
+ */
+int64_t firefly_event_queue_next_timer(struct firefly_event_queue *eq);
+
+/**
+ * @brief Get the strand of an event.
+ *
+ * @param ev The event.
+ * @return The strand of the event.
+ * @retval NULL if the event does not belong to a strand.
+ */
+void *firefly_event_strand(struct firefly_event *ev);
+
 /**
  * @brief Get the next event in the firefly_event_queue and remove it from the
  * queue.
@@ -211,7 +680,8 @@ void firefly_event_return(struct firefly_event_queue *eq,
 int firefly_event_execute(struct firefly_event *ev);
 
 /**
- * @brief Returns the number of events in the firefly_event_queue.
+ * @brief Returns the number of events in the firefly_event_queue. The length
+ * is maintained on insertion and removal so this is a constant time operation.
  *
  * @param eq
  *		The queue to return the length of.
@@ -5,15 +5,97 @@
 
 #include <utils/firefly_event_queue.h>
 
+/**
+ * @brief The largest number of events the event loop may execute per lock
+ * acquisition.
+ */
+#define FIREFLY_EVENT_QUEUE_POSIX_MAX_BATCH (64)
+
 /**
  * @brief Construct a new struct firefly_event_queue with with a context
  * specific for this utility.
  *
+ * Timed events offered with firefly_event_offer_after() are kept on
+ * CLOCK_MONOTONIC, the event loop and the workers sleep at most until the next
+ * timed event is due.
+ *
+ * Events may be executed inline with firefly_event_run_inline() when the queue
+ * is empty and, for the event loop, no event is executing or, for the worker
+ * pool, no event of the same strand is executing. An inline event without
+ * strand runs alone, as if it was popped from the queue.
+ *
  * @param pool_size The number of preallocated events.
  * @return The newly contructed event queue.
  */
 struct firefly_event_queue *firefly_event_queue_posix_new(size_t pool_size);
 
+/**
+ * @brief Construct a new struct firefly_event_queue where events are offered
+ * through a lock free intake instead of the mutex of the queue.
+ *
+ * Offering an event only takes an intake entry from a preallocated freelist
+ * and links it in with atomic operations, the condition variable is only
+ * signaled when the event loop is waiting for events. An entry is allocated
+ * when all \p pool_size entries are in the intake or a copied context is
+ * larger than #FIREFLY_EVENT_PAYLOAD_SIZE. The event loop moves all offered
+ * events into the priority queue in batches before it pops the next event.
+ * Event IDs are assigned when the event is offered, so dependencies work as
+ * with firefly_event_queue_posix_new().
+ *
+ * @note firefly_event_queue_length() does not count events still in the
+ * intake.
+ *
+ * @param pool_size The number of preallocated events and intake entries.
+ * @return The newly contructed event queue.
+ */
+struct firefly_event_queue *firefly_event_queue_posix_lockfree_new(
+		size_t pool_size);
+
+/**
+ * @brief Construct a new struct firefly_event_queue executed by the event loop
+ * of the application instead of a thread of its own.
+ *
+ * The queue has an event file descriptor, see
+ * firefly_event_queue_posix_get_fd(), that becomes readable when events are
+ * offered. The application waits for it, e.g. with epoll, together with its
+ * own descriptors and calls firefly_event_queue_run_pending() when it is
+ * readable or the timeout from firefly_event_queue_posix_get_timeout() has
+ * passed. The descriptor stays readable as long as ready events are left
+ * after a call.
+ *
+ * The queue must not be executed with firefly_event_queue_posix_run() or
+ * firefly_event_queue_posix_run_workers(), and firefly_event_queue_run_pending()
+ * must only be called from one thread at a time.
+ *
+ * @param pool_size The number of preallocated events.
+ * @return The newly contructed event queue.
+ * @retval NULL on error.
+ */
+struct firefly_event_queue *firefly_event_queue_posix_fd_new(size_t pool_size);
+
+/**
+ * @brief Get the event file descriptor of a queue constructed with
+ * firefly_event_queue_posix_fd_new().
+ *
+ * The descriptor must only be waited for, reading it is left to
+ * firefly_event_queue_run_pending().
+ *
+ * @param eq The event queue.
+ * @return The file descriptor.
+ * @retval -1 if the queue has no event file descriptor.
+ */
+int firefly_event_queue_posix_get_fd(struct firefly_event_queue *eq);
+
+/**
+ * @brief Get the longest time the application may wait for the event file
+ * descriptor before the next timed event of the queue is due.
+ *
+ * @param eq The event queue.
+ * @return The timeout in milliseconds, 0 if events are ready.
+ * @retval -1 if there are no timed events.
+ */
+int firefly_event_queue_posix_get_timeout(struct firefly_event_queue *eq);
+
 /**
  * @brief Free the specified event queue and the posix specific context. Stop
  * the event loop if it is running.
@@ -22,6 +104,26 @@ struct firefly_event_queue *firefly_event_queue_posix_new(size_t pool_size);
  */
 void firefly_event_queue_posix_free(struct firefly_event_queue **eq);
 
+/**
+ * @brief Set the number of events the event loop started by
+ * firefly_event_queue_posix_run() pops, and later returns to the pool, per
+ * lock acquisition. The default is 1.
+ *
+ * Larger batches reduce the lock traffic per event but an event added while a
+ * batch is executing waits for the rest of the batch even if it has a higher
+ * priority.
+ *
+ * @param eq The event queue, constructed with firefly_event_queue_posix_new()
+ * or firefly_event_queue_posix_lockfree_new().
+ * @param batch_size The number of events, at most
+ * #FIREFLY_EVENT_QUEUE_POSIX_MAX_BATCH.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 if the batch size is out of range.
+ */
+int firefly_event_queue_posix_set_batch_size(struct firefly_event_queue *eq,
+		size_t batch_size);
+
 /**
  * @brief Start the event loop.
  *
@@ -37,7 +139,29 @@ int firefly_event_queue_posix_run(struct firefly_event_queue *eq,
 		pthread_attr_t *attr);
 
 /**
- * @brief Stop the event loop. Will block untill the event loop is stopped.
+ * @brief Start a pool of worker threads executing events from the queue.
+ *
+ * Events added with the same strand, see firefly_event_offer_strand(), are
+ * executed in queue order and never concurrently while events of different
+ * strands run in parallel. An event without a strand waits for all events
+ * popped before it to finish and runs alone. An event depending on other
+ * events is not started until they have finished executing.
+ *
+ * @param eq The event queue to execute events from. It must have been
+ * constructed with firefly_event_queue_posix_new().
+ * @param attr The attributes to use when starting the worker threads. If NULL
+ * the default is used.
+ * @param nbr_workers The number of worker threads to start.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 on failure.
+ */
+int firefly_event_queue_posix_run_workers(struct firefly_event_queue *eq,
+		pthread_attr_t *attr, size_t nbr_workers);
+
+/**
+ * @brief Stop the event loop or the worker pool. Will block untill all
+ * threads are stopped.
  *
  * @param eq The event queue of the event loop to stop. It must have been
  * constructed with firefly_event_queue_posix_new().
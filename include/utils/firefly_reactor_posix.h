@@ -0,0 +1,156 @@
+/**
+ * @file
+ * @brief An I/O reactor hosting the sockets and timers of several posix link
+ * layer ports in a single thread.
+ *
+ * Instead of running a read thread, and possibly a resend thread, of its own a
+ * link layer port can be attached to a reactor. The reactor waits for all
+ * registered file descriptors with epoll and calls the readiness handler of
+ * each descriptor that has data to read. Timers, e.g. the resend queues of
+ * the link layer ports, are polled by the same thread and the reactor sleeps
+ * at most until the earliest of them is due.
+ */
+
+#ifndef FIREFLY_REACTOR_POSIX_H
+#define FIREFLY_REACTOR_POSIX_H
+
+#include <pthread.h>
+
+/**
+ * @brief An I/O reactor.
+ */
+struct firefly_reactor_posix;
+
+/**
+ * @brief The function called by the reactor thread when a registered file
+ * descriptor is ready to be read.
+ *
+ * The handler must not block, it should read what is available and return.
+ *
+ * @param fd The ready file descriptor.
+ * @param context The context the file descriptor was registered with.
+ */
+typedef void (*firefly_reactor_posix_ready_f)(int fd, void *context);
+
+/**
+ * @brief The function called by the reactor thread to let a timer perform
+ * anything that is due.
+ *
+ * The function is called on every iteration of the reactor loop without the
+ * lock of the reactor held, it may write to its sockets but must not remove
+ * itself from the reactor.
+ *
+ * @param context The context the timer was registered with.
+ * @return The number of milliseconds until the timer is due next.
+ * @retval <0 if the timer has nothing pending.
+ */
+typedef int (*firefly_reactor_posix_timer_f)(void *context);
+
+/**
+ * @brief Allocate and initialize a new reactor.
+ *
+ * @return The new reactor.
+ * @retval NULL on error.
+ */
+struct firefly_reactor_posix *firefly_reactor_posix_new(void);
+
+/**
+ * @brief Stop the reactor if it is running and free it.
+ *
+ * All link layer ports must have been detached before the reactor is freed.
+ *
+ * @param reactor A pointer to the reactor to free, set to NULL.
+ */
+void firefly_reactor_posix_free(struct firefly_reactor_posix **reactor);
+
+/**
+ * @brief Register a file descriptor with the reactor.
+ *
+ * @param reactor The reactor.
+ * @param fd The file descriptor to wait for, each descriptor may only be
+ * registered once.
+ * @param ready The function called when \p fd is ready to be read.
+ * @param context The argument passed to \p ready.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 on failure.
+ */
+int firefly_reactor_posix_add(struct firefly_reactor_posix *reactor, int fd,
+		firefly_reactor_posix_ready_f ready, void *context);
+
+/**
+ * @brief Unregister a file descriptor from the reactor.
+ *
+ * Unless called from the reactor thread, this function waits for a running
+ * handler of \p fd to return. The handler is never called again once this
+ * function returns, so its context may be freed.
+ *
+ * @param reactor The reactor.
+ * @param fd The file descriptor to unregister.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 if \p fd was not registered.
+ */
+int firefly_reactor_posix_remove(struct firefly_reactor_posix *reactor,
+		int fd);
+
+/**
+ * @brief Register a timer with the reactor.
+ *
+ * @param reactor The reactor.
+ * @param timer The function polled by the reactor thread.
+ * @param context The argument passed to \p timer, identifies the timer.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 on failure.
+ */
+int firefly_reactor_posix_add_timer(struct firefly_reactor_posix *reactor,
+		firefly_reactor_posix_timer_f timer, void *context);
+
+/**
+ * @brief Unregister a timer from the reactor. The timer is never called again
+ * once this function returns, a call in progress in the reactor thread is
+ * waited for.
+ *
+ * @param reactor The reactor.
+ * @param context The context the timer was registered with.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 if no timer has the context.
+ */
+int firefly_reactor_posix_remove_timer(struct firefly_reactor_posix *reactor,
+		void *context);
+
+/**
+ * @brief Wake the reactor thread so that it polls its timers again, e.g.
+ * because a timer got an earlier deadline. May be called from any thread.
+ *
+ * @param reactor The reactor to wake.
+ */
+void firefly_reactor_posix_wake(struct firefly_reactor_posix *reactor);
+
+/**
+ * @brief Start the reactor thread. It runs until stopped with
+ * firefly_reactor_posix_stop().
+ *
+ * @param reactor The reactor to run.
+ * @param attr The attributes to use when starting the thread. If NULL the
+ * default is used.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 on failure.
+ */
+int firefly_reactor_posix_run(struct firefly_reactor_posix *reactor,
+		pthread_attr_t *attr);
+
+/**
+ * @brief Stop the reactor thread. Will block until the thread has stopped.
+ *
+ * @param reactor The reactor to stop.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 on failure.
+ */
+int firefly_reactor_posix_stop(struct firefly_reactor_posix *reactor);
+
+#endif
@@ -40,14 +40,15 @@ static void firefly_unknown_dest(struct firefly_connection *conn,
 						      &chan_close);
 }
 
-int firefly_channel_open_event(void *event_arg)
+/*
+ * Creates a channel and sends its request, asking for forward error
+ * correction if fec_group is positive.
+ */
+static int open_channel(struct firefly_connection *conn, int fec_group)
 {
-	struct firefly_connection        *conn;
 	struct firefly_channel           *chan;
 	firefly_protocol_channel_request chan_req;
 
-	conn = event_arg;
-
 	if (conn->open != FIREFLY_CONNECTION_OPEN) {
 		firefly_channel_raise(NULL, conn, FIREFLY_ERROR_CONN_STATE,
 					  "Can't open new channel on closed connection.\n");
@@ -67,6 +68,9 @@ int firefly_channel_open_event(void *event_arg)
 	chan_req.source_chan_id = chan->local_id;
 	chan_req.dest_chan_id   = chan->remote_id;
 	chan_req.auto_restrict  = false;
+	chan_req.fec_group      = fec_group;
+	// Set up once the remote node has agreed.
+	chan->fec_group         = fec_group;
 
 	labcomm_encoder_ioctl(conn->transport_encoder,
 			FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID,
@@ -78,11 +82,16 @@ int firefly_channel_open_event(void *event_arg)
 	return 0;
 }
 
+int firefly_channel_open_event(void *event_arg)
+{
+	return open_channel(event_arg, 0);
+}
+
 void firefly_channel_open(struct firefly_connection *conn)
 {
 	int64_t ret;
 
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
 						FIREFLY_PRIORITY_HIGH,
 						firefly_channel_open_event,
 						conn, 0, NULL);
@@ -90,6 +99,30 @@ void firefly_channel_open(struct firefly_connection *conn)
 		firefly_error(FIREFLY_ERROR_ALLOC, 1, "Could not add event.");
 }
 
+int firefly_channel_open_fec_event(void *event_arg)
+{
+	struct firefly_event_chan_open_fec *arg;
+
+	arg = event_arg;
+	return open_channel(arg->connection, arg->fec_group);
+}
+
+void firefly_channel_open_fec(struct firefly_connection *conn,
+		unsigned int group_size)
+{
+	int64_t ret;
+	struct firefly_event_chan_open_fec ev;
+
+	ev.connection = conn;
+	ev.fec_group = group_size < FIREFLY_FEC_MAX_GROUP ?
+		(int) group_size : FIREFLY_FEC_MAX_GROUP;
+	ret = firefly_event_offer_copy(conn->event_queue, conn,
+			FIREFLY_PRIORITY_HIGH, firefly_channel_open_fec_event,
+			&ev, sizeof(ev), 0, NULL);
+	if (ret < 0)
+		firefly_error(FIREFLY_ERROR_ALLOC, 1, "Could not add event.");
+}
+
 int firefly_channel_open_auto_restrict_event(void *event_arg)
 {
 	struct firefly_event_chan_open_auto_restrict *arg;
@@ -116,6 +149,7 @@ int firefly_channel_open_auto_restrict_event(void *event_arg)
 	chan_req.source_chan_id = chan->local_id;
 	chan_req.dest_chan_id   = chan->remote_id;
 	chan_req.auto_restrict  = true;
+	chan_req.fec_group      = 0;
         chan->types = types;
 	labcomm_encoder_ioctl(conn->transport_encoder,
 			      FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID,
@@ -123,8 +157,6 @@ int firefly_channel_open_auto_restrict_event(void *event_arg)
 	labcomm_encode_firefly_protocol_channel_request(conn->transport_encoder,
 							&chan_req);
 
-	FIREFLY_FREE(event_arg);
-
 	return 0;
 }
 
@@ -132,21 +164,15 @@ void firefly_channel_open_auto_restrict( struct firefly_connection *conn,
 					struct firefly_channel_types types)
 {
 	int64_t ret;
-	struct firefly_event_chan_open_auto_restrict *ev;
-
-	ev = FIREFLY_MALLOC(sizeof(*ev));
-	if (ev) {
-		ev->connection = conn;
-		ev->types = types;
-		ret = conn->event_queue->offer_event_cb(conn->event_queue,
-				FIREFLY_PRIORITY_HIGH,
-				firefly_channel_open_auto_restrict_event,
-				ev, 0, NULL);
-		if (ret < 0)
-			firefly_error(FIREFLY_ERROR_ALLOC, 1, "Could not add event.");
-	} else {
+	struct firefly_event_chan_open_auto_restrict ev;
+
+	ev.connection = conn;
+	ev.types = types;
+	ret = firefly_event_offer_copy(conn->event_queue, conn,
+			FIREFLY_PRIORITY_HIGH, firefly_channel_open_auto_restrict_event,
+			&ev, sizeof(ev), 0, NULL);
+	if (ret < 0)
 		firefly_error(FIREFLY_ERROR_ALLOC, 1, "Could not add event.");
-	}
 }
 
 static int64_t create_channel_closed_event(struct firefly_channel *chan,
@@ -154,8 +180,8 @@ static int64_t create_channel_closed_event(struct firefly_channel *chan,
 {
 	int64_t ret;
 
-	ret = chan->conn->event_queue->offer_event_cb(chan->conn->event_queue,
-			FIREFLY_PRIORITY_HIGH, firefly_channel_closed_event,
+	ret = firefly_event_offer_strand(chan->conn->event_queue, chan->conn,
+			FIREFLY_CHANNEL_CLOSE_PRIORITY, firefly_channel_closed_event,
 			chan, nbr_deps, deps);
 	if (ret < 0)
 		firefly_error(FIREFLY_ERROR_ALLOC, 1, "Could not add event.");
@@ -188,8 +214,8 @@ int64_t firefly_channel_close(struct firefly_channel *chan)
 
 	conn = chan->conn;
 
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
-						FIREFLY_PRIORITY_HIGH,
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
+						FIREFLY_CHANNEL_CLOSE_PRIORITY,
 						firefly_channel_close_event,
 						chan, 0, NULL);
 	if (ret < 0) {
@@ -215,33 +241,55 @@ void protocol_data_received(struct firefly_connection *conn,
 	}
 }
 
+void protocol_data_received_inline(struct firefly_connection *conn,
+		unsigned char *data, size_t size)
+{
+	conn->rx_inline = true;
+	protocol_data_received(conn, data, size);
+	conn->rx_inline = false;
+}
+
+void protocol_buffer_received(struct firefly_connection *conn,
+		struct firefly_buffer *buf)
+{
+	if (conn->open == FIREFLY_CONNECTION_OPEN) {
+		labcomm_decoder_ioctl(conn->transport_decoder,
+				FIREFLY_LABCOMM_IOCTL_READER_ADD_BUFFER, buf);
+		int res = 0;
+		while (res >= 0)
+			res = labcomm_decoder_decode_one(conn->transport_decoder);
+	} else {
+		firefly_buffer_unref(buf);
+	}
+}
+
+void protocol_buffer_received_inline(struct firefly_connection *conn,
+		struct firefly_buffer *buf)
+{
+	conn->rx_inline = true;
+	protocol_buffer_received(conn, buf);
+	conn->rx_inline = false;
+}
+
 void handle_channel_request(firefly_protocol_channel_request *chan_req,
 		void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_chan_req_recv *fecrr;
-	int ret;
+	struct firefly_event_chan_req_recv fecrr;
+	int64_t ret;
 
 	conn = context;
 
-	fecrr = FIREFLY_MALLOC(sizeof(*fecrr));
-	if (fecrr == NULL) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event.\n");
-		return;
-	}
-
-	fecrr->conn = conn;
-	memcpy(&fecrr->chan_req, chan_req, sizeof(*chan_req));
+	fecrr.conn = conn;
+	memcpy(&fecrr.chan_req, chan_req, sizeof(*chan_req));
 
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_event_offer_copy(conn->event_queue, conn,
 						FIREFLY_PRIORITY_HIGH,
 						handle_channel_request_event,
-						fecrr, 0, NULL);
+						&fecrr, sizeof(fecrr), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
-		FIREFLY_FREE(fecrr);
 	}
 }
 
@@ -276,12 +324,15 @@ int handle_channel_request_event(void *event_arg)
 			res.dest_chan_id   = chan->remote_id;
 			res.source_chan_id = chan->local_id;
 			res.ack            = false;
+			res.fec_group      = 0;
 			if (conn->actions != NULL && conn->actions->channel_recv != NULL)
 				res.ack = conn->actions->channel_recv(chan);
 			if (!res.ack) {
 				res.source_chan_id = CHANNEL_ID_NOT_SET;
 				firefly_channel_free(remove_channel_from_connection(chan, conn));
 			} else {
+				res.fec_group = firefly_channel_set_fec(chan,
+						fecrr->chan_req.fec_group);
 				/* TODO: Decoder registrations. */
 				labcomm_encoder_ioctl(fecrr->conn->transport_encoder,
 						FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID,
@@ -292,8 +343,6 @@ int handle_channel_request_event(void *event_arg)
 		}
 	}
 
-	FIREFLY_FREE(event_arg);
-
 	return ret;
 }
 
@@ -301,27 +350,20 @@ void handle_channel_response(firefly_protocol_channel_response *chan_res,
 		void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_chan_res_recv *fecrr;
-	int ret;
+	struct firefly_event_chan_res_recv fecrr;
+	int64_t ret;
 
 	conn = context;
 
-	fecrr = FIREFLY_MALLOC(sizeof(*fecrr));
-	if (fecrr == NULL) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event.\n");
-		return;
-	}
-	fecrr->conn = conn;
-	memcpy(&fecrr->chan_res, chan_res, sizeof(*chan_res));
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	fecrr.conn = conn;
+	memcpy(&fecrr.chan_res, chan_res, sizeof(*chan_res));
+	ret = firefly_event_offer_copy(conn->event_queue, conn,
 						FIREFLY_PRIORITY_HIGH,
 						handle_channel_response_event,
-						fecrr, 0, NULL);
+						&fecrr, sizeof(fecrr), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
-		FIREFLY_FREE(fecrr);
 	}
 }
 
@@ -359,7 +401,11 @@ int handle_channel_response_event(void *event_arg)
                                      fecrr->chan_res.dest_chan_id, "channel_response");
 	} else if (fecrr->chan_res.ack) {
 		if (chan->remote_id == CHANNEL_ID_NOT_SET) {
-			chan->remote_id = fecrr->chan_res.source_chan_id;
+			set_channel_remote_id(chan, fecrr->chan_res.source_chan_id);
+			// The remote node may lower the requested group size.
+			firefly_channel_set_fec(chan,
+					fecrr->chan_res.fec_group <= chan->fec_group ?
+					fecrr->chan_res.fec_group : 0);
 			firefly_channel_ack(chan);
 			firefly_channel_internal_opened(chan);
 			firefly_channel_set_types(chan, chan->types);
@@ -373,7 +419,6 @@ int handle_channel_response_event(void *event_arg)
 		firefly_channel_free(remove_channel_from_connection(chan,
 								fecrr->conn));
 	}
-	FIREFLY_FREE(event_arg);
 
 	return 0;
 }
@@ -381,26 +426,20 @@ int handle_channel_response_event(void *event_arg)
 void handle_channel_ack(firefly_protocol_channel_ack *chan_ack, void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_chan_ack_recv *fecar;
-	int ret;
+	struct firefly_event_chan_ack_recv fecar;
+	int64_t ret;
 
 	conn = context;
-	fecar = FIREFLY_MALLOC(sizeof(*fecar));
-	if (fecar == NULL) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event.\n");
-		return;
-	}
 
-	fecar->conn = conn;
-	memcpy(&fecar->chan_ack, chan_ack, sizeof(*chan_ack));
+	fecar.conn = conn;
+	memcpy(&fecar.chan_ack, chan_ack, sizeof(*chan_ack));
 
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
-			FIREFLY_PRIORITY_HIGH, handle_channel_ack_event, fecar, 0, NULL);
+	ret = firefly_event_offer_copy(conn->event_queue, conn,
+			FIREFLY_PRIORITY_HIGH, handle_channel_ack_event, &fecar,
+			sizeof(fecar), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
-		FIREFLY_FREE(fecar);
 	}
 }
 
@@ -419,7 +458,6 @@ int handle_channel_ack_event(void *event_arg)
 		firefly_unknown_dest(fecar->conn, fecar->chan_ack.source_chan_id,
 							 fecar->chan_ack.dest_chan_id, "channel_ack");
 	}
-	FIREFLY_FREE(event_arg);
 
 	return 0;
 }
@@ -442,14 +480,69 @@ void handle_channel_close(firefly_protocol_channel_close *chan_close,
 	}
 }
 
+static void deliver_data_sample(struct firefly_event_recv_sample *fers);
+
 void handle_data_sample(firefly_protocol_data_sample *data, void *context)
 {
 	struct firefly_connection *conn;
 	struct firefly_event_recv_sample *fers;
+	struct firefly_event_recv_sample_ref ref;
 	unsigned char *fers_data;
-	int ret;
+	unsigned char *borrowed;
+	int64_t ret;
 
 	conn = context;
+	if (conn->rx_inline && !data->important) {
+		struct firefly_channel *chan;
+
+		chan = find_channel_by_local_id(conn, data->dest_chan_id);
+		if (chan != NULL && chan->state == FIREFLY_CHANNEL_OPEN) {
+			struct firefly_event_recv_sample inline_fers;
+
+			// Already running as an event of the connection, deliver now.
+			inline_fers.conn = conn;
+			memcpy(&inline_fers.data, data, sizeof(*data));
+			deliver_data_sample(&inline_fers);
+			return;
+		}
+	}
+	if (sizeof(*fers) + data->app_enc_data.n_0 <= FIREFLY_EVENT_PAYLOAD_SIZE) {
+		// Small samples are copied to the event along with their data.
+		union {
+			struct firefly_event_recv_sample fers;
+			unsigned char bytes[FIREFLY_EVENT_PAYLOAD_SIZE];
+		} arg;
+
+		arg.fers.conn = conn;
+		memcpy(&arg.fers.data, data, sizeof(*data));
+		memcpy(&arg.fers + 1, data->app_enc_data.a, data->app_enc_data.n_0);
+		ret = firefly_event_offer_copy(conn->event_queue, conn,
+				firefly_receive_priority(data->priority),
+				handle_data_sample_copy_event, &arg,
+				sizeof(arg.fers) + data->app_enc_data.n_0, 0, NULL);
+		if (ret < 0)
+			firefly_error(FIREFLY_ERROR_ALLOC, 1,
+				      "could not add event to queue");
+		return;
+	}
+	if (labcomm_decoder_ioctl(conn->transport_decoder,
+				FIREFLY_LABCOMM_IOCTL_READER_BORROW,
+				(size_t) data->app_enc_data.n_0, &borrowed, &ref.buf) == 0) {
+		// Larger samples reference their data in the received buffer.
+		ref.fers.conn = conn;
+		memcpy(&ref.fers.data, data, sizeof(*data));
+		ref.fers.data.app_enc_data.a = borrowed;
+		ret = firefly_event_offer_copy(conn->event_queue, conn,
+				firefly_receive_priority(data->priority),
+				handle_data_sample_ref_event, &ref,
+				sizeof(ref), 0, NULL);
+		if (ret < 0) {
+			firefly_error(FIREFLY_ERROR_ALLOC, 1,
+				      "could not add event to queue");
+			firefly_buffer_unref(ref.buf);
+		}
+		return;
+	}
 	fers = FIREFLY_RUNTIME_MALLOC(conn, sizeof(*fers));
 	fers_data = FIREFLY_RUNTIME_MALLOC(conn, data->app_enc_data.n_0);
 	if (fers == NULL || fers_data == NULL) {
@@ -465,8 +558,9 @@ void handle_data_sample(firefly_protocol_data_sample *data, void *context)
 	memcpy(fers_data, data->app_enc_data.a, data->app_enc_data.n_0);
 	fers->data.app_enc_data.a = fers_data;
 
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
-			FIREFLY_PRIORITY_LOW, handle_data_sample_event, fers, 0, NULL);
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
+			firefly_receive_priority(data->priority),
+			handle_data_sample_event, fers, 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
@@ -475,160 +569,505 @@ void handle_data_sample(firefly_protocol_data_sample *data, void *context)
 	}
 }
 
-int handle_data_sample_event(void *event_arg)
+static int send_acks_event(void *event_arg)
 {
-	struct firefly_event_recv_sample *fers;
-	struct firefly_channel *chan;
+	struct firefly_connection *conn;
 
-	fers = event_arg;
+	conn = event_arg;
+	conn->ack_timer_id = 0;
+	firefly_connection_send_acks(conn, false);
+	return 0;
+}
 
-	chan = find_channel_by_local_id(fers->conn, fers->data.dest_chan_id);
+void firefly_connection_send_acks(struct firefly_connection *conn,
+		bool piggyback)
+{
+	struct firefly_ack_entry entries[FIREFLY_ACK_BATCH_MAX];
+	firefly_protocol_ack_batch batch;
+	struct firefly_channel *chan;
+	int a_n;
 
-	if (chan != NULL) {
-                /* FIXME: Undefined wrapping behaviour. */
-		int expected_seqno = chan->remote_seqno + 1;
+	if (conn->ack_list == NULL)
+		return;
+	if (conn->ack_timer_id > 0) {
+		firefly_event_offer_cancel(conn->event_queue, conn->ack_timer_id);
+		conn->ack_timer_id = 0;
+	}
+	batch.a = (void *) entries;
+	while (conn->ack_list != NULL) {
+		for (a_n = 0; conn->ack_list != NULL && a_n < FIREFLY_ACK_BATCH_MAX;
+				a_n++) {
+			chan = conn->ack_list;
+			conn->ack_list = chan->ack_next;
+			chan->ack_next = NULL;
+			chan->ack_pending = false;
+			entries[a_n].dest_chan_id = chan->remote_id;
+			entries[a_n].src_chan_id  = chan->local_id;
+			entries[a_n].seqno        = chan->remote_seqno;
+			entries[a_n].selective    = 0;
+			for (int i = 0; i < FIREFLY_IMPORTANT_WINDOW; i++) {
+				size_t j = (chan->reorder_head + i) % FIREFLY_IMPORTANT_WINDOW;
+
+				if (chan->reorder[j].used)
+					entries[a_n].selective |= 1 << i;
+			}
+		}
+		batch.n_0 = a_n;
+		if (piggyback && conn->ack_list == NULL) {
+			labcomm_encoder_ioctl(conn->transport_encoder,
+					FIREFLY_LABCOMM_IOCTL_TRANS_PIGGYBACK, 1);
+		}
+		labcomm_encode_firefly_protocol_ack_batch(conn->transport_encoder,
+				&batch);
+	}
+}
+
+/*
+ * Acks an important packet received on the channel, at once or, if the
+ * connection delays acks, with the acks of later packets.
+ */
+static void send_data_ack(struct firefly_channel *chan, int seqno)
+{
+	struct firefly_connection *conn;
+	firefly_protocol_ack ack_pkt;
 
-		if (expected_seqno <= 0) {
-			expected_seqno = 1;
+	conn = chan->conn;
+	if (conn->ack_delay_ms > 0) {
+		if (chan->ack_pending)
+			return;
+		chan->ack_pending = true;
+		chan->ack_next = conn->ack_list;
+		conn->ack_list = chan;
+		// The pending event also sends the acks of this channel.
+		if (conn->ack_timer_id > 0)
+			return;
+		conn->ack_timer_id = firefly_event_offer_after(conn->event_queue,
+				conn, FIREFLY_PRIORITY_HIGH, send_acks_event, conn,
+				conn->ack_delay_ms);
+		if (conn->ack_timer_id < 0) {
+			// Without timed events the acks wait for the queued events.
+			conn->ack_timer_id = firefly_event_offer_strand(
+					conn->event_queue, conn, FIREFLY_PRIORITY_LOW,
+					send_acks_event, conn, 0, NULL);
 		}
-		if (fers->data.important) {
-			firefly_protocol_ack ack_pkt;
-
-			ack_pkt.dest_chan_id = chan->remote_id;
-			ack_pkt.src_chan_id = chan->local_id;
-			ack_pkt.seqno = fers->data.seqno;
-			labcomm_encode_firefly_protocol_ack(
-					chan->conn->transport_encoder,
-					&ack_pkt);
+		if (conn->ack_timer_id < 0) {
+			conn->ack_timer_id = 0;
+			firefly_connection_send_acks(conn, false);
 		}
-		if (!fers->data.important ||
-		    expected_seqno == fers->data.seqno)
-		{
-			size_t size;
-			int id;
-
-			size = fers->data.app_enc_data.n_0;
-			labcomm_decoder_ioctl(chan->proto_decoder,
-					FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER,
-					fers->data.app_enc_data.a,
-					size);
-
-			id = labcomm_decoder_decode_one(chan->proto_decoder);
-			if (fers->data.important) {
-				chan->remote_seqno = fers->data.seqno;
-			}
-			if (id == -ENOENT) {
+		return;
+	}
+	ack_pkt.dest_chan_id = chan->remote_id;
+	ack_pkt.src_chan_id = chan->local_id;
+	ack_pkt.seqno = seqno;
+	labcomm_encode_firefly_protocol_ack(chan->conn->transport_encoder,
+			&ack_pkt);
+}
+
+static void decode_data_sample(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data)
+{
+	size_t size;
+	int id;
+
+	size = data->app_enc_data.n_0;
+	labcomm_decoder_ioctl(chan->proto_decoder,
+			FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER,
+			data->app_enc_data.a,
+			size);
+
+	id = labcomm_decoder_decode_one(chan->proto_decoder);
+	if (id == -ENOENT) {
 #if 0
-				if (!chan->auto_restrict) {
-					firefly_error(FIREFLY_ERROR_LABCOMM, 1,
-						      "Unkn. type. Use autorestr.");
-				} else {
-					firefly_error(FIREFLY_ERROR_LABCOMM, 1,
-						      "Wait for restr.");
-				}
+		if (!chan->auto_restrict) {
+			firefly_error(FIREFLY_ERROR_LABCOMM, 1,
+				      "Unkn. type. Use autorestr.");
+		} else {
+			firefly_error(FIREFLY_ERROR_LABCOMM, 1,
+				      "Wait for restr.");
+		}
 #endif
-			} else if (!chan->restricted_local &&
-				   chan->auto_restrict)
+	} else if (!chan->restricted_local &&
+		   chan->auto_restrict)
+	{
+		size_t n = 0;
+
+		for (; n < chan->n_decoder_types; n++) {
+			if (chan->seen_decoder_ids[n] == -1 ||
+			    chan->seen_decoder_ids[n] == id)
 			{
-				size_t n = 0;
-
-				for (; n < chan->n_decoder_types; n++) {
-					if (chan->seen_decoder_ids[n] == -1 ||
-					    chan->seen_decoder_ids[n] == id)
-					{
-						break;
-					}
-				}
-				chan->seen_decoder_ids[n] = id;
-				if (n == chan->n_decoder_types-1) {
-					FIREFLY_FREE(chan->seen_decoder_ids);
-					chan->seen_decoder_ids = NULL;
-					chan->n_decoder_types = 0; /* State-ish */
-					channel_auto_restr_send_ack(chan);
-				}
+				break;
 			}
-		} else if (fers->data.important &&
-			   expected_seqno != fers->data.seqno)
-		{
-#if 0	/* This would probably be a good idea, but it breaks existing tests. */
-			firefly_error(FIREFLY_ERROR_PROTO_STATE, 1,
-				      "Received data flagged important with "
-				      "unexpected sequence number.");
-#endif
 		}
+		chan->seen_decoder_ids[n] = id;
+		if (n == chan->n_decoder_types-1) {
+			FIREFLY_FREE(chan->seen_decoder_ids);
+			chan->seen_decoder_ids = NULL;
+			chan->n_decoder_types = 0; /* State-ish */
+			channel_auto_restr_send_ack(chan);
+		}
+	}
+}
+
+/*
+ * Stores a fragment in the sample reassembled from it and decodes the sample
+ * once it is complete. Returns the result of firefly_channel_reassemble().
+ */
+static int reassemble_data_fragment(struct firefly_channel *chan,
+		firefly_protocol_data_fragment *frag)
+{
+	firefly_protocol_data_sample data;
+	struct firefly_reassembly *r;
+	int res;
+
+	res = firefly_channel_reassemble(chan, frag);
+	if (res > 0) {
+		r = firefly_channel_reassembled(chan, frag->important);
+		data.dest_chan_id       = frag->dest_chan_id;
+		data.src_chan_id        = frag->src_chan_id;
+		data.seqno              = 0;
+		data.fec_seqno          = 0;
+		data.priority           = frag->priority;
+		data.important          = false;
+		data.app_enc_data.n_0   = r->size;
+		data.app_enc_data.a     = r->data;
+		decode_data_sample(chan, &data);
+		firefly_reassembly_release(r);
+	}
+	return res;
+}
+
+/*
+ * Delivers an important sample or fragment in sequence number order. One
+ * received ahead of its turn is kept until the ones before it are delivered.
+ * Each is acknowledged by its own sequence number once it is delivered or
+ * kept, so the sender only resends the ones actually lost.
+ */
+static void deliver_important(struct firefly_channel *chan, int seqno,
+		firefly_protocol_data_sample *sample,
+		firefly_protocol_data_fragment *frag)
+{
+	struct firefly_reorder_entry *e;
+	int ahead;
+
+	if (seqno <= 0)
+		return;
+	ahead = firefly_seqno_distance(chan->remote_seqno, seqno);
+	if (ahead > 1 && ahead <= FIREFLY_IMPORTANT_WINDOW) {
+		if (firefly_channel_reorder_store(chan, ahead - 1, sample, frag) == 0)
+			send_data_ack(chan, seqno);
+		return;
+	} else if (ahead != 1) {
+		if (firefly_seqno_distance(seqno, chan->remote_seqno) <
+				FIREFLY_IMPORTANT_WINDOW) {
+			// Already delivered, the ack was lost.
+			send_data_ack(chan, seqno);
+		}
+		return;
+	}
+	if (sample != NULL) {
+		send_data_ack(chan, seqno);
+		decode_data_sample(chan, sample);
+	} else if (reassemble_data_fragment(chan, frag) < 0) {
+		return; // Not acked, the fragment is resent.
 	} else {
+		send_data_ack(chan, seqno);
+	}
+	firefly_channel_advance_remote_seqno(chan);
+	while ((e = firefly_channel_reorder_next(chan)) != NULL) {
+		// Already acked, a fragment failing now is lost.
+		if (e->fragment)
+			reassemble_data_fragment(chan, &e->pkt.frag);
+		else
+			decode_data_sample(chan, &e->pkt.sample);
+		firefly_channel_advance_remote_seqno(chan);
+	}
+}
+
+static void deliver_sample(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data)
+{
+	if (data->important)
+		deliver_important(chan, data->seqno, data, NULL);
+	else
+		decode_data_sample(chan, data);
+}
+
+/*
+ * Delivers the sample of the group being received that its parity makes up
+ * for, if one is lost.
+ */
+static void deliver_recovered(struct firefly_channel *chan)
+{
+	firefly_protocol_data_sample data;
+
+	if (firefly_channel_fec_recover(chan, &data))
+		deliver_sample(chan, &data);
+}
+
+static void deliver_data_sample(struct firefly_event_recv_sample *fers)
+{
+	struct firefly_channel *chan;
+
+	chan = find_channel_by_local_id(fers->conn, fers->data.dest_chan_id);
+	if (chan == NULL) {
 		firefly_unknown_dest(fers->conn, fers->data.src_chan_id,
 							 fers->data.dest_chan_id, "data_sample");
+	} else if (firefly_channel_fec_receive(chan, &fers->data)) {
+		deliver_sample(chan, &fers->data);
+		deliver_recovered(chan);
 	}
+}
+
+int handle_data_sample_event(void *event_arg)
+{
+	struct firefly_event_recv_sample *fers;
 
+	fers = event_arg;
+	deliver_data_sample(fers);
 	FIREFLY_RUNTIME_FREE(fers->conn, fers->data.app_enc_data.a);
 	FIREFLY_RUNTIME_FREE(fers->conn, event_arg);
 
 	return 0;
 }
 
+int handle_data_sample_copy_event(void *event_arg)
+{
+	struct firefly_event_recv_sample *fers;
+
+	fers = event_arg;
+	fers->data.app_enc_data.a = (uint8_t *) (fers + 1);
+	deliver_data_sample(fers);
+
+	return 0;
+}
+
+int handle_data_sample_ref_event(void *event_arg)
+{
+	struct firefly_event_recv_sample_ref *ref;
+
+	ref = event_arg;
+	deliver_data_sample(&ref->fers);
+	firefly_buffer_unref(ref->buf);
+
+	return 0;
+}
+
+static void deliver_data_fragment(struct firefly_connection *conn,
+		firefly_protocol_data_fragment *frag)
+{
+	struct firefly_channel *chan;
+
+	chan = find_channel_by_local_id(conn, frag->dest_chan_id);
+	if (chan == NULL) {
+		firefly_unknown_dest(conn, frag->src_chan_id, frag->dest_chan_id,
+				"data_fragment");
+	} else if (frag->important) {
+		deliver_important(chan, frag->seqno, NULL, frag);
+	} else {
+		reassemble_data_fragment(chan, frag);
+	}
+}
+
+void handle_data_fragment(firefly_protocol_data_fragment *frag, void *context)
+{
+	struct firefly_connection *conn;
+	struct firefly_event_recv_fragment *ferf;
+	size_t size;
+	int64_t ret;
+
+	conn = context;
+	if (conn->rx_inline && !frag->important) {
+		// Already running as an event of the connection.
+		deliver_data_fragment(conn, frag);
+		return;
+	}
+	size = frag->frag_data.n_0;
+	ferf = FIREFLY_RUNTIME_MALLOC(conn, sizeof(*ferf) + size);
+	if (ferf == NULL) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "Could not allocate event.\n");
+		return;
+	}
+	ferf->conn = conn;
+	memcpy(&ferf->frag, frag, sizeof(*frag));
+	memcpy(ferf + 1, frag->frag_data.a, size);
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
+			firefly_receive_priority(frag->priority),
+			handle_data_fragment_event, ferf, 0, NULL);
+	if (ret < 0) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "could not add event to queue");
+		FIREFLY_RUNTIME_FREE(conn, ferf);
+	}
+}
+
+int handle_data_fragment_event(void *event_arg)
+{
+	struct firefly_event_recv_fragment *ferf;
+
+	ferf = event_arg;
+	ferf->frag.frag_data.a = (uint8_t *) (ferf + 1);
+	deliver_data_fragment(ferf->conn, &ferf->frag);
+	FIREFLY_RUNTIME_FREE(ferf->conn, event_arg);
+
+	return 0;
+}
+
 void handle_ack(firefly_protocol_ack *ack, void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_channel *chan;
+	struct firefly_event_ack_recv fear;
+	int64_t ret;
 
 	conn = context;
-	chan = find_channel_by_local_id(conn, ack->dest_chan_id);
+	fear.conn = conn;
+	memcpy(&fear.ack, ack, sizeof(*ack));
+	ret = firefly_event_offer_copy(conn->event_queue, conn,
+			FIREFLY_PRIORITY_HIGH, handle_ack_event, &fear, sizeof(fear),
+			0, NULL);
+	if (ret < 0) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "could not add event to queue");
+	}
+}
+
+int handle_ack_event(void *event_arg)
+{
+	struct firefly_event_ack_recv *fear;
+	struct firefly_channel *chan;
+
+	fear = event_arg;
+	chan = find_channel_by_local_id(fear->conn, fear->ack.dest_chan_id);
 	if (chan == NULL) {
-		firefly_unknown_dest(conn, ack->src_chan_id, ack->dest_chan_id, "ack");
-	} else if ((chan->current_seqno == ack->seqno && ack->seqno > 0) ||
-		   (chan->auto_restrict && chan->restricted_local &&
-		    ack->seqno == FIREFLY_PROTO_ACK_RESTRICT_ACK))
-	{
+		firefly_unknown_dest(fear->conn, fear->ack.src_chan_id,
+							 fear->ack.dest_chan_id, "ack");
+	} else if (fear->ack.seqno > 0) {
+		firefly_channel_ack_seqno(chan, fear->ack.seqno);
+	} else if (chan->auto_restrict && chan->restricted_local &&
+		   fear->ack.seqno == FIREFLY_PROTO_ACK_RESTRICT_ACK) {
 		firefly_channel_ack(chan);
 	}
+
+	return 0;
 }
 
-struct firefly_channel *find_channel_by_remote_id(
-		struct firefly_connection *conn, int id)
+void handle_ack_batch(firefly_protocol_ack_batch *batch, void *context)
 {
-	struct channel_list_node *head;
+	struct firefly_connection *conn;
+	struct firefly_event_ack_batch_recv *fear;
+	size_t size;
+	int64_t ret;
 
-	head = conn->chan_list;
-	while (head) {
-		if (head->chan->remote_id == id)
-			break;
-		head = head->next;
+	conn = context;
+	if (batch->n_0 <= 0)
+		return;
+	size = batch->n_0 * sizeof(*batch->a);
+	fear = FIREFLY_RUNTIME_MALLOC(conn, sizeof(*fear) + size);
+	if (fear == NULL) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "Could not allocate event.\n");
+		return;
+	}
+	fear->conn = conn;
+	fear->batch.n_0 = batch->n_0;
+	memcpy(fear + 1, batch->a, size);
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
+			FIREFLY_PRIORITY_HIGH, handle_ack_batch_event, fear, 0, NULL);
+	if (ret < 0) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "could not add event to queue");
+		FIREFLY_RUNTIME_FREE(conn, fear);
 	}
-	return (head) ? head->chan : NULL;
 }
 
-struct firefly_channel *find_channel_by_local_id(
-		struct firefly_connection *conn, int id)
+int handle_ack_batch_event(void *event_arg)
 {
-	struct channel_list_node *head;
+	struct firefly_event_ack_batch_recv *fear;
+	struct firefly_channel *chan;
 
-	head = conn->chan_list;
-	while (head) {
-		if (head->chan->local_id == id)
-			break;
-		head = head->next;
+	fear = event_arg;
+	fear->batch.a = (void *) (fear + 1);
+	for (int i = 0; i < fear->batch.n_0; i++) {
+		chan = find_channel_by_local_id(fear->conn,
+				fear->batch.a[i].dest_chan_id);
+		if (chan == NULL) {
+			firefly_unknown_dest(fear->conn, fear->batch.a[i].src_chan_id,
+					fear->batch.a[i].dest_chan_id, "ack_batch");
+		} else {
+			firefly_channel_ack_cumulative(chan, fear->batch.a[i].seqno,
+					fear->batch.a[i].selective);
+		}
 	}
-	return (head) ? head->chan : NULL;
+	FIREFLY_RUNTIME_FREE(fear->conn, event_arg);
+
+	return 0;
 }
 
-void add_channel_to_connection(struct firefly_channel *chan,
-		struct firefly_connection *conn)
+static void deliver_data_parity(struct firefly_connection *conn,
+		firefly_protocol_data_parity *parity)
 {
-	struct channel_list_node *new_node;
-
-	new_node = FIREFLY_MALLOC(sizeof(*new_node));
+	struct firefly_channel *chan;
 
-	if (new_node != NULL) {
-		new_node->chan = chan;
-		new_node->next = conn->chan_list;
-		conn->chan_list = new_node;
+	chan = find_channel_by_local_id(conn, parity->dest_chan_id);
+	if (chan == NULL) {
+		firefly_unknown_dest(conn, parity->src_chan_id, parity->dest_chan_id,
+				"data_parity");
 	} else {
+		firefly_channel_fec_receive_parity(chan, parity);
+		deliver_recovered(chan);
+	}
+}
+
+void handle_data_parity(firefly_protocol_data_parity *parity, void *context)
+{
+	struct firefly_connection *conn;
+	struct firefly_event_data_parity_recv *fepr;
+	size_t size;
+	int64_t ret;
+
+	conn = context;
+	if (conn->rx_inline) {
+		// Already running as an event of the connection.
+		deliver_data_parity(conn, parity);
+		return;
+	}
+	size = parity->parity.n_0;
+	fepr = FIREFLY_RUNTIME_MALLOC(conn, sizeof(*fepr) + size);
+	if (fepr == NULL) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Failed to allocate new channel list note\n");
+			      "Could not allocate event.\n");
+		return;
+	}
+	fepr->conn = conn;
+	memcpy(&fepr->parity, parity, sizeof(*parity));
+	memcpy(fepr + 1, parity->parity.a, size);
+	/*
+	 * Queued with the highest priority of the data samples so that it is
+	 * never delivered after samples of the next group. A sample of its own
+	 * group delivered after it still recovers the lost one.
+	 */
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
+			firefly_receive_priority(FIREFLY_CHANNEL_PRIORITY_CONTROL),
+			handle_data_parity_event, fepr, 0, NULL);
+	if (ret < 0) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "could not add event to queue");
+		FIREFLY_RUNTIME_FREE(conn, fepr);
 	}
 }
 
+int handle_data_parity_event(void *event_arg)
+{
+	struct firefly_event_data_parity_recv *fepr;
+
+	fepr = event_arg;
+	fepr->parity.parity.a = (uint8_t *) (fepr + 1);
+	deliver_data_parity(fepr->conn, &fepr->parity);
+	FIREFLY_RUNTIME_FREE(fepr->conn, event_arg);
+
+	return 0;
+}
+
 struct labcomm_encoder *firefly_protocol_get_output_stream(
 				struct firefly_channel *chan)
 {
@@ -643,16 +1082,7 @@ struct labcomm_decoder *firefly_protocol_get_input_stream(
 
 size_t firefly_number_channels_in_connection(struct firefly_connection *conn)
 {
-	struct channel_list_node *node;
-	size_t cnt = 0;
-
-	node = conn->chan_list;
-	while (node != NULL) {
-		node = node->next;
-		cnt++;
-	}
-
-	return cnt;
+	return conn->chan_table.count;
 }
 
 void handle_channel_restrict_request(
@@ -660,26 +1090,19 @@ void handle_channel_restrict_request(
 		void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_channel_restrict_request *earg;
-	int ret;
+	struct firefly_event_channel_restrict_request earg;
+	int64_t ret;
 
 	conn = context;
-	earg = FIREFLY_MALLOC(sizeof(*earg));
-	if (!earg) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event arg.\n");
-		return;
-	}
-	memcpy(&earg->rreq, data, sizeof(*data));
-	earg->conn = conn;
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	memcpy(&earg.rreq, data, sizeof(*data));
+	earg.conn = conn;
+	ret = firefly_event_offer_copy(conn->event_queue, conn,
 						FIREFLY_PRIORITY_MEDIUM,
 						&channel_restrict_request_event,
-						earg, 0, NULL);
+						&earg, sizeof(earg), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "Could not add event to queue");
-		FIREFLY_FREE(earg);
 	}
 }
 
@@ -696,7 +1119,6 @@ int channel_restrict_request_event(void *context)
 	if (!chan) {
 		firefly_unknown_dest(conn, earg->rreq.source_chan_id,
 							 earg->rreq.dest_chan_id, "channel_restrict_request");
-		FIREFLY_FREE(earg);
 		return -1;
 	}
 	resp.dest_chan_id   = chan->remote_id;
@@ -729,7 +1151,6 @@ int channel_restrict_request_event(void *context)
 	labcomm_encode_firefly_protocol_channel_restrict_ack(
 			conn->transport_encoder,
 			&resp);
-	FIREFLY_FREE(earg);
 
 	return 0;
 }
@@ -738,27 +1159,20 @@ void handle_channel_restrict_ack(firefly_protocol_channel_restrict_ack *data,
 				 void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_chan_restrict_ack *earg;
-	int ret;
+	struct firefly_event_chan_restrict_ack earg;
+	int64_t ret;
 
 	conn = context;
 
-	earg = FIREFLY_MALLOC(sizeof(*earg));
-	if (!earg) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event arg.\n");
-		return;
-	}
-	memcpy(&earg->rack, data, sizeof(*data));
-	earg->conn = conn;
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	memcpy(&earg.rack, data, sizeof(*data));
+	earg.conn = conn;
+	ret = firefly_event_offer_copy(conn->event_queue, conn,
 						FIREFLY_PRIORITY_MEDIUM,
 						channel_restrict_ack_event,
-						earg, 0, NULL);
+						&earg, sizeof(earg), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "Could not add event to queue");
-		FIREFLY_FREE(earg);
 	}
 }
 
@@ -774,7 +1188,6 @@ int channel_restrict_ack_event(void *context)
 	if (!chan) {
 		firefly_unknown_dest(conn, earg->rack.source_chan_id,
 							 earg->rack.dest_chan_id, "restrict_ack");
-		FIREFLY_FREE(context);
 		return -1;
 	}
 	if (chan->auto_restrict) {
@@ -815,7 +1228,6 @@ int channel_restrict_ack_event(void *context)
 	}
 	chan->restricted_remote = earg->rack.restricted;
 	firefly_channel_ack(chan);
-	FIREFLY_FREE(earg);
 
 	return 0;
 }
@@ -1,6 +1,7 @@
 #include "protocol/firefly_protocol_private.h"
 
 #include <limits.h>
+#include <string.h>
 
 #include <utils/firefly_errors.h>
 #include "utils/firefly_event_queue_private.h"
@@ -22,6 +23,21 @@ struct firefly_channel *firefly_channel_new(struct firefly_connection *conn)
 	chan->important_id	= 0;
 	chan->current_seqno	= 0;
 	chan->remote_seqno	= 0;
+	chan->window_base	= 0;
+	chan->window_head	= 0;
+	chan->window_count	= 0;
+	chan->sending_queued	= false;
+	chan->send_queued_id	= 0;
+	chan->cwnd_waiting	= false;
+	chan->cwnd_next		= NULL;
+	chan->reorder_head	= 0;
+	chan->ack_pending	= false;
+	chan->ack_next		= NULL;
+	for (int i = 0; i < FIREFLY_IMPORTANT_WINDOW; i++) {
+		chan->window_ids[i]   = 0;
+		chan->window_sizes[i] = 0;
+		chan->reorder[i].used = false;
+	}
 	chan->restricted_local	= false;
 	chan->restricted_remote	= false;
 	chan->auto_restrict	= false;
@@ -30,6 +46,26 @@ struct firefly_channel *firefly_channel_new(struct firefly_connection *conn)
 	chan->n_decoder_types	= 0;
 	chan->proto_decoder     = NULL;
 	chan->proto_encoder     = NULL;
+	chan->fragment_sample_id = 0;
+	for (int i = 0; i < 2; i++) {
+		chan->reassembly[i].chan     = chan;
+		chan->reassembly[i].data     = NULL;
+		chan->reassembly[i].timer_id = 0;
+	}
+	chan->priority		= FIREFLY_CHANNEL_PRIORITY_NORMAL;
+	chan->fec_group		= 0;
+	chan->fec_next_seqno	= 1;
+	chan->fec_recovered	= 0;
+	chan->fec_tx.data	= NULL;
+	chan->fec_rx.data	= NULL;
+	chan->conflate		= false;
+	chan->conflate_interval	= 0;
+	chan->conflate_state	= FIREFLY_CONFLATE_IDLE;
+	chan->conflate_timer_id	= 0;
+	chan->conflate_queued_id	= 0;
+	chan->conflated		= NULL;
+	chan->ttl		= 0;
+	chan->nbr_expired	= 0;
 
 	// TODO: Fix this once Labcomm re-gets error handling
 	/* labcomm_register_error_handler_encoder(proto_encoder,*/
@@ -50,13 +86,41 @@ void firefly_channel_free(struct firefly_channel *chan)
 		labcomm_decoder_free(chan->proto_decoder);
 	if (chan->proto_encoder)
 		labcomm_encoder_free(chan->proto_encoder);
+	if (chan->send_queued_id > 0)
+		firefly_event_offer_cancel(chan->conn->event_queue,
+				chan->send_queued_id);
 	node = chan->important_queue;
 	while (node != NULL) {
 		tmp = node;
 		node = node->next;
+		if (tmp->event == send_data_sample_event) {
+			struct firefly_event_send_sample *fess = tmp->event_arg;
+
+			if (fess->frame != NULL)
+				firefly_buffer_unref(fess->frame);
+			else
+				FIREFLY_RUNTIME_FREE(chan->conn, fess->data.app_enc_data.a);
+		}
 		FIREFLY_FREE(tmp->event_arg);
 		FIREFLY_FREE(tmp);
 	}
+	for (int i = 0; i < 2; i++) {
+		struct firefly_reassembly *r = &chan->reassembly[i];
+
+		if (r->timer_id > 0)
+			firefly_event_offer_cancel(chan->conn->event_queue, r->timer_id);
+		firefly_reassembly_release(r);
+	}
+	for (int i = 0; i < FIREFLY_IMPORTANT_WINDOW; i++) {
+		struct firefly_reorder_entry *e = &chan->reorder[i];
+
+		if (!e->used)
+			continue;
+		if (e->fragment)
+			FIREFLY_RUNTIME_FREE(chan->conn, e->pkt.frag.frag_data.a);
+		else
+			FIREFLY_RUNTIME_FREE(chan->conn, e->pkt.sample.app_enc_data.a);
+	}
 	while (chan->enc_types) {
 		struct firefly_channel_encoder_type *tmp;
 
@@ -64,6 +128,24 @@ void firefly_channel_free(struct firefly_channel *chan)
 		chan->enc_types = tmp->next;
 		FIREFLY_FREE(tmp);
 	}
+	FIREFLY_FREE(chan->fec_tx.data);
+	FIREFLY_FREE(chan->fec_rx.data);
+	if (chan->conflate_timer_id > 0)
+		firefly_event_offer_cancel(chan->conn->event_queue,
+				chan->conflate_timer_id);
+	// Cancelling the untimed event does nothing if it has already run.
+	if (chan->conflate_queued_id > 0)
+		firefly_event_offer_cancel(chan->conn->event_queue,
+				chan->conflate_queued_id);
+	while (chan->conflated != NULL) {
+		struct firefly_conflated_sample *tmp;
+
+		tmp = chan->conflated;
+		chan->conflated = tmp->next;
+		if (tmp->data != NULL)
+			FIREFLY_RUNTIME_FREE(chan->conn, tmp->data);
+		FIREFLY_FREE(tmp);
+	}
 	FIREFLY_FREE(chan);
 }
 
@@ -73,6 +155,91 @@ struct firefly_connection *firefly_channel_get_connection(
 	return chan->conn;
 }
 
+void firefly_channel_set_priority(struct firefly_channel *chan,
+		enum firefly_channel_priority priority)
+{
+	chan->priority = priority;
+}
+
+enum firefly_channel_priority firefly_channel_get_priority(
+		struct firefly_channel *chan)
+{
+	return chan->priority;
+}
+
+void firefly_channel_set_conflate(struct firefly_channel *chan, bool conflate,
+		unsigned int min_interval)
+{
+	chan->conflate = conflate;
+	chan->conflate_interval = min_interval;
+}
+
+void firefly_channel_set_deadline(struct firefly_channel *chan,
+		unsigned int ttl)
+{
+	chan->ttl = ttl;
+}
+
+unsigned int firefly_channel_get_expired(struct firefly_channel *chan)
+{
+	return chan->nbr_expired;
+}
+
+int64_t firefly_channel_deadline(struct firefly_channel *chan)
+{
+	if (chan->ttl == 0)
+		return 0;
+	return firefly_event_queue_now(chan->conn->event_queue) + chan->ttl;
+}
+
+bool firefly_channel_expired(struct firefly_channel *chan, int64_t deadline)
+{
+	struct firefly_connection *conn;
+
+	conn = chan->conn;
+	if (deadline == 0 || firefly_event_queue_now(conn->event_queue) <= deadline)
+		return false;
+	chan->nbr_expired++;
+	if (conn->actions != NULL && conn->actions->channel_expired != NULL)
+		conn->actions->channel_expired(chan, chan->nbr_expired);
+	return true;
+}
+
+/*
+ * A normal channel sends at the priority of the protocol packets and delivers
+ * below it, as before the classes. Control channels are sent and delivered
+ * ahead of them, bulk channels after.
+ */
+unsigned char firefly_send_priority(int priority)
+{
+	switch (priority) {
+	case FIREFLY_CHANNEL_PRIORITY_BULK:
+		// The channel is freed after its bulk samples, not before.
+		return FIREFLY_CHANNEL_CLOSE_PRIORITY;
+	case FIREFLY_CHANNEL_PRIORITY_CONTROL:
+		return FIREFLY_PRIORITY_HIGH + 10;
+	default:
+		return FIREFLY_PRIORITY_HIGH;
+	}
+}
+
+unsigned char firefly_channel_send_priority(struct firefly_channel *chan)
+{
+	return firefly_send_priority(chan->priority);
+}
+
+unsigned char firefly_receive_priority(int priority)
+{
+	switch (priority) {
+	case FIREFLY_CHANNEL_PRIORITY_BULK:
+		return FIREFLY_PRIORITY_LOW - 10;
+	case FIREFLY_CHANNEL_PRIORITY_CONTROL:
+		return FIREFLY_PRIORITY_MEDIUM;
+	default:
+		return FIREFLY_PRIORITY_LOW;
+	}
+}
+
 int firefly_channel_next_seqno(struct firefly_channel *chan)
 {
 	if (chan->current_seqno == INT_MAX) {
@@ -88,6 +255,7 @@ int firefly_channel_closed_event(void *event_arg)
 	chan = event_arg;
 
 	firefly_channel_ack(chan);
+	firefly_channel_ack_window(chan);
 
 	remove_channel_from_connection(chan, chan->conn);
 	if (chan->conn->actions && chan->conn->actions->channel_closed)
@@ -103,7 +271,7 @@ void firefly_channel_restrict(struct firefly_channel *chan)
 	int ret;
 
 	conn = chan->conn;
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
 						FIREFLY_PRIORITY_MEDIUM,
 						firefly_channel_restrict_event,
 						chan, 0, NULL);
@@ -147,7 +315,7 @@ void firefly_channel_unrestrict(struct firefly_channel *chan)
 	int ret;
 
 	conn = chan->conn;
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
 						FIREFLY_PRIORITY_MEDIUM,
 						firefly_channel_unrestrict_event,
 						chan, 0, NULL);
@@ -262,50 +430,689 @@ void firefly_channel_internal_opened(struct firefly_channel *chan)
 	}
 }
 
-void firefly_channel_ack(struct firefly_channel *chan)
+/*
+ * Adds the channel to the channels woken when the congestion window of the
+ * connection has room again.
+ */
+static void firefly_channel_cwnd_wait(struct firefly_channel *chan)
 {
 	struct firefly_connection *conn;
+
+	conn = chan->conn;
+	if (chan->cwnd_waiting)
+		return;
+	chan->cwnd_waiting = true;
+	chan->cwnd_next = NULL;
+	if (conn->cwnd_waiting_tail != NULL)
+		conn->cwnd_waiting_tail->cwnd_next = chan;
+	else
+		conn->cwnd_waiting = chan;
+	conn->cwnd_waiting_tail = chan;
+}
+
+/*
+ * Checks whether an important packet sent by the event may be sent now. A
+ * data sample waits for a full send window while a handshake or restrict
+ * packet waits for every packet in flight.
+ */
+static bool firefly_channel_may_send(struct firefly_channel *chan,
+		firefly_event_execute_f event)
+{
+	if (chan->important_id != 0)
+		return false;
+	if (event == send_data_sample_event) {
+		if (!firefly_channel_window_full(chan))
+			return true;
+		if (firefly_connection_cwnd_full(chan->conn))
+			firefly_channel_cwnd_wait(chan);
+		return false;
+	}
+	firefly_channel_window_full(chan); // Drop the packets not resent.
+	return chan->window_count == 0;
+}
+
+static int firefly_channel_send_queued_event(void *event_arg)
+{
+	struct firefly_channel *chan;
 	struct firefly_channel_important_queue *tmp;
 
+	chan = event_arg;
+	chan->send_queued_id = 0;
+	while (chan->state == FIREFLY_CHANNEL_OPEN &&
+			chan->important_queue != NULL &&
+			firefly_channel_may_send(chan, chan->important_queue->event)) {
+		tmp = chan->important_queue;
+		chan->important_queue = tmp->next;
+		chan->sending_queued = true;
+		tmp->event(tmp->event_arg);
+		chan->sending_queued = false;
+		FIREFLY_FREE(tmp);
+	}
+	return 0;
+}
+
+/*
+ * Sends the queued important packets that may be sent now, in order, from an
+ * event of the connection.
+ */
+static void firefly_channel_send_queued(struct firefly_channel *chan)
+{
+	struct firefly_connection *conn;
+	int64_t ret;
+
 	conn = chan->conn;
+	if (chan->state != FIREFLY_CHANNEL_OPEN ||
+			chan->important_queue == NULL || chan->send_queued_id > 0)
+		return;
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
+			FIREFLY_PRIORITY_HIGH, firefly_channel_send_queued_event, chan,
+			0, NULL);
+	if (ret < 0)
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "could not add event to queue");
+	else
+		chan->send_queued_id = ret;
+}
+
+/*
+ * Sends the queued important packets of the channels waiting for room in the
+ * congestion window, in the order they started waiting. A channel still not
+ * fitting waits again.
+ */
+static void firefly_channel_cwnd_wake(struct firefly_connection *conn)
+{
+	struct firefly_channel *chan;
+	struct firefly_channel *next;
+
+	next = conn->cwnd_waiting;
+	conn->cwnd_waiting = NULL;
+	conn->cwnd_waiting_tail = NULL;
+	while (next != NULL) {
+		chan = next;
+		next = chan->cwnd_next;
+		chan->cwnd_next = NULL;
+		chan->cwnd_waiting = false;
+		firefly_channel_send_queued(chan);
+	}
+}
+
+void firefly_channel_ack(struct firefly_channel *chan)
+{
 	if (chan->important_id != 0 &&
 			chan->conn->transport != NULL &&
 			chan->conn->transport->ack != NULL)
 		chan->conn->transport->ack(chan->important_id, chan->conn);
 	chan->important_id = 0;
-	/*
-	 * If there are queued important packets and the channel is open,
-	 * send the next one.
-	 */
-	if (chan->state == FIREFLY_CHANNEL_OPEN &&
-			chan->important_queue != NULL) {
-		tmp = chan->important_queue;
-		chan->important_queue = tmp->next;
-		conn->event_queue->offer_event_cb(conn->event_queue,
-				FIREFLY_PRIORITY_HIGH,
-				tmp->event, tmp->event_arg, 0, NULL);
-		FIREFLY_FREE(tmp);
+	firefly_channel_send_queued(chan);
+}
+
+int firefly_seqno_distance(int from, int to)
+{
+	int d;
+
+	d = to - from;
+	if (d < 0)
+		d += INT_MAX;
+	return d;
+}
+
+/*
+ * Moves the send window past the oldest sequence numbers that are no longer
+ * resent.
+ */
+static void firefly_channel_window_slide(struct firefly_channel *chan)
+{
+	while (chan->window_count > 0 &&
+			chan->window_ids[chan->window_head] == 0) {
+		chan->window_head = (chan->window_head + 1) % FIREFLY_IMPORTANT_WINDOW;
+		chan->window_count--;
+		chan->window_base = chan->window_base == INT_MAX ?
+			1 : chan->window_base + 1;
 	}
 }
 
+bool firefly_channel_window_full(struct firefly_channel *chan)
+{
+	firefly_channel_window_slide(chan);
+	return chan->window_count >= FIREFLY_IMPORTANT_WINDOW ||
+		firefly_connection_cwnd_full(chan->conn);
+}
+
+unsigned int *firefly_channel_window_push(struct firefly_channel *chan,
+		int *seqno)
+{
+	size_t i;
+
+	firefly_channel_window_slide(chan);
+	*seqno = firefly_channel_next_seqno(chan);
+	if (chan->window_count == 0)
+		chan->window_base = *seqno;
+	i = (chan->window_head + chan->window_count) % FIREFLY_IMPORTANT_WINDOW;
+	chan->window_count++;
+	chan->window_ids[i] = 0;
+	chan->window_sizes[i] = 0;
+	return &chan->window_ids[i];
+}
+
+void firefly_channel_window_sent(struct firefly_channel *chan, size_t size)
+{
+	size_t i;
+
+	if (chan->window_count == 0)
+		return;
+	i = (chan->window_head + chan->window_count - 1) %
+		FIREFLY_IMPORTANT_WINDOW;
+	// Packets not resent by the transport layer are never acked to it.
+	if (chan->window_ids[i] == 0 || chan->window_sizes[i] != 0)
+		return;
+	chan->window_sizes[i] = size;
+	firefly_connection_cwnd_sent(chan->conn, size);
+}
+
+/*
+ * Releases the bytes of a packet in the send window from the congestion
+ * window, letting the channels of the connection waiting for room send.
+ */
+static void firefly_channel_window_release(struct firefly_channel *chan,
+		size_t i, bool acked)
+{
+	size_t size;
+
+	size = chan->window_sizes[i];
+	chan->window_sizes[i] = 0;
+	if (size == 0 || !firefly_connection_cwnd_release(chan->conn, size, acked))
+		return;
+	firefly_channel_cwnd_wake(chan->conn);
+}
+
+/*
+ * Acks the packet at an offset from the start of the send window to the
+ * transport layer. Returns false if it was already acked.
+ */
+static bool firefly_channel_window_ack(struct firefly_channel *chan,
+		size_t offset)
+{
+	size_t i;
+
+	i = (chan->window_head + offset) % FIREFLY_IMPORTANT_WINDOW;
+	if (chan->window_ids[i] == 0)
+		return false;
+	if (chan->conn->transport != NULL && chan->conn->transport->ack != NULL)
+		chan->conn->transport->ack(chan->window_ids[i], chan->conn);
+	chan->window_ids[i] = 0;
+	firefly_channel_window_release(chan, i, true);
+	return true;
+}
+
+void firefly_channel_ack_seqno(struct firefly_channel *chan, int seqno)
+{
+	size_t offset;
+
+	if (chan->window_count == 0)
+		return;
+	offset = firefly_seqno_distance(chan->window_base, seqno);
+	if (offset >= chan->window_count ||
+			!firefly_channel_window_ack(chan, offset))
+		return;
+	firefly_channel_window_slide(chan);
+	firefly_channel_send_queued(chan);
+}
+
+void firefly_channel_ack_cumulative(struct firefly_channel *chan, int seqno,
+		int selective)
+{
+	bool acked = false;
+	int s;
+	int d;
+
+	if (seqno < 0)
+		return;
+	s = chan->window_base;
+	for (size_t offset = 0; offset < chan->window_count; offset++) {
+		d = firefly_seqno_distance(seqno, s);
+		// Up to seqno if not ahead of it, otherwise if selected. A seqno of
+		// 0 acknowledges no packet up to it.
+		if ((seqno > 0 &&
+			 firefly_seqno_distance(s, seqno) < FIREFLY_IMPORTANT_WINDOW) ||
+				(d >= 1 && d <= FIREFLY_IMPORTANT_WINDOW &&
+				 (selective & (1 << (d - 1))) != 0))
+			acked |= firefly_channel_window_ack(chan, offset);
+		s = s == INT_MAX ? 1 : s + 1;
+	}
+	if (!acked)
+		return;
+	firefly_channel_window_slide(chan);
+	firefly_channel_send_queued(chan);
+}
+
+void firefly_channel_ack_window(struct firefly_channel *chan)
+{
+	for (size_t n = 0; n < chan->window_count; n++) {
+		size_t i = (chan->window_head + n) % FIREFLY_IMPORTANT_WINDOW;
+
+		if (chan->window_ids[i] != 0 && chan->conn->transport != NULL &&
+				chan->conn->transport->ack != NULL)
+			chan->conn->transport->ack(chan->window_ids[i], chan->conn);
+		chan->window_ids[i] = 0;
+		firefly_channel_window_release(chan, i, false);
+	}
+	chan->window_count = 0;
+}
+
+int firefly_channel_reorder_store(struct firefly_channel *chan, size_t ahead,
+		firefly_protocol_data_sample *sample,
+		firefly_protocol_data_fragment *frag)
+{
+	struct firefly_reorder_entry *e;
+	unsigned char *data;
+	size_t size;
+
+	e = &chan->reorder[(chan->reorder_head + ahead) % FIREFLY_IMPORTANT_WINDOW];
+	if (e->used)
+		return 0;
+	size = sample != NULL ? sample->app_enc_data.n_0 : frag->frag_data.n_0;
+	data = FIREFLY_RUNTIME_MALLOC(chan->conn, size > 0 ? size : 1);
+	if (data == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		return -1;
+	}
+	if (sample != NULL) {
+		memcpy(data, sample->app_enc_data.a, size);
+		e->pkt.sample = *sample;
+		e->pkt.sample.app_enc_data.a = data;
+	} else {
+		memcpy(data, frag->frag_data.a, size);
+		e->pkt.frag = *frag;
+		e->pkt.frag.frag_data.a = data;
+	}
+	e->fragment = sample == NULL;
+	e->used = true;
+	return 0;
+}
+
+struct firefly_reorder_entry *firefly_channel_reorder_next(
+		struct firefly_channel *chan)
+{
+	struct firefly_reorder_entry *e;
+
+	e = &chan->reorder[chan->reorder_head];
+	return e->used ? e : NULL;
+}
+
+void firefly_channel_advance_remote_seqno(struct firefly_channel *chan)
+{
+	struct firefly_reorder_entry *e;
+
+	e = &chan->reorder[chan->reorder_head];
+	if (e->used) {
+		if (e->fragment)
+			FIREFLY_RUNTIME_FREE(chan->conn, e->pkt.frag.frag_data.a);
+		else
+			FIREFLY_RUNTIME_FREE(chan->conn, e->pkt.sample.app_enc_data.a);
+		e->used = false;
+	}
+	chan->reorder_head = (chan->reorder_head + 1) % FIREFLY_IMPORTANT_WINDOW;
+	chan->remote_seqno = chan->remote_seqno == INT_MAX ?
+		1 : chan->remote_seqno + 1;
+}
+
 bool firefly_channel_enqueue_important(struct firefly_channel *chan,
 		firefly_event_execute_f event, void *event_arg)
 {
-	if (chan->important_id != 0) {
-		struct firefly_channel_important_queue **last;
+	struct firefly_channel_important_queue **last;
+
+	// The queued packet being sent was checked by the sender.
+	if (chan->sending_queued)
+		return false;
+	if (chan->important_queue == NULL &&
+			firefly_channel_may_send(chan, event))
+		return false;
+	last = &chan->important_queue;
+	while (*last != NULL) {
+		last = &(*last)->next;
+	}
+	*last = FIREFLY_MALLOC(sizeof(**last));
+	(*last)->next = NULL;
+	(*last)->event_arg = event_arg;
+	(*last)->event = event;
+	return true;
+}
+
+int firefly_channel_push_important(struct firefly_channel *chan,
+		firefly_event_execute_f event, void *event_arg)
+{
+	struct firefly_channel_important_queue *node;
+
+	node = FIREFLY_MALLOC(sizeof(*node));
+	if (node == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		return -1;
+	}
+	node->next = chan->important_queue;
+	node->event_arg = event_arg;
+	node->event = event;
+	chan->important_queue = node;
+	if (firefly_connection_cwnd_full(chan->conn))
+		firefly_channel_cwnd_wait(chan);
+	return 0;
+}
 
-		last = &chan->important_queue;
-		while (*last != NULL) {
-			last = &(*last)->next;
+int firefly_channel_next_fragment_id(struct firefly_channel *chan)
+{
+	if (chan->fragment_sample_id == INT_MAX) {
+		chan->fragment_sample_id = 0;
+	}
+	return ++chan->fragment_sample_id;
+}
+
+static void firefly_fec_group_reset(struct firefly_fec_group *g, int base)
+{
+	if (g->length > 0)
+		memset(g->data, 0, g->length);
+	g->base      = base;
+	g->count     = 0;
+	g->received  = 0;
+	g->recovered = 0;
+	g->parity    = false;
+	g->seqno     = 0;
+	g->important = 0;
+	g->size      = 0;
+	g->length    = 0;
+}
+
+/*
+ * XOR a sample, or the parity, into the group. The size field is XORed as
+ * is, only the length bytes of data are XORed into the buffer of the group.
+ * The caller makes sure length fits the buffer.
+ */
+static void firefly_fec_group_xor(struct firefly_fec_group *g, int seqno,
+		int important, int size, const unsigned char *data, size_t length)
+{
+	g->seqno     ^= seqno;
+	g->important ^= important;
+	g->size      ^= size;
+	for (size_t i = 0; i < length; i++)
+		g->data[i] ^= data[i];
+	if (length > g->length)
+		g->length = length;
+}
+
+int firefly_channel_set_fec(struct firefly_channel *chan, int group)
+{
+	if (group > FIREFLY_FEC_MAX_GROUP)
+		group = FIREFLY_FEC_MAX_GROUP;
+	if (group > 0 && chan->fec_tx.data == NULL) {
+		chan->fec_tx.data = FIREFLY_MALLOC(FIREFLY_FRAGMENT_SIZE);
+		chan->fec_rx.data = FIREFLY_MALLOC(FIREFLY_FRAGMENT_SIZE);
+		if (chan->fec_tx.data == NULL || chan->fec_rx.data == NULL) {
+			FFL(FIREFLY_ERROR_ALLOC);
+			group = 0;
 		}
-		*last = FIREFLY_MALLOC(sizeof(**last));
-		(*last)->next = NULL;
-		(*last)->event_arg = event_arg;
-		(*last)->event = event;
+		chan->fec_tx.length = FIREFLY_FRAGMENT_SIZE;
+		chan->fec_rx.length = FIREFLY_FRAGMENT_SIZE;
+	}
+	if (group <= 0) {
+		FIREFLY_FREE(chan->fec_tx.data);
+		FIREFLY_FREE(chan->fec_rx.data);
+		chan->fec_tx.data = NULL;
+		chan->fec_rx.data = NULL;
+		chan->fec_group = 0;
+		return 0;
+	}
+	chan->fec_group = group;
+	chan->fec_next_seqno = 1;
+	firefly_fec_group_reset(&chan->fec_tx, 0);
+	firefly_fec_group_reset(&chan->fec_rx, 0);
+	return group;
+}
+
+bool firefly_channel_fec_add(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data)
+{
+	struct firefly_fec_group *g = &chan->fec_tx;
+	int size = data->app_enc_data.n_0;
+
+	data->fec_seqno = 0;
+	if (g->data == NULL || size > FIREFLY_FRAGMENT_SIZE)
+		return false;
+	if (g->count == 0) {
+		// Groups start at 1 + n * fec_group, also after the wrap around.
+		if (chan->fec_next_seqno > INT_MAX - chan->fec_group)
+			chan->fec_next_seqno = 1;
+		firefly_fec_group_reset(g, chan->fec_next_seqno);
+	}
+	data->fec_seqno = chan->fec_next_seqno++;
+	firefly_fec_group_xor(g, data->seqno, data->important ? 1 : 0, size,
+			data->app_enc_data.a, size);
+	return ++g->count == (size_t) chan->fec_group;
+}
+
+void firefly_channel_fec_parity(struct firefly_channel *chan,
+		firefly_protocol_data_parity *parity)
+{
+	struct firefly_fec_group *g = &chan->fec_tx;
+
+	parity->dest_chan_id = chan->remote_id;
+	parity->src_chan_id  = chan->local_id;
+	parity->fec_seqno    = g->base;
+	parity->seqno        = g->seqno;
+	parity->important    = g->important;
+	parity->size         = g->size;
+	parity->parity.n_0   = g->length;
+	parity->parity.a     = g->data;
+	g->count = 0;
+}
+
+/*
+ * Gets the group being received if base is its first fec_seqno. The group is
+ * restarted if base is newer and NULL is returned if it is older.
+ */
+static struct firefly_fec_group *firefly_channel_fec_group(
+		struct firefly_channel *chan, int base)
+{
+	struct firefly_fec_group *g = &chan->fec_rx;
+
+	if (g->base != base) {
+		if (g->base != 0 &&
+				firefly_seqno_distance(g->base, base) > INT_MAX / 2)
+			return NULL;
+		firefly_fec_group_reset(g, base);
+	}
+	return g;
+}
+
+bool firefly_channel_fec_receive(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data)
+{
+	struct firefly_fec_group *g;
+	unsigned int bit;
+	int base;
+
+	if (chan->fec_rx.data == NULL || data->fec_seqno <= 0 ||
+			data->app_enc_data.n_0 > FIREFLY_FRAGMENT_SIZE)
 		return true;
-	} else {
+	base = data->fec_seqno - (data->fec_seqno - 1) % chan->fec_group;
+	g = firefly_channel_fec_group(chan, base);
+	if (g == NULL)
+		return data->important || data->fec_seqno != chan->fec_recovered;
+	bit = 1u << (data->fec_seqno - base);
+	if (g->received & bit)
+		return data->important || !(g->recovered & bit);
+	g->received |= bit;
+	firefly_fec_group_xor(g, data->seqno, data->important ? 1 : 0,
+			data->app_enc_data.n_0, data->app_enc_data.a,
+			data->app_enc_data.n_0);
+	return true;
+}
+
+void firefly_channel_fec_receive_parity(struct firefly_channel *chan,
+		firefly_protocol_data_parity *parity)
+{
+	struct firefly_fec_group *g;
+
+	// The parity covers at most the group buffer.
+	if (chan->fec_rx.data == NULL || parity->fec_seqno <= 0 ||
+			(parity->fec_seqno - 1) % chan->fec_group != 0 ||
+			parity->parity.n_0 < 0 ||
+			parity->parity.n_0 > FIREFLY_FRAGMENT_SIZE)
+		return;
+	g = firefly_channel_fec_group(chan, parity->fec_seqno);
+	if (g == NULL || g->parity)
+		return;
+	g->parity = true;
+	firefly_fec_group_xor(g, parity->seqno, parity->important, parity->size,
+			parity->parity.a, parity->parity.n_0);
+}
+
+bool firefly_channel_fec_recover(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data)
+{
+	struct firefly_fec_group *g = &chan->fec_rx;
+	unsigned int missing;
+	int i;
+
+	if (g->data == NULL || !g->parity)
 		return false;
+	missing = ((1u << chan->fec_group) - 1) & ~g->received;
+	// Recoverable only if exactly one sample is missing.
+	if (missing == 0 || (missing & (missing - 1)) != 0)
+		return false;
+	g->received |= missing;
+	// A recovered size beyond the XORed bytes means a corrupt parity.
+	if (g->size < 0 || (size_t) g->size > g->length ||
+			g->size > FIREFLY_FRAGMENT_SIZE)
+		return false;
+	for (i = 0; !(missing & (1u << i)); i++)
+		;
+	g->recovered |= missing;
+	chan->fec_recovered = g->base + i;
+	data->dest_chan_id = chan->local_id;
+	data->src_chan_id = chan->remote_id;
+	data->seqno = g->seqno;
+	data->important = g->important & 1;
+	data->fec_seqno = g->base + i;
+	data->priority = chan->priority;
+	data->app_enc_data.n_0 = g->size;
+	data->app_enc_data.a = g->data;
+	return true;
+}
+
+static int firefly_reassembly_timeout_event(void *event_arg)
+{
+	struct firefly_reassembly *r;
+	struct firefly_connection *conn;
+
+	r = event_arg;
+	conn = r->chan->conn;
+	r->timer_id = 0;
+	if (r->data == NULL)
+		return 0;
+	if (!r->progress) {
+		firefly_reassembly_release(r);
+		return 0;
+	}
+	r->progress = false;
+	r->timer_id = firefly_event_offer_after(conn->event_queue, conn,
+			FIREFLY_PRIORITY_LOW, firefly_reassembly_timeout_event, r,
+			FIREFLY_REASSEMBLY_TIMEOUT);
+	if (r->timer_id < 0)
+		r->timer_id = 0;
+	return 0;
+}
+
+/*
+ * Start reassembling a new sample. Returns a negative value if the sample may
+ * not be reassembled.
+ */
+static int firefly_reassembly_start(struct firefly_reassembly *r,
+		firefly_protocol_data_fragment *frag)
+{
+	struct firefly_connection *conn;
+	size_t nbr_frags;
+
+	conn = r->chan->conn;
+	if (conn->reassembly_bytes + frag->total_size >
+			FIREFLY_REASSEMBLY_MAX_BYTES) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+				"Too many bytes in partially received samples.");
+		return -1;
+	}
+	nbr_frags = (frag->total_size + FIREFLY_FRAGMENT_SIZE - 1) /
+		FIREFLY_FRAGMENT_SIZE;
+	r->data = FIREFLY_RUNTIME_MALLOC(conn,
+			frag->total_size + (nbr_frags + 7) / 8);
+	if (r->data == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		return -1;
+	}
+	memset(r->data + frag->total_size, 0, (nbr_frags + 7) / 8);
+	r->size = frag->total_size;
+	r->nbr_missing = nbr_frags;
+	r->sample_id = frag->sample_id;
+	conn->reassembly_bytes += r->size;
+	if (r->timer_id == 0) {
+		r->timer_id = firefly_event_offer_after(conn->event_queue, conn,
+				FIREFLY_PRIORITY_LOW, firefly_reassembly_timeout_event, r,
+				FIREFLY_REASSEMBLY_TIMEOUT);
+		if (r->timer_id < 0)
+			r->timer_id = 0;
 	}
+	return 0;
+}
+
+int firefly_channel_reassemble(struct firefly_channel *chan,
+		firefly_protocol_data_fragment *frag)
+{
+	struct firefly_reassembly *r;
+	unsigned char *received;
+	size_t index;
+	size_t size;
+
+	if (frag->total_size <= 0 || frag->total_size > FIREFLY_SAMPLE_MAX_SIZE ||
+			frag->offset < 0 || frag->offset >= frag->total_size ||
+			frag->offset % FIREFLY_FRAGMENT_SIZE != 0) {
+		firefly_error(FIREFLY_ERROR_PROTO_STATE, 1,
+				"Received malformed data fragment.");
+		return -1;
+	}
+	size = frag->total_size - frag->offset;
+	if (size > FIREFLY_FRAGMENT_SIZE)
+		size = FIREFLY_FRAGMENT_SIZE;
+	if ((size_t) frag->frag_data.n_0 != size) {
+		firefly_error(FIREFLY_ERROR_PROTO_STATE, 1,
+				"Received malformed data fragment.");
+		return -1;
+	}
+	r = firefly_channel_reassembled(chan, frag->important);
+	if (r->data != NULL && (r->sample_id != frag->sample_id ||
+				r->size != (size_t) frag->total_size))
+		firefly_reassembly_release(r);
+	if (r->data == NULL && firefly_reassembly_start(r, frag) < 0)
+		return -1;
+
+	index = frag->offset / FIREFLY_FRAGMENT_SIZE;
+	received = r->data + r->size;
+	r->progress = true;
+	if (received[index / 8] & (1 << (index % 8)))
+		return 0;
+	received[index / 8] |= 1 << (index % 8);
+	memcpy(r->data + frag->offset, frag->frag_data.a, size);
+	return --r->nbr_missing == 0 ? 1 : 0;
+}
+
+struct firefly_reassembly *firefly_channel_reassembled(
+		struct firefly_channel *chan, bool important)
+{
+	return &chan->reassembly[important ? 1 : 0];
+}
+
+void firefly_reassembly_release(struct firefly_reassembly *r)
+{
+	if (r->data == NULL)
+		return;
+	r->chan->conn->reassembly_bytes -= r->size;
+	FIREFLY_RUNTIME_FREE(r->chan->conn, r->data);
+	r->data = NULL;
 }
 
 void firefly_channel_raise(
@@ -6,6 +6,7 @@
 #include "protocol/firefly_protocol.h"
 
 #include <string.h>
+#include <stdint.h>
 
 #include "utils/firefly_errors.h"
 #include "utils/cppmacros.h"
@@ -30,7 +31,7 @@ static int firefly_connection_open_event(void *arg)
  */
 static void signature_trans_write(unsigned char *data, size_t size,
 				  struct firefly_connection *conn,
-				  bool important, unsigned char *id)
+				  bool important, unsigned int *id)
 {
 	UNUSED_VAR(important);
 	UNUSED_VAR(id);
@@ -59,7 +60,8 @@ struct firefly_connection *firefly_connection_new(
 
 	conn = FIREFLY_MALLOC(sizeof(*conn));
 	lc_mem = firefly_labcomm_memory_new(conn);
-	if (conn == NULL || lc_mem == NULL) {
+	if (conn == NULL || lc_mem == NULL ||
+			firefly_channel_table_init(&conn->chan_table)) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 3,
 			      "memory allocation failed %s:%d",
 			      __FUNCTION__, __LINE__);
@@ -75,6 +77,20 @@ struct firefly_connection *firefly_connection_new(
 	conn->context            = NULL;
 	conn->transport          = tc;
 	conn->open               = FIREFLY_CONNECTION_OPEN;
+	conn->rx_inline          = false;
+	conn->reassembly_bytes   = 0;
+	conn->ack_delay_ms       = 0;
+	conn->ack_list           = NULL;
+	conn->cwnd_waiting       = NULL;
+	conn->cwnd_waiting_tail  = NULL;
+	conn->ack_timer_id       = 0;
+	conn->cc.cwnd            = FIREFLY_CWND_INITIAL;
+	conn->cc.ssthresh        = SIZE_MAX;
+	conn->cc.in_flight       = 0;
+	conn->cc.backoffs        = 0;
+	conn->cc_recover         = 0;
+	conn->cc_acked           = 0;
+	conn->tx_priority        = FIREFLY_CHANNEL_PRIORITY_NORMAL;
 	if (memory_replacements) {
 		conn->memory_replacements.alloc_replacement =
 			memory_replacements->alloc_replacement;
@@ -92,6 +108,7 @@ struct firefly_connection *firefly_connection_new(
 			      __FUNCTION__, __LINE__);
 		transport_labcomm_reader_free(reader);
 		transport_labcomm_writer_free(writer);
+		firefly_channel_table_free(&conn->chan_table);
 		FIREFLY_FREE(conn);
 		firefly_labcomm_memory_free(lc_mem);
 		return NULL;
@@ -151,6 +168,15 @@ struct firefly_connection *firefly_connection_new(
 	labcomm_decoder_register_firefly_protocol_channel_restrict_ack(
 			conn->transport_decoder, handle_channel_restrict_ack, conn);
 
+	labcomm_decoder_register_firefly_protocol_data_fragment(
+			conn->transport_decoder, handle_data_fragment, conn);
+
+	labcomm_decoder_register_firefly_protocol_ack_batch(
+			conn->transport_decoder, handle_ack_batch, conn);
+
+	labcomm_decoder_register_firefly_protocol_data_parity(
+			conn->transport_decoder, handle_data_parity, conn);
+
 	labcomm_encoder_register_firefly_protocol_data_sample(conn->transport_encoder);
 	labcomm_encoder_register_firefly_protocol_channel_request(conn->transport_encoder);
 	labcomm_encoder_register_firefly_protocol_channel_response(conn->transport_encoder);
@@ -159,6 +185,9 @@ struct firefly_connection *firefly_connection_new(
 	labcomm_encoder_register_firefly_protocol_ack(conn->transport_encoder);
 	labcomm_encoder_register_firefly_protocol_channel_restrict_request(conn->transport_encoder);
 	labcomm_encoder_register_firefly_protocol_channel_restrict_ack(conn->transport_encoder);
+	labcomm_encoder_register_firefly_protocol_data_fragment(conn->transport_encoder);
+	labcomm_encoder_register_firefly_protocol_ack_batch(conn->transport_encoder);
+	labcomm_encoder_register_firefly_protocol_data_parity(conn->transport_encoder);
 
 	conn->transport = orig_transport;
 	// TODO: Fix this once Labcomm re-gets error handling
@@ -245,6 +274,10 @@ int firefly_connection_free_event(void *event_arg)
 	struct firefly_connection *conn;
 
 	conn = event_arg;
+	// Send what the transport writer has pending while the transport is open.
+	firefly_connection_send_acks(conn, false);
+	labcomm_encoder_ioctl(conn->transport_encoder,
+			FIREFLY_LABCOMM_IOCTL_TRANS_SET_COALESCING, (size_t) 0, 0U);
 	if (conn->transport != NULL && conn->transport->close != NULL) {
 		conn->transport->close(conn);
 	}
@@ -259,6 +292,10 @@ void firefly_connection_free(struct firefly_connection **conn)
 		firefly_channel_closed_event((*conn)->chan_list->chan);
 	}
 	FIREFLY_FREE((*conn)->chan_list);
+	if ((*conn)->ack_timer_id > 0)
+		firefly_event_offer_cancel((*conn)->event_queue,
+				(*conn)->ack_timer_id);
+	firefly_channel_table_free(&(*conn)->chan_table);
 	if ((*conn)->transport_encoder != NULL) {
 		labcomm_encoder_free((*conn)->transport_encoder);
 	}
@@ -270,33 +307,295 @@ void firefly_connection_free(struct firefly_connection **conn)
 	*conn = NULL;
 }
 
+int firefly_channel_table_init(struct firefly_channel_table *table)
+{
+	int size = FIREFLY_CHANNEL_TABLE_INITIAL_SIZE;
+
+	table->local = FIREFLY_MALLOC(size * sizeof(*table->local));
+	table->free_next = FIREFLY_MALLOC(size * sizeof(*table->free_next));
+	table->free_time = FIREFLY_MALLOC(size * sizeof(*table->free_time));
+	table->remote = FIREFLY_MALLOC(size * sizeof(*table->remote));
+	if (table->local == NULL || table->free_next == NULL ||
+			table->free_time == NULL || table->remote == NULL) {
+		FIREFLY_FREE(table->local);
+		FIREFLY_FREE(table->free_next);
+		FIREFLY_FREE(table->free_time);
+		FIREFLY_FREE(table->remote);
+		return -1;
+	}
+	memset(table->local, 0, size * sizeof(*table->local));
+	memset(table->remote, 0, size * sizeof(*table->remote));
+	table->size = size;
+	table->remote_size = size;
+	table->free_head = -1;
+	table->free_tail = -1;
+	table->count = 0;
+	return 0;
+}
+
+void firefly_channel_table_free(struct firefly_channel_table *table)
+{
+	FIREFLY_FREE(table->local);
+	FIREFLY_FREE(table->free_next);
+	FIREFLY_FREE(table->free_time);
+	FIREFLY_FREE(table->remote);
+	table->local = NULL;
+	table->free_next = NULL;
+	table->free_time = NULL;
+	table->remote = NULL;
+}
+
+/*
+ * Grow the local id index of the table to hold at least id. The new slots
+ * are not free ids, they are handed out by the id counter of the connection.
+ */
+static int channel_table_grow_local(struct firefly_channel_table *table,
+		int id)
+{
+	struct channel_list_node **local;
+	int *free_next;
+	int64_t *free_time;
+	int size = table->size;
+
+	while (size <= id)
+		size *= 2;
+	local = FIREFLY_MALLOC(size * sizeof(*local));
+	free_next = FIREFLY_MALLOC(size * sizeof(*free_next));
+	free_time = FIREFLY_MALLOC(size * sizeof(*free_time));
+	if (local == NULL || free_next == NULL || free_time == NULL) {
+		FIREFLY_FREE(local);
+		FIREFLY_FREE(free_next);
+		FIREFLY_FREE(free_time);
+		return -1;
+	}
+	memcpy(local, table->local, table->size * sizeof(*local));
+	memset(local + table->size, 0, (size - table->size) * sizeof(*local));
+	memcpy(free_next, table->free_next, table->size * sizeof(*free_next));
+	memcpy(free_time, table->free_time, table->size * sizeof(*free_time));
+	FIREFLY_FREE(table->local);
+	FIREFLY_FREE(table->free_next);
+	FIREFLY_FREE(table->free_time);
+	table->local = local;
+	table->free_next = free_next;
+	table->free_time = free_time;
+	table->size = size;
+	return 0;
+}
+
+static inline unsigned int channel_table_bucket(
+		struct firefly_channel_table *table, int remote_id)
+{
+	return ((unsigned int) remote_id * 2654435761u) &
+		(table->remote_size - 1);
+}
+
+static void channel_table_insert_remote(struct firefly_channel_table *table,
+		struct channel_list_node *node)
+{
+	unsigned int b = channel_table_bucket(table, node->chan->remote_id);
+
+	node->remote_next = table->remote[b];
+	table->remote[b] = node;
+}
+
+static void channel_table_remove_remote(struct firefly_channel_table *table,
+		struct channel_list_node *node)
+{
+	struct channel_list_node **n;
+
+	n = &table->remote[channel_table_bucket(table, node->chan->remote_id)];
+	while (*n != NULL && *n != node)
+		n = &(*n)->remote_next;
+	if (*n != NULL)
+		*n = node->remote_next;
+}
+
+/*
+ * Double the number of remote id buckets once there are more channels than
+ * buckets. The table keeps working with long chains if this fails.
+ */
+static void channel_table_grow_remote(struct firefly_channel_table *table)
+{
+	struct channel_list_node **old = table->remote;
+	struct channel_list_node *node;
+	int old_size = table->remote_size;
+	int size = old_size * 2;
+
+	table->remote = FIREFLY_MALLOC(size * sizeof(*table->remote));
+	if (table->remote == NULL) {
+		table->remote = old;
+		return;
+	}
+	memset(table->remote, 0, size * sizeof(*table->remote));
+	table->remote_size = size;
+	for (int i = 0; i < old_size; i++) {
+		while ((node = old[i]) != NULL) {
+			old[i] = node->remote_next;
+			channel_table_insert_remote(table, node);
+		}
+	}
+	FIREFLY_FREE(old);
+}
+
+/*
+ * Get the node of a channel or NULL if it has not been added to its
+ * connection.
+ */
+static struct channel_list_node *channel_table_node(
+		struct firefly_channel *chan)
+{
+	struct firefly_channel_table *table = &chan->conn->chan_table;
+	struct channel_list_node *node;
+
+	if (chan->local_id < 0 || chan->local_id >= table->size)
+		return NULL;
+	node = table->local[chan->local_id];
+	return node != NULL && node->chan == chan ? node : NULL;
+}
+
+void add_channel_to_connection(struct firefly_channel *chan,
+		struct firefly_connection *conn)
+{
+	struct firefly_channel_table *table = &conn->chan_table;
+	struct channel_list_node *new_node;
+
+	if (chan->local_id < 0 || (chan->local_id < table->size &&
+				table->local[chan->local_id] != NULL)) {
+		firefly_error(FIREFLY_ERROR_PROTO_STATE, 1,
+			      "Channel id already in use\n");
+		return;
+	}
+	new_node = FIREFLY_MALLOC(sizeof(*new_node));
+	if (new_node == NULL || (chan->local_id >= table->size &&
+				channel_table_grow_local(table, chan->local_id))) {
+		FIREFLY_FREE(new_node);
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "Failed to allocate new channel list note\n");
+		return;
+	}
+	new_node->chan = chan;
+	new_node->prev = NULL;
+	new_node->next = conn->chan_list;
+	if (conn->chan_list != NULL)
+		conn->chan_list->prev = new_node;
+	conn->chan_list = new_node;
+	table->local[chan->local_id] = new_node;
+	// An id not handed out by next_channel_id() must not be handed out later.
+	if (chan->local_id >= conn->channel_id_counter)
+		conn->channel_id_counter = chan->local_id + 1;
+	if (chan->remote_id != CHANNEL_ID_NOT_SET)
+		channel_table_insert_remote(table, new_node);
+	table->count++;
+	if (table->count > (size_t) table->remote_size)
+		channel_table_grow_remote(table);
+}
+
 struct firefly_channel *remove_channel_from_connection(
 		struct firefly_channel *chan, struct firefly_connection *conn)
 {
-	struct firefly_channel *ret;
-	struct channel_list_node **head;
-
-	ret = NULL;
-	head = &conn->chan_list;
-	while (head != NULL && (*head) != NULL) {
-		if ((*head)->chan->local_id == chan->local_id) {
-			struct channel_list_node *tmp;
-
-			tmp = (*head)->next;
-			ret = chan;
-			FIREFLY_FREE(*head);
-			*head = tmp;
-			head = NULL;
-		} else {
-			*head = (*head)->next;
+	struct firefly_channel_table *table = &conn->chan_table;
+	struct channel_list_node *node;
+	int id;
+
+	if (chan == NULL || (node = channel_table_node(chan)) == NULL)
+		return NULL;
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else
+		conn->chan_list = node->next;
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	if (chan->remote_id != CHANNEL_ID_NOT_SET)
+		channel_table_remove_remote(table, node);
+	FIREFLY_FREE(node);
+	table->count--;
+	if (chan->ack_pending) {
+		struct firefly_channel **a = &conn->ack_list;
+
+		while (*a != chan)
+			a = &(*a)->ack_next;
+		*a = chan->ack_next;
+		chan->ack_next = NULL;
+		chan->ack_pending = false;
+	}
+	if (chan->cwnd_waiting) {
+		struct firefly_channel *prev = NULL;
+		struct firefly_channel **w = &conn->cwnd_waiting;
+
+		while (*w != chan) {
+			prev = *w;
+			w = &(*w)->cwnd_next;
 		}
+		*w = chan->cwnd_next;
+		if (conn->cwnd_waiting_tail == chan)
+			conn->cwnd_waiting_tail = prev;
+		chan->cwnd_next = NULL;
+		chan->cwnd_waiting = false;
 	}
-	return ret;
+
+	id = chan->local_id;
+	table->local[id] = NULL;
+	table->free_next[id] = -1;
+	table->free_time[id] = firefly_event_queue_now(conn->event_queue);
+	if (table->free_tail >= 0)
+		table->free_next[table->free_tail] = id;
+	else
+		table->free_head = id;
+	table->free_tail = id;
+	return chan;
+}
+
+struct firefly_channel *find_channel_by_remote_id(
+		struct firefly_connection *conn, int id)
+{
+	struct firefly_channel_table *table = &conn->chan_table;
+	struct channel_list_node *node;
+
+	node = table->remote[channel_table_bucket(table, id)];
+	while (node != NULL && node->chan->remote_id != id)
+		node = node->remote_next;
+	return node != NULL ? node->chan : NULL;
+}
+
+struct firefly_channel *find_channel_by_local_id(
+		struct firefly_connection *conn, int id)
+{
+	struct firefly_channel_table *table = &conn->chan_table;
+
+	if (id < 0 || id >= table->size || table->local[id] == NULL)
+		return NULL;
+	return table->local[id]->chan;
+}
+
+void set_channel_remote_id(struct firefly_channel *chan, int id)
+{
+	struct firefly_channel_table *table = &chan->conn->chan_table;
+	struct channel_list_node *node;
+
+	node = channel_table_node(chan);
+	if (node != NULL && chan->remote_id != CHANNEL_ID_NOT_SET)
+		channel_table_remove_remote(table, node);
+	chan->remote_id = id;
+	if (node != NULL && id != CHANNEL_ID_NOT_SET)
+		channel_table_insert_remote(table, node);
 }
 
 int next_channel_id(struct firefly_connection *conn)
 {
-	return conn->channel_id_counter++;
+	struct firefly_channel_table *table = &conn->chan_table;
+	int id;
+
+	// The oldest free id is the first to leave quarantine.
+	if (table->free_head < 0 ||
+			firefly_event_queue_now(conn->event_queue) -
+			table->free_time[table->free_head] <
+			FIREFLY_CHANNEL_ID_QUARANTINE)
+		return conn->channel_id_counter++;
+	id = table->free_head;
+	table->free_head = table->free_next[id];
+	if (table->free_head < 0)
+		table->free_tail = -1;
+	return id;
 }
 
 void *firefly_connection_get_context(struct firefly_connection *conn)
@@ -316,6 +615,145 @@ struct firefly_event_queue *firefly_connection_get_event_queue(
 	return conn->event_queue;
 }
 
+struct firefly_connection_coalescing_arg {
+	struct firefly_connection *conn;
+	size_t mtu;
+	unsigned int max_delay_us;
+};
+
+static int firefly_connection_coalescing_event(void *event_arg)
+{
+	struct firefly_connection_coalescing_arg *args;
+
+	args = event_arg;
+	labcomm_encoder_ioctl(args->conn->transport_encoder,
+			FIREFLY_LABCOMM_IOCTL_TRANS_SET_COALESCING,
+			args->mtu, args->max_delay_us);
+	return 0;
+}
+
+int64_t firefly_connection_set_tx_coalescing(struct firefly_connection *conn,
+		size_t mtu, unsigned int max_delay_us)
+{
+	struct firefly_connection_coalescing_arg args;
+
+	args.conn = conn;
+	args.mtu = mtu;
+	args.max_delay_us = max_delay_us;
+	return firefly_event_offer_copy(conn->event_queue, conn,
+			FIREFLY_PRIORITY_HIGH, firefly_connection_coalescing_event,
+			&args, sizeof(args), 0, NULL);
+}
+
+struct firefly_connection_ack_delay_arg {
+	struct firefly_connection *conn;
+	unsigned int max_delay_us;
+};
+
+static int firefly_connection_ack_delay_event(void *event_arg)
+{
+	struct firefly_connection_ack_delay_arg *args;
+
+	args = event_arg;
+	args->conn->ack_delay_ms = (args->max_delay_us + 999) / 1000;
+	if (args->conn->ack_delay_ms == 0)
+		firefly_connection_send_acks(args->conn, false);
+	return 0;
+}
+
+int64_t firefly_connection_set_delayed_ack(struct firefly_connection *conn,
+		unsigned int max_delay_us)
+{
+	struct firefly_connection_ack_delay_arg args;
+
+	args.conn = conn;
+	args.max_delay_us = max_delay_us;
+	return firefly_event_offer_copy(conn->event_queue, conn,
+			FIREFLY_PRIORITY_HIGH, firefly_connection_ack_delay_event,
+			&args, sizeof(args), 0, NULL);
+}
+
+void firefly_connection_get_congestion(struct firefly_connection *conn,
+		struct firefly_congestion_state *state)
+{
+	*state = conn->cc;
+}
+
+bool firefly_connection_cwnd_full(struct firefly_connection *conn)
+{
+	return conn->cc.in_flight >= conn->cc.cwnd;
+}
+
+void firefly_connection_cwnd_sent(struct firefly_connection *conn,
+		size_t size)
+{
+	conn->cc.in_flight += size;
+}
+
+bool firefly_connection_cwnd_release(struct firefly_connection *conn,
+		size_t size, bool acked)
+{
+	struct firefly_congestion_state *cc;
+	bool full;
+	bool limited;
+
+	cc = &conn->cc;
+	full = firefly_connection_cwnd_full(conn);
+	// Only grow the window while it limits the sender.
+	limited = 2 * cc->in_flight >= cc->cwnd;
+	cc->in_flight -= size < cc->in_flight ? size : cc->in_flight;
+	if (acked) {
+		conn->cc_recover -= size < conn->cc_recover ?
+			size : conn->cc_recover;
+		if (limited && cc->cwnd < cc->ssthresh) {
+			cc->cwnd += size;
+		} else if (limited) {
+			conn->cc_acked += size;
+			if (conn->cc_acked >= cc->cwnd) {
+				conn->cc_acked -= cc->cwnd;
+				cc->cwnd += FIREFLY_FRAGMENT_SIZE;
+			}
+		}
+	}
+	return full && !firefly_connection_cwnd_full(conn);
+}
+
+static int firefly_connection_resend_timeout_event(void *event_arg)
+{
+	struct firefly_connection *conn;
+	struct firefly_congestion_state *cc;
+
+	conn = event_arg;
+	cc = &conn->cc;
+	// The packets in flight when the window was cut are lost together.
+	if (conn->cc_recover > 0)
+		return 0;
+	cc->ssthresh = cc->cwnd / 2 > FIREFLY_CWND_MIN ?
+		cc->cwnd / 2 : FIREFLY_CWND_MIN;
+	cc->cwnd = cc->ssthresh;
+	cc->backoffs++;
+	conn->cc_recover = cc->in_flight;
+	conn->cc_acked = 0;
+	return 0;
+}
+
+void firefly_connection_resend_timeout(struct firefly_connection *conn)
+{
+	int64_t ret;
+
+	ret = firefly_event_offer_strand(conn->event_queue, conn,
+			FIREFLY_PRIORITY_HIGH, firefly_connection_resend_timeout_event,
+			conn, 0, NULL);
+	if (ret < 0)
+		FFL(FIREFLY_ERROR_ALLOC);
+}
+
+enum firefly_channel_priority firefly_connection_tx_priority(
+		struct firefly_connection *conn)
+{
+	return __sync_fetch_and_add(&conn->tx_priority, 0);
+}
+
 struct firefly_connection_raise_arg {
 	struct firefly_connection *conn;
 	enum firefly_error reason;
@@ -349,7 +787,7 @@ void firefly_connection_raise_later(struct firefly_connection *conn,
 		memset(args->msg, 0, FF_ERRMSG_MAXLEN + 1);
 	}
 
-	conn->event_queue->offer_event_cb(conn->event_queue,
+	firefly_event_offer_strand(conn->event_queue, conn,
 				FIREFLY_PRIORITY_HIGH, firefly_connection_raise_event,
 				args, 0, NULL);
 }
@@ -14,26 +14,57 @@
 
 #include "utils/firefly_event_queue_private.h"
 
+/*
+ * The frames a writer encodes into, w->data is the data of the current frame.
+ */
+struct writer_frames {
+	struct firefly_buffer_pool *pool;
+	struct firefly_buffer *frame;
+};
+
 struct protocol_writer_context {
 	struct firefly_channel *chan;
 	bool important;
+	int index; /* The LabComm index of the type being written. */
+	struct writer_frames frames;
 };
 
-struct transport_writer_context {
-	struct firefly_connection *conn;
-	unsigned char *important_id;
+/*
+ * Packs consecutive unimportant messages of a connection into one frame. The
+ * frame is flushed by an event running after the events already queued for
+ * the connection or, at the latest, by a timed event. The queued events hold
+ * references to the coalescer since they may outlive the writer.
+ */
+struct tx_coalescer {
+	int refs;
+	struct firefly_connection *conn; /* NULL once the writer is freed. */
+	struct firefly_buffer *frame;
+	size_t len;
+	size_t mtu; /* Coalescing is disabled if 0. */
+	int64_t delay_ms;
+	bool held; /* The frame waits for a message to piggyback on. */
+	int priority; /* The highest priority class of the pending messages. */
+	bool perishable; /* A pending message must not be resent. */
+	bool batch_queued;
+	int batch_priority; /* The priority class the flush is queued at. */
+	bool deadline_queued;
 };
 
-struct transport_reader_list {
-	unsigned char *data;
-	size_t len;
-	struct transport_reader_list *next;
+struct transport_writer_context {
+	struct firefly_connection *conn;
+	unsigned int *important_id;
+	bool piggyback; /* Hold the next unimportant message. */
+	int priority; /* The priority class of the next message. */
+	bool perishable; /* The next message must not be resent. */
+	struct writer_frames frames;
+	struct tx_coalescer *coalescer;
 };
 
 struct transport_reader_context {
 	struct firefly_connection *conn;
-	struct transport_reader_list *read;
-	struct transport_reader_list *to_read;
+	struct firefly_buffer *current; /* The buffer of r->data. */
+	struct firefly_buffer *read;
+	struct firefly_buffer *to_read;
 	int last_end_pos;
 };
 
@@ -157,50 +188,47 @@ void protocol_labcomm_reader_free(struct labcomm_reader *r)
 	FIREFLY_FREE(r);
 }
 
-static int trans_reader_append_buffer(struct labcomm_reader *r,
-		unsigned char *data, size_t len)
+static void trans_reader_append_buffer(struct labcomm_reader *r,
+		struct firefly_buffer *buf)
 {
 	struct transport_reader_context *ctx;
-	struct transport_reader_list *le;
-	struct transport_reader_list **next;
+	struct firefly_buffer **next;
 	ctx = r->action_context->context;
-	le = FIREFLY_RUNTIME_MALLOC(ctx->conn, sizeof(*le));
-	if (le == NULL)
-		return -1;
-	le->data = data;
-	le->len = len;
-	le->next = NULL;
+	buf->next = NULL;
 	for (next = &ctx->to_read; *next != NULL; next = &(*next)->next) {}
-	*next = le;
-	return 0;
+	*next = buf;
+}
+
+static void trans_reader_set_current(struct labcomm_reader *r,
+		struct firefly_buffer *buf)
+{
+	struct transport_reader_context *ctx;
+	ctx = r->action_context->context;
+	ctx->current = buf;
+	r->data = buf->data;
+	r->data_size = buf->size;
+	r->count = buf->size;
 }
 
 static int trans_reader_next_buffer(struct labcomm_reader *r)
 {
 	struct transport_reader_context *ctx;
-	struct transport_reader_list *le;
-	struct transport_reader_list **next;
-	unsigned char *tmp_data;
-	size_t tmp_len;
+	struct firefly_buffer *buf;
+	struct firefly_buffer **next;
 	ctx = r->action_context->context;
 	if (ctx->to_read == NULL)
 		return -1;
 	// Pop buffer from to_read list
-	le = ctx->to_read;
-	ctx->to_read = le->next;
-	// temporarily save buffer
-	tmp_data = le->data;
-	tmp_len = le->len;
-	// Reuse buffer struct to save current buffer in backstack
-	le->data = r->data;
-	le->len = r->count;
-	le->next = NULL;
+	buf = ctx->to_read;
+	ctx->to_read = buf->next;
 	// Save current buffer in backstack
-	for (next = &ctx->read; *next != NULL; next = &(*next)->next) {}
-	*next = le;
+	if (ctx->current != NULL) {
+		ctx->current->next = NULL;
+		for (next = &ctx->read; *next != NULL; next = &(*next)->next) {}
+		*next = ctx->current;
+	}
 	// Set popped buffer as current buffer
-	r->data = tmp_data;
-	r->count = tmp_len;
+	trans_reader_set_current(r, buf);
 	r->pos = 0;
 	return 0;
 }
@@ -215,44 +243,33 @@ static int trans_reader_next_buffer(struct labcomm_reader *r)
 static void trans_reader_pop_backstack(struct labcomm_reader *r)
 {
 	struct transport_reader_context *ctx;
-	struct transport_reader_list *le;
-	struct transport_reader_list **next;
-	unsigned char *tmp_data;
-	size_t tmp_len;
+	struct firefly_buffer *first;
+	struct firefly_buffer **next;
 	ctx = r->action_context->context;
 	if (ctx->read == NULL)
 		return;
-	le = ctx->read;
-
-	// Switch current buffer and first buffer in backstack
-	ctx->read = le->next;
-	tmp_data = r->data;
-	tmp_len = r->count;
-	r->data = le->data;
-	r->count = le->len;
-	le->data = tmp_data;
-	le->len = tmp_len;
+	first = ctx->read;
+	ctx->read = first->next;
 	// Get previous buffer in backstack, the last one in the list
 	for (next = &ctx->read; *next != NULL; next = &(*next)->next) {}
 	// Let the previous buffer point to the current
-	*next = le;
+	*next = ctx->current;
 	// Let the current buffer point to the next in to_read;
-	le->next = ctx->to_read;
+	ctx->current->next = ctx->to_read;
 	// Push the backstack to beginning of to_read
 	ctx->to_read = ctx->read;
 	ctx->read = NULL;
+	// Switch current buffer and first buffer in backstack
+	trans_reader_set_current(r, first);
 }
 
-static void trans_reader_free_backstack(struct labcomm_reader *r)
+static void trans_reader_free_list(struct firefly_buffer **list)
 {
-	struct transport_reader_context *ctx;
-	struct transport_reader_list *le;
-	ctx = r->action_context->context;
-	while (ctx->read != NULL) {
-		le = ctx->read;
-		ctx->read = le->next;
-		FIREFLY_RUNTIME_FREE(ctx->conn, le->data);
-		FIREFLY_RUNTIME_FREE(ctx->conn, le);
+	struct firefly_buffer *buf;
+	while (*list != NULL) {
+		buf = *list;
+		*list = buf->next;
+		firefly_buffer_unref(buf);
 	}
 }
 
@@ -313,9 +330,9 @@ static int trans_reader_end(struct labcomm_reader *r,
 	struct transport_reader_context *ctx;
 	ctx = action_context->context;
 	if (r->pos >= r->count) {
-		if (trans_reader_next_buffer(r) < 0 && r->data != NULL) {
-			struct firefly_connection *conn = ctx->conn;
-			FIREFLY_RUNTIME_FREE(conn, r->data);
+		if (trans_reader_next_buffer(r) < 0 && ctx->current != NULL) {
+			firefly_buffer_unref(ctx->current);
+			ctx->current = NULL;
 			r->data = NULL;
 			r->count = 0;
 			r->pos = 0;
@@ -324,7 +341,7 @@ static int trans_reader_end(struct labcomm_reader *r,
 	} else {
 		ctx->last_end_pos = r->pos;
 	}
-	trans_reader_free_backstack(r);
+	trans_reader_free_list(&ctx->read);
 	return 0;
 }
 
@@ -343,20 +360,31 @@ static int trans_reader_ioctl(struct labcomm_reader *r,
 	ctx = action_context->context;
 
 	switch (ioctl_action) {
-	case FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER: {
-		void *buffer;
-		size_t size;
-
-		buffer = va_arg(args, void*);
-		size = va_arg(args, size_t);
+	case FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER:
+	case FIREFLY_LABCOMM_IOCTL_READER_ADD_BUFFER: {
+		struct firefly_buffer *buf;
+
+		if (ioctl_action == FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER) {
+			void *buffer;
+			size_t size;
+
+			buffer = va_arg(args, void*);
+			size = va_arg(args, size_t);
+			buf = firefly_buffer_wrap(ctx->conn, buffer, size);
+			if (buf == NULL) {
+				FIREFLY_RUNTIME_FREE(ctx->conn, buffer);
+				result = -ENOMEM;
+				break;
+			}
+		} else {
+			buf = va_arg(args, struct firefly_buffer*);
+		}
 
-		if (r->data == NULL) {
-			r->data = buffer;
-			r->data_size = size;
-			r->count = size;
+		if (ctx->current == NULL) {
+			trans_reader_set_current(r, buf);
 			r->pos = 0;
 		} else {
-			trans_reader_append_buffer(r, buffer, size);
+			trans_reader_append_buffer(r, buf);
 		}
 		if (r->error) {
 			r->error = 0;
@@ -364,6 +392,26 @@ static int trans_reader_ioctl(struct labcomm_reader *r,
 		}
 		result = 0;
 		} break;
+	case FIREFLY_LABCOMM_IOCTL_READER_BORROW: {
+		size_t size;
+		unsigned char **data;
+		struct firefly_buffer **buf;
+
+		size = va_arg(args, size_t);
+		data = va_arg(args, unsigned char**);
+		buf = va_arg(args, struct firefly_buffer**);
+
+		// The bytes were read from the current buffer only if all of them
+		// precede the read position.
+		if (ctx->current != NULL && (size_t) r->pos >= size) {
+			firefly_buffer_ref(ctx->current);
+			*data = r->data + r->pos - size;
+			*buf = ctx->current;
+			result = 0;
+		} else {
+			result = -EINVAL;
+		}
+		} break;
 	default:
 		result = -ENOTSUP;
 		break;
@@ -393,6 +441,7 @@ struct labcomm_reader *transport_labcomm_reader_new(
 	reader_context = FIREFLY_MALLOC(sizeof(*reader_context));
 	if (reader != NULL && action_context != NULL && reader_context != NULL)
 	{
+		reader_context->current = NULL;
 		reader_context->read    = NULL;
 		reader_context->to_read = NULL;
 		reader_context->last_end_pos = 0;
@@ -416,34 +465,62 @@ struct labcomm_reader *transport_labcomm_reader_new(
 
 void transport_labcomm_reader_free(struct labcomm_reader *r)
 {
+	struct transport_reader_context *ctx;
+	ctx = r->action_context->context;
+	firefly_buffer_unref(ctx->current);
+	trans_reader_free_list(&ctx->read);
+	trans_reader_free_list(&ctx->to_read);
 	FIREFLY_FREE(r->action_context->context);
 	FIREFLY_FREE(r->action_context);
 	FIREFLY_FREE(r);
 }
 
-static int comm_writer_alloc(struct labcomm_writer *w,
-		struct labcomm_writer_action_context *action_context)
+/*
+ * Let the writer continue in a new frame from its pool. The current frame
+ * is kept if no new frame could be allocated.
+ */
+static int writer_next_frame(struct labcomm_writer *w,
+		struct writer_frames *frames)
 {
-	UNUSED_VAR(action_context);
+	struct firefly_buffer *frame;
 
-	w->data_size	= BUFFER_SIZE;
+	frame = firefly_buffer_pool_get(frames->pool);
+	if (frame == NULL)
+		return -ENOMEM;
+	frames->frame   = frame;
+	w->data_size	= frame->size;
 	w->count	= w->data_size;
-	w->data		= FIREFLY_MALLOC(w->data_size);
+	w->data		= frame->data;
+	w->pos		= 0;
 
-	if (w->data == NULL) {
+	return 0;
+}
+
+static int writer_frames_alloc(struct labcomm_writer *w,
+		struct writer_frames *frames)
+{
+	frames->frame = NULL;
+	frames->pool  = firefly_buffer_pool_new(BUFFER_SIZE);
+	if (frames->pool == NULL || writer_next_frame(w, frames) < 0) {
+		firefly_buffer_pool_free(frames->pool);
+		frames->pool = NULL;
+		w->data = NULL;
 		w->error = -ENOMEM;
-	} else {
-		memset(w->data, 0, w->data_size);
 	}
 	w->pos = 0;
 
 	return w->error;
 }
 
+static void writer_frames_free(struct writer_frames *frames)
+{
+	firefly_buffer_unref(frames->frame);
+	firefly_buffer_pool_free(frames->pool);
+}
+
 static int comm_writer_free(struct labcomm_writer *w,
 		struct labcomm_writer_action_context *action_context)
 {
-	FIREFLY_FREE(w->data);
 	FIREFLY_FREE(action_context->context);
 	FIREFLY_FREE(action_context);
 	FIREFLY_FREE(w);
@@ -462,6 +539,57 @@ static int comm_writer_flush(struct labcomm_writer *w,
 	return (result < 0) ? -ENOMEM : result;
 }
 
+/*
+ * Samples larger than a frame are encoded into a growing buffer, they are
+ * sent in fragments.
+ */
+static int proto_writer_flush(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct protocol_writer_context *ctx;
+	struct firefly_buffer *buf;
+	size_t size;
+
+	ctx = action_context->context;
+	if (w->pos < w->count)
+		return 0;
+	size = 2 * w->data_size;
+	if (size > FIREFLY_SAMPLE_MAX_SIZE)
+		size = FIREFLY_SAMPLE_MAX_SIZE;
+	if (size <= (size_t) w->pos)
+		return -ENOMEM;
+	buf = firefly_buffer_new(size);
+	if (buf == NULL)
+		return -ENOMEM;
+	memcpy(buf->data, w->data, w->pos);
+	firefly_buffer_unref(ctx->frames.frame);
+	ctx->frames.frame = buf;
+	w->data_size	= size;
+	w->count	= size;
+	w->data		= buf->data;
+
+	return 0;
+}
+
+static int proto_writer_alloc(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct protocol_writer_context *ctx;
+
+	ctx = action_context->context;
+	return writer_frames_alloc(w, &ctx->frames);
+}
+
+static int proto_writer_free(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct protocol_writer_context *ctx;
+
+	ctx = action_context->context;
+	writer_frames_free(&ctx->frames);
+	return comm_writer_free(w, action_context);
+}
+
 static int proto_writer_start(struct labcomm_writer *w,
 		struct labcomm_writer_action_context *action_context,
 		int index,
@@ -470,12 +598,12 @@ static int proto_writer_start(struct labcomm_writer *w,
 {
 	struct protocol_writer_context *ctx;
 
-	UNUSED_VAR(w);
-	UNUSED_VAR(index);
 	UNUSED_VAR(signature);
 
 	ctx = action_context->context;
 	ctx->important = (value == NULL);
+	ctx->index = index;
+	w->pos = 0;
 
 	if (!value && ctx->chan->restricted_local) {
 		/* Until we get the updated lc, just print an error. */
@@ -489,6 +617,84 @@ static int proto_writer_start(struct labcomm_writer *w,
 	return 0;
 }
 
+/*
+ * Queue an event sending a conflating channel unless one is queued or the
+ * channel is held.
+ */
+static void conflate_schedule(struct firefly_channel *chan)
+{
+	struct firefly_connection *conn;
+	int64_t id;
+	int64_t old;
+
+	conn = chan->conn;
+	if (!__sync_bool_compare_and_swap(&chan->conflate_state,
+				FIREFLY_CONFLATE_IDLE, FIREFLY_CONFLATE_QUEUED))
+		return;
+	id = firefly_event_offer_strand(conn->event_queue, conn,
+			firefly_channel_send_priority(chan), send_conflated_event,
+			chan, 0, NULL);
+	if (id < 0) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		__sync_lock_test_and_set(&chan->conflate_state,
+				FIREFLY_CONFLATE_IDLE);
+		return;
+	}
+	// Keep the id for firefly_channel_free(). Event ids grow, so an older
+	// id stored late by another writer does not replace a queued event.
+	old = chan->conflate_queued_id;
+	while (old < id && !__sync_bool_compare_and_swap(
+				&chan->conflate_queued_id, old, id))
+		old = chan->conflate_queued_id;
+}
+
+/*
+ * Replace the unsent sample of the type being written on a conflating channel
+ * with a copy of the written one.
+ */
+static int conflate_sample(struct labcomm_writer *w,
+		struct protocol_writer_context *ctx)
+{
+	struct firefly_channel *chan;
+	struct firefly_conflated_sample *cs;
+	struct firefly_conflated_data *d;
+
+	chan = ctx->chan;
+	for (cs = chan->conflated; cs != NULL && cs->index != ctx->index;
+			cs = cs->next)
+		;
+	if (cs == NULL) {
+		cs = FIREFLY_MALLOC(sizeof(*cs));
+		if (cs == NULL) {
+			FFL(FIREFLY_ERROR_ALLOC);
+			w->pos = 0;
+			return -ENOMEM;
+		}
+		cs->index = ctx->index;
+		cs->data  = NULL;
+		cs->next  = chan->conflated;
+		// The sending event may walk the types concurrently.
+		__sync_synchronize();
+		chan->conflated = cs;
+	}
+	d = FIREFLY_RUNTIME_MALLOC(chan->conn, sizeof(*d) + w->pos);
+	if (d == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		w->pos = 0;
+		return -ENOMEM;
+	}
+	d->size = w->pos;
+	d->deadline = firefly_channel_deadline(chan);
+	memcpy(d + 1, w->data, w->pos);
+	w->pos = 0;
+	d = __sync_lock_test_and_set(&cs->data, d);
+	if (d != NULL)
+		FIREFLY_RUNTIME_FREE(chan->conn, d);
+	conflate_schedule(chan);
+
+	return 0;
+}
+
 static int proto_writer_end(struct labcomm_writer *w,
 		struct labcomm_writer_action_context *action_context)
 {
@@ -506,17 +712,85 @@ static int proto_writer_end(struct labcomm_writer *w,
 		return -EINVAL;
 	}
 
+	if (!ctx->important && chan->conflate)
+		return conflate_sample(w, ctx);
+
 	// create protocol packet and encode it
+	if (!ctx->important &&
+			sizeof(struct firefly_event_send_sample) + w->pos <=
+			FIREFLY_EVENT_PAYLOAD_SIZE) {
+		/*
+		 * Unimportant samples are never kept after the event so small ones
+		 * are copied to the event along with their data.
+		 */
+		union {
+			struct firefly_event_send_sample fess;
+			unsigned char bytes[FIREFLY_EVENT_PAYLOAD_SIZE];
+		} arg;
+
+		arg.fess.chan                  = chan;
+		arg.fess.data.dest_chan_id     = chan->remote_id;
+		arg.fess.data.src_chan_id      = chan->local_id;
+		arg.fess.data.seqno            = 0;
+		arg.fess.data.fec_seqno        = 0;
+		arg.fess.data.important        = false;
+		arg.fess.data.app_enc_data.n_0 = w->pos;
+		arg.fess.data.app_enc_data.a   = NULL;
+		arg.fess.important_id          = NULL;
+		arg.fess.frame                 = NULL;
+		arg.fess.offset                = 0;
+		arg.fess.deadline              = firefly_channel_deadline(chan);
+		memcpy(&arg.fess + 1, w->data, w->pos);
+
+		firefly_event_offer_copy(conn->event_queue, conn,
+				firefly_channel_send_priority(chan),
+				send_data_sample_copy_event, &arg,
+				sizeof(arg.fess) + w->pos, 0, NULL);
+		w->pos = 0;
+
+		return 0;
+	}
+	if (!ctx->important) {
+		/*
+		 * Larger unimportant samples hand the frame they are encoded in over
+		 * to the event, the writer continues in a new frame.
+		 */
+		struct firefly_event_send_sample fess;
+		unsigned char *data;
+		size_t size;
+
+		data = w->data;
+		size = w->pos;
+		fess.frame = ctx->frames.frame;
+		if (writer_next_frame(w, &ctx->frames) == 0) {
+			fess.chan                  = chan;
+			fess.data.dest_chan_id     = chan->remote_id;
+			fess.data.src_chan_id      = chan->local_id;
+			fess.data.seqno            = 0;
+			fess.data.fec_seqno        = 0;
+			fess.data.important        = false;
+			fess.data.app_enc_data.n_0 = size;
+			fess.data.app_enc_data.a   = data;
+			fess.important_id          = NULL;
+			fess.offset                = 0;
+			fess.deadline              = firefly_channel_deadline(chan);
+			if (firefly_event_offer_copy(conn->event_queue, conn,
+						firefly_channel_send_priority(chan),
+						send_data_sample_frame_event,
+						&fess, sizeof(fess), 0, NULL) < 0)
+				firefly_buffer_unref(fess.frame);
+
+			return 0;
+		}
+	}
 	struct firefly_event_send_sample *fess =
 		FIREFLY_RUNTIME_MALLOC(conn, sizeof(*fess));
 
-	unsigned char *a = FIREFLY_RUNTIME_MALLOC(conn, w->pos);
-	if (fess == NULL || a == NULL) {
+	if (fess == NULL) {
 		// TODO: Check if Labcomm reports error
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 				"Protocol writer could not allocate send event\n");
-		FIREFLY_FREE(fess);
-		FIREFLY_FREE(a);
+		w->pos = 0;
 
 		return -ENOMEM;
 	}
@@ -525,14 +799,35 @@ static int proto_writer_end(struct labcomm_writer *w,
 	fess->data.dest_chan_id     = chan->remote_id;
 	fess->data.src_chan_id      = chan->local_id;
 	fess->data.seqno            = 0;
+	fess->data.fec_seqno        = 0;
 	fess->data.important        = ctx->important;
 	fess->data.app_enc_data.n_0 = w->pos;
-	fess->data.app_enc_data.a   = a;
-	memcpy(fess->data.app_enc_data.a, w->data, w->pos);
+	fess->data.app_enc_data.a   = w->data;
+	fess->frame                 = ctx->frames.frame;
+	fess->offset                = 0;
+	fess->deadline              = ctx->important ? 0 :
+		firefly_channel_deadline(chan);
+	if (writer_next_frame(w, &ctx->frames) < 0) {
+		// Keep the frame and send a copy of the data instead.
+		unsigned char *a = FIREFLY_RUNTIME_MALLOC(conn, w->pos);
+
+		if (a == NULL) {
+			firefly_error(FIREFLY_ERROR_ALLOC, 1,
+					"Protocol writer could not allocate send event\n");
+			FIREFLY_RUNTIME_FREE(conn, fess);
+			w->pos = 0;
+
+			return -ENOMEM;
+		}
+		memcpy(a, w->data, w->pos);
+		fess->data.app_enc_data.a = a;
+		fess->frame               = NULL;
+		w->pos = 0;
+	}
 
-	conn->event_queue->offer_event_cb(conn->event_queue, FIREFLY_PRIORITY_HIGH,
-			send_data_sample_event, fess, 0, NULL);
-	w->pos = 0;
+	firefly_event_offer_strand(conn->event_queue, conn,
+			firefly_channel_send_priority(chan), send_data_sample_event,
+			fess, 0, NULL);
 
 	return 0;
 }
@@ -553,11 +848,11 @@ static int proto_writer_ioctl(struct labcomm_writer *w,
 }
 
 static const struct labcomm_writer_action proto_writer_action = {
-	.alloc = comm_writer_alloc,
-	.free = comm_writer_free,
+	.alloc = proto_writer_alloc,
+	.free = proto_writer_free,
 	.start = proto_writer_start,
 	.end = proto_writer_end,
-	.flush = comm_writer_flush,
+	.flush = proto_writer_flush,
 	.ioctl = proto_writer_ioctl
 };
 
@@ -593,6 +888,8 @@ struct labcomm_writer *protocol_labcomm_writer_new(struct firefly_channel *chan,
 	result = labcomm_writer_new(context, &proto_writer_action, mem);
 	if (context != NULL && result != NULL) {
 		context->chan = chan;
+		context->frames.pool = NULL;
+		context->frames.frame = NULL;
 	} else {
 		FIREFLY_FREE(context);
 		FIREFLY_FREE(result);
@@ -604,7 +901,138 @@ struct labcomm_writer *protocol_labcomm_writer_new(struct firefly_channel *chan,
 
 void protocol_labcomm_writer_free(struct labcomm_writer *w)
 {
-	comm_writer_free(w, w->action_context);
+	proto_writer_free(w, w->action_context);
+}
+
+static int trans_writer_alloc(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct transport_writer_context *ctx;
+
+	ctx = action_context->context;
+	return writer_frames_alloc(w, &ctx->frames);
+}
+
+static void tx_coalescer_unref(struct tx_coalescer *co)
+{
+	if (--co->refs > 0)
+		return;
+	firefly_buffer_unref(co->frame);
+	FIREFLY_FREE(co);
+}
+
+/*
+ * Send the pending frame, as an important packet if important_id is set.
+ */
+static void tx_coalescer_send(struct tx_coalescer *co,
+		unsigned int *important_id)
+{
+	struct firefly_connection *conn;
+
+	conn = co->conn;
+	co->held = false;
+	if (co->len == 0)
+		return;
+	__sync_lock_test_and_set(&conn->tx_priority, co->priority);
+	co->priority = FIREFLY_CHANNEL_PRIORITY_BULK;
+	co->perishable = false;
+	if (conn->transport->write_buffer != NULL) {
+		co->frame->size = co->len;
+		conn->transport->write_buffer(co->frame, conn,
+				important_id != NULL, important_id);
+		co->frame = NULL;
+	} else {
+		conn->transport->write(co->frame->data, co->len, conn,
+				important_id != NULL, important_id);
+	}
+	co->len = 0;
+}
+
+static void tx_coalescer_flush(struct tx_coalescer *co)
+{
+	tx_coalescer_send(co, NULL);
+}
+
+static int tx_coalescer_batch_event(void *event_arg)
+{
+	struct tx_coalescer *co;
+
+	co = event_arg;
+	co->batch_queued = false;
+	if (co->conn != NULL)
+		tx_coalescer_flush(co);
+	tx_coalescer_unref(co);
+	return 0;
+}
+
+static int tx_coalescer_deadline_event(void *event_arg)
+{
+	struct tx_coalescer *co;
+
+	co = event_arg;
+	co->deadline_queued = false;
+	if (co->conn != NULL)
+		tx_coalescer_flush(co);
+	tx_coalescer_unref(co);
+	return 0;
+}
+
+/*
+ * Append a message to the pending frame and make sure a flush is queued.
+ * Returns a negative value if the message could not be appended.
+ */
+static int tx_coalescer_append(struct tx_coalescer *co,
+		struct writer_frames *frames, unsigned char *data, size_t size,
+		int priority, bool perishable)
+{
+	struct firefly_event_queue *eq;
+
+	eq = co->conn->event_queue;
+	if (co->frame == NULL) {
+		co->frame = firefly_buffer_pool_get(frames->pool);
+		if (co->frame == NULL)
+			return -ENOMEM;
+	}
+	memcpy(co->frame->data + co->len, data, size);
+	co->len += size;
+	if (priority > co->priority)
+		co->priority = priority;
+	co->perishable = co->perishable || perishable;
+	// Flush after the queued sends of the pending messages but not after
+	// those of lower classes.
+	if (!co->batch_queued || co->priority > co->batch_priority) {
+		if (firefly_event_offer_strand(eq, co->conn,
+					firefly_send_priority(co->priority),
+					tx_coalescer_batch_event, co, 0, NULL) < 0) {
+			// Nothing would flush the frame, send it right away.
+			tx_coalescer_flush(co);
+			return 0;
+		}
+		co->batch_queued = true;
+		co->batch_priority = co->priority;
+		co->refs++;
+	}
+	if (co->delay_ms > 0 && !co->deadline_queued &&
+			firefly_event_offer_after(eq, co->conn, FIREFLY_PRIORITY_HIGH,
+				tx_coalescer_deadline_event, co, co->delay_ms) >= 0) {
+		co->deadline_queued = true;
+		co->refs++;
+	}
+	return 0;
+}
+
+static int trans_writer_free(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct transport_writer_context *ctx;
+
+	ctx = action_context->context;
+	// The transport is closed by now, pending data is dropped.
+	ctx->coalescer->conn = NULL;
+	ctx->coalescer->len = 0;
+	tx_coalescer_unref(ctx->coalescer);
+	writer_frames_free(&ctx->frames);
+	return comm_writer_free(w, action_context);
 }
 
 static int trans_writer_start(struct labcomm_writer *w,
@@ -625,11 +1053,68 @@ static int trans_writer_end(struct labcomm_writer *w,
 {
 	struct transport_writer_context *ctx;
 	struct firefly_connection *conn;
+	struct tx_coalescer *co;
+	struct firefly_buffer *frame;
+	size_t size;
+	int priority;
+	bool perishable;
 
 	ctx = action_context->context;
 	conn = ctx->conn;
-	conn->transport->write(w->data, w->pos, conn,
-			ctx->important_id != NULL, ctx->important_id);
+	co = ctx->coalescer;
+	frame = ctx->frames.frame;
+	size = w->pos;
+	priority = ctx->priority;
+	ctx->priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
+	perishable = ctx->perishable;
+	ctx->perishable = false;
+	if (ctx->piggyback && ctx->important_id == NULL) {
+		ctx->piggyback = false;
+		if (co->mtu > 0 && co->len + size > co->mtu)
+			tx_coalescer_flush(co);
+		// The queued flush sends the message if nothing follows it.
+		if (tx_coalescer_append(co, &ctx->frames, w->data, size,
+					priority, perishable) == 0) {
+			co->held = co->len > 0;
+			w->pos = 0;
+			return 0;
+		}
+	}
+	// A frame resent until acked would carry perishable messages late.
+	if (co->held && co->len + size <= BUFFER_SIZE &&
+			!(co->perishable && ctx->important_id != NULL)) {
+		memcpy(co->frame->data + co->len, w->data, size);
+		co->len += size;
+		if (priority > co->priority)
+			co->priority = priority;
+		tx_coalescer_send(co, ctx->important_id);
+		ctx->important_id = NULL;
+		w->pos = 0;
+		return 0;
+	}
+	if (co->mtu > 0 && ctx->important_id == NULL && size <= co->mtu) {
+		if (co->len + size > co->mtu)
+			tx_coalescer_flush(co);
+		if (tx_coalescer_append(co, &ctx->frames, w->data, size,
+					priority, perishable) == 0) {
+			w->pos = 0;
+			return 0;
+		}
+	} else {
+		// Keep the order of the messages.
+		tx_coalescer_flush(co);
+	}
+	__sync_lock_test_and_set(&conn->tx_priority, priority);
+	if (conn->transport->write_buffer != NULL &&
+			writer_next_frame(w, &ctx->frames) == 0) {
+		// The frame is sent, and possibly kept for resending, as it is.
+		frame->size = size;
+		conn->transport->write_buffer(frame, conn,
+				ctx->important_id != NULL, ctx->important_id);
+	} else {
+		conn->transport->write(w->data, w->pos, conn,
+				ctx->important_id != NULL, ctx->important_id);
+	}
 	ctx->important_id = NULL;
 	w->pos = 0;
 
@@ -652,7 +1137,28 @@ static int trans_writer_ioctl(struct labcomm_writer *w,
 	switch (ioctl_action) {
 	case FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID: {
 		result = 0;
-		ctx->important_id = va_arg(arg, unsigned char*);
+		ctx->important_id = va_arg(arg, unsigned int *);
+	} break;
+	case FIREFLY_LABCOMM_IOCTL_TRANS_PIGGYBACK: {
+		result = 0;
+		ctx->piggyback = va_arg(arg, int) != 0;
+	} break;
+	case FIREFLY_LABCOMM_IOCTL_TRANS_SET_PRIORITY: {
+		result = 0;
+		ctx->priority = va_arg(arg, int);
+	} break;
+	case FIREFLY_LABCOMM_IOCTL_TRANS_SET_PERISHABLE: {
+		result = 0;
+		ctx->perishable = va_arg(arg, int) != 0;
+	} break;
+	case FIREFLY_LABCOMM_IOCTL_TRANS_SET_COALESCING: {
+		size_t mtu = va_arg(arg, size_t);
+		unsigned int max_delay_us = va_arg(arg, unsigned int);
+
+		result = 0;
+		tx_coalescer_flush(ctx->coalescer);
+		ctx->coalescer->mtu = mtu < BUFFER_SIZE ? mtu : BUFFER_SIZE;
+		ctx->coalescer->delay_ms = (max_delay_us + 999) / 1000;
 	} break;
 	default:
 		result = -ENOTSUP;
@@ -662,8 +1168,8 @@ static int trans_writer_ioctl(struct labcomm_writer *w,
 }
 
 static const struct labcomm_writer_action trans_writer_action = {
-	.alloc = comm_writer_alloc,
-	.free = comm_writer_free,
+	.alloc = trans_writer_alloc,
+	.free = trans_writer_free,
 	.start = trans_writer_start,
 	.end = trans_writer_end,
 	.flush = comm_writer_flush,
@@ -675,13 +1181,34 @@ struct labcomm_writer *transport_labcomm_writer_new(
 {
 	struct labcomm_writer *result;
 	struct transport_writer_context *context;
+	struct tx_coalescer *co;
 
 	context = FIREFLY_MALLOC(sizeof(*context));
+	co = FIREFLY_MALLOC(sizeof(*co));
 	result = labcomm_writer_new(context, &trans_writer_action, mem);
-	if (result != NULL && context != NULL) {
+	if (result != NULL && context != NULL && co != NULL) {
+		co->refs = 1;
+		co->conn = conn;
+		co->frame = NULL;
+		co->len = 0;
+		co->mtu = 0;
+		co->delay_ms = 0;
+		co->held = false;
+		co->priority = FIREFLY_CHANNEL_PRIORITY_BULK;
+		co->perishable = false;
+		co->batch_queued = false;
+		co->batch_priority = FIREFLY_CHANNEL_PRIORITY_BULK;
+		co->deadline_queued = false;
 		context->conn = conn;
 		context->important_id = NULL;
+		context->piggyback = false;
+		context->priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
+		context->perishable = false;
+		context->frames.pool = NULL;
+		context->frames.frame = NULL;
+		context->coalescer = co;
 	} else {
+		FIREFLY_FREE(co);
 		FIREFLY_FREE(context);
 		FIREFLY_FREE(result);
 		result = NULL;
@@ -692,10 +1219,104 @@ struct labcomm_writer *transport_labcomm_writer_new(
 
 void transport_labcomm_writer_free(struct labcomm_writer *w)
 {
-	comm_writer_free(w, w->action_context);
+	trans_writer_free(w, w->action_context);
 }
 
 
+/*
+ * Send a sample larger than FIREFLY_FRAGMENT_SIZE in fragments. Unimportant
+ * samples are sent at once while important ones are sent as far as the send
+ * window of the channel allows, the rest as acks make room. Returns true once
+ * the last fragment is sent.
+ */
+static bool send_data_fragments(struct firefly_event_send_sample *fess)
+{
+	firefly_protocol_data_fragment frag;
+	struct firefly_channel *chan;
+	struct labcomm_encoder *enc;
+	size_t size;
+
+	chan = fess->chan;
+	enc = chan->conn->transport_encoder;
+	size = fess->data.app_enc_data.n_0;
+	if (fess->offset == 0)
+		fess->sample_id = firefly_channel_next_fragment_id(chan);
+	frag.dest_chan_id = fess->data.dest_chan_id;
+	frag.src_chan_id  = fess->data.src_chan_id;
+	frag.seqno        = 0;
+	frag.important    = fess->data.important;
+	frag.priority     = chan->priority;
+	frag.sample_id    = fess->sample_id;
+	frag.total_size   = size;
+	firefly_connection_send_acks(chan->conn, true);
+	do {
+		frag.offset          = fess->offset;
+		frag.frag_data.n_0   = size - fess->offset < FIREFLY_FRAGMENT_SIZE ?
+			size - fess->offset : FIREFLY_FRAGMENT_SIZE;
+		frag.frag_data.a     = fess->data.app_enc_data.a + fess->offset;
+		if (frag.important) {
+			labcomm_encoder_ioctl(enc,
+					FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID,
+					firefly_channel_window_push(chan, &frag.seqno));
+		}
+		labcomm_encoder_ioctl(enc, FIREFLY_LABCOMM_IOCTL_TRANS_SET_PRIORITY,
+				(int) chan->priority);
+		labcomm_encoder_ioctl(enc, FIREFLY_LABCOMM_IOCTL_TRANS_SET_PERISHABLE,
+				fess->deadline != 0);
+		labcomm_encode_firefly_protocol_data_fragment(enc, &frag);
+		if (frag.important)
+			firefly_channel_window_sent(chan, frag.frag_data.n_0);
+		fess->offset += frag.frag_data.n_0;
+		// Fragments not resent leave the window at once.
+	} while (fess->offset < size &&
+			(!frag.important || !firefly_channel_window_full(chan)));
+
+	return fess->offset >= size;
+}
+
+/*
+ * Drop a data sample whose deadline has passed, unless some of its fragments
+ * are already sent.
+ */
+static bool data_sample_expired(struct firefly_event_send_sample *fess)
+{
+	return fess->offset == 0 &&
+		firefly_channel_expired(fess->chan, fess->deadline);
+}
+
+/*
+ * Encode a data sample of at most FIREFLY_FRAGMENT_SIZE bytes on the
+ * transport, followed by the parity of its group if it completes one.
+ */
+static void encode_data_sample(struct firefly_event_send_sample *fess)
+{
+	firefly_protocol_data_parity parity;
+	struct firefly_channel *chan;
+	firefly_protocol_data_sample *data;
+	struct labcomm_encoder *enc;
+	bool group_done;
+
+	chan = fess->chan;
+	data = &fess->data;
+	enc = chan->conn->transport_encoder;
+	data->priority = chan->priority;
+	group_done = firefly_channel_fec_add(chan, data);
+	labcomm_encoder_ioctl(enc, FIREFLY_LABCOMM_IOCTL_TRANS_SET_PRIORITY,
+			(int) chan->priority);
+	labcomm_encoder_ioctl(enc, FIREFLY_LABCOMM_IOCTL_TRANS_SET_PERISHABLE,
+			fess->deadline != 0);
+	labcomm_encode_firefly_protocol_data_sample(enc, data);
+	if (group_done) {
+		// The parity is never resent, it only spares resends.
+		firefly_channel_fec_parity(chan, &parity);
+		labcomm_encoder_ioctl(enc, FIREFLY_LABCOMM_IOCTL_TRANS_SET_PRIORITY,
+				(int) chan->priority);
+		labcomm_encoder_ioctl(enc, FIREFLY_LABCOMM_IOCTL_TRANS_SET_PERISHABLE,
+				fess->deadline != 0);
+		labcomm_encode_firefly_protocol_data_parity(enc, &parity);
+	}
+}
+
 int send_data_sample_event(void *event_arg)
 {
 	struct firefly_event_send_sample *fess;
@@ -715,16 +1336,126 @@ int send_data_sample_event(void *event_arg)
 	if (!fess->data.important ||
 			!firefly_channel_enqueue_important(chan,
 				send_data_sample_event, fess)) {
-		if (fess->data.important) {
-			fess->data.seqno = firefly_channel_next_seqno(fess->chan);
-			labcomm_encoder_ioctl(fess->chan->conn->transport_encoder,
-					FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID,
-					&fess->chan->important_id);
+		if (data_sample_expired(fess)) {
+			// Released below without being sent.
+		} else if (fess->data.app_enc_data.n_0 > FIREFLY_FRAGMENT_SIZE) {
+			// The rest is sent once the window has room, or dropped
+			// below if it cannot be queued.
+			if (!send_data_fragments(fess) &&
+					firefly_channel_push_important(chan,
+						send_data_sample_event, fess) == 0)
+				return 0;
+		} else {
+			firefly_connection_send_acks(chan->conn, true);
+			if (fess->data.important) {
+				labcomm_encoder_ioctl(fess->chan->conn->transport_encoder,
+						FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID,
+						firefly_channel_window_push(chan,
+							&fess->data.seqno));
+			}
+			encode_data_sample(fess);
+			if (fess->data.important)
+				firefly_channel_window_sent(chan,
+						fess->data.app_enc_data.n_0);
 		}
-		labcomm_encode_firefly_protocol_data_sample(
-				fess->chan->conn->transport_encoder, &fess->data);
-		FIREFLY_RUNTIME_FREE(fess->chan->conn, fess->data.app_enc_data.a);
+		if (fess->frame != NULL)
+			firefly_buffer_unref(fess->frame);
+		else
+			FIREFLY_RUNTIME_FREE(fess->chan->conn, fess->data.app_enc_data.a);
 		FIREFLY_RUNTIME_FREE(fess->chan->conn, event_arg);
 	}
 	return 0;
 }
+
+int send_data_sample_copy_event(void *event_arg)
+{
+	struct firefly_event_send_sample *fess;
+
+	fess = event_arg;
+	fess->data.app_enc_data.a = (uint8_t *) (fess + 1);
+	if (data_sample_expired(fess))
+		return 0;
+	firefly_connection_send_acks(fess->chan->conn, true);
+	encode_data_sample(fess);
+	return 0;
+}
+
+int send_data_sample_frame_event(void *event_arg)
+{
+	struct firefly_event_send_sample *fess;
+
+	fess = event_arg;
+	if (data_sample_expired(fess)) {
+		// Released below without being sent.
+	} else if (fess->data.app_enc_data.n_0 > FIREFLY_FRAGMENT_SIZE) {
+		send_data_fragments(fess);
+	} else {
+		firefly_connection_send_acks(fess->chan->conn, true);
+		encode_data_sample(fess);
+	}
+	firefly_buffer_unref(fess->frame);
+	return 0;
+}
+
+int send_conflated_event(void *event_arg)
+{
+	struct firefly_channel *chan;
+	struct firefly_connection *conn;
+	struct firefly_conflated_sample *cs;
+	struct firefly_conflated_data *d;
+	struct firefly_event_send_sample fess;
+	bool sent = false;
+
+	chan = event_arg;
+	conn = chan->conn;
+	chan->conflate_timer_id = 0;
+	for (cs = chan->conflated; cs != NULL; cs = cs->next) {
+		d = __sync_lock_test_and_set(&cs->data, NULL);
+		if (d == NULL)
+			continue;
+		fess.chan                  = chan;
+		fess.data.dest_chan_id     = chan->remote_id;
+		fess.data.src_chan_id      = chan->local_id;
+		fess.data.seqno            = 0;
+		fess.data.fec_seqno        = 0;
+		fess.data.important        = false;
+		fess.data.app_enc_data.n_0 = d->size;
+		fess.data.app_enc_data.a   = (uint8_t *) (d + 1);
+		fess.important_id          = NULL;
+		fess.frame                 = NULL;
+		fess.offset                = 0;
+		fess.deadline              = d->deadline;
+		if (data_sample_expired(&fess)) {
+			FIREFLY_RUNTIME_FREE(conn, d);
+			continue;
+		}
+		if (d->size > FIREFLY_FRAGMENT_SIZE) {
+			send_data_fragments(&fess);
+		} else {
+			firefly_connection_send_acks(conn, true);
+			encode_data_sample(&fess);
+		}
+		FIREFLY_RUNTIME_FREE(conn, d);
+		sent = true;
+	}
+	if (sent && chan->conflate_interval > 0) {
+		__sync_lock_test_and_set(&chan->conflate_state,
+				FIREFLY_CONFLATE_HOLD);
+		chan->conflate_timer_id = firefly_event_offer_after(
+				conn->event_queue, conn, firefly_channel_send_priority(chan),
+				send_conflated_event, chan, chan->conflate_interval);
+		if (chan->conflate_timer_id > 0)
+			return 0;
+		chan->conflate_timer_id = 0;
+	}
+	__sync_lock_test_and_set(&chan->conflate_state, FIREFLY_CONFLATE_IDLE);
+	__sync_synchronize();
+	// Samples written since they were taken found the channel not idle.
+	for (cs = chan->conflated; cs != NULL; cs = cs->next) {
+		if (cs->data != NULL) {
+			conflate_schedule(chan);
+			break;
+		}
+	}
+	return 0;
+}
@@ -60,3 +60,148 @@ void firefly_labcomm_memory_free(struct labcomm_memory *mem)
 {
 	FIREFLY_FREE(mem);
 }
+
+struct firefly_buffer *firefly_buffer_new(size_t size)
+{
+	struct firefly_buffer *buf;
+
+	buf = FIREFLY_MALLOC(sizeof(*buf) + size);
+	if (buf == NULL)
+		return NULL;
+	buf->refs = 1;
+	buf->data = (unsigned char *) (buf + 1);
+	buf->size = size;
+	buf->conn = NULL;
+	buf->pool = NULL;
+	buf->next = NULL;
+	return buf;
+}
+
+struct firefly_buffer *firefly_buffer_wrap(struct firefly_connection *conn,
+		unsigned char *data, size_t size)
+{
+	struct firefly_buffer *buf;
+
+	buf = FIREFLY_RUNTIME_MALLOC(conn, sizeof(*buf));
+	if (buf == NULL)
+		return NULL;
+	buf->refs = 1;
+	buf->data = data;
+	buf->size = size;
+	buf->conn = conn;
+	buf->pool = NULL;
+	buf->next = NULL;
+	return buf;
+}
+
+void firefly_buffer_ref(struct firefly_buffer *buf)
+{
+	__sync_add_and_fetch(&buf->refs, 1);
+}
+
+static void firefly_buffer_pool_put(struct firefly_buffer *buf);
+
+void firefly_buffer_unref(struct firefly_buffer *buf)
+{
+	if (buf == NULL || __sync_sub_and_fetch(&buf->refs, 1) > 0)
+		return;
+	if (buf->pool != NULL) {
+		firefly_buffer_pool_put(buf);
+	} else if (buf->conn != NULL) {
+		FIREFLY_RUNTIME_FREE(buf->conn, buf->data);
+		FIREFLY_RUNTIME_FREE(buf->conn, buf);
+	} else {
+		FIREFLY_FREE(buf);
+	}
+}
+
+struct firefly_buffer_pool *firefly_buffer_pool_new(size_t frame_size)
+{
+	struct firefly_buffer_pool *pool;
+
+	pool = FIREFLY_MALLOC(sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+	pool->free = NULL;
+	pool->frame_size = frame_size;
+	pool->refs = 1;
+	pool->closed = 0;
+	return pool;
+}
+
+static void firefly_buffer_pool_release(struct firefly_buffer_pool *pool)
+{
+	if (__sync_sub_and_fetch(&pool->refs, 1) == 0)
+		FIREFLY_FREE(pool);
+}
+
+/*
+ * Free all released frames. Only called once the pool is closed, when no
+ * frame is taken from it anymore.
+ */
+static void firefly_buffer_pool_drain(struct firefly_buffer_pool *pool)
+{
+	struct firefly_buffer *buf;
+	struct firefly_buffer *next;
+
+	buf = __sync_lock_test_and_set(&pool->free, NULL);
+	while (buf != NULL) {
+		next = buf->next;
+		FIREFLY_FREE(buf);
+		firefly_buffer_pool_release(pool);
+		buf = next;
+	}
+}
+
+static void firefly_buffer_pool_put(struct firefly_buffer *buf)
+{
+	struct firefly_buffer_pool *pool;
+	struct firefly_buffer *head;
+
+	pool = buf->pool;
+	// Keep the pool while it is used, the frame may be drained once pushed.
+	__sync_add_and_fetch(&pool->refs, 1);
+	do {
+		head = pool->free;
+		buf->next = head;
+	} while (!__sync_bool_compare_and_swap(&pool->free, head, buf));
+	if (__sync_fetch_and_add(&pool->closed, 0))
+		firefly_buffer_pool_drain(pool);
+	firefly_buffer_pool_release(pool);
+}
+
+struct firefly_buffer *firefly_buffer_pool_get(struct firefly_buffer_pool *pool)
+{
+	struct firefly_buffer *buf;
+
+	/*
+	 * There is only one taker at a time, a frame at the head of the list can
+	 * not be taken by anyone else while it is read.
+	 */
+	do {
+		buf = pool->free;
+	} while (buf != NULL &&
+			!__sync_bool_compare_and_swap(&pool->free, buf, buf->next));
+	if (buf == NULL) {
+		buf = FIREFLY_MALLOC(sizeof(*buf) + pool->frame_size);
+		if (buf == NULL)
+			return NULL;
+		__sync_add_and_fetch(&pool->refs, 1);
+		buf->data = (unsigned char *) (buf + 1);
+		buf->conn = NULL;
+		buf->pool = pool;
+	}
+	buf->refs = 1;
+	buf->size = pool->frame_size;
+	buf->next = NULL;
+	return buf;
+}
+
+void firefly_buffer_pool_free(struct firefly_buffer_pool *pool)
+{
+	if (pool == NULL)
+		return;
+	__sync_lock_test_and_set(&pool->closed, 1);
+	firefly_buffer_pool_drain(pool);
+	firefly_buffer_pool_release(pool);
+}
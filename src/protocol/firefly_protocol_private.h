@@ -20,6 +20,73 @@
  */
 #define BUFFER_SIZE			(1500)
 
+/**
+ * @brief The number of sample bytes carried by each fragment of a sample too
+ * large to be sent in one #BUFFER_SIZE frame. Only the last fragment of a
+ * sample may be smaller.
+ */
+#define FIREFLY_FRAGMENT_SIZE		(1400)
+
+/**
+ * @brief The largest encoded sample that may be sent or reassembled.
+ */
+#define FIREFLY_SAMPLE_MAX_SIZE		(1 << 20)
+
+/**
+ * @brief The largest number of bytes a connection may hold in partially
+ * received samples.
+ */
+#define FIREFLY_REASSEMBLY_MAX_BYTES	(4 << 20)
+
+/**
+ * @brief The number of milliseconds without any new fragment after which a
+ * partially received sample is discarded.
+ */
+#define FIREFLY_REASSEMBLY_TIMEOUT	(1000)
+
+/**
+ * @brief The largest number of important samples or fragments a channel may
+ * have in flight. The receiver keeps up to as many received ahead of their
+ * turn.
+ */
+#define FIREFLY_IMPORTANT_WINDOW	(8)
+
+/**
+ * @brief The largest number of channels acknowledged by one
+ * firefly_protocol_ack_batch, keeping it well within one #BUFFER_SIZE frame.
+ */
+#define FIREFLY_ACK_BATCH_MAX		(64)
+
+/**
+ * @brief An element of firefly_protocol_ack_batch, laid out like the
+ * anonymous struct of the generated array so a batch can be encoded from a
+ * fixed array.
+ */
+struct firefly_ack_entry {
+	int32_t dest_chan_id;
+	int32_t src_chan_id;
+	int32_t seqno;
+	int32_t selective;
+};
+
+/**
+ * @brief The congestion window of a new connection, in bytes of important
+ * samples and fragments resent by the transport layer.
+ */
+#define FIREFLY_CWND_INITIAL		(4 * FIREFLY_FRAGMENT_SIZE)
+
+/**
+ * @brief The smallest congestion window of a connection. One packet is always
+ * allowed in flight.
+ */
+#define FIREFLY_CWND_MIN		(FIREFLY_FRAGMENT_SIZE)
+
+/**
+ * @brief The largest number of data samples protected by one parity sample
+ * on a channel with forward error correction.
+ */
+#define FIREFLY_FEC_MAX_GROUP		(16)
+
 /**
  * @defgroup conn_state Connection State Values
  * @brief The different values the state of a connection may have.
@@ -40,6 +107,15 @@
  */
 #define FIREFLY_CONNECTION_CLOSE_PRIORITY FIREFLY_PRIORITY_MEDIUM
 
+/**
+ * @brief The priority of the events closing and freeing a channel.
+ *
+ * No data sample is sent at a lower priority, so the samples queued before a
+ * channel is closed are sent before it is freed.
+ * @see firefly_send_priority()
+ */
+#define FIREFLY_CHANNEL_CLOSE_PRIORITY FIREFLY_PRIORITY_MEDIUM
+
 /**
  * @brief A macro that, if defined, lets the user replace malloc() with
  * their own version.
@@ -110,7 +186,72 @@ void FIREFLY_FREE(void *ptr);
  * through Labcomm's ioctl functionality.
  */
 #define FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID				\
-  LABCOMM_IOW('f', 1, unsigned char*)
+  LABCOMM_IOW('f', 1, unsigned int*)
+
+/**
+ * @brief A macro for appending a #firefly_buffer to the read buffers through
+ * Labcomm's ioctl functionality. The reference of the caller is handed over
+ * to the reader.
+ */
+#define FIREFLY_LABCOMM_IOCTL_READER_ADD_BUFFER					\
+  LABCOMM_IOW('f', 2, struct firefly_buffer*)
+
+/**
+ * @brief A macro for borrowing the last read bytes of the current read
+ * buffer through Labcomm's ioctl functionality.
+ *
+ * The arguments are the number of bytes, a pointer set to the first of the
+ * bytes and a pointer set to the buffer holding them. A reference to the
+ * buffer is taken on success. Fails if the bytes are not contiguous in one
+ * #firefly_buffer.
+ */
+#define FIREFLY_LABCOMM_IOCTL_READER_BORROW					\
+  LABCOMM_IOR('f', 3, struct firefly_buffer*)
+
+/**
+ * @brief A macro for setting the coalescing of the transport writer through
+ * Labcomm's ioctl functionality.
+ *
+ * The arguments are the maximum number of bytes to pack into one frame, a
+ * size_t where 0 disables coalescing, and the maximum number of microseconds
+ * a message may wait for more messages, an unsigned int. Any pending messages
+ * are sent first.
+ */
+#define FIREFLY_LABCOMM_IOCTL_TRANS_SET_COALESCING				\
+  LABCOMM_IOW('f', 4, size_t)
+
+/**
+ * @brief A macro for letting the next message piggyback on the one after it
+ * through Labcomm's ioctl functionality.
+ *
+ * The argument is an int, if non-zero the next unimportant message is held
+ * by the transport writer and sent in the same frame as the following
+ * message, if both fit. The caller must encode the following message before
+ * its event returns.
+ */
+#define FIREFLY_LABCOMM_IOCTL_TRANS_PIGGYBACK					\
+  LABCOMM_IOW('f', 5, int)
+
+/**
+ * @brief A macro for setting the priority class of the next message through
+ * Labcomm's ioctl functionality.
+ *
+ * The argument is an int, an #firefly_channel_priority. A frame is sent with
+ * the highest class of the messages in it, messages without a class are
+ * #FIREFLY_CHANNEL_PRIORITY_NORMAL.
+ */
+#define FIREFLY_LABCOMM_IOCTL_TRANS_SET_PRIORITY				\
+  LABCOMM_IOW('f', 6, int)
+
+/**
+ * @brief A macro for marking the next message as perishable through Labcomm's
+ * ioctl functionality.
+ *
+ * The argument is an int, if non-zero the next message, e.g. a data sample
+ * with a deadline, is never packed into a frame that is resent.
+ */
+#define FIREFLY_LABCOMM_IOCTL_TRANS_SET_PERISHABLE				\
+  LABCOMM_IOW('f', 7, int)
 
 #define FF_ERRMSG_MAXLEN (128)
 
@@ -150,14 +291,177 @@ typedef void (* protocol_data_received_f)(struct firefly_connection *conn,
 					  unsigned char *data,
 					  size_t size);
 
+struct firefly_buffer_pool;
+
+/**
+ * @brief A reference counted buffer of received or sent data.
+ *
+ * Received data is passed from the transport layer through the protocol
+ * layer in buffers like this, without being copied. Sent data is encoded
+ * into frames, buffers taken from a #firefly_buffer_pool, and passed on to
+ * the transport layer the same way. Every holder of a pointer to the buffer
+ * owns a reference and releases it with firefly_buffer_unref() when done.
+ */
+struct firefly_buffer {
+	unsigned int refs; /**< The number of references, only changed
+						 atomically. */
+	unsigned char *data; /**< The data of the buffer. */
+	size_t size; /**< The number of bytes in \p data. */
+	struct firefly_connection *conn; /**< The connection whose runtime memory
+									   \p data and the buffer are allocated
+									   with, or NULL if allocated by
+									   firefly_buffer_new() or
+									   firefly_buffer_pool_get(). */
+	struct firefly_buffer_pool *pool; /**< The pool the buffer is returned
+										to, or NULL. */
+	struct firefly_buffer *next; /**< Used by the holder of the buffer to
+								   queue it. */
+};
+
+/**
+ * @brief Allocate a new buffer with room for \p size bytes of data and one
+ * reference.
+ *
+ * @param size The size of the data of the buffer.
+ * @return The new buffer.
+ * @retval NULL If the allocation failed.
+ */
+struct firefly_buffer *firefly_buffer_new(size_t size);
+
+/**
+ * @brief Wrap data allocated with #FIREFLY_RUNTIME_MALLOC() in a new buffer
+ * with one reference. The data is freed together with the buffer.
+ *
+ * @param conn The connection the data is allocated for.
+ * @param data The data to wrap.
+ * @param size The size of \p data.
+ * @return The new buffer.
+ * @retval NULL If the allocation failed, \p data is not freed.
+ */
+struct firefly_buffer *firefly_buffer_wrap(struct firefly_connection *conn,
+		unsigned char *data, size_t size);
+
+/**
+ * @brief Take another reference to a buffer.
+ *
+ * @param buf The buffer.
+ */
+void firefly_buffer_ref(struct firefly_buffer *buf);
+
+/**
+ * @brief Release a reference to a buffer, the buffer is freed, or returned to
+ * its pool, when the last reference is released. May be called from any
+ * thread.
+ *
+ * @param buf The buffer, may be NULL.
+ */
+void firefly_buffer_unref(struct firefly_buffer *buf);
+
+/**
+ * @brief A pool of equally sized frames.
+ *
+ * Frames are only taken from the pool by its owner, one thread at a time,
+ * while they may be released to it from any thread.
+ */
+struct firefly_buffer_pool {
+	struct firefly_buffer *free; /**< The released frames, only changed
+								   atomically. */
+	size_t frame_size; /**< The size of the data of each frame. */
+	unsigned int refs; /**< One reference per allocated frame and one held by
+						 the owner until the pool is freed. */
+	int closed; /**< Set when the owner has freed the pool. */
+};
+
+/**
+ * @brief Allocate a new, empty, pool.
+ *
+ * @param frame_size The size of the data of the frames of the pool.
+ * @return The new pool.
+ * @retval NULL If the allocation failed.
+ */
+struct firefly_buffer_pool *firefly_buffer_pool_new(size_t frame_size);
+
+/**
+ * @brief Take a frame with one reference from the pool, a new frame is
+ * allocated if no released frame is available.
+ *
+ * @param pool The pool.
+ * @return The frame, its size is the frame size of the pool.
+ * @retval NULL If the allocation failed.
+ */
+struct firefly_buffer *firefly_buffer_pool_get(struct firefly_buffer_pool *pool);
+
+/**
+ * @brief Free the pool and the frames released to it. Frames still
+ * referenced are freed when they are released.
+ *
+ * @param pool The pool to free, may be NULL.
+ */
+void firefly_buffer_pool_free(struct firefly_buffer_pool *pool);
+
+/**
+ * @brief A prototype for the callback used by the transport layer to
+ * pass a received buffer to the protocol layer.
+ *
+ * @param conn The connection the data is received on.
+ * @param buf The received buffer, the reference of the caller is handed
+ * over.
+ */
+typedef void (* protocol_buffer_received_f)(struct firefly_connection *conn,
+					  struct firefly_buffer *buf);
+
+/**
+ * @brief The initial number of local ids, and remote id buckets, in a
+ * #firefly_channel_table.
+ */
+#define FIREFLY_CHANNEL_TABLE_INITIAL_SIZE (16)
+
+/**
+ * @brief The number of milliseconds the local id of a removed channel is kept
+ * unused, so packets still in flight to the removed channel are not taken by
+ * a new one. It outlasts a peer resending with the default transport timeouts
+ * and retries.
+ */
+#define FIREFLY_CHANNEL_ID_QUARANTINE (30000)
+
 /**
  * @brief A structure for representing a node in a linked list of channels.
  */
 struct channel_list_node {
 	struct channel_list_node *next;	/**< A pointer to the next list node. */
+	struct channel_list_node *prev;	/**< A pointer to the previous list
+									  node. */
+	struct channel_list_node *remote_next; /**< The next node in the same
+											 remote id bucket. */
 	struct firefly_channel *chan;	/**< A pointer the channel struct for this node. */
 };
 
+/**
+ * @brief The channels of a connection indexed by their ids.
+ *
+ * The local id of a channel is its index in \a local, the remote id is
+ * hashed into \a remote. Local ids are handed out by next_channel_id() and
+ * ids of removed channels are reused, oldest first, so the table stays dense.
+ * An id is not reused until #FIREFLY_CHANNEL_ID_QUARANTINE has passed since
+ * it was freed.
+ */
+struct firefly_channel_table {
+	struct channel_list_node **local; /**< The channels indexed by local
+										id. */
+	int *free_next; /**< The id after each unused id in the queue of free
+					  ids, -1 ends the queue. */
+	int64_t *free_time; /**< The time each unused id was freed, on the clock
+						  of the event queue. */
+	int size; /**< The number of elements of \a local, \a free_next and
+				\a free_time. */
+	int free_head; /**< The oldest free id or -1. */
+	int free_tail; /**< The newest free id or -1. */
+	struct channel_list_node **remote; /**< The buckets of the remote id
+										 hash. */
+	int remote_size; /**< The number of buckets, a power of two. */
+	size_t count; /**< The number of channels in the table. */
+};
+
 /**
  * @brief A prototype for the function used to write data on the
  * specified connection.
@@ -175,7 +479,26 @@ struct channel_list_node {
  */
 typedef void (* firefly_transport_connection_write_f)(unsigned char *data, size_t data_size,
 					struct firefly_connection *conn, bool important,
-					unsigned char *id);
+					unsigned int *id);
+
+/**
+ * @brief Write a frame like #firefly_transport_connection_write_f but
+ * without copying it. An important frame is kept by reference until it is
+ * acknowledged.
+ *
+ * @param frame The frame to write, the reference of the caller is handed
+ * over.
+ * @param conn The #firefly_connection to write the data to.
+ * @param important If true the packet must be re-sent until
+ * acknowledged.
+ * @param id If important is true the id is a return value and will
+ * contain the identifier of the packet which must be used when
+ * acknowleding the packet.
+ */
+typedef void (* firefly_transport_connection_write_buffer_f)(
+					struct firefly_buffer *frame,
+					struct firefly_connection *conn, bool important,
+					unsigned int *id);
 
 /**
  * @brief Inform transport that a packet is acknowledged and should not
@@ -184,7 +507,7 @@ typedef void (* firefly_transport_connection_write_f)(unsigned char *data, size_
  * @param pkg_id The id of the packet.
  * @param conn The #firefly_connection the packet is sent on.
  */
-typedef void (* firefly_transport_connection_ack_f)(unsigned char pkg_id,
+typedef void (* firefly_transport_connection_ack_f)(unsigned int pkg_id,
 					struct firefly_connection *conn);
 
 /**
@@ -227,6 +550,11 @@ struct firefly_transport_connection {
 	firefly_transport_connection_write_f write;/**< Used when writing
 												 data, see
 												 #firefly_transport_connection_write_f. */
+	firefly_transport_connection_write_buffer_f write_buffer;/**< Used
+															   instead of
+															   write if not
+															   NULL, see
+															   #firefly_transport_connection_write_buffer_f. */
 	firefly_transport_connection_ack_f ack;/**< Inform transport that a packet
 											 is acked or should not be resent
 											 anymore, see #firefly_transport_connection_ack_f. */
@@ -247,6 +575,7 @@ struct firefly_connection {
 															  */
 	struct labcomm_decoder			*transport_decoder;		/**< The transport layer decoder for this connection. */
 	struct channel_list_node		*chan_list;			/**< The list of channels associated with this connection. */
+	struct firefly_channel_table		chan_table;			/**< The channels of chan_list indexed by id. */
 	struct firefly_event_queue		*event_queue;			/**< The queue to which spawned events are added. */
 	int 					channel_id_counter;		/**< The unique id reserved to the next opened channel on the connection. */
 	struct firefly_memory_funcs		memory_replacements; /**< A struct containing function
@@ -258,6 +587,42 @@ struct firefly_connection {
 	void					*context;			/**< A reference to an optional, user defined context.  */
 	struct firefly_connection_actions 	*actions;			/**< Callbacks to the applicaiton. */
 	struct firefly_transport_connection *transport;	/**< Transport specific connection data. */
+	bool					rx_inline;			/**< True while received data is
+												  processed inline on the thread
+												  reading it, see
+												  protocol_data_received_inline(). */
+	size_t					reassembly_bytes;		/**< The number of bytes allocated
+													  for partially received
+													  samples on all channels. */
+	int64_t					ack_delay_ms;			/**< The longest time an ack of an
+													  important sample may be delayed,
+													  0 if each is sent at once. */
+	struct firefly_channel	*ack_list;				/**< The channels with a
+													  delayed ack to send, linked
+													  by their ack_next, or
+													  NULL. */
+	int64_t					ack_timer_id;			/**< The event sending the delayed
+													  acks or 0. */
+	struct firefly_congestion_state		cc;				/**< The congestion window of the
+													  important packets, see
+													  firefly_connection_cwnd_full(). */
+	struct firefly_channel	*cwnd_waiting;			/**< The channels with queued
+													  data samples waiting for
+													  room in the congestion
+													  window, oldest first,
+													  linked by their cwnd_next. */
+	struct firefly_channel	*cwnd_waiting_tail;		/**< The newest channel in
+													  cwnd_waiting or NULL. */
+	size_t					cc_recover;			/**< The bytes to be acked before
+													  a resend timeout cuts the
+													  window again. */
+	size_t					cc_acked;			/**< The bytes acked since the
+													  window last grew above the
+													  slow start threshold. */
+	int					tx_priority;			/**< The priority class of the
+													  frame last written to the
+													  transport layer, see
+													  firefly_connection_tx_priority(). */
 };
 
 /**
@@ -271,6 +636,89 @@ struct firefly_channel_important_queue {
 	void *event_arg; /**< The argument to the event. */
 };
 
+/**
+ * @brief A sample being reassembled from its fragments.
+ */
+struct firefly_reassembly {
+	struct firefly_channel *chan; /**< The channel the sample is received
+									on. */
+	unsigned char *data; /**< The sample followed by a bitmap of the received
+						   fragments, NULL if no sample is reassembled. */
+	size_t size; /**< The size of the sample. */
+	size_t nbr_missing; /**< The number of fragments not yet received. */
+	int sample_id; /**< The identifier of the sample set by the sender. */
+	bool progress; /**< A fragment was received since the timeout was last
+					 checked. */
+	int64_t timer_id; /**< The timed event checking the timeout or 0. */
+};
+
+/**
+ * @brief An important sample or fragment received ahead of its turn.
+ */
+struct firefly_reorder_entry {
+	bool used; /**< The entry holds a sample or fragment. */
+	bool fragment; /**< The entry holds a fragment. */
+	union {
+		firefly_protocol_data_sample sample;
+		firefly_protocol_data_fragment frag;
+	} pkt; /**< The received packet, its data is a copy owned by the
+			 entry. */
+};
+
+/**
+ * @brief The parity of a group of data samples sent or received on a channel
+ * with forward error correction. Each field is the XOR of the corresponding
+ * field of the samples of the group, and of its parity sample when received.
+ */
+struct firefly_fec_group {
+	int base; /**< The fec_seqno of the first sample of the group, 0 if
+				none. */
+	size_t count; /**< The number of samples added, when sending. */
+	unsigned int received; /**< Bit i is set once sample #base + i is
+							 received or recovered. */
+	unsigned int recovered; /**< Bit i is set if sample #base + i was
+							  recovered. */
+	bool parity; /**< The parity sample of the group is received. */
+	int seqno; /**< The XOR of the sequence numbers. */
+	int important; /**< The XOR of the important flags. */
+	int size; /**< The XOR of the sample sizes. */
+	size_t length; /**< The size of the largest sample XORed in #data. */
+	unsigned char *data; /**< The XOR of the sample data,
+						   #FIREFLY_FRAGMENT_SIZE bytes or NULL if forward
+						   error correction is off. */
+};
+
+/**
+ * @brief The newest unsent data sample of a type written on a conflating
+ * channel.
+ */
+struct firefly_conflated_sample {
+	int index; /**< The LabComm index of the type. */
+	struct firefly_conflated_data *data; /**< The unsent sample or NULL,
+										   swapped atomically by the writer
+										   and the sending event. */
+	struct firefly_conflated_sample *next; /**< The next type. */
+};
+
+/**
+ * @brief The encoded data of a conflated sample, directly followed by the
+ * bytes.
+ */
+struct firefly_conflated_data {
+	size_t size; /**< The number of bytes. */
+	int64_t deadline; /**< The deadline of the sample or 0. */
+};
+
+/**
+ * @brief The sending state of a conflating channel.
+ */
+enum firefly_conflate_state {
+	FIREFLY_CONFLATE_IDLE, /**< A written sample is sent at once. */
+	FIREFLY_CONFLATE_QUEUED, /**< An event sending the channel is queued. */
+	FIREFLY_CONFLATE_HOLD /**< The channel waits for its minimum interval
+							to pass. */
+};
+
 /**
  * @brief An enum of the different states a channel can be in.
  */
@@ -294,13 +742,46 @@ struct firefly_channel {
 	struct firefly_channel_important_queue *important_queue; /**< The
 	queue used to queue important packets when sending another. */
 
-	unsigned char important_id; /**< The identifier used to reference the packet
-								  to the transport layer. If 0 no packet is
+	unsigned int important_id; /**< The identifier used to reference the
+								  channel handshake or restrict packet to the
+								  transport layer. If 0 no such packet is
 								  resent. */
 	int current_seqno; /**< The sequence number of the currently or last
 						 important packet. */
 	int remote_seqno; /**< The sequence number of the last received important
 						packet. */
+	int window_base; /**< The sequence number of the oldest important sample
+					   or fragment in flight. */
+	size_t window_head; /**< The index of #window_base in #window_ids. */
+	size_t window_count; /**< The number of sequence numbers sent from
+						   #window_base. */
+	unsigned int window_ids[FIREFLY_IMPORTANT_WINDOW]; /**< The transport
+													   identifiers of the
+													   sequence numbers in
+													   flight, 0 once
+													   acknowledged. */
+	size_t window_sizes[FIREFLY_IMPORTANT_WINDOW]; /**< The bytes of the
+												   sequence numbers in flight
+												   counted in the congestion
+												   window of the
+												   connection. */
+	bool sending_queued; /**< A queued important packet is being sent. */
+	int64_t send_queued_id; /**< The event sending queued important packets
+							  or 0. */
+	bool cwnd_waiting; /**< The channel is in the cwnd_waiting list of the
+						 connection. */
+	struct firefly_channel *cwnd_next; /**< The next channel in the
+										 cwnd_waiting list of the
+										 connection. */
+	struct firefly_reorder_entry reorder[FIREFLY_IMPORTANT_WINDOW]; /**< The
+							important packets received ahead of their turn,
+							starting with the one after #remote_seqno. */
+	size_t reorder_head; /**< The index of the entry following
+						   #remote_seqno. */
+	bool ack_pending; /**< Important packets were received since the last
+						ack, see firefly_connection_send_acks(). */
+	struct firefly_channel *ack_next; /**< The next channel in the ack_list
+										of the connection. */
 	struct labcomm_encoder *proto_encoder; /**< LabComm encoder for this
 					   			channel.*/
 	struct labcomm_decoder *proto_decoder; /**< LabComm decoder for this
@@ -312,6 +793,36 @@ struct firefly_channel {
 	size_t n_decoder_types;
 	int *seen_decoder_ids;
 	struct firefly_channel_types types; /**< Holds types until after channel handshake. */
+	int fragment_sample_id; /**< The identifier of the last sample sent in
+							  fragments. */
+	struct firefly_reassembly reassembly[2]; /**< The unimportant and the
+											   important sample being
+											   reassembled. */
+	enum firefly_channel_priority priority; /**< The priority class of the
+											  data samples sent. */
+	int fec_group; /**< The number of data samples protected by each parity
+					 sample, requested or agreed at channel open. 0 if
+					 forward error correction is off. */
+	int fec_next_seqno; /**< The fec_seqno of the next data sample sent. */
+	int fec_recovered; /**< The fec_seqno of the last recovered sample. */
+	struct firefly_fec_group fec_tx; /**< The group being sent. */
+	struct firefly_fec_group fec_rx; /**< The group being received. */
+	bool conflate; /**< Unsent data samples are replaced by newer ones of the
+					 same type. */
+	unsigned int conflate_interval; /**< The least number of ms between the
+									  sends of a conflating channel or 0. */
+	int conflate_state; /**< The #firefly_conflate_state, changed
+						  atomically. */
+	int64_t conflate_timer_id; /**< The event ending the hold of the channel
+								 or 0. */
+	int64_t conflate_queued_id; /**< The newest untimed event sending the
+								  channel or 0, changed atomically. */
+	struct firefly_conflated_sample *conflated; /**< The types written on
+												  the conflating channel. */
+	unsigned int ttl; /**< The number of ms a data sample may wait to be
+						sent, 0 if forever. */
+	unsigned int nbr_expired; /**< The number of data samples dropped past
+								their deadline. */
 };
 
 /**
@@ -459,6 +970,48 @@ int firefly_connection_free_event(void *event_arg);
 void protocol_data_received(struct firefly_connection *conn,
 							unsigned char *data, size_t size);
 
+/**
+ * @brief Process received data like protocol_data_received() but deliver
+ * unimportant data samples on open channels directly instead of through an
+ * event.
+ *
+ * Used by transports running received data to completion on the thread
+ * reading it. Control messages and important samples are still handled
+ * through the event queue.
+ *
+ * @warning Must only be called where an event of the connection could be
+ * executed, i.e. from an event or from firefly_event_run_inline().
+ *
+ * @param conn The connection the data is associated with.
+ * @param data The received data.
+ * @param size The size of the received data.
+ */
+void protocol_data_received_inline(struct firefly_connection *conn,
+							unsigned char *data, size_t size);
+
+/**
+ * @brief The function called by the transport layer upon received data in a
+ * #firefly_buffer.
+ *
+ * The data is decoded straight from the buffer and data samples keep a
+ * reference to it instead of a copy of their data.
+ *
+ * @param conn The connection the data is associated with.
+ * @param buf The received data, the reference of the caller is handed over.
+ */
+void protocol_buffer_received(struct firefly_connection *conn,
+							struct firefly_buffer *buf);
+
+/**
+ * @brief Process a received buffer like protocol_buffer_received() with the
+ * inline delivery of protocol_data_received_inline().
+ *
+ * @param conn The connection the data is associated with.
+ * @param buf The received data, the reference of the caller is handed over.
+ */
+void protocol_buffer_received_inline(struct firefly_connection *conn,
+							struct firefly_buffer *buf);
+
 /**
  * @brief Create a new channel with some defaults.
  *
@@ -640,6 +1193,9 @@ void handle_channel_close(firefly_protocol_channel_close *chan_close,
  * should be acknowledged, and lastly decode the user data inside the
  * packet.
  *
+ * An unimportant sample received through protocol_data_received_inline() on
+ * an open channel is decoded directly, without an event.
+ *
  * @param data The decoded data sample.
  * @param context The connection associated with the received data.
  */
@@ -665,12 +1221,165 @@ struct firefly_event_recv_sample {
  */
 int handle_data_sample_event(void *event_arg);
 
+/**
+ * @brief The event that parses a firefly_protocol_data_sample copied to the
+ * event together with its data.
+ *
+ * @param event_arg A firefly_event_recv_sample directly followed by the
+ * encoded data.
+ * @return Integer idicating the resutlt of the event.
+ * @retval Negative integer upon error.
+ * @see #handle_data_sample
+ */
+int handle_data_sample_copy_event(void *event_arg);
+
+/**
+ * @brief The event argument of handle_data_sample_ref_event.
+ */
+struct firefly_event_recv_sample_ref {
+	struct firefly_event_recv_sample fers; /**< The sample, its data points
+											 into \p buf. */
+	struct firefly_buffer *buf; /**< The referenced buffer holding the data
+								  of the sample. */
+};
+
+/**
+ * @brief The event that parses a firefly_protocol_data_sample whose data is
+ * borrowed from the received buffer. Releases the buffer afterwards.
+ *
+ * @param event_arg A firefly_event_recv_sample_ref.
+ * @return Integer idicating the resutlt of the event.
+ * @retval Negative integer upon error.
+ * @see #handle_data_sample
+ */
+int handle_data_sample_ref_event(void *event_arg);
+
+/**
+ * @brief Parses a firefly_protocol_data_fragment.
+ *
+ * This function creates an event that stores the fragment in the sample
+ * reassembled on the channel and decodes the sample once it is complete.
+ *
+ * @param frag The decoded fragment.
+ * @param context The connection associated with the received data.
+ */
+void handle_data_fragment(firefly_protocol_data_fragment *frag,
+		void *context);
+
+/**
+ * @brief The event argument of handle_data_fragment_event, directly followed
+ * by the data of the fragment.
+ */
+struct firefly_event_recv_fragment {
+	struct firefly_connection *conn; /**< The connection the fragment was
+									   received on. */
+	firefly_protocol_data_fragment frag; /**< The fragment. */
+};
+
+/**
+ * @brief The event that stores a received firefly_protocol_data_fragment.
+ *
+ * @param event_arg A firefly_event_recv_fragment.
+ * @return Integer idicating the resutlt of the event.
+ * @retval Negative integer upon error.
+ * @see #handle_data_fragment
+ */
+int handle_data_fragment_event(void *event_arg);
+
 /**
  *
  */
 //TODO comments
 void handle_ack(firefly_protocol_ack *ack, void *context);
 
+/**
+ * @brief The event argument of handle_ack_event.
+ */
+struct firefly_event_ack_recv {
+	struct firefly_connection *conn; /**< The connection the ack was
+						received on. */
+	firefly_protocol_ack ack; /**< The received ack. */
+};
+
+/**
+ * @brief The event that parses a firefly_protocol_ack.
+ *
+ * @param event_arg A firefly_event_ack_recv.
+ * @return Integer idicating the resutlt of the event.
+ * @see #handle_ack
+ */
+int handle_ack_event(void *event_arg);
+
+/**
+ * @brief The callback registered with LabComm used to receive the
+ * acknowledgements of several channels.
+ *
+ * @param batch The decoded acknowledgements.
+ * @param context The connection they were received on.
+ */
+void handle_ack_batch(firefly_protocol_ack_batch *batch, void *context);
+
+/**
+ * @brief The event argument of handle_ack_batch_event, followed by the
+ * acknowledgements of the batch.
+ */
+struct firefly_event_ack_batch_recv {
+	struct firefly_connection *conn; /**< The connection the acks were
+						received on. */
+	firefly_protocol_ack_batch batch; /**< The received acks. */
+};
+
+/**
+ * @brief The event that parses a firefly_protocol_ack_batch.
+ *
+ * @param event_arg A firefly_event_ack_batch_recv.
+ * @return Integer idicating the resutlt of the event.
+ * @see #handle_ack_batch
+ */
+int handle_ack_batch_event(void *event_arg);
+
+/**
+ * @brief The callback registered with LabComm used to receive the parity of a
+ * group of data samples.
+ *
+ * @param parity The decoded parity.
+ * @param context The connection it was received on.
+ */
+void handle_data_parity(firefly_protocol_data_parity *parity, void *context);
+
+/**
+ * @brief The event argument of handle_data_parity_event, followed by the
+ * parity data.
+ */
+struct firefly_event_data_parity_recv {
+	struct firefly_connection *conn; /**< The connection the parity was
+						received on. */
+	firefly_protocol_data_parity parity; /**< The received parity. */
+};
+
+/**
+ * @brief The event that parses a firefly_protocol_data_parity.
+ *
+ * @param event_arg A firefly_event_data_parity_recv.
+ * @return Integer idicating the resutlt of the event.
+ * @see #handle_data_parity
+ */
+int handle_data_parity_event(void *event_arg);
+
+/**
+ * @brief Sends the delayed acks of the channels in the ack_list of the
+ * connection in firefly_protocol_ack_batch messages. Each channel
+ * acknowledges every important packet up to its #remote_seqno and,
+ * selectively, the ones kept in its reorder buffer.
+ *
+ * @param conn The concerned connection.
+ * @param piggyback If true the acks are sent in the same frame as the next
+ * message encoded on the transport encoder, which must follow before the
+ * calling event returns.
+ */
+void firefly_connection_send_acks(struct firefly_connection *conn,
+		bool piggyback);
+
 struct firefly_event_channel_restrict_request {
 	struct firefly_connection *conn; /**< The connection the request was
 						received on. */
@@ -701,7 +1410,14 @@ int channel_restrict_ack_event(void *context);
 struct firefly_event_send_sample {
 	struct firefly_channel *chan; /**< The channel to send the sample on. */
 	firefly_protocol_data_sample data; /**< The sample to send. */
-	unsigned char *important_id;
+	unsigned int *important_id;
+	struct firefly_buffer *frame; /**< The referenced frame the data was
+									encoded into, or NULL if the data is
+									allocated for the event. */
+	size_t offset; /**< The number of bytes of a fragmented sample sent. */
+	int sample_id; /**< The identifier of a fragmented sample. */
+	int64_t deadline; /**< The time on the clock of the event queue after
+						which the sample is dropped, or 0. */
 };
 
 /**
@@ -713,6 +1429,39 @@ struct firefly_event_send_sample {
  */
 int send_data_sample_event(void *event_arg);
 
+/**
+ * @brief Encodes and sends an unimportant firefly_protocol_data_sample copied
+ * to the event together with its data.
+ *
+ * @param event_arg A firefly_event_send_sample directly followed by the
+ * encoded data.
+ * @return Integer idicating the resutlt of the event.
+ * @retval Negative integer upon error.
+ */
+int send_data_sample_copy_event(void *event_arg);
+
+/**
+ * @brief Encodes and sends an unimportant firefly_protocol_data_sample whose
+ * data is in a frame of the channel encoder. Releases the frame afterwards.
+ *
+ * @param event_arg A firefly_event_send_sample with a frame.
+ * @return Integer idicating the resutlt of the event.
+ * @retval Negative integer upon error.
+ */
+int send_data_sample_frame_event(void *event_arg);
+
+/**
+ * @brief Sends the newest unsent data sample of each type written on a
+ * conflating channel. If the channel has a minimum interval and anything was
+ * sent, the channel holds further samples until a timed instance of the event
+ * sends them.
+ *
+ * @param event_arg The channel.
+ * @return Integer idicating the resutlt of the event.
+ * @retval Negative integer upon error.
+ */
+int send_conflated_event(void *event_arg);
+
 /**
  * @brief Find and return the channel associated with the given connection with
  * the given remote channel id.
@@ -750,9 +1499,38 @@ void add_channel_to_connection(struct firefly_channel *chan,
 struct firefly_channel *remove_channel_from_connection(struct firefly_channel *chan,
 		struct firefly_connection *conn);
 
+/**
+ * @brief Set the remote id of a channel and index the channel by it.
+ *
+ * @param chan The channel, it may or may not have been added to a connection.
+ * @param id The remote id of the channel.
+ */
+void set_channel_remote_id(struct firefly_channel *chan, int id);
+
+/**
+ * @brief Initialize an empty channel table.
+ *
+ * @param table The table to initialize.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 on failure.
+ */
+int firefly_channel_table_init(struct firefly_channel_table *table);
+
+/**
+ * @brief Free the memory of a channel table, the channels are not freed.
+ *
+ * @param table The table to free.
+ */
+void firefly_channel_table_free(struct firefly_channel_table *table);
+
 /**
  * @brief Generates new uniqe channel ID for the supplied firefly_connection.
  *
+ * The ID of a channel removed from the connection is reused once all other
+ * free IDs have been reused and #FIREFLY_CHANNEL_ID_QUARANTINE has passed
+ * since it was removed.
+ *
  * @param conn The connection the new channel ID is generated for.
  * @return The new uniqe channel ID.
  */
@@ -767,6 +1545,60 @@ int next_channel_id(struct firefly_connection *conn);
 void firefly_connection_raise_later(struct firefly_connection *conn,
 		enum firefly_error reason, const char *msg);
 
+/**
+ * @brief Tells the connection that the transport layer resent an important
+ * packet because it was not acked in time. Backs off the congestion window
+ * from the event queue of the connection, at most once for the packets in
+ * flight when it was last backed off. May be called from any thread.
+ *
+ * @param conn The connection the packet was resent on.
+ */
+void firefly_connection_resend_timeout(struct firefly_connection *conn);
+
+/**
+ * @brief Gets the priority class of the frame the transport layer is asked to
+ * write, the highest class of the messages in it. Only valid while the frame
+ * is written, a transport that resends the packet later must store the class
+ * with it.
+ *
+ * @param conn The connection the frame is written on.
+ * @return The priority class of the frame.
+ */
+enum firefly_channel_priority firefly_connection_tx_priority(
+		struct firefly_connection *conn);
+
+/**
+ * @brief Checks whether the congestion window of the connection is full.
+ *
+ * @param conn The concerned connection.
+ * @return true if no more important packets may be sent now.
+ */
+bool firefly_connection_cwnd_full(struct firefly_connection *conn);
+
+/**
+ * @brief Counts bytes sent in an important packet, resent until acked, in
+ * the congestion window.
+ *
+ * @param conn The concerned connection.
+ * @param size The number of bytes sent.
+ */
+void firefly_connection_cwnd_sent(struct firefly_connection *conn,
+		size_t size);
+
+/**
+ * @brief Releases the bytes of an important packet from the congestion
+ * window. The window grows if the packet was acked, exponentially up to
+ * the slow start threshold and by about one fragment per round trip above
+ * it.
+ *
+ * @param conn The concerned connection.
+ * @param size The number of bytes counted when the packet was sent.
+ * @param acked The packet was acked, it is not only forgotten.
+ * @return true if the window was full and has room now.
+ */
+bool firefly_connection_cwnd_release(struct firefly_connection *conn,
+		size_t size, bool acked);
+
 /**
  * @brief Call channel_error callback on the given connection with the given
  * channel.
@@ -803,16 +1635,243 @@ int firefly_channel_restrict_event(void *earg);
 int firefly_channel_unrestrict_event(void *earg);
 
 /**
- * @brief Internal function which will ack to the transport layer any non-acked
- * important packet on the provided channel.
+ * @brief Internal function which will ack to the transport layer the
+ * non-acked channel handshake or restrict packet on the provided channel.
  *
- * @param chan All important packets of this channel will be acked.
+ * @param chan The handshake or restrict packet of this channel will be acked.
  */
 void firefly_channel_ack(struct firefly_channel *chan);
 
 /**
- * @brief Enqueues an important packet if there is already another important
- * packet on the channel.
+ * @brief Acks to the transport layer the important sample or fragment with
+ * the provided sequence number if it is in flight, letting the send window
+ * of the channel move on.
+ *
+ * @param chan The concerned channel.
+ * @param seqno The acknowledged sequence number.
+ */
+void firefly_channel_ack_seqno(struct firefly_channel *chan, int seqno);
+
+/**
+ * @brief Acks to the transport layer all important samples and fragments in
+ * flight on the channel, e.g. when it is closed.
+ *
+ * @param chan The concerned channel.
+ */
+void firefly_channel_ack_window(struct firefly_channel *chan);
+
+/**
+ * @brief Acks to the transport layer every important sample and fragment in
+ * flight up to a sequence number and the selected ones after it.
+ *
+ * @param chan The concerned channel.
+ * @param seqno The sequence number up to which all packets are acknowledged.
+ * @param selective Bit i set acknowledges \p seqno + 1 + i.
+ */
+void firefly_channel_ack_cumulative(struct firefly_channel *chan, int seqno,
+		int selective);
+
+/**
+ * @brief Puts the next important sample or fragment in the send window of the
+ * channel. The window must not be full, see firefly_channel_window_full().
+ *
+ * @param chan The concerned channel.
+ * @param seqno Set to the sequence number of the packet.
+ * @return The location to pass to
+ * #FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID when sending the packet.
+ */
+unsigned int *firefly_channel_window_push(struct firefly_channel *chan,
+		int *seqno);
+
+/**
+ * @brief Checks whether the channel has #FIREFLY_IMPORTANT_WINDOW sequence
+ * numbers in flight or the congestion window of the connection is full.
+ *
+ * @param chan The concerned channel.
+ * @return true if no more important samples may be sent now.
+ */
+bool firefly_channel_window_full(struct firefly_channel *chan);
+
+/**
+ * @brief Counts the important sample or fragment last put in the send window
+ * in the congestion window of the connection, if the transport layer resends
+ * it.
+ *
+ * @param chan The concerned channel.
+ * @param size The number of sample bytes sent.
+ */
+void firefly_channel_window_sent(struct firefly_channel *chan, size_t size);
+
+/**
+ * @brief Gets the priority of the events sending the data samples of a
+ * channel.
+ *
+ * @param chan The concerned channel.
+ * @return The event priority.
+ */
+unsigned char firefly_channel_send_priority(struct firefly_channel *chan);
+
+/**
+ * @brief Gets the priority of the events sending messages of a priority
+ * class, never below #FIREFLY_CHANNEL_CLOSE_PRIORITY.
+ *
+ * @param priority The priority class of the messages.
+ * @return The event priority.
+ * @see firefly_channel_send_priority()
+ */
+unsigned char firefly_send_priority(int priority);
+
+/**
+ * @brief Get the deadline of a data sample written on a channel now.
+ *
+ * @param chan The channel.
+ * @return The time on the clock of the event queue of the connection after
+ * which the sample is dropped.
+ * @retval 0 if the samples of the channel have no deadline.
+ */
+int64_t firefly_channel_deadline(struct firefly_channel *chan);
+
+/**
+ * @brief Check if the deadline of a data sample of a channel has passed. An
+ * expired sample is counted and reported to the channel_expired action of
+ * the connection, the caller must drop it.
+ *
+ * @param chan The channel the sample was written on.
+ * @param deadline The deadline of the sample or 0.
+ * @return True if the sample must be dropped.
+ */
+bool firefly_channel_expired(struct firefly_channel *chan, int64_t deadline);
+
+/**
+ * @brief Gets the priority of the event delivering a received data sample or
+ * fragment.
+ *
+ * @param priority The priority class carried by the sample, classes unknown
+ * to this node are #FIREFLY_CHANNEL_PRIORITY_NORMAL.
+ * @return The event priority.
+ */
+unsigned char firefly_receive_priority(int priority);
+
+/**
+ * @brief Turns forward error correction on the channel on, allocating the
+ * parity buffers, or off.
+ *
+ * @param chan The concerned channel.
+ * @param group The number of data samples protected by each parity sample,
+ * at most #FIREFLY_FEC_MAX_GROUP are used. 0 turns it off.
+ * @return The group size in use.
+ * @retval 0 if forward error correction is off, also if the buffers could
+ * not be allocated.
+ */
+int firefly_channel_set_fec(struct firefly_channel *chan, int group);
+
+/**
+ * @brief Numbers a data sample about to be sent and adds it to the parity of
+ * its group. Samples larger than one fragment get fec_seqno 0 and are not
+ * protected.
+ *
+ * @param chan The channel the sample is sent on.
+ * @param data The sample, its fec_seqno is set.
+ * @return true if the group is complete and its parity should be sent, see
+ * firefly_channel_fec_parity().
+ */
+bool firefly_channel_fec_add(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data);
+
+/**
+ * @brief Gets the parity of the group last completed by
+ * firefly_channel_fec_add(). The parity data is valid until the next sample
+ * is added.
+ *
+ * @param chan The concerned channel.
+ * @param parity Set to the parity of the group.
+ */
+void firefly_channel_fec_parity(struct firefly_channel *chan,
+		firefly_protocol_data_parity *parity);
+
+/**
+ * @brief Adds a received data sample to the parity of its group.
+ *
+ * @param chan The channel the sample is received on.
+ * @param data The received sample.
+ * @return false if the sample is an unimportant duplicate of a recovered one
+ * and should be dropped.
+ */
+bool firefly_channel_fec_receive(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data);
+
+/**
+ * @brief Adds a received parity sample to the parity of its group.
+ *
+ * @param chan The channel the parity is received on.
+ * @param parity The received parity.
+ */
+void firefly_channel_fec_receive_parity(struct firefly_channel *chan,
+		firefly_protocol_data_parity *parity);
+
+/**
+ * @brief Rebuilds the only missing data sample of the group being received
+ * once its parity is received.
+ *
+ * @param chan The concerned channel.
+ * @param data Set to the recovered sample, its data is valid until the next
+ * sample or parity is received.
+ * @return true if a sample was recovered.
+ */
+bool firefly_channel_fec_recover(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data);
+
+/**
+ * @brief Gets the distance between two sequence numbers, taking the wrap
+ * around after INT_MAX into account.
+ *
+ * @param from The earlier sequence number, or 0 if none.
+ * @param to The later sequence number.
+ * @return The number of sequence numbers from \p from to \p to.
+ */
+int firefly_seqno_distance(int from, int to);
+
+/**
+ * @brief Keeps a copy of an important sample or fragment received ahead of
+ * its turn.
+ *
+ * @param chan The channel the packet was received on.
+ * @param ahead The number of packets between #remote_seqno and the received
+ * one, less than #FIREFLY_IMPORTANT_WINDOW.
+ * @param sample The received sample or NULL.
+ * @param frag The received fragment if \p sample is NULL.
+ * @return Integer indicating the result.
+ * @retval 0 if the packet is kept, or was already.
+ * @retval <0 on failure.
+ */
+int firefly_channel_reorder_store(struct firefly_channel *chan, size_t ahead,
+		firefly_protocol_data_sample *sample,
+		firefly_protocol_data_fragment *frag);
+
+/**
+ * @brief Gets the kept packet following #remote_seqno.
+ *
+ * @param chan The concerned channel.
+ * @return The entry of the packet or NULL if it is not received yet.
+ */
+struct firefly_reorder_entry *firefly_channel_reorder_next(
+		struct firefly_channel *chan);
+
+/**
+ * @brief Moves #remote_seqno past the next important packet once it is
+ * delivered, discarding its kept copy if any.
+ *
+ * @param chan The concerned channel.
+ */
+void firefly_channel_advance_remote_seqno(struct firefly_channel *chan);
+
+/**
+ * @brief Enqueues an important packet if the channel may not send it yet.
+ *
+ * A channel handshake or restrict packet waits for every important packet in
+ * flight while a data sample only waits for a full send window or a
+ * handshake or restrict packet. Packets are sent in the order they are
+ * queued.
  *
  * @param chan The channel to queue the packet on.
  * @param event An event which will send the packet.
@@ -825,11 +1884,91 @@ void firefly_channel_ack(struct firefly_channel *chan);
 bool firefly_channel_enqueue_important(struct firefly_channel *chan,
 		firefly_event_execute_f event, void *event_arg);
 
+/**
+ * @brief Queues an important packet first in the queue of the channel, to be
+ * sent as soon as the send window of the channel, and the congestion window
+ * of its connection, has room.
+ *
+ * @param chan The channel to queue the packet on.
+ * @param event An event which will send the packet.
+ * @param event_arg The argument to the event.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 if the queue entry could not be allocated, the packet is not
+ * queued.
+ */
+int firefly_channel_push_important(struct firefly_channel *chan,
+		firefly_event_execute_f event, void *event_arg);
+
+/**
+ * @brief Gets and updates the identifier of the samples sent in fragments.
+ *
+ * @param chan The concerned channel.
+ * @return The next identifier.
+ */
+int firefly_channel_next_fragment_id(struct firefly_channel *chan);
+
+/**
+ * @brief Stores a received fragment in the sample reassembled from it.
+ *
+ * A fragment of another sample than the one reassembled discards the
+ * reassembled one. A sample without new fragments for
+ * #FIREFLY_REASSEMBLY_TIMEOUT milliseconds is discarded if the event queue
+ * supports timed events.
+ *
+ * @param chan The channel the fragment was received on.
+ * @param frag The fragment.
+ * @return Integer indicating the result.
+ * @retval 1 if the sample is complete, see firefly_channel_reassembled().
+ * @retval 0 if the fragment was stored.
+ * @retval <0 if the fragment was dropped.
+ */
+int firefly_channel_reassemble(struct firefly_channel *chan,
+		firefly_protocol_data_fragment *frag);
+
+/**
+ * @brief Gets the reassembly of a sample.
+ *
+ * @param chan The channel the sample is received on.
+ * @param important Whether the sample is important.
+ * @return The reassembly, its data is the sample once all fragments are
+ * received.
+ */
+struct firefly_reassembly *firefly_channel_reassembled(
+		struct firefly_channel *chan, bool important);
+
+/**
+ * @brief Discards a reassembled or partially received sample.
+ *
+ * @param r The reassembly of the sample.
+ */
+void firefly_reassembly_release(struct firefly_reassembly *r);
+
 struct labcomm_memory *firefly_labcomm_memory_new(
 		struct firefly_connection *conn);
 
 void firefly_labcomm_memory_free(struct labcomm_memory *mem);
 
+/**
+ * @brief The event argument of firefly_channel_open_fec_event.
+ */
+struct firefly_event_chan_open_fec {
+	struct firefly_connection *connection;
+	int fec_group; /**< The requested number of data samples protected by each
+					 parity sample. */
+};
+
+/**
+ * @brief The event performing the opening of a channel with forward error
+ * correction on the connection.
+ *
+ * @param event_arg A firefly_event_chan_open_fec.
+ * @return Integer idicating the resutlt of the event.
+ * @retval Negative integer upon error.
+ * @see #firefly_channel_open_fec
+ */
+int firefly_channel_open_fec_event(void *event_arg);
+
 /**
  * @brief The event argument of firefly_channel_open_auto_restrict_event.
  */
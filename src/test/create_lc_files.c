@@ -11,6 +11,7 @@ int main(int argc, char **argv)
 	firefly_protocol_channel_request chan_req;
 	chan_req.source_chan_id = 0;
 	chan_req.dest_chan_id = 1;
+	chan_req.fec_group = 0;
 	create_lc_files_name(
 			labcomm_encoder_register_firefly_protocol_channel_request,
 			(lc_encode_f) labcomm_encode_firefly_protocol_channel_request,
@@ -20,6 +21,7 @@ int main(int argc, char **argv)
 	chan_res.source_chan_id = 0;
 	chan_res.dest_chan_id = 1;
 	chan_res.ack = true;
+	chan_res.fec_group = 0;
 	create_lc_files_name(
 			labcomm_encoder_register_firefly_protocol_channel_response,
 			(lc_encode_f) labcomm_encode_firefly_protocol_channel_response,
@@ -47,6 +49,8 @@ int main(int argc, char **argv)
 	sample.dest_chan_id = 1;
 	sample.app_enc_data.n_0 = 0;
 	sample.app_enc_data.a = NULL;
+	sample.fec_seqno = 0;
+	sample.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
 	create_lc_files_name(
 			labcomm_encoder_register_firefly_protocol_data_sample,
 			(lc_encode_f) labcomm_encode_firefly_protocol_data_sample,
@@ -31,6 +31,8 @@ firefly_protocol_channel_close channel_close;
 firefly_protocol_ack ack;
 firefly_protocol_channel_restrict_request restrict_request;
 firefly_protocol_channel_restrict_ack restrict_ack;
+firefly_protocol_ack_batch ack_batch;
+firefly_protocol_data_parity data_parity;
 
 bool received_data_sample = false;
 bool received_channel_request = false;
@@ -40,6 +42,8 @@ bool received_channel_close = false;
 bool received_ack = false;
 bool received_restrict_request = false;
 bool received_restrict_ack = false;
+bool received_ack_batch = false;
+bool received_data_parity = false;
 bool received_important = false;
 bool conn_ack_called = false;
 
@@ -81,6 +85,7 @@ struct firefly_connection *setup_test_conn_new(
 	struct firefly_transport_connection *test_trsp_conn =
 		malloc(sizeof(*test_trsp_conn));
 	test_trsp_conn->write = transport_write_test_decoder;
+	test_trsp_conn->write_buffer = NULL;
 	test_trsp_conn->ack = transport_ack_test;
 	test_trsp_conn->open = test_conn_open;
 	test_trsp_conn->close = test_conn_close;
@@ -108,7 +113,7 @@ void chan_opened_mock(struct firefly_channel *chan)
 	chan_opened_called = true;
 }
 
-void transport_ack_test(unsigned char id, struct firefly_connection *conn)
+void transport_ack_test(unsigned int id, struct firefly_connection *conn)
 {
 	UNUSED_VAR(conn);
 	CU_ASSERT_EQUAL(id, IMPORTANT_ID);
@@ -117,7 +122,7 @@ void transport_ack_test(unsigned char id, struct firefly_connection *conn)
 
 void transport_write_test_decoder(unsigned char *data, size_t size,
 					  struct firefly_connection *conn, bool important,
-					   unsigned char *id)
+					   unsigned int *id)
 {
 	UNUSED_VAR(conn);
 	received_important = important;
@@ -141,7 +146,7 @@ bool chan_open_recv_accept_open(struct firefly_channel *chan)
 
 void chan_open_recv_write_open(unsigned char *data, size_t size,
 					   struct firefly_connection *conn, bool important,
-					   unsigned char *id)
+					   unsigned int *id)
 {
 	UNUSED_VAR(conn);
 	UNUSED_VAR(important);
@@ -159,7 +164,7 @@ bool chan_open_recv_accept_recv(struct firefly_channel *chan)
 
 void chan_open_recv_write_recv(unsigned char *data, size_t size,
 					   struct firefly_connection *conn, bool important,
-					   unsigned char *id)
+					   unsigned int *id)
 {
 	UNUSED_VAR(conn);
 	UNUSED_VAR(important);
@@ -236,6 +241,25 @@ void test_handle_restrict_ack(firefly_protocol_channel_restrict_ack *d, void *ct
 	received_restrict_ack = true;
 }
 
+void test_handle_ack_batch(firefly_protocol_ack_batch *d, void *ctx)
+{
+	UNUSED_VAR(ctx);
+	free(ack_batch.a);
+	ack_batch.n_0 = d->n_0;
+	ack_batch.a = malloc(d->n_0 * sizeof(*d->a));
+	memcpy(ack_batch.a, d->a, d->n_0 * sizeof(*d->a));
+	received_ack_batch = true;
+}
+
+void test_handle_data_parity(firefly_protocol_data_parity *d, void *ctx)
+{
+	UNUSED_VAR(ctx);
+	memcpy(&data_parity, d, sizeof(*d));
+	// The parity data is not kept.
+	data_parity.parity.a = NULL;
+	received_data_parity = true;
+}
+
 int init_labcomm_test_enc_dec_custom(struct labcomm_reader *test_r,
 		struct labcomm_writer *test_w)
 {
@@ -271,6 +295,10 @@ int init_labcomm_test_enc_dec_custom(struct labcomm_reader *test_r,
 						test_handle_restrict_request, NULL);
 	labcomm_decoder_register_firefly_protocol_channel_restrict_ack(test_dec,
 						test_handle_restrict_ack, NULL);
+	labcomm_decoder_register_firefly_protocol_ack_batch(test_dec,
+						test_handle_ack_batch, NULL);
+	labcomm_decoder_register_firefly_protocol_data_parity(test_dec,
+						test_handle_data_parity, NULL);
 
 	void *buffer;
 	size_t buffer_size;
@@ -338,6 +366,22 @@ int init_labcomm_test_enc_dec_custom(struct labcomm_reader *test_r,
 	labcomm_decoder_decode_one(test_dec);
 	free(buffer);
 
+	labcomm_encoder_register_firefly_protocol_ack_batch(test_enc);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buffer, &buffer_size);
+	labcomm_decoder_ioctl(test_dec, LABCOMM_IOCTL_READER_SET_BUFFER,
+			buffer, buffer_size);
+	labcomm_decoder_decode_one(test_dec);
+	free(buffer);
+
+	labcomm_encoder_register_firefly_protocol_data_parity(test_enc);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buffer, &buffer_size);
+	labcomm_decoder_ioctl(test_dec, LABCOMM_IOCTL_READER_SET_BUFFER,
+			buffer, buffer_size);
+	labcomm_decoder_decode_one(test_dec);
+	free(buffer);
+
 	return 0;
 }
 
@@ -356,5 +400,7 @@ int clean_labcomm_test_enc_dec()
 	labcomm_encoder_free(test_enc);
 	test_enc = NULL;
 	labcomm_decoder_free(test_dec);
+	free(ack_batch.a);
+	ack_batch.a = NULL;
 	return 0;
 }
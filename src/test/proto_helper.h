@@ -20,23 +20,23 @@ struct firefly_connection *setup_test_conn_new(
 
 void chan_opened_mock(struct firefly_channel *chan);
 
-void transport_ack_test(unsigned char id, struct firefly_connection *conn);
+void transport_ack_test(unsigned int id, struct firefly_connection *conn);
 
 void transport_write_test_decoder(unsigned char *data, size_t size,
 					  struct firefly_connection *conn, bool important,
-					   unsigned char *id);
+					   unsigned int *id);
 
 bool chan_open_recv_accept_open(struct firefly_channel *chan);
 
 void chan_open_recv_write_open(unsigned char *data, size_t size,
 							   struct firefly_connection *conn, bool important,
-					   unsigned char *id);
+					   unsigned int *id);
 
 bool chan_open_recv_accept_recv(struct firefly_channel *chan);
 
 void chan_open_recv_write_recv(unsigned char *data, size_t size,
 					   struct firefly_connection *conn, bool important,
-					   unsigned char *id);
+					   unsigned int *id);
 
 void free_tmp_data(struct tmp_data *td);
 
@@ -50,5 +50,7 @@ void test_handle_channel_ack(firefly_protocol_channel_ack *d, void *ctx);
 void test_handle_channel_response(firefly_protocol_channel_response *d, void *ctx);
 void test_handle_channel_request(firefly_protocol_channel_request *d, void *ctx);
 void test_handle_data_sample(firefly_protocol_data_sample *d, void *ctx);
+void test_handle_ack_batch(firefly_protocol_ack_batch *d, void *ctx);
+void test_handle_data_parity(firefly_protocol_data_parity *d, void *ctx);
 
 #endif
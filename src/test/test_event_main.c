@@ -7,11 +7,17 @@
 #include "CUnit/Console.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
 
 #include <utils/firefly_event_queue.h>
+#include <utils/firefly_errors.h>
 
 #include "utils/firefly_event_queue_private.h"
 
+extern bool was_in_error;
+extern enum firefly_error expected_error;
+
 int init_suite_event()
 {
 	return 0;
@@ -29,13 +35,13 @@ void test_add_pop_event_simple()
 
 	int st = q->offer_event_cb(q, 1, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL(st, 1);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(q->head);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(q->head->depends);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(firefly_event_queue_head(q));
+	CU_ASSERT_PTR_NOT_NULL_FATAL(firefly_event_queue_head(q)->edges);
 	struct firefly_event *test = firefly_event_pop(q);
 
 	CU_ASSERT_EQUAL(1, test->prio);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_head(q));
 
 	// Clean up
 	firefly_event_return(q, &test);
@@ -52,13 +58,13 @@ void test_queue_events_in_order()
 
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL(st, 1);
-	CU_ASSERT_EQUAL(q->head->id, 1);
+	CU_ASSERT_EQUAL(firefly_event_queue_head(q)->id, 1);
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_MEDIUM, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL(st, 2);
-	CU_ASSERT_EQUAL(q->head->id, 2);
+	CU_ASSERT_EQUAL(firefly_event_queue_head(q)->id, 2);
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL(st, 3);
-	CU_ASSERT_EQUAL(q->head->id, 3);
+	CU_ASSERT_EQUAL(firefly_event_queue_head(q)->id, 3);
 
 	ev = firefly_event_pop(q);
 	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_HIGH, ev->prio);
@@ -70,7 +76,7 @@ void test_queue_events_in_order()
 	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_LOW, ev->prio);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_head(q));
 
 	firefly_event_queue_free(&q);
 }
@@ -101,7 +107,7 @@ void test_queue_event_same_prio()
 	CU_ASSERT_PTR_EQUAL(&id_3, ev->context);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_head(q));
 
 	firefly_event_queue_free(&q);
 }
@@ -147,7 +153,7 @@ void test_queue_event_same_and_diff_prio()
 	CU_ASSERT_PTR_EQUAL(&id_l2, ev->context);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_head(q));
 
 	firefly_event_queue_free(&q);
 }
@@ -194,6 +200,65 @@ void test_length()
 	firefly_event_queue_free(&q);
 }
 
+void test_length_pop_all_prios()
+{
+	struct firefly_event *ev;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 256, NULL);
+
+	for (int prio = 0; prio < 256; prio++) {
+		q->offer_event_cb(q, prio, NULL, NULL, 0, NULL);
+	}
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 256);
+
+	for (int prio = 255; prio >= 0; prio--) {
+		ev = firefly_event_pop(q);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+		CU_ASSERT_EQUAL(ev->prio, prio);
+		firefly_event_return(q, &ev);
+		CU_ASSERT_EQUAL(firefly_event_queue_length(q), (size_t) prio);
+	}
+	CU_ASSERT_PTR_NULL(firefly_event_queue_head(q));
+
+	firefly_event_queue_free(&q);
+}
+
+void test_dependency_inside_bucket()
+{
+	int64_t id;
+	struct firefly_event *ev;
+	int id_1 = 1;
+	int id_2 = 2;
+	int id_3 = 3;
+	int id_4 = 4;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+
+	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, &id_1, 0, NULL);
+	id = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, &id_2, 0, NULL);
+	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, &id_3, 0, NULL);
+	q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, &id_4, 1, &id);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 4);
+
+	// The middle event of the low bucket must be unlinked first.
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(&id_2, ev->context);
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(&id_4, ev->context);
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(&id_1, ev->context);
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(&id_3, ev->context);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 0);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+
+	firefly_event_queue_free(&q);
+}
+
 static int complex_event(void *event_arg)
 {
 	static int last_id = 0;
@@ -422,15 +487,15 @@ void test_event_dependencies()
 
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, &id_1, 0, NULL);
 	CU_ASSERT_EQUAL(st, 1);
-	CU_ASSERT_EQUAL(q->head->id, 1);
+	CU_ASSERT_EQUAL(firefly_event_queue_head(q)->id, 1);
 	id = st;
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_MEDIUM, NULL, &id_2, 1, &id);
 	CU_ASSERT_EQUAL(st, 2);
-	CU_ASSERT_EQUAL(q->head->id, 2);
+	CU_ASSERT_EQUAL(firefly_event_queue_head(q)->id, 2);
 	id = st;
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, &id_3, 1, &id);
 	CU_ASSERT_EQUAL(st, 3);
-	CU_ASSERT_EQUAL(q->head->id, 3);
+	CU_ASSERT_EQUAL(firefly_event_queue_head(q)->id, 3);
 
 	ev = firefly_event_pop(q);
 	CU_ASSERT_PTR_EQUAL(&id_1, ev->context);
@@ -445,7 +510,7 @@ void test_event_dependencies()
 	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_HIGH, ev->prio);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_head(q));
 
 	firefly_event_queue_free(&q);
 }
@@ -464,17 +529,17 @@ void test_event_dependencies_done()
 	int64_t dep_1[] = {4};
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, &id_1, 1, dep_1);
 	CU_ASSERT_EQUAL(st, 1);
-	CU_ASSERT_EQUAL(q->head->id, 1);
+	CU_ASSERT_EQUAL(firefly_event_queue_head(q)->id, 1);
 	id = st;
 	int64_t dep_2[] = {id, 5};
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_MEDIUM, NULL, &id_2, 2, dep_2);
 	CU_ASSERT_EQUAL(st, 2);
-	CU_ASSERT_EQUAL(q->head->id, 2);
+	CU_ASSERT_EQUAL(firefly_event_queue_head(q)->id, 2);
 	id = st;
 	int64_t dep_3[] = {id, 6};
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, &id_3, 2, dep_3);
 	CU_ASSERT_EQUAL(st, 3);
-	CU_ASSERT_EQUAL(q->head->id, 3);
+	CU_ASSERT_EQUAL(firefly_event_queue_head(q)->id, 3);
 
 	ev = firefly_event_pop(q);
 	CU_ASSERT_PTR_EQUAL(&id_1, ev->context);
@@ -489,11 +554,391 @@ void test_event_dependencies_done()
 	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_HIGH, ev->prio);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_head(q));
 
 	firefly_event_queue_free(&q);
 }
 
+void test_dependency_released()
+{
+	int64_t deps[2];
+	struct firefly_event *ev;
+	struct firefly_event *dependent;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+
+	deps[0] = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
+	deps[1] = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
+	int64_t id = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, NULL, 2,
+			deps);
+	dependent = firefly_event_find(q, id);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(dependent);
+	CU_ASSERT_PTR_EQUAL(dependent->edges[0].target,
+			firefly_event_find(q, deps[0]));
+	CU_ASSERT_PTR_EQUAL(dependent->edges[1].target,
+			firefly_event_find(q, deps[1]));
+	CU_ASSERT_EQUAL(dependent->nbr_pending, 2);
+
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, deps[0]);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(dependent->nbr_pending, 1);
+	CU_ASSERT_PTR_NULL(firefly_event_find(q, deps[0]));
+
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, deps[1]);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(dependent->nbr_pending, 0);
+
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, id);
+	firefly_event_return(q, &ev);
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_find_index_resize()
+{
+	const size_t k_len = 100;
+	int64_t ids[100];
+	struct firefly_event *ev;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 1, NULL);
+
+	for (size_t i = 0; i < k_len; i++) {
+		ids[i] = q->offer_event_cb(q, FIREFLY_PRIORITY_MEDIUM, NULL, NULL, 0,
+				NULL);
+	}
+	CU_ASSERT_TRUE(q->index_size >= q->event_pool_size);
+	for (size_t i = 0; i < k_len; i++) {
+		ev = firefly_event_find(q, ids[i]);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+		CU_ASSERT_EQUAL(ev->id, ids[i]);
+	}
+	// Depend on an event sharing index slot with others.
+	int64_t id = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, NULL, 1,
+			&ids[k_len - 1]);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, ids[k_len - 1]);
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, id);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_PTR_NULL(firefly_event_find(q, ids[k_len - 1]));
+	CU_ASSERT_PTR_NULL(firefly_event_find(q, id));
+
+	firefly_event_queue_free(&q);
+}
+
+void test_add_batch()
+{
+	int ctx[3] = {0, 1, 2};
+	struct firefly_event *ev;
+	struct firefly_event_batch_entry entries[3];
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 3, NULL);
+
+	for (int i = 0; i < 3; i++) {
+		entries[i].strand = NULL;
+		entries[i].prio = i == 1 ? FIREFLY_PRIORITY_HIGH : FIREFLY_PRIORITY_LOW;
+		entries[i].execute = NULL;
+		entries[i].context = &ctx[i];
+		entries[i].context_size = 0;
+		entries[i].nbr_depends = 0;
+		entries[i].depends = NULL;
+	}
+	CU_ASSERT_EQUAL(firefly_event_add_batch(q, entries, 3), 3);
+	CU_ASSERT_EQUAL(entries[0].id, 1);
+	CU_ASSERT_EQUAL(entries[1].id, 2);
+	CU_ASSERT_EQUAL(entries[2].id, 3);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 3);
+
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(ev->context, &ctx[1]);
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(ev->context, &ctx[0]);
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(ev->context, &ctx[2]);
+	firefly_event_return(q, &ev);
+
+	firefly_event_queue_free(&q);
+}
+
+void test_many_dependencies()
+{
+	int64_t deps[FIREFLY_EVENT_INLINE_DEPENDS + 1];
+	struct firefly_event *ev;
+	struct firefly_event *dependent;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 1, NULL);
+
+	for (int i = 0; i < FIREFLY_EVENT_INLINE_DEPENDS + 1; i++)
+		deps[i] = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0,
+				NULL);
+	int64_t id = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, NULL,
+			FIREFLY_EVENT_INLINE_DEPENDS + 1, deps);
+	dependent = firefly_event_find(q, id);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(dependent);
+	CU_ASSERT_PTR_NOT_EQUAL(dependent->edges, dependent->inline_edges);
+	CU_ASSERT_EQUAL(dependent->nbr_pending, FIREFLY_EVENT_INLINE_DEPENDS + 1);
+
+	for (int i = 0; i < FIREFLY_EVENT_INLINE_DEPENDS + 1; i++) {
+		ev = firefly_event_pop(q);
+		CU_ASSERT_EQUAL(ev->id, deps[i]);
+		firefly_event_return(q, &ev);
+	}
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, id);
+	firefly_event_return(q, &ev);
+
+	firefly_event_queue_free(&q);
+}
+
+static unsigned char copied[FIREFLY_EVENT_PAYLOAD_SIZE + 1];
+static size_t copied_size;
+
+static int copy_event(void *event_arg)
+{
+	memcpy(copied, event_arg, copied_size);
+	return 0;
+}
+
+static int64_t wrapped_event_add(struct firefly_event_queue *eq,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		unsigned int nbr_depends, const int64_t *depends)
+{
+	return firefly_event_add(eq, prio, execute, context, nbr_depends,
+			depends);
+}
+
+void test_offer_copy()
+{
+	unsigned char ctx[FIREFLY_EVENT_PAYLOAD_SIZE + 1];
+	unsigned char expected[FIREFLY_EVENT_PAYLOAD_SIZE + 1];
+	struct firefly_event *ev;
+	int64_t id;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 1, NULL);
+
+	// Fits in the event.
+	memset(ctx, 1, sizeof(ctx));
+	memset(expected, 0, sizeof(expected));
+	memset(expected, 1, FIREFLY_EVENT_PAYLOAD_SIZE);
+	copied_size = FIREFLY_EVENT_PAYLOAD_SIZE;
+	id = firefly_event_offer_copy(q, NULL, FIREFLY_PRIORITY_LOW, copy_event,
+			ctx, FIREFLY_EVENT_PAYLOAD_SIZE, 0, NULL);
+	CU_ASSERT_TRUE(id > 0);
+	memset(ctx, 2, sizeof(ctx));
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(ev->context, ev->payload.bytes);
+	CU_ASSERT_FALSE(ev->context_allocated);
+	memset(copied, 0, sizeof(copied));
+	firefly_event_execute(ev);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(memcmp(copied, expected, sizeof(copied)), 0);
+
+	// Too large for the event.
+	memset(expected, 2, sizeof(expected));
+	copied_size = sizeof(ctx);
+	id = firefly_event_offer_copy(q, NULL, FIREFLY_PRIORITY_LOW, copy_event,
+			ctx, sizeof(ctx), 0, NULL);
+	CU_ASSERT_TRUE(id > 0);
+	memset(ctx, 3, sizeof(ctx));
+	ev = firefly_event_pop(q);
+	CU_ASSERT_TRUE(ev->context_allocated);
+	firefly_event_execute(ev);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(memcmp(copied, expected, sizeof(copied)), 0);
+	firefly_event_queue_free(&q);
+
+	// A queue with an offer function of its own gets a copy of its own.
+	q = firefly_event_queue_new(wrapped_event_add, 1, NULL);
+	memset(expected, 3, sizeof(expected));
+	id = firefly_event_offer_copy(q, NULL, FIREFLY_PRIORITY_LOW, copy_event,
+			ctx, sizeof(ctx), 0, NULL);
+	CU_ASSERT_TRUE(id > 0);
+	memset(ctx, 4, sizeof(ctx));
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_EQUAL(ev->execute, copy_event);
+	firefly_event_execute(ev);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(memcmp(copied, expected, sizeof(copied)), 0);
+	firefly_event_queue_free(&q);
+}
+
+void test_timer_due()
+{
+	int a = 1;
+	int b = 2;
+	int c = 3;
+	int64_t dep;
+	struct firefly_event *ev;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 2, NULL);
+
+	CU_ASSERT_EQUAL(firefly_event_queue_next_timer(q), -1);
+	CU_ASSERT_TRUE(firefly_event_add_after(q, NULL, FIREFLY_PRIORITY_LOW,
+				NULL, &a, 10) > 0);
+	CU_ASSERT_TRUE(firefly_event_add_at(q, NULL, FIREFLY_PRIORITY_HIGH,
+				NULL, &b, 5) > 0);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 0);
+	CU_ASSERT_EQUAL(firefly_event_queue_next_timer(q), 5);
+
+	firefly_event_queue_advance(q, 4);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 0);
+	CU_ASSERT_EQUAL(firefly_event_queue_now(q), 4);
+	firefly_event_queue_advance(q, 5);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 1);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(ev->context, &b);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(firefly_event_queue_next_timer(q), 10);
+
+	// Already due.
+	CU_ASSERT_TRUE(firefly_event_add_at(q, NULL, FIREFLY_PRIORITY_HIGH,
+				NULL, &c, 5) > 0);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 1);
+
+	firefly_event_queue_advance(q, 100);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 2);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(ev->context, &c);
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(ev->context, &a);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(firefly_event_queue_next_timer(q), -1);
+
+	// A dependency on an event that is not due is ignored.
+	dep = firefly_event_add_after(q, NULL, FIREFLY_PRIORITY_LOW, NULL, &a, 10);
+	expected_error = FIREFLY_ERROR_EVENT;
+	was_in_error = false;
+	CU_ASSERT_TRUE(q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, &b, 1,
+				&dep) > 0);
+	CU_ASSERT_TRUE(was_in_error);
+	was_in_error = false;
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(ev->context, &b);
+	CU_ASSERT_EQUAL(ev->nbr_pending, 0);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(firefly_event_queue_next_timer(q), 110);
+	firefly_event_queue_advance(q, 110);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(ev->context, &a);
+	firefly_event_return(q, &ev);
+
+	firefly_event_queue_free(&q);
+}
+
+void test_timer_levels()
+{
+	const int64_t delays[] = {1, 63, 64, 65, 100, 4095, 4096, 4097, 300000,
+		262144, 16777215, 16777216, 40000000};
+	const size_t nbr_delays = sizeof(delays) / sizeof(delays[0]);
+	size_t nbr_due = 0;
+	int64_t t;
+	struct firefly_event *ev;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+
+	firefly_event_queue_advance(q, 1000);
+	for (size_t i = 0; i < nbr_delays; i++)
+		CU_ASSERT_TRUE(firefly_event_add_after(q, NULL, FIREFLY_PRIORITY_LOW,
+					NULL, (void *) &delays[i], delays[i]) > 0);
+	// Following the next timer every event is due exactly on time.
+	for (int i = 0; i < 100000 && nbr_due < nbr_delays; i++) {
+		t = firefly_event_queue_next_timer(q);
+		CU_ASSERT_FATAL(t > 1000);
+		firefly_event_queue_advance(q, t);
+		while ((ev = firefly_event_pop(q)) != NULL) {
+			CU_ASSERT_EQUAL(1000 + *((int64_t *) ev->context), t);
+			firefly_event_return(q, &ev);
+			nbr_due++;
+		}
+	}
+	CU_ASSERT_EQUAL(nbr_due, nbr_delays);
+	CU_ASSERT_EQUAL(firefly_event_queue_next_timer(q), -1);
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_cancel()
+{
+	int64_t ids[3];
+	int64_t dep;
+	struct firefly_event *ev;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 2, NULL);
+
+	for (int i = 0; i < 3; i++)
+		ids[i] = firefly_event_offer_after(q, NULL, FIREFLY_PRIORITY_LOW,
+				NULL, &ids[i], 10 + i);
+	CU_ASSERT_EQUAL(firefly_event_offer_cancel(q, ids[1]), 0);
+	CU_ASSERT_EQUAL(firefly_event_offer_cancel(q, ids[1]), -1);
+	firefly_event_queue_advance(q, 100);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 2);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, ids[0]);
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, ids[2]);
+	firefly_event_return(q, &ev);
+
+	// Cancelling a queued event releases the events depending on it.
+	dep = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
+	ids[0] = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, NULL, 1, &dep);
+	CU_ASSERT_EQUAL(firefly_event_cancel(q, dep), 0);
+	CU_ASSERT_EQUAL(firefly_event_find(q, ids[0])->nbr_pending, 0);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, ids[0]);
+	firefly_event_return(q, &ev);
+
+	// Cancelling an event waiting for another leaves the other one queued.
+	dep = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
+	ids[0] = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, NULL, 1, &dep);
+	CU_ASSERT_EQUAL(firefly_event_cancel(q, ids[0]), 0);
+	CU_ASSERT_PTR_NULL(firefly_event_find(q, dep)->dependents);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL(ev->id, dep);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 0);
+
+	firefly_event_queue_free(&q);
+}
+
+static int count_event(void *event_arg)
+{
+	(*(int *) event_arg)++;
+	return 0;
+}
+
+void test_run_pending()
+{
+	int count = 0;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+
+	for (int i = 0; i < 3; i++)
+		q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, count_event, &count, 0,
+				NULL);
+	CU_ASSERT_EQUAL(firefly_event_queue_run_pending(q, 2), 2);
+	CU_ASSERT_EQUAL(count, 2);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 1);
+	CU_ASSERT_EQUAL(firefly_event_queue_run_pending(q, 2), 1);
+	CU_ASSERT_EQUAL(count, 3);
+	CU_ASSERT_EQUAL(firefly_event_queue_run_pending(q, 2), 0);
+	firefly_event_queue_free(&q);
+
+	// A queue with an offer function of its own may be executed elsewhere.
+	q = firefly_event_queue_new(wrapped_event_add, 1, NULL);
+	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, count_event, &count, 0, NULL);
+	CU_ASSERT_EQUAL(firefly_event_queue_run_pending(q, 2), 0);
+	CU_ASSERT_EQUAL(count, 3);
+	firefly_event_queue_free(&q);
+}
+
 // TODO test errors when using event pool
 int main()
 {
@@ -531,6 +976,9 @@ int main()
 		(CU_add_test(event_suite, "test_length",
 					 test_length) == NULL)
 		||
+		(CU_add_test(event_suite, "test_length_pop_all_prios",
+					 test_length_pop_all_prios) == NULL)
+		||
 		(CU_add_test(event_suite, "test_complex_priorities",
 					 test_complex_priorities) == NULL)
 		||
@@ -548,6 +996,36 @@ int main()
 		||
 		(CU_add_test(event_suite, "test_event_dependencies_done",
 					 test_event_dependencies_done) == NULL)
+		||
+		(CU_add_test(event_suite, "test_dependency_inside_bucket",
+					 test_dependency_inside_bucket) == NULL)
+		||
+		(CU_add_test(event_suite, "test_dependency_released",
+					 test_dependency_released) == NULL)
+		||
+		(CU_add_test(event_suite, "test_event_find_index_resize",
+					 test_event_find_index_resize) == NULL)
+		||
+		(CU_add_test(event_suite, "test_add_batch",
+					 test_add_batch) == NULL)
+		||
+		(CU_add_test(event_suite, "test_many_dependencies",
+					 test_many_dependencies) == NULL)
+		||
+		(CU_add_test(event_suite, "test_offer_copy",
+					 test_offer_copy) == NULL)
+		||
+		(CU_add_test(event_suite, "test_timer_due",
+					 test_timer_due) == NULL)
+		||
+		(CU_add_test(event_suite, "test_timer_levels",
+					 test_timer_levels) == NULL)
+		||
+		(CU_add_test(event_suite, "test_event_cancel",
+					 test_event_cancel) == NULL)
+		||
+		(CU_add_test(event_suite, "test_run_pending",
+					 test_run_pending) == NULL)
 	   ) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -0,0 +1,682 @@
+/**
+ * @file
+ * @brief Test the posix event queue executors.
+ */
+#define _POSIX_C_SOURCE (200112L)
+#include <pthread.h>
+
+#include "CUnit/Basic.h"
+#include "CUnit/Console.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+
+#include <utils/firefly_event_queue.h>
+#include <utils/firefly_event_queue_posix.h>
+
+#define NBR_STRANDS (4)
+#define NBR_EVENTS_PER_STRAND (200)
+#define NBR_WORKERS (4)
+
+struct strand_state {
+	pthread_mutex_t lock;
+	int in_flight;
+	int next_seq;
+	bool error;
+};
+
+struct strand_event {
+	struct strand_state *state;
+	int seq;
+};
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static int global_in_flight;
+static int nbr_executed;
+static bool exclusive_error;
+
+int init_suite_event_posix()
+{
+	return 0;
+}
+
+int clean_suite_event_posix()
+{
+	return 0;
+}
+
+static void busy_work()
+{
+	volatile int x = 0;
+	for (int i = 0; i < 2000; i++)
+		x += i;
+}
+
+static int strand_event(void *event_arg)
+{
+	struct strand_event *arg = event_arg;
+	struct strand_state *s = arg->state;
+
+	pthread_mutex_lock(&global_lock);
+	global_in_flight++;
+	pthread_mutex_unlock(&global_lock);
+
+	pthread_mutex_lock(&s->lock);
+	s->in_flight++;
+	if (s->in_flight != 1 || s->next_seq != arg->seq)
+		s->error = true;
+	s->next_seq++;
+	pthread_mutex_unlock(&s->lock);
+
+	busy_work();
+
+	pthread_mutex_lock(&s->lock);
+	s->in_flight--;
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_mutex_lock(&global_lock);
+	global_in_flight--;
+	nbr_executed++;
+	pthread_mutex_unlock(&global_lock);
+	return 0;
+}
+
+static int exclusive_event(void *event_arg)
+{
+	(void) event_arg;
+
+	pthread_mutex_lock(&global_lock);
+	if (global_in_flight != 0)
+		exclusive_error = true;
+	global_in_flight++;
+	pthread_mutex_unlock(&global_lock);
+
+	busy_work();
+
+	pthread_mutex_lock(&global_lock);
+	global_in_flight--;
+	nbr_executed++;
+	pthread_mutex_unlock(&global_lock);
+	return 0;
+}
+
+static int dependency_event(void *event_arg);
+
+static int64_t eq_offer(struct firefly_event_queue *eq, unsigned char prio,
+		int *arg, unsigned int nbr_deps, const int64_t *deps)
+{
+	return firefly_event_offer_strand(eq, NULL, prio, dependency_event, arg,
+			nbr_deps, deps);
+}
+
+static void reset_counters()
+{
+	global_in_flight = 0;
+	nbr_executed = 0;
+	exclusive_error = false;
+}
+
+void test_posix_single_thread()
+{
+	struct firefly_event_queue *eq = firefly_event_queue_posix_new(4);
+	reset_counters();
+
+	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_posix_run(eq, NULL), 0);
+	for (int i = 0; i < 50; i++) {
+		CU_ASSERT_TRUE(firefly_event_offer_strand(eq, NULL,
+					FIREFLY_PRIORITY_MEDIUM, exclusive_event, NULL, 0, NULL) > 0);
+	}
+	firefly_event_queue_posix_free(&eq);
+
+	CU_ASSERT_EQUAL(nbr_executed, 50);
+	CU_ASSERT_FALSE(exclusive_error);
+}
+
+void test_posix_workers_strands()
+{
+	struct strand_state states[NBR_STRANDS];
+	static struct strand_event args[NBR_STRANDS][NBR_EVENTS_PER_STRAND];
+	struct firefly_event_queue *eq = firefly_event_queue_posix_new(16);
+	reset_counters();
+
+	for (int s = 0; s < NBR_STRANDS; s++) {
+		pthread_mutex_init(&states[s].lock, NULL);
+		states[s].in_flight = 0;
+		states[s].next_seq = 0;
+		states[s].error = false;
+	}
+
+	CU_ASSERT_EQUAL_FATAL(
+			firefly_event_queue_posix_run_workers(eq, NULL, NBR_WORKERS), 0);
+	for (int i = 0; i < NBR_EVENTS_PER_STRAND; i++) {
+		for (int s = 0; s < NBR_STRANDS; s++) {
+			args[s][i].state = &states[s];
+			args[s][i].seq = i;
+			firefly_event_offer_strand(eq, &states[s],
+					FIREFLY_PRIORITY_MEDIUM, strand_event, &args[s][i], 0,
+					NULL);
+		}
+		if (i % 50 == 0) {
+			firefly_event_offer_strand(eq, NULL, FIREFLY_PRIORITY_HIGH,
+					exclusive_event, NULL, 0, NULL);
+		}
+	}
+	firefly_event_queue_posix_free(&eq);
+
+	CU_ASSERT_EQUAL(nbr_executed, NBR_STRANDS*NBR_EVENTS_PER_STRAND +
+			NBR_EVENTS_PER_STRAND/50);
+	CU_ASSERT_FALSE(exclusive_error);
+	for (int s = 0; s < NBR_STRANDS; s++) {
+		CU_ASSERT_FALSE(states[s].error);
+		CU_ASSERT_EQUAL(states[s].next_seq, NBR_EVENTS_PER_STRAND);
+		pthread_mutex_destroy(&states[s].lock);
+	}
+}
+
+struct producer_args {
+	struct firefly_event_queue *eq;
+	struct strand_state *state;
+	struct strand_event *events;
+	int nbr_events;
+};
+
+static void *producer_main(void *arg)
+{
+	struct producer_args *pa = arg;
+
+	for (int i = 0; i < pa->nbr_events; i++) {
+		pa->events[i].state = pa->state;
+		pa->events[i].seq = i;
+		firefly_event_offer_strand(pa->eq, pa->state, FIREFLY_PRIORITY_MEDIUM,
+				strand_event, &pa->events[i], 0, NULL);
+	}
+	return NULL;
+}
+
+static void run_lockfree_producers(size_t nbr_workers)
+{
+	pthread_t producers[NBR_STRANDS];
+	struct producer_args pargs[NBR_STRANDS];
+	struct strand_state states[NBR_STRANDS];
+	static struct strand_event args[NBR_STRANDS][NBR_EVENTS_PER_STRAND];
+	struct firefly_event_queue *eq = firefly_event_queue_posix_lockfree_new(4);
+	reset_counters();
+
+	if (nbr_workers > 0) {
+		CU_ASSERT_EQUAL_FATAL(
+			firefly_event_queue_posix_run_workers(eq, NULL, nbr_workers), 0);
+	} else {
+		CU_ASSERT_EQUAL_FATAL(firefly_event_queue_posix_run(eq, NULL), 0);
+	}
+	for (int s = 0; s < NBR_STRANDS; s++) {
+		pthread_mutex_init(&states[s].lock, NULL);
+		states[s].in_flight = 0;
+		states[s].next_seq = 0;
+		states[s].error = false;
+		pargs[s].eq = eq;
+		pargs[s].state = &states[s];
+		pargs[s].events = args[s];
+		pargs[s].nbr_events = NBR_EVENTS_PER_STRAND;
+		pthread_create(&producers[s], NULL, producer_main, &pargs[s]);
+	}
+	for (int s = 0; s < NBR_STRANDS; s++)
+		pthread_join(producers[s], NULL);
+	firefly_event_queue_posix_free(&eq);
+
+	CU_ASSERT_EQUAL(nbr_executed, NBR_STRANDS*NBR_EVENTS_PER_STRAND);
+	for (int s = 0; s < NBR_STRANDS; s++) {
+		CU_ASSERT_FALSE(states[s].error);
+		CU_ASSERT_EQUAL(states[s].next_seq, NBR_EVENTS_PER_STRAND);
+		pthread_mutex_destroy(&states[s].lock);
+	}
+}
+
+void test_posix_lockfree_single_thread()
+{
+	run_lockfree_producers(0);
+}
+
+void test_posix_lockfree_workers()
+{
+	run_lockfree_producers(NBR_WORKERS);
+}
+
+static int64_t dep_ids[3];
+static int dep_order[3];
+static int dep_count;
+
+static int dependency_event(void *event_arg)
+{
+	dep_order[dep_count++] = *((int *) event_arg);
+	return 0;
+}
+
+void test_posix_lockfree_dependencies()
+{
+	int a = 0, b = 1, c = 2;
+	struct firefly_event_queue *eq = firefly_event_queue_posix_lockfree_new(4);
+	dep_count = 0;
+
+	dep_ids[0] = eq_offer(eq, FIREFLY_PRIORITY_LOW, &a, 0, NULL);
+	dep_ids[1] = eq_offer(eq, FIREFLY_PRIORITY_MEDIUM, &b, 1, &dep_ids[0]);
+	dep_ids[2] = eq_offer(eq, FIREFLY_PRIORITY_HIGH, &c, 1, &dep_ids[1]);
+	CU_ASSERT_TRUE(dep_ids[0] > 0 && dep_ids[1] > dep_ids[0] &&
+			dep_ids[2] > dep_ids[1]);
+	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_posix_run(eq, NULL), 0);
+	firefly_event_queue_posix_free(&eq);
+
+	CU_ASSERT_EQUAL(dep_count, 3);
+	CU_ASSERT_EQUAL(dep_order[0], 0);
+	CU_ASSERT_EQUAL(dep_order[1], 1);
+	CU_ASSERT_EQUAL(dep_order[2], 2);
+}
+
+#define BATCH_EVENTS (100)
+
+static int batch_order[BATCH_EVENTS];
+static int batch_count;
+
+static int batch_event(void *event_arg)
+{
+	batch_order[batch_count++] = *((int *) event_arg);
+	return 0;
+}
+
+static void run_batch(struct firefly_event_queue *eq)
+{
+	int ctx[BATCH_EVENTS];
+	struct firefly_event_batch_entry entries[BATCH_EVENTS];
+
+	batch_count = 0;
+	for (int i = 0; i < BATCH_EVENTS; i++) {
+		ctx[i] = i;
+		entries[i].strand = NULL;
+		entries[i].prio = i < BATCH_EVENTS/2 ?
+			FIREFLY_PRIORITY_LOW : FIREFLY_PRIORITY_HIGH;
+		entries[i].execute = batch_event;
+		entries[i].context = &ctx[i];
+		entries[i].context_size = sizeof(ctx[i]);
+		entries[i].nbr_depends = 0;
+		entries[i].depends = NULL;
+	}
+	CU_ASSERT_EQUAL(firefly_event_add_batch(eq, entries, BATCH_EVENTS),
+			BATCH_EVENTS);
+	for (int i = 1; i < BATCH_EVENTS; i++)
+		CU_ASSERT_TRUE(entries[i].id > entries[i - 1].id);
+	CU_ASSERT_EQUAL(firefly_event_queue_posix_set_batch_size(eq, 0), -1);
+	CU_ASSERT_EQUAL(firefly_event_queue_posix_set_batch_size(eq,
+				FIREFLY_EVENT_QUEUE_POSIX_MAX_BATCH + 1), -1);
+	CU_ASSERT_EQUAL(firefly_event_queue_posix_set_batch_size(eq, 16), 0);
+	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_posix_run(eq, NULL), 0);
+	firefly_event_queue_posix_free(&eq);
+
+	// All events were queued before the loop started, priority order holds.
+	CU_ASSERT_EQUAL(batch_count, BATCH_EVENTS);
+	for (int i = 0; i < BATCH_EVENTS/2; i++) {
+		CU_ASSERT_EQUAL(batch_order[i], BATCH_EVENTS/2 + i);
+		CU_ASSERT_EQUAL(batch_order[BATCH_EVENTS/2 + i], i);
+	}
+}
+
+void test_posix_batch()
+{
+	run_batch(firefly_event_queue_posix_new(8));
+}
+
+void test_posix_lockfree_batch()
+{
+	run_batch(firefly_event_queue_posix_lockfree_new(8));
+}
+
+static pthread_cond_t timed_signal = PTHREAD_COND_INITIALIZER;
+static int timed_fired;
+static int64_t timed_at;
+
+static int64_t monotonic_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int timed_event(void *event_arg)
+{
+	pthread_mutex_lock(&global_lock);
+	timed_fired += *((int *) event_arg);
+	timed_at = monotonic_ms();
+	pthread_cond_broadcast(&timed_signal);
+	pthread_mutex_unlock(&global_lock);
+	return 0;
+}
+
+static void run_timed(struct firefly_event_queue *eq)
+{
+	int fired = 1;
+	int cancelled = 100;
+	int64_t start;
+	int64_t id;
+	struct timespec timeout;
+
+	timed_fired = 0;
+	start = monotonic_ms();
+	id = firefly_event_offer_after(eq, NULL, FIREFLY_PRIORITY_MEDIUM,
+			timed_event, &cancelled, 10000);
+	CU_ASSERT_TRUE(id > 0);
+	CU_ASSERT_TRUE(firefly_event_offer_after(eq, NULL,
+				FIREFLY_PRIORITY_MEDIUM, timed_event, &fired, 20) > 0);
+	CU_ASSERT_EQUAL(firefly_event_offer_cancel(eq, id), 0);
+	CU_ASSERT_NOT_EQUAL(firefly_event_offer_cancel(eq, id), 0);
+
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_sec += 5;
+	pthread_mutex_lock(&global_lock);
+	while (timed_fired == 0 &&
+			pthread_cond_timedwait(&timed_signal, &global_lock, &timeout) == 0)
+		;
+	pthread_mutex_unlock(&global_lock);
+	firefly_event_queue_posix_free(&eq);
+
+	CU_ASSERT_EQUAL(timed_fired, 1);
+	CU_ASSERT_TRUE(timed_at - start >= 20);
+}
+
+void test_posix_timed()
+{
+	struct firefly_event_queue *eq = firefly_event_queue_posix_new(4);
+
+	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_posix_run(eq, NULL), 0);
+	run_timed(eq);
+}
+
+void test_posix_lockfree_timed_workers()
+{
+	struct firefly_event_queue *eq = firefly_event_queue_posix_lockfree_new(4);
+
+	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_posix_run_workers(eq, NULL,
+				NBR_WORKERS), 0);
+	run_timed(eq);
+}
+
+static bool blocker_started;
+static bool blocker_release;
+static bool blocker_finished;
+static pthread_t inline_thread;
+static int nbr_inline;
+
+static int blocking_event(void *event_arg)
+{
+	pthread_mutex_lock(&global_lock);
+	blocker_started = true;
+	pthread_cond_broadcast(&timed_signal);
+	while (!blocker_release)
+		pthread_cond_wait(&timed_signal, &global_lock);
+	blocker_finished = true;
+	pthread_mutex_unlock(&global_lock);
+	return 0;
+}
+
+static int inline_event(void *event_arg)
+{
+	inline_thread = pthread_self();
+	nbr_inline++;
+	return 0;
+}
+
+static void run_inline(struct firefly_event_queue *eq, bool workers)
+{
+	int strand_a;
+	int strand_b;
+	int res = -1;
+	int64_t start;
+
+	blocker_started = false;
+	blocker_release = false;
+	nbr_inline = 0;
+	CU_ASSERT_TRUE(firefly_event_offer_strand(eq, &strand_a,
+				FIREFLY_PRIORITY_MEDIUM, blocking_event, NULL, 0, NULL) > 0);
+	pthread_mutex_lock(&global_lock);
+	while (!blocker_started)
+		pthread_cond_wait(&timed_signal, &global_lock);
+	pthread_mutex_unlock(&global_lock);
+
+	// The strand of the executing event, or any strand for the event loop.
+	CU_ASSERT_NOT_EQUAL(firefly_event_run_inline(eq, &strand_a, inline_event,
+				NULL), 0);
+	CU_ASSERT_NOT_EQUAL(firefly_event_run_inline(eq, NULL, inline_event,
+				NULL), 0);
+	res = firefly_event_run_inline(eq, &strand_b, inline_event, NULL);
+	if (workers) {
+		CU_ASSERT_EQUAL(res, 0);
+		CU_ASSERT_EQUAL(nbr_inline, 1);
+		CU_ASSERT_TRUE(pthread_equal(inline_thread, pthread_self()));
+	} else {
+		CU_ASSERT_NOT_EQUAL(res, 0);
+		CU_ASSERT_EQUAL(nbr_inline, 0);
+	}
+
+	pthread_mutex_lock(&global_lock);
+	blocker_release = true;
+	pthread_cond_broadcast(&timed_signal);
+	pthread_mutex_unlock(&global_lock);
+	// Once the queue is idle again an event without strand may run inline.
+	nbr_inline = 0;
+	start = monotonic_ms();
+	while (firefly_event_run_inline(eq, NULL, inline_event, NULL) != 0 &&
+			monotonic_ms() - start < 5000)
+		busy_work();
+	CU_ASSERT_EQUAL(nbr_inline, 1);
+	CU_ASSERT_TRUE(pthread_equal(inline_thread, pthread_self()));
+	firefly_event_queue_posix_free(&eq);
+}
+
+void test_posix_run_inline()
+{
+	struct firefly_event_queue *eq = firefly_event_queue_posix_new(4);
+
+	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_posix_run(eq, NULL), 0);
+	run_inline(eq, false);
+}
+
+void test_posix_lockfree_run_inline_workers()
+{
+	struct firefly_event_queue *eq = firefly_event_queue_posix_lockfree_new(4);
+
+	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_posix_run_workers(eq, NULL,
+				NBR_WORKERS), 0);
+	run_inline(eq, true);
+}
+
+static int nbr_after_blocker;
+static bool after_blocker_early;
+
+static int after_blocker_event(void *event_arg)
+{
+	bool *depends = event_arg;
+
+	pthread_mutex_lock(&global_lock);
+	if (*depends && !blocker_finished)
+		after_blocker_early = true;
+	nbr_after_blocker++;
+	pthread_cond_broadcast(&timed_signal);
+	pthread_mutex_unlock(&global_lock);
+	return 0;
+}
+
+void test_posix_workers_dependencies()
+{
+	int strand_a;
+	int strand_b;
+	int strand_c;
+	int64_t blocker_id;
+	bool depends = true;
+	bool independent = false;
+	struct firefly_event_queue *eq = firefly_event_queue_posix_new(4);
+
+	blocker_started = false;
+	blocker_release = false;
+	blocker_finished = false;
+	nbr_after_blocker = 0;
+	after_blocker_early = false;
+	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_posix_run_workers(eq, NULL,
+				NBR_WORKERS), 0);
+	blocker_id = firefly_event_offer_strand(eq, &strand_a,
+			FIREFLY_PRIORITY_MEDIUM, blocking_event, NULL, 0, NULL);
+	CU_ASSERT_TRUE_FATAL(blocker_id > 0);
+	pthread_mutex_lock(&global_lock);
+	while (!blocker_started)
+		pthread_cond_wait(&timed_signal, &global_lock);
+	pthread_mutex_unlock(&global_lock);
+
+	// The dependent waits for the executing event, other strands do not.
+	CU_ASSERT_TRUE(firefly_event_offer_strand(eq, &strand_b,
+				FIREFLY_PRIORITY_HIGH, after_blocker_event, &depends, 1,
+				&blocker_id) > 0);
+	CU_ASSERT_TRUE(firefly_event_offer_strand(eq, &strand_c,
+				FIREFLY_PRIORITY_MEDIUM, after_blocker_event, &independent,
+				0, NULL) > 0);
+	pthread_mutex_lock(&global_lock);
+	while (nbr_after_blocker < 1)
+		pthread_cond_wait(&timed_signal, &global_lock);
+	CU_ASSERT_EQUAL(nbr_after_blocker, 1);
+	blocker_release = true;
+	pthread_cond_broadcast(&timed_signal);
+	pthread_mutex_unlock(&global_lock);
+	firefly_event_queue_posix_free(&eq);
+
+	CU_ASSERT_EQUAL(nbr_after_blocker, 2);
+	CU_ASSERT_FALSE(after_blocker_early);
+}
+
+static bool fd_readable(int fd, int timeout)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN
+	};
+
+	return poll(&pfd, 1, timeout) == 1;
+}
+
+void test_posix_fd_run_pending()
+{
+	struct firefly_event_queue *eq = firefly_event_queue_posix_fd_new(4);
+	int fd;
+	int timeout;
+
+	reset_counters();
+	CU_ASSERT_PTR_NOT_NULL_FATAL(eq);
+	fd = firefly_event_queue_posix_get_fd(eq);
+	CU_ASSERT_TRUE_FATAL(fd >= 0);
+	CU_ASSERT_FALSE(fd_readable(fd, 0));
+	CU_ASSERT_EQUAL(firefly_event_queue_posix_get_timeout(eq), -1);
+
+	for (int i = 0; i < 5; i++) {
+		CU_ASSERT_TRUE(firefly_event_offer_strand(eq, NULL,
+					FIREFLY_PRIORITY_MEDIUM, exclusive_event, NULL, 0, NULL) > 0);
+	}
+	CU_ASSERT_TRUE(fd_readable(fd, 0));
+	CU_ASSERT_EQUAL(firefly_event_queue_posix_get_timeout(eq), 0);
+	CU_ASSERT_EQUAL(firefly_event_queue_run_pending(eq, 2), 2);
+	CU_ASSERT_EQUAL(nbr_executed, 2);
+	// Events are left so the descriptor is still readable.
+	CU_ASSERT_TRUE(fd_readable(fd, 0));
+	CU_ASSERT_EQUAL(firefly_event_queue_run_pending(eq, 10), 3);
+	CU_ASSERT_EQUAL(nbr_executed, 5);
+	CU_ASSERT_FALSE(fd_readable(fd, 0));
+	CU_ASSERT_EQUAL(firefly_event_queue_run_pending(eq, 10), 0);
+
+	// A timed event is run once the timeout has passed.
+	CU_ASSERT_TRUE(firefly_event_offer_after(eq, NULL,
+				FIREFLY_PRIORITY_MEDIUM, exclusive_event, NULL, 20) > 0);
+	timeout = firefly_event_queue_posix_get_timeout(eq);
+	CU_ASSERT_TRUE(timeout > 0 && timeout <= 20);
+	CU_ASSERT_EQUAL(firefly_event_queue_run_pending(eq, 10), 0);
+	while ((timeout = firefly_event_queue_posix_get_timeout(eq)) > 0)
+		fd_readable(fd, timeout);
+	CU_ASSERT_EQUAL(timeout, 0);
+	CU_ASSERT_EQUAL(firefly_event_queue_run_pending(eq, 10), 1);
+	CU_ASSERT_EQUAL(nbr_executed, 6);
+	CU_ASSERT_FALSE(exclusive_error);
+
+	firefly_event_queue_posix_free(&eq);
+}
+
+int main()
+{
+	CU_pSuite event_posix_suite = NULL;
+
+	// Initialize CUnit test registry.
+	if (CUE_SUCCESS != CU_initialize_registry()) {
+		return CU_get_error();
+	}
+
+	event_posix_suite = CU_add_suite("event_queue_posix",
+			init_suite_event_posix, clean_suite_event_posix);
+	if (event_posix_suite == NULL) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if (
+		(CU_add_test(event_posix_suite, "test_posix_single_thread",
+				test_posix_single_thread) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_workers_strands",
+				test_posix_workers_strands) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_lockfree_single_thread",
+				test_posix_lockfree_single_thread) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_lockfree_workers",
+				test_posix_lockfree_workers) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_lockfree_dependencies",
+				test_posix_lockfree_dependencies) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_batch",
+				test_posix_batch) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_lockfree_batch",
+				test_posix_lockfree_batch) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_timed",
+				test_posix_timed) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_lockfree_timed_workers",
+				test_posix_lockfree_timed_workers) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_run_inline",
+				test_posix_run_inline) == NULL)
+		||
+		(CU_add_test(event_posix_suite,
+				"test_posix_lockfree_run_inline_workers",
+				test_posix_lockfree_run_inline_workers) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_workers_dependencies",
+				test_posix_workers_dependencies) == NULL)
+		||
+		(CU_add_test(event_posix_suite, "test_posix_fd_run_pending",
+				test_posix_fd_run_pending) == NULL)
+	   ) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	// Set verbosity.
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	/*CU_console_run_tests();*/
+
+	// Run all test suites.
+	CU_basic_run_tests();
+	int res = CU_get_number_of_tests_failed();
+	// Clean up.
+	CU_cleanup_registry();
+
+	if (res != 0) {
+		return 1;
+	}
+	return CU_get_error();
+}
@@ -149,6 +149,7 @@ void test_chan_open()
 	chan_resp.source_chan_id = REMOTE_CHAN_ID;
 	chan_resp.dest_chan_id = conn->chan_list->chan->local_id;
 	chan_resp.ack = true;
+	chan_resp.fec_group = 0;
 	labcomm_encode_firefly_protocol_channel_response(test_enc, &chan_resp);
 	int res = labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -203,6 +204,7 @@ void test_chan_recv_accept()
 	chan_req.source_chan_id = REMOTE_CHAN_ID;
 	chan_req.dest_chan_id = CHANNEL_ID_NOT_SET;
 	chan_req.auto_restrict = false;
+	chan_req.fec_group = 0;
 	// Give channel request data to protocol layer.
 	labcomm_encode_firefly_protocol_channel_request(test_enc, &chan_req);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
@@ -270,6 +272,7 @@ void test_chan_recv_reject()
 	chan_req.dest_chan_id = CHANNEL_ID_NOT_SET;
 	chan_req.source_chan_id = REMOTE_CHAN_ID;
 	chan_req.auto_restrict = false;
+	chan_req.fec_group = 0;
 	labcomm_encode_firefly_protocol_channel_request(test_enc, &chan_req);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -329,6 +332,7 @@ void test_chan_open_rejected()
 	chan_res.dest_chan_id = conn->chan_list->chan->local_id;
 	chan_res.source_chan_id = CHANNEL_ID_NOT_SET;
 	chan_res.ack = false;
+	chan_res.fec_group = 0;
 
 	labcomm_encode_firefly_protocol_channel_response(test_enc, &chan_res);
 	// send response
@@ -646,6 +650,8 @@ void test_recv_app_data()
 	proto_sign_pkt.seqno = 1;
 	proto_sign_pkt.app_enc_data.a = buf;
 	proto_sign_pkt.app_enc_data.n_0 = buf_size;
+	proto_sign_pkt.fec_seqno = 0;
+	proto_sign_pkt.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
 
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_sign_pkt);
 	free(buf);
@@ -669,6 +675,8 @@ void test_recv_app_data()
 	proto_data_pkt.seqno = 2;
 	proto_data_pkt.app_enc_data.a = buf;
 	proto_data_pkt.app_enc_data.n_0 = buf_size;
+	proto_data_pkt.fec_seqno = 0;
+	proto_data_pkt.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
 
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_data_pkt);
 	free(buf);
@@ -692,6 +700,132 @@ void test_recv_app_data()
 	mock_test_event_queue_reset(eq);
 }
 
+#define BORROWED_SAMPLE_SIZE (200)
+
+static struct firefly_buffer *borrowed_buf;
+static unsigned int borrowed_refs;
+static int nbr_borrowed_samples;
+
+static void handle_borrowed_var_bytes(test_test_var_bytes *v, void *context)
+{
+	UNUSED_VAR(context);
+	CU_ASSERT_EQUAL(v->n_0, BORROWED_SAMPLE_SIZE);
+	for (int i = 0; i < v->n_0; i++) {
+		if (v->a[i] != (unsigned char) i) {
+			CU_FAIL("Borrowed sample differs.");
+			break;
+		}
+	}
+	// The event still holds its reference to the received buffer.
+	borrowed_refs = borrowed_buf->refs;
+	nbr_borrowed_samples++;
+}
+
+void test_recv_app_data_borrowed()
+{
+	unsigned char *buf;
+	size_t buf_size;
+	struct firefly_event *ev;
+
+	struct labcomm_encoder *data_encoder;
+	struct labcomm_writer *w;
+	w = labcomm_static_buffer_writer_new(labcomm_default_memory);
+	data_encoder = labcomm_encoder_new(w, NULL, labcomm_default_memory,
+			NULL);
+
+	// Setup connection
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn =
+		setup_test_conn_new(&ca, eq);
+	struct firefly_channel *ch = firefly_channel_new(conn);
+	if (ch == NULL)
+		CU_FAIL("Could not create channel");
+	ch->remote_id = REMOTE_CHAN_ID;
+	add_channel_to_connection(ch, conn);
+
+	struct labcomm_decoder *ch_dec = firefly_protocol_get_input_stream(ch);
+	labcomm_decoder_register_test_test_var_bytes(ch_dec,
+			handle_borrowed_var_bytes, NULL);
+
+	// create protocol sample with app signature
+	labcomm_encoder_register_test_test_var_bytes(data_encoder);
+	labcomm_encoder_ioctl(data_encoder, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	firefly_protocol_data_sample proto_sign_pkt;
+	proto_sign_pkt.src_chan_id = REMOTE_CHAN_ID;
+	proto_sign_pkt.dest_chan_id = ch->local_id;
+	proto_sign_pkt.important = true;
+	proto_sign_pkt.seqno = 1;
+	proto_sign_pkt.app_enc_data.a = buf;
+	proto_sign_pkt.app_enc_data.n_0 = buf_size;
+	proto_sign_pkt.fec_seqno = 0;
+	proto_sign_pkt.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
+
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_sign_pkt);
+	free(buf);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	ev = firefly_event_pop(eq);
+	CU_ASSERT_PTR_NOT_NULL(ev);
+	firefly_event_execute(ev);
+	firefly_event_return(eq, &ev);
+
+	// create protocol sample with app data too large to copy to its event
+	test_test_var_bytes app_pkt;
+	app_pkt.n_0 = BORROWED_SAMPLE_SIZE;
+	app_pkt.a = malloc(app_pkt.n_0);
+	for (int i = 0; i < app_pkt.n_0; i++)
+		app_pkt.a[i] = i;
+	labcomm_encode_test_test_var_bytes(data_encoder, &app_pkt);
+	free(app_pkt.a);
+	labcomm_encoder_ioctl(data_encoder, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	firefly_protocol_data_sample proto_data_pkt;
+	proto_data_pkt.src_chan_id = REMOTE_CHAN_ID;
+	proto_data_pkt.dest_chan_id = ch->local_id;
+	proto_data_pkt.important = false;
+	proto_data_pkt.seqno = 0;
+	proto_data_pkt.app_enc_data.a = buf;
+	proto_data_pkt.app_enc_data.n_0 = buf_size;
+	proto_data_pkt.fec_seqno = 0;
+	proto_data_pkt.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
+
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_data_pkt);
+	free(buf);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+
+	// Keep a reference to the received buffer to follow the references
+	// taken by the protocol layer.
+	borrowed_buf = firefly_buffer_new(buf_size);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(borrowed_buf);
+	memcpy(borrowed_buf->data, buf, buf_size);
+	free(buf);
+	firefly_buffer_ref(borrowed_buf);
+	nbr_borrowed_samples = 0;
+	protocol_buffer_received(conn, borrowed_buf);
+	// The event references the data in the buffer instead of a copy.
+	CU_ASSERT_EQUAL(borrowed_buf->refs, 2);
+
+	ev = firefly_event_pop(eq);
+	CU_ASSERT_PTR_NOT_NULL(ev);
+	firefly_event_execute(ev);
+	firefly_event_return(eq, &ev);
+	CU_ASSERT_EQUAL(nbr_borrowed_samples, 1);
+	CU_ASSERT_EQUAL(borrowed_refs, 2);
+	// The reference is released once the sample is handled.
+	CU_ASSERT_EQUAL(borrowed_buf->refs, 1);
+	firefly_buffer_unref(borrowed_buf);
+	borrowed_buf = NULL;
+
+	// clean up
+	labcomm_encoder_free(data_encoder);
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
+
 static bool chan_restrict_called = false;
 static bool chan_restrict_accept = true;
 static bool test_chan_restrict(struct firefly_channel *chan)
@@ -1128,7 +1262,7 @@ void trans_w(struct data_space **space,
 			 size_t data_size,
 			 struct firefly_connection *conn,
 			 bool important,
-			 unsigned char *id)
+			 unsigned int *id)
 {
 	UNUSED_VAR(conn);
 	UNUSED_VAR(important);
@@ -1155,14 +1289,14 @@ void trans_w(struct data_space **space,
 
 void trans_w_from_conn_0(unsigned char *data, size_t data_size,
 					 struct firefly_connection *conn, bool important,
-					 unsigned char *id)
+					 unsigned int *id)
 {
 	trans_w(&space_from_conn[0], data, data_size, conn, important, id);
 }
 
 void trans_w_from_conn_1(unsigned char *data, size_t data_size,
 					 struct firefly_connection *conn, bool important,
-					 unsigned char *id)
+					 unsigned int *id)
 {
 	trans_w(&space_from_conn[1], data, data_size, conn, important, id);
 }
@@ -1212,7 +1346,7 @@ void handle_ttv(test_test_var *ttv, void *cont)
 	*((test_test_var *) cont) = *ttv;
 }
 
-void mock_ack(unsigned char id, struct firefly_connection *conn) {
+void mock_ack(unsigned int id, struct firefly_connection *conn) {
 	UNUSED_VAR(id);
 	UNUSED_VAR(conn);
 }
@@ -1880,18 +2014,620 @@ void test_chan_open_close_multiple()
 
 void test_nbr_chan()
 {
-	struct firefly_connection conn;
-	struct channel_list_node ln[2];
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn = setup_test_conn_new(&ca, eq);
+	struct firefly_channel *ch[2];
+
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 0);
+
+	ch[0] = firefly_channel_new(conn);
+	add_channel_to_connection(ch[0], conn);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 1);
+
+	ch[1] = firefly_channel_new(conn);
+	add_channel_to_connection(ch[1], conn);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 2);
+
+	firefly_channel_free(remove_channel_from_connection(ch[0], conn));
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 1);
+	firefly_channel_free(remove_channel_from_connection(ch[1], conn));
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 0);
+
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
+
+#define NBR_TABLE_CHANNELS (2000)
+
+void test_channel_table()
+{
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn = setup_test_conn_new(&ca, eq);
+	struct firefly_channel *ch[NBR_TABLE_CHANNELS];
+
+	for (int i = 0; i < NBR_TABLE_CHANNELS; i++) {
+		ch[i] = firefly_channel_new(conn);
+		CU_ASSERT_EQUAL_FATAL(ch[i]->local_id, i);
+		ch[i]->remote_id = NBR_TABLE_CHANNELS - i;
+		add_channel_to_connection(ch[i], conn);
+	}
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn),
+			NBR_TABLE_CHANNELS);
+	for (int i = 0; i < NBR_TABLE_CHANNELS; i++) {
+		CU_ASSERT_PTR_EQUAL(find_channel_by_local_id(conn, i), ch[i]);
+		CU_ASSERT_PTR_EQUAL(find_channel_by_remote_id(conn,
+					NBR_TABLE_CHANNELS - i), ch[i]);
+	}
+	CU_ASSERT_PTR_NULL(find_channel_by_local_id(conn, NBR_TABLE_CHANNELS));
+	CU_ASSERT_PTR_NULL(find_channel_by_local_id(conn, -1));
+	CU_ASSERT_PTR_NULL(find_channel_by_remote_id(conn, 0));
+
+	// A new remote id replaces the old one.
+	set_channel_remote_id(ch[7], -7);
+	CU_ASSERT_PTR_EQUAL(find_channel_by_remote_id(conn, -7), ch[7]);
+	CU_ASSERT_PTR_NULL(find_channel_by_remote_id(conn,
+				NBR_TABLE_CHANNELS - 7));
+
+	// Ids of removed channels are reused, oldest first, once quarantined.
+	firefly_channel_free(remove_channel_from_connection(ch[5], conn));
+	firefly_channel_free(remove_channel_from_connection(ch[3], conn));
+	CU_ASSERT_PTR_NULL(find_channel_by_local_id(conn, 5));
+	CU_ASSERT_PTR_NULL(find_channel_by_remote_id(conn,
+				NBR_TABLE_CHANNELS - 5));
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn),
+			NBR_TABLE_CHANNELS - 2);
+	struct firefly_channel *new_ch = firefly_channel_new(conn);
+	CU_ASSERT_EQUAL(new_ch->local_id, NBR_TABLE_CHANNELS);
+	firefly_channel_free(new_ch);
+	firefly_event_queue_advance(eq, firefly_event_queue_now(eq) +
+			FIREFLY_CHANNEL_ID_QUARANTINE);
+	ch[5] = firefly_channel_new(conn);
+	CU_ASSERT_EQUAL(ch[5]->local_id, 5);
+	ch[3] = firefly_channel_new(conn);
+	CU_ASSERT_EQUAL(ch[3]->local_id, 3);
+	add_channel_to_connection(ch[5], conn);
+	add_channel_to_connection(ch[3], conn);
+	new_ch = firefly_channel_new(conn);
+	CU_ASSERT_EQUAL(new_ch->local_id, NBR_TABLE_CHANNELS + 1);
+	firefly_channel_free(new_ch);
+
+	for (int i = 0; i < NBR_TABLE_CHANNELS; i++)
+		firefly_channel_free(remove_channel_from_connection(ch[i], conn));
+	CU_ASSERT_PTR_NULL(conn->chan_list);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 0);
+
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
+
+#define FRAGMENTED_SAMPLE_SIZE (10 * FIREFLY_FRAGMENT_SIZE + 100)
+
+static int nbr_loopback_writes = 0;
+static int nbr_loopback_acks = 0;
+static int nbr_bytes_received = 0;
+static unsigned int loopback_drop = 0; // Bit n - 1 drops the n:th write.
+
+static void transport_write_loopback(unsigned char *data, size_t size,
+		struct firefly_connection *conn, bool important, unsigned int *id)
+{
+	unsigned char *cpy_data = malloc(size);
+
+	CU_ASSERT_TRUE(size <= BUFFER_SIZE);
+	if (important)
+		*id = IMPORTANT_ID;
+	nbr_loopback_writes++;
+	if (nbr_loopback_writes <= 32 &&
+			(loopback_drop & (1u << (nbr_loopback_writes - 1)))) {
+		free(cpy_data);
+		return;
+	}
+	memcpy(cpy_data, data, size);
+	protocol_data_received(conn, cpy_data, size);
+}
+
+static void transport_ack_loopback(unsigned int id,
+		struct firefly_connection *conn)
+{
+	UNUSED_VAR(conn);
+	CU_ASSERT_EQUAL(id, IMPORTANT_ID);
+	nbr_loopback_acks++;
+}
+
+static struct firefly_transport_connection loopback_trsp_conn = {
+	.write = transport_write_loopback,
+	.write_buffer = NULL,
+	.ack = transport_ack_loopback,
+	.open = NULL,
+	.close = NULL,
+	.context = NULL
+};
+
+/*
+ * Open a channel on a connection over the loopback transport. The channel
+ * talks to itself, its test_var_bytes samples are handled by handler.
+ */
+static struct firefly_channel *loopback_channel_new(
+		struct firefly_connection *conn, struct firefly_event_queue *feq,
+		void (*handler)(test_test_var_bytes *v, void *context))
+{
+	struct firefly_channel *chan;
 
-	conn.chan_list = NULL;
-	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(&conn), 0);
+	chan = firefly_channel_new(conn);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(chan);
+	add_channel_to_connection(chan, conn);
+	set_channel_remote_id(chan, chan->local_id);
+	chan->types.decoder_types = NULL;
+	chan->types.encoder_types = NULL;
+	firefly_channel_internal_opened(chan);
+	labcomm_decoder_register_test_test_var_bytes(chan->proto_decoder,
+			handler, NULL);
+	labcomm_encoder_register_test_test_var_bytes(chan->proto_encoder);
+	event_execute_all_test(feq);
+	return chan;
+}
 
-	ln[0].next = NULL;
-	conn.chan_list = &ln[0];
-	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(&conn), 1);
+static void handle_test_var_bytes(test_test_var_bytes *v, void *context)
+{
+	UNUSED_VAR(context);
+	CU_ASSERT_EQUAL(v->n_0, FRAGMENTED_SAMPLE_SIZE);
+	for (int i = 0; i < v->n_0; i++) {
+		if (v->a[i] != (unsigned char) i) {
+			CU_FAIL("Reassembled sample differs.");
+			break;
+		}
+	}
+	nbr_bytes_received += v->n_0;
+}
+
+void test_fragmented_sample()
+{
+	struct firefly_event_queue *feq;
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn;
+	struct firefly_channel *chan;
+	test_test_var_bytes v;
+	int nbr_frags = FRAGMENTED_SAMPLE_SIZE / FIREFLY_FRAGMENT_SIZE + 1;
+
+	feq = firefly_event_queue_new(firefly_event_add, 10, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(feq);
+	ca.channel_opened = chan_opened_mock;
+	conn = firefly_connection_new(&ca, NULL, feq, &loopback_trsp_conn);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
+	chan = loopback_channel_new(conn, feq, handle_test_var_bytes);
+
+	v.n_0 = FRAGMENTED_SAMPLE_SIZE;
+	v.a = malloc(v.n_0);
+	for (int i = 0; i < v.n_0; i++)
+		v.a[i] = i;
+
+	// An unimportant sample is sent in one go.
+	nbr_loopback_writes = 0;
+	nbr_bytes_received = 0;
+	CU_ASSERT_EQUAL(labcomm_encode_test_test_var_bytes(chan->proto_encoder,
+				&v), 0);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_loopback_writes, nbr_frags);
+	CU_ASSERT_EQUAL(nbr_bytes_received, FRAGMENTED_SAMPLE_SIZE);
+	CU_ASSERT_PTR_NULL(chan->reassembly[0].data);
+	CU_ASSERT_EQUAL(conn->reassembly_bytes, 0);
+
+	// An important sample keeps at most a window of fragments in flight.
+	// Its data is no sample known to the decoder.
+	struct firefly_event_send_sample *fess = malloc(sizeof(*fess));
+	int remote_seqno = chan->remote_seqno;
+
+	fess->chan                  = chan;
+	fess->data.dest_chan_id     = chan->remote_id;
+	fess->data.src_chan_id      = chan->local_id;
+	fess->data.seqno            = 0;
+	fess->data.fec_seqno        = 0;
+	fess->data.priority         = FIREFLY_CHANNEL_PRIORITY_NORMAL;
+	fess->data.important        = true;
+	fess->data.app_enc_data.n_0 = FRAGMENTED_SAMPLE_SIZE;
+	fess->data.app_enc_data.a   = malloc(FRAGMENTED_SAMPLE_SIZE);
+	fess->important_id          = NULL;
+	fess->frame                 = NULL;
+	fess->offset                = 0;
+	fess->deadline              = 0;
+	memset(fess->data.app_enc_data.a, 0x7f, FRAGMENTED_SAMPLE_SIZE);
+	nbr_loopback_acks = 0;
+	nbr_bytes_received = 0;
+	send_data_sample_event(fess);
+	CU_ASSERT_EQUAL(nbr_loopback_acks, 0);
+	CU_ASSERT_EQUAL(chan->window_count, FIREFLY_IMPORTANT_WINDOW);
+	CU_ASSERT_PTR_NOT_NULL(chan->important_queue);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_loopback_acks, nbr_frags);
+	CU_ASSERT_EQUAL(chan->window_count, 0);
+	CU_ASSERT_EQUAL(chan->remote_seqno, remote_seqno + nbr_frags);
+	CU_ASSERT_EQUAL(nbr_bytes_received, 0);
+	CU_ASSERT_PTR_NULL(chan->reassembly[1].data);
+	CU_ASSERT_EQUAL(chan->important_id, 0);
+	CU_ASSERT_PTR_NULL(chan->important_queue);
+
+	// A fragment of a new sample discards the partially received one.
+	firefly_protocol_data_fragment frag;
+	frag.dest_chan_id = chan->local_id;
+	frag.src_chan_id  = chan->remote_id;
+	frag.seqno        = 0;
+	frag.important    = false;
+	frag.priority     = FIREFLY_CHANNEL_PRIORITY_NORMAL;
+	frag.sample_id    = 1000;
+	frag.total_size   = FRAGMENTED_SAMPLE_SIZE;
+	frag.offset       = 0;
+	frag.frag_data.n_0 = FIREFLY_FRAGMENT_SIZE;
+	frag.frag_data.a  = v.a;
+	CU_ASSERT_EQUAL(firefly_channel_reassemble(chan, &frag), 0);
+	CU_ASSERT_EQUAL(conn->reassembly_bytes, FRAGMENTED_SAMPLE_SIZE);
+	frag.sample_id++;
+	frag.offset       = FIREFLY_FRAGMENT_SIZE;
+	frag.frag_data.a  = v.a + FIREFLY_FRAGMENT_SIZE;
+	CU_ASSERT_EQUAL(firefly_channel_reassemble(chan, &frag), 0);
+	CU_ASSERT_EQUAL(chan->reassembly[0].sample_id, frag.sample_id);
+	CU_ASSERT_EQUAL(chan->reassembly[0].nbr_missing, (size_t) nbr_frags - 1);
+	CU_ASSERT_EQUAL(conn->reassembly_bytes, FRAGMENTED_SAMPLE_SIZE);
+
+	// Malformed fragments are dropped.
+	frag.offset = 1;
+	CU_ASSERT_TRUE(firefly_channel_reassemble(chan, &frag) < 0);
+	frag.offset = 0;
+	frag.frag_data.n_0 = FIREFLY_FRAGMENT_SIZE - 1;
+	CU_ASSERT_TRUE(firefly_channel_reassemble(chan, &frag) < 0);
+	frag.total_size = FIREFLY_SAMPLE_MAX_SIZE + 1;
+	frag.frag_data.n_0 = FIREFLY_FRAGMENT_SIZE;
+	CU_ASSERT_TRUE(firefly_channel_reassemble(chan, &frag) < 0);
+
+	firefly_reassembly_release(&chan->reassembly[0]);
+	CU_ASSERT_EQUAL(conn->reassembly_bytes, 0);
+
+	free(v.a);
+	firefly_channel_free(remove_channel_from_connection(chan, conn));
+	firefly_connection_free(&conn);
+	firefly_event_queue_free(&feq);
+}
 
-	ln[1].next = NULL;
-	conn.chan_list->next = &ln[1];
-	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(&conn), 2);
+static bool chan_recv_accept_fec(struct firefly_channel *chan)
+{
+	UNUSED_VAR(chan);
+	return true;
+}
+
+void test_chan_recv_fec()
+{
+	unsigned char *buf;
+	size_t buf_size;
+	struct firefly_connection_actions ca = {
+		.channel_opened = chan_opened_mock,
+		.channel_recv   = chan_recv_accept_fec
+	};
+	struct firefly_connection *conn =
+		setup_test_conn_new(&ca, eq);
+
+	// A larger group than supported is lowered in the response.
+	firefly_protocol_channel_request chan_req;
+	chan_req.source_chan_id = REMOTE_CHAN_ID;
+	chan_req.dest_chan_id = CHANNEL_ID_NOT_SET;
+	chan_req.auto_restrict = false;
+	chan_req.fec_group = FIREFLY_FEC_MAX_GROUP + 1;
+	labcomm_encode_firefly_protocol_channel_request(test_enc, &chan_req);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_all_test(eq);
+
+	CU_ASSERT_TRUE(received_channel_response);
+	received_channel_response = false;
+	CU_ASSERT_TRUE(channel_response.ack);
+	CU_ASSERT_EQUAL(channel_response.fec_group, FIREFLY_FEC_MAX_GROUP);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn->chan_list);
+	CU_ASSERT_EQUAL(conn->chan_list->chan->fec_group, FIREFLY_FEC_MAX_GROUP);
+	CU_ASSERT_PTR_NOT_NULL(conn->chan_list->chan->fec_rx.data);
+
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
 	mock_test_event_queue_reset(eq);
 }
+
+#define FEC_GROUP (3)
+
+static unsigned int fec_samples_received = 0;
+
+static void handle_fec_var_bytes(test_test_var_bytes *v, void *context)
+{
+	UNUSED_VAR(context);
+	CU_ASSERT_FATAL(v->n_0 > 10);
+	for (int i = 0; i < v->n_0; i++) {
+		if (v->a[i] != v->n_0 - 10) {
+			CU_FAIL("Recovered sample differs.");
+			break;
+		}
+	}
+	fec_samples_received |= 1u << (v->n_0 - 10);
+}
+
+static void send_fec_samples(struct firefly_channel *chan,
+		struct firefly_event_queue *feq, int first)
+{
+	test_test_var_bytes v;
+	unsigned char data[10 + 2 * FEC_GROUP];
+
+	for (int k = first; k < first + FEC_GROUP; k++) {
+		// Samples of different sizes, sample k has k + 10 bytes of value k.
+		v.n_0 = 10 + k;
+		v.a = data;
+		memset(data, k, v.n_0);
+		CU_ASSERT_EQUAL(labcomm_encode_test_test_var_bytes(
+					chan->proto_encoder, &v), 0);
+		event_execute_all_test(feq);
+	}
+}
+
+void test_fec_recover()
+{
+	struct firefly_event_queue *feq;
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn;
+	struct firefly_channel *chan;
+
+	feq = firefly_event_queue_new(firefly_event_add, 10, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(feq);
+	ca.channel_opened = chan_opened_mock;
+	conn = firefly_connection_new(&ca, NULL, feq, &loopback_trsp_conn);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
+	chan = loopback_channel_new(conn, feq, handle_fec_var_bytes);
+	CU_ASSERT_EQUAL(firefly_channel_set_fec(chan, FEC_GROUP), FEC_GROUP);
+
+	// The parity follows the last sample of each group.
+	nbr_loopback_writes = 0;
+	fec_samples_received = 0;
+	send_fec_samples(chan, feq, 1);
+	CU_ASSERT_EQUAL(nbr_loopback_writes, FEC_GROUP + 1);
+	CU_ASSERT_EQUAL(fec_samples_received, 0x7u << 1);
+
+	// A single lost sample is rebuilt from the parity.
+	nbr_loopback_writes = 0;
+	fec_samples_received = 0;
+	loopback_drop = 1u << 1;
+	send_fec_samples(chan, feq, 1 + FEC_GROUP);
+	CU_ASSERT_EQUAL(fec_samples_received, 0x7u << (1 + FEC_GROUP));
+	CU_ASSERT_EQUAL(chan->fec_recovered, 2 + FEC_GROUP);
+
+	// Two lost samples are not.
+	nbr_loopback_writes = 0;
+	fec_samples_received = 0;
+	loopback_drop = 0x3u;
+	send_fec_samples(chan, feq, 1);
+	CU_ASSERT_EQUAL(fec_samples_received, 1u << 3);
+
+	// The largest sample is rebuilt even if the XOR of the sizes is smaller,
+	// the case in one of the groups whatever the encoding adds to the sizes.
+	for (int first = 1; first <= 1 + FEC_GROUP; first += FEC_GROUP) {
+		nbr_loopback_writes = 0;
+		fec_samples_received = 0;
+		loopback_drop = 1u << (FEC_GROUP - 1);
+		send_fec_samples(chan, feq, first);
+		CU_ASSERT_EQUAL(fec_samples_received, 0x7u << first);
+	}
+
+	// A lost parity loses nothing else.
+	nbr_loopback_writes = 0;
+	fec_samples_received = 0;
+	loopback_drop = 1u << FEC_GROUP;
+	send_fec_samples(chan, feq, 1);
+	CU_ASSERT_EQUAL(fec_samples_received, 0x7u << 1);
+	loopback_drop = 0;
+
+	firefly_channel_free(remove_channel_from_connection(chan, conn));
+	firefly_connection_free(&conn);
+	firefly_event_queue_free(&feq);
+}
+
+static int priority_order[2];
+static int nbr_priority_received = 0;
+
+static void handle_priority_var_bytes(test_test_var_bytes *v, void *context)
+{
+	UNUSED_VAR(context);
+	if (nbr_priority_received < 2)
+		priority_order[nbr_priority_received] = v->n_0;
+	nbr_priority_received++;
+}
+
+void test_chan_priority()
+{
+	struct firefly_event_queue *feq;
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn;
+	struct firefly_channel *chan;
+	test_test_var_bytes v;
+	unsigned char data[2] = {0, 0};
+
+	feq = firefly_event_queue_new(firefly_event_add, 10, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(feq);
+	ca.channel_opened = chan_opened_mock;
+	conn = firefly_connection_new(&ca, NULL, feq, &loopback_trsp_conn);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
+	chan = loopback_channel_new(conn, feq, handle_priority_var_bytes);
+	CU_ASSERT_EQUAL(firefly_channel_get_priority(chan),
+			FIREFLY_CHANNEL_PRIORITY_NORMAL);
+
+	// The control sample overtakes the bulk sample written before it.
+	v.a = data;
+	v.n_0 = 1;
+	firefly_channel_set_priority(chan, FIREFLY_CHANNEL_PRIORITY_BULK);
+	CU_ASSERT_EQUAL(labcomm_encode_test_test_var_bytes(chan->proto_encoder,
+				&v), 0);
+	v.n_0 = 2;
+	firefly_channel_set_priority(chan, FIREFLY_CHANNEL_PRIORITY_CONTROL);
+	CU_ASSERT_EQUAL(labcomm_encode_test_test_var_bytes(chan->proto_encoder,
+				&v), 0);
+	CU_ASSERT_EQUAL(firefly_channel_get_priority(chan),
+			FIREFLY_CHANNEL_PRIORITY_CONTROL);
+	nbr_priority_received = 0;
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL_FATAL(nbr_priority_received, 2);
+	CU_ASSERT_EQUAL(priority_order[0], 2);
+	CU_ASSERT_EQUAL(priority_order[1], 1);
+
+	// Received samples are queued by the class they were sent with.
+	CU_ASSERT_TRUE(firefly_receive_priority(FIREFLY_CHANNEL_PRIORITY_CONTROL) >
+			firefly_receive_priority(FIREFLY_CHANNEL_PRIORITY_NORMAL));
+	CU_ASSERT_TRUE(firefly_receive_priority(FIREFLY_CHANNEL_PRIORITY_NORMAL) >
+			firefly_receive_priority(FIREFLY_CHANNEL_PRIORITY_BULK));
+
+	// No class is sent after the events closing and freeing the channel.
+	CU_ASSERT_TRUE(firefly_send_priority(FIREFLY_CHANNEL_PRIORITY_BULK) >=
+			FIREFLY_CHANNEL_CLOSE_PRIORITY);
+	CU_ASSERT_TRUE(firefly_send_priority(FIREFLY_CHANNEL_PRIORITY_NORMAL) >=
+			FIREFLY_CHANNEL_CLOSE_PRIORITY);
+
+	firefly_channel_free(remove_channel_from_connection(chan, conn));
+	firefly_connection_free(&conn);
+	firefly_event_queue_free(&feq);
+}
+
+static int conflated_last = 0;
+static int nbr_conflated_received = 0;
+
+static void handle_conflated_var_bytes(test_test_var_bytes *v, void *context)
+{
+	UNUSED_VAR(context);
+	conflated_last = v->n_0;
+	nbr_conflated_received++;
+}
+
+static void write_conflated(struct firefly_channel *chan, int first, int last)
+{
+	test_test_var_bytes v;
+	unsigned char data[16];
+
+	memset(data, 0, sizeof(data));
+	v.a = data;
+	for (int i = first; i <= last; i++) {
+		v.n_0 = i;
+		CU_ASSERT_EQUAL(labcomm_encode_test_test_var_bytes(
+					chan->proto_encoder, &v), 0);
+	}
+}
+
+void test_chan_conflate()
+{
+	struct firefly_event_queue *feq;
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn;
+	struct firefly_channel *chan;
+
+	feq = firefly_event_queue_new(firefly_event_add, 10, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(feq);
+	ca.channel_opened = chan_opened_mock;
+	conn = firefly_connection_new(&ca, NULL, feq, &loopback_trsp_conn);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
+	chan = loopback_channel_new(conn, feq, handle_conflated_var_bytes);
+
+	// Only the last of the samples written before the channel is sent is.
+	firefly_channel_set_conflate(chan, true, 0);
+	nbr_conflated_received = 0;
+	write_conflated(chan, 1, 5);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 1);
+	CU_ASSERT_EQUAL(conflated_last, 5);
+	CU_ASSERT_EQUAL(chan->conflate_state, FIREFLY_CONFLATE_IDLE);
+
+	// Samples written within the minimum interval wait for it to pass.
+	firefly_channel_set_conflate(chan, true, 50);
+	nbr_conflated_received = 0;
+	write_conflated(chan, 1, 1);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 1);
+	CU_ASSERT_EQUAL(chan->conflate_state, FIREFLY_CONFLATE_HOLD);
+	write_conflated(chan, 2, 4);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 1);
+	firefly_event_queue_advance(feq, 50);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 2);
+	CU_ASSERT_EQUAL(conflated_last, 4);
+	// Nothing was written during the second interval.
+	firefly_event_queue_advance(feq, 100);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 2);
+	CU_ASSERT_EQUAL(chan->conflate_state, FIREFLY_CONFLATE_IDLE);
+
+	// A channel no longer conflating sends every sample.
+	firefly_channel_set_conflate(chan, false, 0);
+	nbr_conflated_received = 0;
+	write_conflated(chan, 1, 3);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 3);
+
+	firefly_channel_free(remove_channel_from_connection(chan, conn));
+	firefly_connection_free(&conn);
+	firefly_event_queue_free(&feq);
+}
+
+static unsigned int nbr_expired_reported = 0;
+
+static void chan_expired_mock(struct firefly_channel *chan,
+		unsigned int nbr_expired)
+{
+	UNUSED_VAR(chan);
+	nbr_expired_reported = nbr_expired;
+}
+
+void test_chan_deadline()
+{
+	struct firefly_event_queue *feq;
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn;
+	struct firefly_channel *chan;
+
+	feq = firefly_event_queue_new(firefly_event_add, 10, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(feq);
+	ca.channel_opened = chan_opened_mock;
+	ca.channel_expired = chan_expired_mock;
+	conn = firefly_connection_new(&ca, NULL, feq, &loopback_trsp_conn);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
+	chan = loopback_channel_new(conn, feq, handle_conflated_var_bytes);
+	firefly_channel_set_deadline(chan, 10);
+
+	// A sample sent within its time to live is delivered.
+	nbr_conflated_received = 0;
+	nbr_expired_reported = 0;
+	write_conflated(chan, 1, 1);
+	firefly_event_queue_advance(feq, 10);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 1);
+	CU_ASSERT_EQUAL(firefly_channel_get_expired(chan), 0);
+
+	// One waiting past its deadline is dropped and reported.
+	write_conflated(chan, 2, 3);
+	firefly_event_queue_advance(feq, 21);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 1);
+	CU_ASSERT_EQUAL(firefly_channel_get_expired(chan), 2);
+	CU_ASSERT_EQUAL(nbr_expired_reported, 2);
+
+	// So is the pending sample of a conflating channel.
+	firefly_channel_set_conflate(chan, true, 0);
+	write_conflated(chan, 4, 4);
+	firefly_event_queue_advance(feq, 40);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 1);
+	CU_ASSERT_EQUAL(firefly_channel_get_expired(chan), 3);
+	CU_ASSERT_EQUAL(chan->conflate_state, FIREFLY_CONFLATE_IDLE);
+
+	// Samples of a channel without a deadline never expire.
+	firefly_channel_set_conflate(chan, false, 0);
+	firefly_channel_set_deadline(chan, 0);
+	write_conflated(chan, 5, 5);
+	firefly_event_queue_advance(feq, 1000);
+	event_execute_all_test(feq);
+	CU_ASSERT_EQUAL(nbr_conflated_received, 2);
+	CU_ASSERT_EQUAL(firefly_channel_get_expired(chan), 3);
+
+	firefly_channel_free(remove_channel_from_connection(chan, conn));
+	firefly_connection_free(&conn);
+	firefly_event_queue_free(&feq);
+}
@@ -17,6 +17,7 @@ void test_chan_recv_reject();
 void test_chan_open_recv();
 void test_chan_close();
 void test_chan_recv_close();
+void test_chan_recv_fec();
 
 /* Test restrict */
 void test_restrict_recv();
@@ -30,9 +31,16 @@ void test_restrict_req_dup();
 /* Test data exchange */
 void test_send_app_data();
 void test_recv_app_data();
+void test_recv_app_data_borrowed();
 void test_transmit_app_data_over_mock_trans_layer();
 void test_chan_open_close_multiple();
 void test_chan_app_data_multiple();
 void test_nbr_chan();
+void test_channel_table();
+void test_fragmented_sample();
+void test_fec_recover();
+void test_chan_priority();
+void test_chan_conflate();
+void test_chan_deadline();
 
 #endif
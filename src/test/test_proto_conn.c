@@ -71,7 +71,7 @@ static int free_plat_conn_test(struct firefly_connection *conn)
 
 static bool transport_sent = false;
 static void transport_write_mock(unsigned char *data, size_t size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, unsigned int *id)
 {
 	UNUSED_VAR(data);
 	UNUSED_VAR(size);
@@ -374,6 +374,7 @@ void test_conn_close_recv_chan_req_first()
 	firefly_protocol_channel_request chan_req;
 	chan_req.source_chan_id = 0;
 	chan_req.dest_chan_id = CHANNEL_ID_NOT_SET;
+	chan_req.fec_group = 0;
 	labcomm_encode_firefly_protocol_channel_request(test_enc, &chan_req);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -126,6 +126,7 @@ void test_unexpected_response()
 	resp.dest_chan_id = 14;
 	resp.source_chan_id = 14;
 	resp.ack = true;
+	resp.fec_group = 0;
 	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_length(eq), 0);
 	labcomm_encode_firefly_protocol_channel_response(
 					conn_recv->transport_encoder, &resp);
@@ -159,6 +160,8 @@ void test_unexpected_data_sample()
 	sample.src_chan_id = 15;
 	sample.app_enc_data.n_0 = app_data_size;
 	sample.app_enc_data.a = app_data;
+	sample.fec_seqno = 0;
+	sample.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
 	CU_ASSERT_EQUAL_FATAL(firefly_event_queue_length(eq), 0);
 
 	labcomm_encode_firefly_protocol_data_sample(
@@ -185,11 +188,10 @@ void test_unexpected_data_sample()
 	 */
 	CU_ASSERT_PTR_NOT_NULL(conn_open);
 	CU_ASSERT_PTR_NULL(conn_open->chan_list);
-	conn_open->chan_list = malloc(sizeof(struct channel_list_node));
-	conn_open->chan_list->next = NULL;
-	conn_open->chan_list->chan = firefly_channel_new(conn_open);
-	conn_open->chan_list->chan->local_id = 15;
-	conn_open->chan_list->chan->remote_id = 14;
+	struct firefly_channel *chan = firefly_channel_new(conn_open);
+	chan->local_id = 15;
+	chan->remote_id = 14;
+	add_channel_to_connection(chan, conn_open);
 
 	protocol_data_received(conn_open, conn_recv_write.data,
 						   conn_recv_write.size);
@@ -1,5 +1,7 @@
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "CUnit/Basic.h"
 #include <limits.h>
@@ -30,6 +32,8 @@ extern firefly_protocol_channel_request channel_request;
 extern firefly_protocol_channel_response channel_response;
 extern firefly_protocol_channel_ack channel_ack;
 extern bool received_ack;
+extern firefly_protocol_ack_batch ack_batch;
+extern bool received_ack_batch;
 
 struct firefly_event_queue *eq;
 
@@ -57,7 +61,7 @@ int clean_suit_proto_important()
 
 bool mock_transport_written = false;
 void mock_transport_write_important(unsigned char *data, size_t size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, unsigned int *id)
 {
 	UNUSED_VAR(data);
 	UNUSED_VAR(size);
@@ -73,7 +77,7 @@ void mock_transport_write_important(unsigned char *data, size_t size,
 }
 
 bool mock_transport_acked = false;
-void mock_transport_ack(unsigned char id, struct firefly_connection *conn)
+void mock_transport_ack(unsigned int id, struct firefly_connection *conn)
 {
 	UNUSED_VAR(conn);
 	CU_ASSERT_EQUAL(id, TEST_IMPORTANT_ID);
@@ -112,7 +116,8 @@ void test_important_signature()
 	event_execute_test(eq, 1);
 	CU_ASSERT_TRUE(mock_transport_written);
 	CU_ASSERT_TRUE(data_sample.important);
-	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
+	CU_ASSERT_EQUAL(chan->window_count, 1);
+	CU_ASSERT_EQUAL(chan->window_ids[chan->window_head], TEST_IMPORTANT_ID);
 	CU_ASSERT_EQUAL(chan->current_seqno, 1);
 
 	mock_transport_written = false;
@@ -139,8 +144,9 @@ void test_important_recv_ack()
 	struct firefly_channel *chan = firefly_channel_new(conn);
 	add_channel_to_connection(chan, conn);
 
-	chan->important_id = TEST_IMPORTANT_ID;
-	chan->current_seqno = 1;
+	int seqno;
+	*firefly_channel_window_push(chan, &seqno) = TEST_IMPORTANT_ID;
+	CU_ASSERT_EQUAL(seqno, 1);
 
 	firefly_protocol_ack ack_pkt;
 	ack_pkt.dest_chan_id = chan->local_id;
@@ -150,8 +156,9 @@ void test_important_recv_ack()
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
 	protocol_data_received(conn, buf, buf_size);
+	event_execute_test(eq, 1);
 	CU_ASSERT_TRUE(mock_transport_acked);
-	CU_ASSERT_EQUAL(chan->important_id, 0);
+	CU_ASSERT_EQUAL(chan->window_count, 0);
 	CU_ASSERT_EQUAL(chan->current_seqno, 1);
 
 	mock_transport_written = false;
@@ -183,11 +190,12 @@ void test_important_signatures_mult()
 	event_execute_test(eq, 1);
 	CU_ASSERT_TRUE(mock_transport_written);
 	CU_ASSERT_TRUE(data_sample.important);
-	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
+	CU_ASSERT_EQUAL(chan->window_ids[chan->window_head], TEST_IMPORTANT_ID);
 	CU_ASSERT_EQUAL(chan->current_seqno, 1);
 
 	// simulate ack received
-	chan->important_id = 0;
+	firefly_channel_ack_seqno(chan, 1);
+	CU_ASSERT_EQUAL(chan->window_count, 0);
 
 	labcomm_encoder_register_test_test_var_2(
 			firefly_protocol_get_output_stream(chan));
@@ -195,7 +203,8 @@ void test_important_signatures_mult()
 	event_execute_test(eq, 1);
 	CU_ASSERT_TRUE(mock_transport_written);
 	CU_ASSERT_TRUE(data_sample.important);
-	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
+	CU_ASSERT_EQUAL(chan->window_count, 1);
+	CU_ASSERT_EQUAL(chan->window_ids[chan->window_head], TEST_IMPORTANT_ID);
 	CU_ASSERT_EQUAL(chan->current_seqno, 2);
 
 	mock_transport_written = false;
@@ -226,7 +235,8 @@ void test_important_seqno_overflow()
 	event_execute_test(eq, 1);
 	CU_ASSERT_TRUE(mock_transport_written);
 	CU_ASSERT_TRUE(data_sample.important);
-	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
+	CU_ASSERT_EQUAL(chan->window_ids[chan->window_head], TEST_IMPORTANT_ID);
+	CU_ASSERT_EQUAL(chan->window_base, 1);
 	CU_ASSERT_EQUAL(chan->current_seqno, 1);
 
 	mock_transport_written = false;
@@ -260,6 +270,8 @@ void test_important_send_ack()
 	sample_pkt.important = true;
 	sample_pkt.app_enc_data.a = NULL;
 	sample_pkt.app_enc_data.n_0 = 0;
+	sample_pkt.fec_seqno = 0;
+	sample_pkt.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -301,6 +313,8 @@ void test_not_important_not_send_ack()
 	sample_pkt.important = false;
 	sample_pkt.app_enc_data.a = NULL;
 	sample_pkt.app_enc_data.n_0 = 0;
+	sample_pkt.fec_seqno = 0;
+	sample_pkt.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -348,53 +362,59 @@ void test_important_mult_simultaneously()
 	labcomm_encoder_register_test_test_var_3(
 			firefly_protocol_get_output_stream(chan));
 
+	// All three are in flight at once.
 	event_execute_all_test(eq);
 	CU_ASSERT_TRUE(mock_transport_written);
 	CU_ASSERT_TRUE(data_sample.important);
-	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
-	CU_ASSERT_EQUAL(chan->current_seqno, 1);
+	CU_ASSERT_EQUAL(chan->window_count, 3);
+	CU_ASSERT_EQUAL(chan->window_base, 1);
+	CU_ASSERT_EQUAL(chan->current_seqno, 3);
 	mock_transport_written = false;
 
-	ack_pkt.seqno = 1;
+	// A later ack does not move the window past an unacked packet.
+	ack_pkt.seqno = 2;
 	labcomm_encode_firefly_protocol_ack(test_enc, &ack_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
 	protocol_data_received(conn, buf, buf_size);
-
 	event_execute_all_test(eq);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL(chan->window_count, 3);
+	CU_ASSERT_EQUAL(chan->window_base, 1);
+	mock_transport_acked = false;
 
-	CU_ASSERT_TRUE(mock_transport_written);
-	CU_ASSERT_TRUE(data_sample.important);
-	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
-	CU_ASSERT_EQUAL(chan->current_seqno, 2);
-	mock_transport_written = false;
+	ack_pkt.seqno = 1;
+	labcomm_encode_firefly_protocol_ack(test_enc, &ack_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_all_test(eq);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL(chan->window_count, 1);
+	CU_ASSERT_EQUAL(chan->window_base, 3);
+	mock_transport_acked = false;
 
+	// A duplicate ack is ignored.
 	ack_pkt.seqno = 2;
 	labcomm_encode_firefly_protocol_ack(test_enc, &ack_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
 	protocol_data_received(conn, buf, buf_size);
-
 	event_execute_all_test(eq);
-
-	CU_ASSERT_TRUE(mock_transport_written);
-	CU_ASSERT_TRUE(data_sample.important);
-	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
-	CU_ASSERT_EQUAL(chan->current_seqno, 3);
-	mock_transport_written = false;
+	CU_ASSERT_FALSE(mock_transport_acked);
 
 	ack_pkt.seqno = 3;
 	labcomm_encode_firefly_protocol_ack(test_enc, &ack_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
 	protocol_data_received(conn, buf, buf_size);
-
 	event_execute_all_test(eq);
-
+	CU_ASSERT_TRUE(mock_transport_acked);
 	CU_ASSERT_FALSE(mock_transport_written);
-	CU_ASSERT_EQUAL(chan->important_id, 0);
+	CU_ASSERT_EQUAL(chan->window_count, 0);
 	CU_ASSERT_EQUAL(chan->current_seqno, 3);
 
+	mock_transport_acked = false;
 	mock_transport_written = false;
 	firefly_connection_free(&conn);
 
@@ -420,8 +440,10 @@ void test_errorneous_ack()
 	struct firefly_channel *chan = firefly_channel_new(conn);
 	add_channel_to_connection(chan, conn);
 
-	chan->current_seqno = 5;
-	chan->important_id = TEST_IMPORTANT_ID;
+	int seqno;
+	chan->current_seqno = 4;
+	*firefly_channel_window_push(chan, &seqno) = TEST_IMPORTANT_ID;
+	CU_ASSERT_EQUAL(seqno, 5);
 
 	firefly_protocol_ack ack_pkt;
 	ack_pkt.dest_chan_id = chan->local_id;
@@ -431,8 +453,9 @@ void test_errorneous_ack()
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
 	protocol_data_received(conn, buf, buf_size);
+	event_execute_all_test(eq);
 	CU_ASSERT_FALSE(mock_transport_acked);
-	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
+	CU_ASSERT_EQUAL(chan->window_count, 1);
 	CU_ASSERT_EQUAL(chan->current_seqno, 5);
 
 	ack_pkt.seqno = 6;
@@ -440,8 +463,9 @@ void test_errorneous_ack()
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
 	protocol_data_received(conn, buf, buf_size);
+	event_execute_all_test(eq);
 	CU_ASSERT_FALSE(mock_transport_acked);
-	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
+	CU_ASSERT_EQUAL(chan->window_count, 1);
 	CU_ASSERT_EQUAL(chan->current_seqno, 5);
 
 	mock_transport_written = false;
@@ -490,6 +514,8 @@ void test_important_recv_duplicate()
 	sample_pkt.important = true;
 	sample_pkt.app_enc_data.a = buf;
 	sample_pkt.app_enc_data.n_0 = buf_size;
+	sample_pkt.fec_seqno = 0;
+	sample_pkt.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
 	free(buf);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
@@ -528,7 +554,351 @@ void test_important_recv_duplicate()
 	firefly_connection_free(&conn);
 }
 
+static int reorder_values[3];
+static int nbr_reorder_values = 0;
+static void handle_test_var_2_reorder(test_test_var_2 *d, void *context)
+{
+	UNUSED_VAR(context);
+	if (nbr_reorder_values < 3)
+		reorder_values[nbr_reorder_values] = *d;
+	nbr_reorder_values++;
+}
+
+static void recv_important_sample(struct firefly_connection *conn,
+		struct firefly_channel *chan, int seqno, unsigned char *data,
+		size_t size)
+{
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_data_sample sample_pkt;
+
+	sample_pkt.dest_chan_id = chan->local_id;
+	sample_pkt.src_chan_id = chan->remote_id;
+	sample_pkt.seqno = seqno;
+	sample_pkt.important = true;
+	sample_pkt.app_enc_data.a = data;
+	sample_pkt.app_enc_data.n_0 = size;
+	sample_pkt.fec_seqno = 0;
+	sample_pkt.priority = FIREFLY_CHANNEL_PRIORITY_NORMAL;
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_all_test(eq);
+}
+
+void test_important_recv_reordered()
+{
+	unsigned char *sig;
+	size_t sig_size;
+	unsigned char *buf;
+	size_t buf_size;
+	unsigned char *values[2];
+	size_t value_sizes[2];
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = false, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = transport_write_test_decoder,
+		.ack = NULL,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	labcomm_decoder_register_test_test_var_2(
+			firefly_protocol_get_input_stream(chan),
+			handle_test_var_2_reorder, NULL);
+
+	labcomm_encoder_register_test_test_var_2(test_enc);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	sig = malloc(buf_size);
+	memcpy(sig, buf, buf_size);
+	sig_size = buf_size;
+	for (int i = 0; i < 2; i++) {
+		test_test_var_2 v = i + 2;
+
+		labcomm_encode_test_test_var_2(test_enc, &v);
+		labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+				&buf, &buf_size);
+		values[i] = malloc(buf_size);
+		memcpy(values[i], buf, buf_size);
+		value_sizes[i] = buf_size;
+	}
+
+	// The samples after the signature arrive first and are kept.
+	nbr_reorder_values = 0;
+	recv_important_sample(conn, chan, 3, values[1], value_sizes[1]);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 3);
+	received_ack = false;
+	recv_important_sample(conn, chan, 2, values[0], value_sizes[0]);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 2);
+	received_ack = false;
+	CU_ASSERT_EQUAL(chan->remote_seqno, 0);
+	CU_ASSERT_EQUAL(nbr_reorder_values, 0);
+
+	// A sample beyond the window is neither kept nor acked.
+	recv_important_sample(conn, chan, FIREFLY_IMPORTANT_WINDOW + 1,
+			values[0], value_sizes[0]);
+	CU_ASSERT_FALSE(received_ack);
+
+	// The signature releases the kept samples in order.
+	recv_important_sample(conn, chan, 1, sig, sig_size);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 1);
+	received_ack = false;
+	CU_ASSERT_EQUAL(chan->remote_seqno, 3);
+	CU_ASSERT_EQUAL(nbr_reorder_values, 2);
+	CU_ASSERT_EQUAL(reorder_values[0], 2);
+	CU_ASSERT_EQUAL(reorder_values[1], 3);
+
+	// A resent sample is acked again but not delivered.
+	recv_important_sample(conn, chan, 2, values[0], value_sizes[0]);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 2);
+	received_ack = false;
+	CU_ASSERT_EQUAL(nbr_reorder_values, 2);
+
+	free(sig);
+	free(values[0]);
+	free(values[1]);
+	firefly_connection_free(&conn);
+}
+
+static int nbr_delayed_ack_writes = 0;
+static void delayed_ack_write(unsigned char *data, size_t size,
+		struct firefly_connection *conn, bool important, unsigned int *id)
+{
+	UNUSED_VAR(conn);
+	int dec_res = 0;
+
+	if (important)
+		*id = TEST_IMPORTANT_ID;
+	labcomm_decoder_ioctl(test_dec, LABCOMM_IOCTL_READER_SET_BUFFER,
+			data, size);
+	while (dec_res >= 0)
+		dec_res = labcomm_decoder_decode_one(test_dec);
+	nbr_delayed_ack_writes++;
+}
+
+void test_important_delayed_ack()
+{
+	unsigned char *sig;
+	size_t sig_size;
+	unsigned char *buf;
+	size_t buf_size;
+	unsigned char *values[2];
+	size_t value_sizes[2];
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = false, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = delayed_ack_write,
+		.ack = mock_transport_ack,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	labcomm_decoder_register_test_test_var_2(
+			firefly_protocol_get_input_stream(chan),
+			handle_test_var_2_reorder, NULL);
+	CU_ASSERT_TRUE(firefly_connection_set_delayed_ack(conn, 5000) > 0);
+	event_execute_all_test(eq);
+
+	labcomm_encoder_register_test_test_var_2(test_enc);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	sig = malloc(buf_size);
+	memcpy(sig, buf, buf_size);
+	sig_size = buf_size;
+	for (int i = 0; i < 2; i++) {
+		test_test_var_2 v = i + 2;
+
+		labcomm_encode_test_test_var_2(test_enc, &v);
+		labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+				&buf, &buf_size);
+		values[i] = malloc(buf_size);
+		memcpy(values[i], buf, buf_size);
+		value_sizes[i] = buf_size;
+	}
+
+	// Received packets are not acked at once.
+	nbr_reorder_values = 0;
+	nbr_delayed_ack_writes = 0;
+	received_ack = false;
+	received_ack_batch = false;
+	recv_important_sample(conn, chan, 1, sig, sig_size);
+	recv_important_sample(conn, chan, 3, values[1], value_sizes[1]);
+	CU_ASSERT_EQUAL(nbr_delayed_ack_writes, 0);
+	CU_ASSERT_PTR_EQUAL(conn->ack_list, chan);
+	CU_ASSERT_PTR_NULL(chan->ack_next);
+
+	// The acks share the datagram of the next sample sent.
+	data_sample.important = false;
+	labcomm_encoder_register_test_test_var(
+			firefly_protocol_get_output_stream(chan));
+	event_execute_all_test(eq);
+	CU_ASSERT_EQUAL(nbr_delayed_ack_writes, 1);
+	CU_ASSERT_TRUE(data_sample.important);
+	CU_ASSERT_FALSE(received_ack);
+	CU_ASSERT_TRUE_FATAL(received_ack_batch);
+	CU_ASSERT_EQUAL_FATAL(ack_batch.n_0, 1);
+	CU_ASSERT_EQUAL(ack_batch.a[0].dest_chan_id, chan->remote_id);
+	CU_ASSERT_EQUAL(ack_batch.a[0].src_chan_id, chan->local_id);
+	CU_ASSERT_EQUAL(ack_batch.a[0].seqno, 1);
+	CU_ASSERT_EQUAL(ack_batch.a[0].selective, 1 << 1);
+	CU_ASSERT_PTR_NULL(conn->ack_list);
+	received_ack_batch = false;
+
+	// Without anything to send the acks are sent when the delay expires.
+	recv_important_sample(conn, chan, 2, values[0], value_sizes[0]);
+	CU_ASSERT_EQUAL(nbr_reorder_values, 2);
+	CU_ASSERT_EQUAL(nbr_delayed_ack_writes, 1);
+	firefly_event_queue_advance(eq, firefly_event_queue_next_timer(eq));
+	event_execute_all_test(eq);
+	CU_ASSERT_EQUAL(nbr_delayed_ack_writes, 2);
+	CU_ASSERT_TRUE_FATAL(received_ack_batch);
+	CU_ASSERT_EQUAL_FATAL(ack_batch.n_0, 1);
+	CU_ASSERT_EQUAL(ack_batch.a[0].seqno, 3);
+	CU_ASSERT_EQUAL(ack_batch.a[0].selective, 0);
+	CU_ASSERT_FALSE(received_ack);
+
+	// A received batch acks the packets in flight.
+	firefly_protocol_ack_batch batch_pkt;
+	batch_pkt.n_0 = 1;
+	batch_pkt.a = malloc(sizeof(*batch_pkt.a));
+	batch_pkt.a[0].dest_chan_id = chan->local_id;
+	batch_pkt.a[0].src_chan_id = chan->remote_id;
+	batch_pkt.a[0].seqno = 1;
+	batch_pkt.a[0].selective = 0;
+	labcomm_encode_firefly_protocol_ack_batch(test_enc, &batch_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	CU_ASSERT_EQUAL(chan->window_count, 1);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_all_test(eq);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL(chan->window_count, 0);
+
+	mock_transport_acked = false;
+	free(batch_pkt.a);
+	free(sig);
+	free(values[0]);
+	free(values[1]);
+	firefly_connection_free(&conn);
+}
+
 bool handshake_chan_open_called = false;
+void test_important_congestion_window()
+{
+	struct firefly_connection *conn;
+	struct firefly_congestion_state cc;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = mock_transport_write_important,
+		.ack = mock_transport_ack,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+	int seqno;
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	chan->state = FIREFLY_CHANNEL_OPEN;
+
+	firefly_connection_get_congestion(conn, &cc);
+	CU_ASSERT_EQUAL(cc.cwnd, FIREFLY_CWND_INITIAL);
+	CU_ASSERT_EQUAL(cc.in_flight, 0);
+	CU_ASSERT_EQUAL(cc.backoffs, 0);
+
+	// Packets not resent by the transport are not counted.
+	firefly_channel_window_push(chan, &seqno);
+	firefly_channel_window_sent(chan, FIREFLY_FRAGMENT_SIZE);
+	firefly_connection_get_congestion(conn, &cc);
+	CU_ASSERT_EQUAL(cc.in_flight, 0);
+	CU_ASSERT_FALSE(firefly_channel_window_full(chan));
+
+	while (!firefly_channel_window_full(chan)) {
+		*firefly_channel_window_push(chan, &seqno) = TEST_IMPORTANT_ID;
+		firefly_channel_window_sent(chan, FIREFLY_FRAGMENT_SIZE);
+	}
+	firefly_connection_get_congestion(conn, &cc);
+	CU_ASSERT_EQUAL(cc.in_flight, FIREFLY_CWND_INITIAL);
+	CU_ASSERT_EQUAL(chan->window_count, 4);
+
+	// An ack in slow start grows the window by the acked bytes.
+	firefly_channel_ack_seqno(chan, 2);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	mock_transport_acked = false;
+	firefly_connection_get_congestion(conn, &cc);
+	CU_ASSERT_EQUAL(cc.cwnd, FIREFLY_CWND_INITIAL + FIREFLY_FRAGMENT_SIZE);
+	CU_ASSERT_EQUAL(cc.in_flight, FIREFLY_CWND_INITIAL - FIREFLY_FRAGMENT_SIZE);
+	CU_ASSERT_FALSE(firefly_channel_window_full(chan));
+
+	// The resends of the packets in flight cut the window once.
+	firefly_connection_resend_timeout(conn);
+	firefly_connection_resend_timeout(conn);
+	event_execute_all_test(eq);
+	firefly_connection_get_congestion(conn, &cc);
+	CU_ASSERT_EQUAL(cc.backoffs, 1);
+	CU_ASSERT_EQUAL(cc.cwnd, (FIREFLY_CWND_INITIAL + FIREFLY_FRAGMENT_SIZE) / 2);
+	CU_ASSERT_EQUAL(cc.ssthresh, cc.cwnd);
+	CU_ASSERT_TRUE(firefly_channel_window_full(chan));
+
+	// Above the threshold the window grows by a fragment per window acked.
+	firefly_channel_ack_cumulative(chan, 5, 0);
+	firefly_connection_get_congestion(conn, &cc);
+	CU_ASSERT_EQUAL(cc.in_flight, 0);
+	CU_ASSERT_EQUAL(cc.cwnd, cc.ssthresh);
+	CU_ASSERT_EQUAL(chan->window_count, 0);
+
+	// Once they are acked another resend cuts it again.
+	firefly_connection_resend_timeout(conn);
+	event_execute_all_test(eq);
+	firefly_connection_get_congestion(conn, &cc);
+	CU_ASSERT_EQUAL(cc.backoffs, 2);
+
+	// Only the channels with samples waiting for room are woken by acks.
+	struct firefly_channel *chan_2 = firefly_channel_new(conn);
+	struct firefly_event_send_sample *fess = calloc(1, sizeof(*fess));
+	add_channel_to_connection(chan_2, conn);
+	chan_2->state = FIREFLY_CHANNEL_OPEN;
+	fess->chan = chan_2;
+	while (!firefly_channel_window_full(chan)) {
+		*firefly_channel_window_push(chan, &seqno) = TEST_IMPORTANT_ID;
+		firefly_channel_window_sent(chan, FIREFLY_FRAGMENT_SIZE);
+	}
+	CU_ASSERT_PTR_NULL(conn->cwnd_waiting);
+	CU_ASSERT_TRUE(firefly_channel_enqueue_important(chan_2,
+				send_data_sample_event, fess));
+	CU_ASSERT_PTR_EQUAL(conn->cwnd_waiting, chan_2);
+	CU_ASSERT_EQUAL(chan_2->send_queued_id, 0);
+	firefly_channel_ack_cumulative(chan, seqno, 0);
+	CU_ASSERT_PTR_NULL(conn->cwnd_waiting);
+	CU_ASSERT_FALSE(chan_2->cwnd_waiting);
+	CU_ASSERT_TRUE(chan_2->send_queued_id > 0);
+
+	mock_transport_acked = false;
+	// Frees the queued sample and cancels the event sending it.
+	firefly_connection_free(&conn);
+}
+
 void important_handshake_chan_open(struct firefly_channel *chan)
 {
 	CU_ASSERT_EQUAL(chan->important_id, 0);
@@ -573,6 +943,7 @@ void test_important_handshake_recv()
 	req_pkt.source_chan_id = 1;
 	req_pkt.dest_chan_id = CHANNEL_ID_NOT_SET;
 	req_pkt.auto_restrict = false;
+	req_pkt.fec_group = 0;
 	labcomm_encode_firefly_protocol_channel_request(test_enc, &req_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -631,6 +1002,7 @@ void test_important_handshake_recv_errors()
 	req_pkt.source_chan_id = 1;
 	req_pkt.dest_chan_id = CHANNEL_ID_NOT_SET;
 	req_pkt.auto_restrict = false;
+	req_pkt.fec_group = 0;
 	labcomm_encode_firefly_protocol_channel_request(test_enc, &req_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -717,6 +1089,7 @@ void test_important_handshake_open()
 	res_pkt.source_chan_id = 1;
 	res_pkt.dest_chan_id = channel_request.source_chan_id;
 	res_pkt.ack = true;
+	res_pkt.fec_group = 0;
 	labcomm_encode_firefly_protocol_channel_response(test_enc, &res_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -770,6 +1143,7 @@ void test_important_handshake_open_errors()
 	res_pkt.source_chan_id = 1;
 	res_pkt.dest_chan_id = channel_request.source_chan_id;
 	res_pkt.ack = true;
+	res_pkt.fec_group = 0;
 	labcomm_encode_firefly_protocol_channel_response(test_enc, &res_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -13,6 +13,9 @@ void test_not_important_not_send_ack();
 void test_errorneous_ack();
 void test_important_mult_simultaneously();
 void test_important_recv_duplicate();
+void test_important_recv_reordered();
+void test_important_delayed_ack();
+void test_important_congestion_window();
 void test_important_handshake_recv();
 void test_important_handshake_recv_errors();
 void test_important_handshake_open();
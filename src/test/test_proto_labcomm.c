@@ -65,7 +65,7 @@ void labcomm_handle_data_sample(firefly_protocol_data_sample *v, void *context)
 // previously encoded.
 static size_t last_written_size = 0;
 void transport_write_udp_posix_mock(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, unsigned int *id)
 {
 	UNUSED_VAR(important);
 	UNUSED_VAR(id);
@@ -424,3 +424,223 @@ void test_decode_small_protocol_fragments()
 	successfully_decoded = false;
 	firefly_event_queue_free(&eq);
 }
+
+void test_decode_buffer_fragments()
+{
+	struct firefly_connection conn;
+	conn.open = FIREFLY_CONNECTION_OPEN;
+	conn.memory_replacements.alloc_replacement = NULL;
+	conn.memory_replacements.free_replacement = NULL;
+
+	// Construct decoder.
+	struct labcomm_reader *r;
+	r = transport_labcomm_reader_new(&conn, labcomm_default_memory);
+	conn.transport_decoder =
+			labcomm_decoder_new(r, NULL, labcomm_default_memory, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn.transport_decoder);
+
+	// Construct encoder.
+	struct labcomm_writer *w;
+	struct labcomm_encoder *test_enc;
+	w = labcomm_static_buffer_writer_new();
+	test_enc = labcomm_encoder_new(w, NULL, labcomm_default_memory, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(test_enc);
+
+	unsigned char full_buf[512];
+	size_t full_buf_size = 0;
+	unsigned char *buf;
+	size_t buf_size;
+	int i;
+	int res;
+	labcomm_decoder_register_test_test_var_large(conn.transport_decoder,
+			test_fragments_handle_test_var_large, NULL);
+	labcomm_encoder_register_test_test_var_large(test_enc);
+	res = labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_RESET_BUFFER);
+	CU_ASSERT_EQUAL_FATAL(res, 0);
+	memcpy(full_buf + full_buf_size, buf, buf_size);
+	full_buf_size += buf_size;
+	free(buf);
+
+	test_test_var_large v;
+	for (i = 0; i < 7; i++) {
+		for (int j = 0; j < 10; j++) {
+			v.data.a[j] = i;
+		}
+		labcomm_encode_test_test_var_large(test_enc, &v);
+		res = labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+				&buf, &buf_size);
+		labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_RESET_BUFFER);
+		CU_ASSERT_EQUAL_FATAL(res, 0);
+		memcpy(full_buf + full_buf_size, buf, buf_size);
+		full_buf_size += buf_size;
+		free(buf);
+	}
+
+	// Keep a reference to every fragment to check that the reader releases
+	// its own.
+	size_t frag_size = full_buf_size / 19;
+	struct firefly_buffer *frags[19];
+	for (i = 0; i < 19; i++) {
+		size_t size = i < 18 ? frag_size : full_buf_size - 18*frag_size;
+
+		frags[i] = firefly_buffer_new(size);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(frags[i]);
+		memcpy(frags[i]->data, full_buf + i*frag_size, size);
+		firefly_buffer_ref(frags[i]);
+	}
+	nbr_test_vars = 0;
+	for (i = 0; i < 19; i++) {
+		int dec_res = 0;
+
+		labcomm_decoder_ioctl(conn.transport_decoder,
+				FIREFLY_LABCOMM_IOCTL_READER_ADD_BUFFER, frags[i]);
+		while (dec_res >= 0) {
+			dec_res = labcomm_decoder_decode_one(conn.transport_decoder);
+		}
+	}
+	CU_ASSERT_EQUAL(nbr_test_vars, 7);
+	for (i = 0; i < 19; i++) {
+		CU_ASSERT_EQUAL(frags[i]->refs, 1);
+		firefly_buffer_unref(frags[i]);
+	}
+
+	labcomm_encoder_free(test_enc);
+	labcomm_decoder_free(conn.transport_decoder);
+	nbr_test_vars = 0;
+}
+
+static int nbr_coalesced_writes = 0;
+void transport_write_coalesced_mock(unsigned char *data, size_t data_size,
+		struct firefly_connection *conn, bool important, unsigned int *id)
+{
+	UNUSED_VAR(important);
+	UNUSED_VAR(id);
+	unsigned char *cpy_data = malloc(data_size);
+	int dec_res = 0;
+
+	memcpy(cpy_data, data, data_size);
+	labcomm_decoder_ioctl(conn->transport_decoder,
+			FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER, cpy_data, data_size);
+	while (dec_res >= 0) {
+		dec_res = labcomm_decoder_decode_one(conn->transport_decoder);
+	}
+	last_written_size = data_size;
+	nbr_coalesced_writes++;
+}
+
+static struct firefly_transport_connection test_coalesce_trsp_conn = {
+	.write = transport_write_coalesced_mock,
+	.write_buffer = NULL,
+	.ack = NULL,
+	.open = NULL,
+	.close = NULL,
+	.context = NULL
+};
+
+static int nbr_writes_before_medium = -1;
+static int record_coalesced_writes(void *arg)
+{
+	UNUSED_VAR(arg);
+	nbr_writes_before_medium = nbr_coalesced_writes;
+	return 0;
+}
+
+void test_coalesce_transport_writes()
+{
+	struct firefly_event_queue *eq = firefly_event_queue_new(firefly_event_add,
+			10, NULL);
+	struct firefly_connection conn;
+	conn.transport = &test_coalesce_trsp_conn;
+	conn.open = FIREFLY_CONNECTION_OPEN;
+	conn.event_queue = eq;
+	conn.memory_replacements.alloc_replacement = NULL;
+	conn.memory_replacements.free_replacement = NULL;
+
+	struct labcomm_reader *r;
+	r = transport_labcomm_reader_new(&conn, labcomm_default_memory);
+	conn.transport_decoder =
+			labcomm_decoder_new(r, NULL, labcomm_default_memory, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn.transport_decoder);
+	struct labcomm_writer *w;
+	w = transport_labcomm_writer_new(&conn, labcomm_default_memory);
+	conn.transport_encoder =
+		labcomm_encoder_new(w, NULL, labcomm_default_memory, NULL);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn.transport_encoder);
+
+	labcomm_decoder_register_test_test_var(conn.transport_decoder,
+			test_fragments_handle_test_var, NULL);
+	labcomm_encoder_register_test_test_var(conn.transport_encoder);
+
+	// Measure the size of one message.
+	test_test_var v = 0;
+	nbr_test_vars = 0;
+	labcomm_encode_test_test_var(conn.transport_encoder, &v);
+	CU_ASSERT_EQUAL(nbr_test_vars, 1);
+	size_t msg_size = last_written_size;
+
+	CU_ASSERT_EQUAL(labcomm_encoder_ioctl(conn.transport_encoder,
+			FIREFLY_LABCOMM_IOCTL_TRANS_SET_COALESCING,
+			(size_t) 1500, 0U), 0);
+
+	// Unimportant messages are sent once the queued events are executed.
+	nbr_coalesced_writes = 0;
+	for (v = 1; v <= 5; v++) {
+		labcomm_encode_test_test_var(conn.transport_encoder, &v);
+	}
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 0);
+	CU_ASSERT_EQUAL(nbr_test_vars, 1);
+	// The flush is queued at the priority of the messages it sends.
+	firefly_event_add(eq, FIREFLY_PRIORITY_MEDIUM, record_coalesced_writes,
+			NULL, 0, NULL);
+	event_execute_all_test(eq);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 1);
+	CU_ASSERT_EQUAL(nbr_writes_before_medium, 1);
+	CU_ASSERT_EQUAL(last_written_size, 5*msg_size);
+	CU_ASSERT_EQUAL(nbr_test_vars, 6);
+
+	// An important message is sent on its own after the pending ones.
+	unsigned int important_id = 0;
+	nbr_coalesced_writes = 0;
+	labcomm_encode_test_test_var(conn.transport_encoder, &v);
+	v++;
+	labcomm_encoder_ioctl(conn.transport_encoder,
+			FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID, &important_id);
+	labcomm_encode_test_test_var(conn.transport_encoder, &v);
+	v++;
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 2);
+	CU_ASSERT_EQUAL(last_written_size, msg_size);
+	CU_ASSERT_EQUAL(nbr_test_vars, 8);
+	event_execute_all_test(eq);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 2);
+
+	// A full frame is sent before the message that does not fit.
+	CU_ASSERT_EQUAL(labcomm_encoder_ioctl(conn.transport_encoder,
+			FIREFLY_LABCOMM_IOCTL_TRANS_SET_COALESCING,
+			2*msg_size, 0U), 0);
+	nbr_coalesced_writes = 0;
+	for (int i = 0; i < 3; i++, v++) {
+		labcomm_encode_test_test_var(conn.transport_encoder, &v);
+	}
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 1);
+	CU_ASSERT_EQUAL(last_written_size, 2*msg_size);
+	event_execute_all_test(eq);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 2);
+	CU_ASSERT_EQUAL(last_written_size, msg_size);
+	CU_ASSERT_EQUAL(nbr_test_vars, 11);
+
+	// Pending messages are sent when coalescing is disabled.
+	labcomm_encode_test_test_var(conn.transport_encoder, &v);
+	CU_ASSERT_EQUAL(labcomm_encoder_ioctl(conn.transport_encoder,
+			FIREFLY_LABCOMM_IOCTL_TRANS_SET_COALESCING,
+			(size_t) 0, 0U), 0);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 3);
+	CU_ASSERT_EQUAL(nbr_test_vars, 12);
+	event_execute_all_test(eq);
+
+	labcomm_encoder_free(conn.transport_encoder);
+	labcomm_decoder_free(conn.transport_decoder);
+	nbr_test_vars = 0;
+	firefly_event_queue_free(&eq);
+}
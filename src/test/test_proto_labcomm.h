@@ -8,5 +8,7 @@ void test_encode_decode_protocol();
 void test_encode_decode_app();
 void test_decode_large_protocol_fragments();
 void test_decode_small_protocol_fragments();
+void test_decode_buffer_fragments();
+void test_coalesce_transport_writes();
 
 #endif
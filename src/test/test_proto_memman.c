@@ -284,6 +284,7 @@ void test_memory_management_one_chan()
 	resp.source_chan_id = 1;
 	resp.dest_chan_id = channel_request.source_chan_id;
 	resp.ack = true;
+	resp.fec_group = 0;
 	labcomm_encode_firefly_protocol_channel_response(test_enc, &resp);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buffer, &buffer_size);
@@ -318,12 +319,12 @@ void test_memory_management_one_chan()
 	ack.src_chan_id = open_chan->remote_id;
 	ack.dest_chan_id = open_chan->local_id;
 	labcomm_encode_firefly_protocol_ack(test_enc, &ack);
-	CU_ASSERT_NOT_EQUAL(open_chan->important_id, 0);
+	CU_ASSERT_EQUAL(open_chan->window_count, 1);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buffer, &buffer_size);
 	protocol_data_received(conn, buffer, buffer_size);
 	event_execute_all_test(eq);
-	CU_ASSERT_EQUAL(open_chan->important_id, 0);
+	CU_ASSERT_EQUAL(open_chan->window_count, 0);
 
 	// --- END SETUP PHASE
 	// --- RUNTIME PHASE
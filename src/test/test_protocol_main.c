@@ -75,6 +75,14 @@ int main()
 			(CU_add_test(labcomm_suite,
 					"test_decode_small_protocol_fragments",
 					test_decode_small_protocol_fragments) == NULL)
+			||
+			(CU_add_test(labcomm_suite,
+					"test_decode_buffer_fragments",
+					test_decode_buffer_fragments) == NULL)
+			||
+			(CU_add_test(labcomm_suite,
+					"test_coalesce_transport_writes",
+					test_coalesce_transport_writes) == NULL)
 		) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -139,12 +147,18 @@ int main()
 			(CU_add_test(chan_suite, "test_chan_recv_close",
 					test_chan_recv_close) == NULL)
 			||
+			(CU_add_test(chan_suite, "test_chan_recv_fec",
+					test_chan_recv_fec) == NULL)
+			||
 			(CU_add_test(chan_suite, "test_send_app_data",
 					test_send_app_data) == NULL)
 			||
 			(CU_add_test(chan_suite, "test_recv_app_data",
 					test_recv_app_data) == NULL)
 			||
+			(CU_add_test(chan_suite, "test_recv_app_data_borrowed",
+					test_recv_app_data_borrowed) == NULL)
+			||
 			(CU_add_test(chan_suite, "test_restrict_recv",
 					test_restrict_recv) == NULL)
 			||
@@ -206,6 +220,15 @@ int main()
 			(CU_add_test(important_suite, "test_important_recv_duplicate",
 					test_important_recv_duplicate) == NULL)
 			||
+			(CU_add_test(important_suite, "test_important_recv_reordered",
+					test_important_recv_reordered) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_delayed_ack",
+					test_important_delayed_ack) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_congestion_window",
+					test_important_congestion_window) == NULL)
+			||
 			(CU_add_test(important_suite, "test_important_handshake_recv",
 					test_important_handshake_recv) == NULL)
 			||
@@ -241,6 +264,24 @@ int main()
 			||
 			(CU_add_test(chan_suite, "test_nbr_chan",
 					test_nbr_chan) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_channel_table",
+					test_channel_table) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_fragmented_sample",
+					test_fragmented_sample) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_fec_recover",
+					test_fec_recover) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_chan_priority",
+					test_chan_priority) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_chan_conflate",
+					test_chan_conflate) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_chan_deadline",
+					test_chan_deadline) == NULL)
 			) {
 				CU_cleanup_registry();
 				return CU_get_error();
@@ -0,0 +1,339 @@
+/**
+ * @file
+ * @brief Test the posix I/O reactor.
+ */
+#define _POSIX_C_SOURCE (200112L)
+#include <pthread.h>
+
+#include "CUnit/Basic.h"
+#include "CUnit/Console.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <utils/firefly_reactor_posix.h>
+#include "utils/firefly_resend_posix.h"
+
+#define TIMER_DELAY_MS (30)
+#define WAIT_TIMEOUT_S (2)
+#define NBR_RESEND_PACKETS (40)
+#define RESEND_PRIORITY (2)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t signal_cond = PTHREAD_COND_INITIALIZER;
+
+struct pipe_source {
+	int fds[2];
+	int nbr_read;
+	struct firefly_reactor_posix *remove_from;
+};
+
+static int nbr_timer_calls;
+static struct timespec timer_started;
+static long timer_elapsed_ms;
+static int nbr_no_ack;
+static int nbr_resent;
+static int resent_priority;
+
+int init_suite_reactor_posix()
+{
+	return 0;
+}
+
+int clean_suite_reactor_posix()
+{
+	return 0;
+}
+
+static long timespec_diff_ms(struct timespec *f, struct timespec *t)
+{
+	return (t->tv_sec - f->tv_sec)*1000 + (t->tv_nsec - f->tv_nsec)/1000000;
+}
+
+/*
+ * Wait until *counter reaches at least target or the wait times out. Returns
+ * the last seen value of the counter.
+ */
+static int wait_for(int *counter, int target)
+{
+	struct timespec deadline;
+	int res;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += WAIT_TIMEOUT_S;
+	pthread_mutex_lock(&lock);
+	while (*counter < target &&
+			pthread_cond_timedwait(&signal_cond, &lock, &deadline) == 0)
+		;
+	res = *counter;
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+static void sleep_ms(long ms)
+{
+	struct timespec t = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000
+	};
+
+	nanosleep(&t, NULL);
+}
+
+static int read_count(int *counter)
+{
+	int res;
+
+	pthread_mutex_lock(&lock);
+	res = *counter;
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+static void pipe_ready(int fd, void *context)
+{
+	struct pipe_source *ps = context;
+	char c;
+
+	if (read(fd, &c, 1) != 1)
+		return;
+	if (ps->remove_from != NULL)
+		firefly_reactor_posix_remove(ps->remove_from, fd);
+	pthread_mutex_lock(&lock);
+	ps->nbr_read++;
+	pthread_cond_broadcast(&signal_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void pipe_source_init(struct pipe_source *ps)
+{
+	CU_ASSERT_EQUAL_FATAL(pipe(ps->fds), 0);
+	ps->nbr_read = 0;
+	ps->remove_from = NULL;
+}
+
+static void pipe_source_close(struct pipe_source *ps)
+{
+	close(ps->fds[0]);
+	close(ps->fds[1]);
+}
+
+static void pipe_write(struct pipe_source *ps)
+{
+	CU_ASSERT_EQUAL(write(ps->fds[1], "x", 1), 1);
+}
+
+void test_reactor_sources()
+{
+	struct firefly_reactor_posix *reactor;
+	struct pipe_source a;
+	struct pipe_source b;
+
+	pipe_source_init(&a);
+	pipe_source_init(&b);
+	reactor = firefly_reactor_posix_new();
+	CU_ASSERT_PTR_NOT_NULL_FATAL(reactor);
+	CU_ASSERT_EQUAL(firefly_reactor_posix_add(reactor, a.fds[0], pipe_ready,
+				&a), 0);
+	CU_ASSERT_EQUAL(firefly_reactor_posix_add(reactor, b.fds[0], pipe_ready,
+				&b), 0);
+	CU_ASSERT_EQUAL(firefly_reactor_posix_run(reactor, NULL), 0);
+
+	pipe_write(&a);
+	pipe_write(&b);
+	CU_ASSERT_EQUAL(wait_for(&a.nbr_read, 1), 1);
+	CU_ASSERT_EQUAL(wait_for(&b.nbr_read, 1), 1);
+
+	// A removed source is never dispatched again.
+	CU_ASSERT_EQUAL(firefly_reactor_posix_remove(reactor, a.fds[0]), 0);
+	CU_ASSERT_NOT_EQUAL(firefly_reactor_posix_remove(reactor, a.fds[0]), 0);
+	pipe_write(&a);
+	pipe_write(&b);
+	CU_ASSERT_EQUAL(wait_for(&b.nbr_read, 2), 2);
+	CU_ASSERT_EQUAL(read_count(&a.nbr_read), 1);
+
+	// A handler may remove its own source.
+	b.remove_from = reactor;
+	pipe_write(&b);
+	CU_ASSERT_EQUAL(wait_for(&b.nbr_read, 3), 3);
+	pipe_write(&b);
+	sleep_ms(TIMER_DELAY_MS);
+	CU_ASSERT_EQUAL(read_count(&b.nbr_read), 3);
+
+	CU_ASSERT_EQUAL(firefly_reactor_posix_stop(reactor), 0);
+	firefly_reactor_posix_free(&reactor);
+	CU_ASSERT_PTR_NULL(reactor);
+	pipe_source_close(&a);
+	pipe_source_close(&b);
+}
+
+static int delay_timer(void *context)
+{
+	struct timespec now;
+	int res = -1;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	pthread_mutex_lock(&lock);
+	if (nbr_timer_calls == 0) {
+		timer_started = now;
+		res = TIMER_DELAY_MS;
+	} else if (timespec_diff_ms(&timer_started, &now) < TIMER_DELAY_MS) {
+		res = TIMER_DELAY_MS - timespec_diff_ms(&timer_started, &now);
+	} else if (timer_elapsed_ms < 0) {
+		timer_elapsed_ms = timespec_diff_ms(&timer_started, &now);
+		pthread_cond_broadcast(&signal_cond);
+	}
+	nbr_timer_calls++;
+	pthread_mutex_unlock(&lock);
+	return res;
+}
+
+void test_reactor_timer()
+{
+	struct firefly_reactor_posix *reactor;
+	int dummy;
+	struct timespec deadline;
+
+	nbr_timer_calls = 0;
+	timer_elapsed_ms = -1;
+	reactor = firefly_reactor_posix_new();
+	CU_ASSERT_PTR_NOT_NULL_FATAL(reactor);
+	CU_ASSERT_EQUAL(firefly_reactor_posix_run(reactor, NULL), 0);
+	CU_ASSERT_EQUAL(firefly_reactor_posix_add_timer(reactor, delay_timer,
+				&dummy), 0);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += WAIT_TIMEOUT_S;
+	pthread_mutex_lock(&lock);
+	while (timer_elapsed_ms < 0 &&
+			pthread_cond_timedwait(&signal_cond, &lock, &deadline) == 0)
+		;
+	CU_ASSERT_TRUE(timer_elapsed_ms >= TIMER_DELAY_MS);
+	pthread_mutex_unlock(&lock);
+
+	CU_ASSERT_EQUAL(firefly_reactor_posix_remove_timer(reactor, &dummy), 0);
+	CU_ASSERT_NOT_EQUAL(firefly_reactor_posix_remove_timer(reactor, &dummy),
+			0);
+	firefly_reactor_posix_free(&reactor);
+}
+
+static void count_no_ack(struct firefly_connection *conn)
+{
+	pthread_mutex_lock(&lock);
+	nbr_no_ack++;
+	pthread_cond_broadcast(&signal_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void record_resend(struct firefly_connection *conn,
+		unsigned char *data, size_t size, int priority)
+{
+	pthread_mutex_lock(&lock);
+	resent_priority = priority;
+	nbr_resent++;
+	pthread_cond_broadcast(&signal_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void test_reactor_resend()
+{
+	struct firefly_reactor_posix *reactor;
+	struct firefly_resend_loop_args largs;
+	unsigned char *data;
+
+	nbr_no_ack = 0;
+	nbr_resent = 0;
+	resent_priority = -1;
+	largs.rq = firefly_resend_queue_new();
+	largs.on_no_ack = count_no_ack;
+	largs.on_resend = NULL;
+	largs.resend = record_resend;
+	reactor = firefly_reactor_posix_new();
+	CU_ASSERT_PTR_NOT_NULL_FATAL(reactor);
+	CU_ASSERT_EQUAL(firefly_resend_attach(&largs, reactor), 0);
+	CU_ASSERT_EQUAL(firefly_reactor_posix_run(reactor, NULL), 0);
+
+	// The reactor sleeps without timeout until the packet is added.
+	sleep_ms(TIMER_DELAY_MS);
+	data = malloc(1);
+	firefly_resend_add(largs.rq, data, 1, TIMER_DELAY_MS, 0, NULL, 0,
+			NULL);
+	CU_ASSERT_EQUAL(wait_for(&nbr_no_ack, 1), 1);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(largs.rq));
+
+	// More packets than are taken per lock become due together.
+	for (int i = 0; i < NBR_RESEND_PACKETS; i++) {
+		data = malloc(1);
+		firefly_resend_add(largs.rq, data, 1, TIMER_DELAY_MS, 0, NULL, 0,
+			NULL);
+	}
+	CU_ASSERT_EQUAL(wait_for(&nbr_no_ack, NBR_RESEND_PACKETS + 1),
+			NBR_RESEND_PACKETS + 1);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(largs.rq));
+
+	// A packet is resent with the class it was added with.
+	data = malloc(1);
+	firefly_resend_add(largs.rq, data, 1, TIMER_DELAY_MS, 1, NULL,
+			RESEND_PRIORITY, NULL);
+	CU_ASSERT_EQUAL(wait_for(&nbr_resent, 1), 1);
+	CU_ASSERT_EQUAL(wait_for(&nbr_no_ack, NBR_RESEND_PACKETS + 2),
+			NBR_RESEND_PACKETS + 2);
+	pthread_mutex_lock(&lock);
+	CU_ASSERT_EQUAL(resent_priority, RESEND_PRIORITY);
+	pthread_mutex_unlock(&lock);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(largs.rq));
+
+	firefly_resend_detach(&largs, reactor);
+	CU_ASSERT_PTR_NULL(largs.rq->notify);
+	firefly_reactor_posix_free(&reactor);
+	firefly_resend_queue_free(largs.rq);
+}
+
+int main()
+{
+	CU_pSuite reactor_posix_suite = NULL;
+
+	// Initialize CUnit test registry.
+	if (CUE_SUCCESS != CU_initialize_registry()) {
+		return CU_get_error();
+	}
+
+	reactor_posix_suite = CU_add_suite("reactor_posix",
+			init_suite_reactor_posix, clean_suite_reactor_posix);
+	if (reactor_posix_suite == NULL) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if (
+		(CU_add_test(reactor_posix_suite, "test_reactor_sources",
+				test_reactor_sources) == NULL)
+		||
+		(CU_add_test(reactor_posix_suite, "test_reactor_timer",
+				test_reactor_timer) == NULL)
+		||
+		(CU_add_test(reactor_posix_suite, "test_reactor_resend",
+				test_reactor_resend) == NULL)
+	   ) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	// Set verbosity.
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	/*CU_console_run_tests();*/
+
+	// Run all test suites.
+	CU_basic_run_tests();
+	int res = CU_get_number_of_tests_failed();
+	// Clean up.
+	CU_cleanup_registry();
+
+	if (res != 0) {
+		return 1;
+	}
+	return CU_get_error();
+}
@@ -4,11 +4,13 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "CUnit/Basic.h"
 #include "CUnit/Console.h"
 #include <time.h>
 
 #include "utils/firefly_resend_posix.h"
+#include "protocol/firefly_protocol_private.h"
 
 #define DATA_SIZE (5)
 
@@ -40,25 +42,25 @@ void test_add_simple()
 {
 	struct timespec at;
 	struct resend_queue *rq = firefly_resend_queue_new();
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(rq));
+	CU_ASSERT_EQUAL(rq->count, 0);
 
-	unsigned char id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			1500, 1, NULL);
+	unsigned int id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			1500, 1, NULL, 0, NULL);
 	clock_gettime(CLOCK_REALTIME, &at);
 	CU_ASSERT_TRUE(id != 0);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
-	CU_ASSERT_PTR_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(rq->count, 1);
 	CU_ASSERT_NOT_EQUAL(id, rq->next_id);
-	struct resend_elem *re = rq->first;
+	struct resend_elem *re = firefly_resend_top(rq);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(re);
 	CU_ASSERT_EQUAL(re->id, id);
 	CU_ASSERT_EQUAL(re->size, DATA_SIZE);
 	CU_ASSERT_EQUAL(memcmp(data, re->data, DATA_SIZE), 0);
 	long diff = timespec_diff_ms(&at, &re->resend_at);
 	CU_ASSERT_TRUE(diff <= 1500);
 	CU_ASSERT_TRUE(diff > 1470);
-	CU_ASSERT_PTR_NULL(re->prev);
+	CU_ASSERT_EQUAL(re->heap_index, 0);
+	CU_ASSERT_FALSE(re->acked);
 	
 	firefly_resend_queue_free(rq);
 }
@@ -67,12 +69,11 @@ void test_remove_empty()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
-	unsigned char id = 1;
+	CU_ASSERT_PTR_NULL(firefly_resend_top(rq));
+	unsigned int id = 1;
 	firefly_resend_remove(rq, id);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(rq));
+	CU_ASSERT_EQUAL(rq->count, 0);
 
 	firefly_resend_queue_free(rq);
 }
@@ -83,11 +84,11 @@ void test_remove_simple()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			1500, 1, NULL);
+	unsigned int id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			1500, 1, NULL, 0, NULL);
 	firefly_resend_remove(rq, id);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->count, 0);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(rq));
 
 	firefly_resend_queue_free(rq);
 }
@@ -98,34 +99,29 @@ void test_add_many()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	unsigned int id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
 	CU_ASSERT_TRUE(id_1 != 0);
-	CU_ASSERT_PTR_EQUAL(rq->first, rq->last);
 	CU_ASSERT_NOT_EQUAL(id_1, rq->next_id);
-	struct resend_elem *re = rq->first;
+	struct resend_elem *re = firefly_resend_top(rq);
 	CU_ASSERT_EQUAL(re->id, id_1);
-	CU_ASSERT_PTR_NULL(re->prev);
 
-	unsigned char id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	unsigned int id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
 	CU_ASSERT_TRUE(id_2 != 0);
 	CU_ASSERT_NOT_EQUAL(id_1, id_2);
 	CU_ASSERT_NOT_EQUAL(id_2, rq->next_id);
-	CU_ASSERT_PTR_NOT_EQUAL(rq->first, rq->last);
-	CU_ASSERT_PTR_EQUAL(re->prev, rq->last);
-	re = rq->last;
-	CU_ASSERT_PTR_NULL(re->prev);
+	CU_ASSERT_EQUAL(rq->count, 2);
 
-	unsigned char id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	unsigned int id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
 	CU_ASSERT_TRUE(id_3 != 0);
 	CU_ASSERT_NOT_EQUAL(id_1, id_3);
 	CU_ASSERT_NOT_EQUAL(id_2, id_3);
 	CU_ASSERT_NOT_EQUAL(id_3, rq->next_id);
-	CU_ASSERT_PTR_EQUAL(re->prev, rq->last);
-	re = rq->last;
-	CU_ASSERT_PTR_NULL(re->prev);
+	CU_ASSERT_EQUAL(rq->count, 3);
+	// The packet added first is due first.
+	CU_ASSERT_PTR_EQUAL(firefly_resend_top(rq), re);
 
 	firefly_resend_queue_free(rq);
 }
@@ -136,22 +132,21 @@ void test_remove_many()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
-	unsigned char id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
-	unsigned char id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	unsigned int id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
+	unsigned int id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
+	unsigned int id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
 	firefly_resend_remove(rq, id_1);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->count, 2);
+	CU_ASSERT_PTR_NOT_NULL(firefly_resend_top(rq));
 	firefly_resend_remove(rq, id_2);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
-	CU_ASSERT_PTR_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(rq->count, 1);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, id_3);
 	firefly_resend_remove(rq, id_3);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->count, 0);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(rq));
 
 	firefly_resend_queue_free(rq);
 }
@@ -162,22 +157,21 @@ void test_remove_not_ordered()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
-	unsigned char id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
-	unsigned char id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	unsigned int id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
+	unsigned int id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
+	unsigned int id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
 	firefly_resend_remove(rq, id_2);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->count, 2);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, id_1);
 	firefly_resend_remove(rq, id_1);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
-	CU_ASSERT_PTR_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(rq->count, 1);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, id_3);
 	firefly_resend_remove(rq, id_3);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->count, 0);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(rq));
 
 	firefly_resend_queue_free(rq);
 }
@@ -186,15 +180,15 @@ void test_remove_non_existing_elem()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	unsigned int id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
 
 	firefly_resend_remove(rq, id + 1);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->count, 1);
+	CU_ASSERT_PTR_NOT_NULL(firefly_resend_top(rq));
 	firefly_resend_remove(rq, id);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->count, 0);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(rq));
 
 	firefly_resend_queue_free(rq);
 }
@@ -203,17 +197,68 @@ void test_top_simple()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	unsigned int id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			0, 1, NULL, 0, NULL);
 
 	struct resend_elem *elem = firefly_resend_top(rq);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(elem);
 	CU_ASSERT_EQUAL(elem->id, id);
 
 	firefly_resend_remove(rq, id);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(rq));
+
+	firefly_resend_queue_free(rq);
+}
+
+void test_top_timeout_order()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+
+	unsigned int id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			1500, 1, NULL, 0, NULL);
+	unsigned int id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			10, 1, NULL, 0, NULL);
+	unsigned int id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+			500, 1, NULL, 0, NULL);
+
+	// The packet with the shortest timeout is due first.
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, id_2);
+	firefly_resend_remove(rq, id_2);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, id_3);
+	firefly_resend_remove(rq, id_3);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, id_1);
+
+	firefly_resend_queue_free(rq);
+}
+
+void test_add_remove_wide_ids()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+	unsigned int ids[1000];
+
+	for (int i = 0; i < 1000; i++) {
+		ids[i] = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+				1500 - i, 1, NULL, 0, NULL);
+		CU_ASSERT_EQUAL(ids[i], (unsigned int) i + 1);
+	}
+	CU_ASSERT_EQUAL(rq->count, 1000);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, ids[999]);
+
+	// Every other packet is acked.
+	for (int i = 999; i >= 0; i -= 2)
+		firefly_resend_remove(rq, ids[i]);
+	CU_ASSERT_EQUAL(rq->count, 500);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, ids[998]);
+	firefly_resend_readd(rq, ids[998]);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, ids[996]);
+
+	// Ids in use are skipped when the counter wraps.
+	rq->next_id = UINT_MAX;
+	CU_ASSERT_EQUAL(firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+				1500, 1, NULL, 0, NULL), UINT_MAX);
+	CU_ASSERT_EQUAL(firefly_resend_add(rq, data_test_new(), DATA_SIZE,
+				1500, 1, NULL, 0, NULL), 2);
+	CU_ASSERT_EQUAL(rq->count, 502);
 
 	firefly_resend_queue_free(rq);
 }
@@ -223,8 +268,8 @@ void test_readd_simple()
 	struct resend_queue *rq = firefly_resend_queue_new();
 
 	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 2, NULL);
-	struct resend_elem *re = rq->first;
+			0, 2, NULL, 0, NULL);
+	struct resend_elem *re = firefly_resend_top(rq);
 	re->resend_at.tv_sec = 1;
 	re->resend_at.tv_nsec = 2;
 	re->timeout = 500;
@@ -233,8 +278,8 @@ void test_readd_simple()
 	CU_ASSERT_EQUAL(re->num_retries, 1);
 	CU_ASSERT_EQUAL(re->resend_at.tv_sec, 1);
 	CU_ASSERT_EQUAL(re->resend_at.tv_nsec, 500000002);
-	CU_ASSERT_EQUAL(rq->first, re);
-	CU_ASSERT_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq), re);
+	CU_ASSERT_EQUAL(rq->count, 1);
 
 
 	firefly_resend_queue_free(rq);
@@ -245,22 +290,20 @@ void test_readd_complex()
 	struct resend_queue *rq = firefly_resend_queue_new();
 
 	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 2, NULL);
+			0, 2, NULL, 0, NULL);
 	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+			0, 1, NULL, 0, NULL);
 	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 2, NULL);
-	struct resend_elem *re = rq->first;
-	re->resend_at.tv_sec = 1;
-	re->resend_at.tv_nsec = 600000002;
+			0, 2, NULL, 0, NULL);
+	struct resend_elem *re = firefly_resend_top(rq);
+	struct timespec t = re->resend_at;
 	re->timeout = 2500;
 	firefly_resend_readd(rq, re->id);
 
 	CU_ASSERT_EQUAL(re->num_retries, 1);
-	CU_ASSERT_EQUAL(re->resend_at.tv_sec, 4);
-	CU_ASSERT_EQUAL(re->resend_at.tv_nsec, 100000002);
-	CU_ASSERT_NOT_EQUAL(rq->first, re);
-	CU_ASSERT_EQUAL(rq->last, re);
+	CU_ASSERT_EQUAL(timespec_diff_ms(&t, &re->resend_at), 2500);
+	CU_ASSERT_NOT_EQUAL(firefly_resend_top(rq), re);
+	CU_ASSERT_NOT_EQUAL(re->heap_index, 0);
 
 	firefly_resend_queue_free(rq);
 }
@@ -270,8 +313,8 @@ void test_readd_removed()
 	struct resend_queue *rq = firefly_resend_queue_new();
 
 	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 2, NULL);
-	struct resend_elem *re = rq->first;
+			0, 2, NULL, 0, NULL);
+	struct resend_elem *re = firefly_resend_top(rq);
 	struct timespec t = re->resend_at;
 	re->timeout = 500;
 	firefly_resend_readd(rq, 5);
@@ -279,8 +322,107 @@ void test_readd_removed()
 	CU_ASSERT_EQUAL(re->num_retries, 2);
 	CU_ASSERT_EQUAL(re->resend_at.tv_sec, t.tv_sec);
 	CU_ASSERT_EQUAL(re->resend_at.tv_nsec, t.tv_nsec);
-	CU_ASSERT_EQUAL(rq->first, re);
-	CU_ASSERT_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq), re);
+	CU_ASSERT_EQUAL(rq->count, 1);
+
+	firefly_resend_queue_free(rq);
+}
+
+void test_add_buffer()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+	struct firefly_buffer *frame = firefly_buffer_new(DATA_SIZE);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(frame);
+	memcpy(frame->data, data, DATA_SIZE);
+
+	// Keep a reference to see that the queue releases its own.
+	firefly_buffer_ref(frame);
+	unsigned int id = firefly_resend_add_buffer(rq, frame, 1500, 1, NULL,
+			FIREFLY_CHANNEL_PRIORITY_CONTROL, NULL);
+	CU_ASSERT_TRUE(id != 0);
+	struct resend_elem *re = firefly_resend_top(rq);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(re);
+	CU_ASSERT_PTR_EQUAL(re->buf, frame);
+	CU_ASSERT_PTR_EQUAL(re->data, frame->data);
+	CU_ASSERT_EQUAL(re->size, DATA_SIZE);
+	CU_ASSERT_EQUAL(re->priority, FIREFLY_CHANNEL_PRIORITY_CONTROL);
+	CU_ASSERT_EQUAL(frame->refs, 2);
+
+	firefly_resend_remove(rq, id);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(rq));
+	CU_ASSERT_EQUAL(frame->refs, 1);
+
+	firefly_buffer_unref(frame);
+	firefly_resend_queue_free(rq);
+}
+
+void test_rto_estimate()
+{
+	struct firefly_rto rto;
+
+	firefly_rto_init(&rto, 500, 1, 5000);
+	CU_ASSERT_EQUAL(firefly_rto_timeout_ms(&rto), 500);
+
+	// The first sample sets the variation to half the round trip time.
+	firefly_rto_sample(&rto, 8000);
+	CU_ASSERT_EQUAL(rto.srtt_us, 8000);
+	CU_ASSERT_EQUAL(rto.rttvar_us, 4000);
+	CU_ASSERT_EQUAL(firefly_rto_timeout_ms(&rto), 24);
+
+	firefly_rto_sample(&rto, 16000);
+	CU_ASSERT_EQUAL(rto.srtt_us, 9000);
+	CU_ASSERT_EQUAL(rto.rttvar_us, 5000);
+	CU_ASSERT_EQUAL(firefly_rto_timeout_ms(&rto), 29);
+
+	// A short and steady round trip time is bounded by the clock granularity.
+	for (int i = 0; i < 100; i++)
+		firefly_rto_sample(&rto, 200);
+	CU_ASSERT_EQUAL(rto.srtt_us, 200);
+	CU_ASSERT_EQUAL(firefly_rto_timeout_ms(&rto), 2);
+
+	firefly_rto_sample(&rto, 60000000);
+	CU_ASSERT_EQUAL(firefly_rto_timeout_ms(&rto), 5000);
+}
+
+void test_rto_backoff()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+	struct firefly_rto rto;
+	struct resend_elem *re;
+	struct timespec t;
+	unsigned int id;
+
+	firefly_rto_init(&rto, 100, 1, 350);
+	id = firefly_resend_add(rq, data_test_new(), DATA_SIZE, 0, 3, &rto,
+			0, NULL);
+	re = firefly_resend_top(rq);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(re);
+	CU_ASSERT_EQUAL(re->timeout, 100);
+
+	// Each resend doubles the timeout up to the upper bound.
+	t = re->resend_at;
+	firefly_resend_readd(rq, id);
+	CU_ASSERT_EQUAL(timespec_diff_ms(&t, &re->resend_at), 200);
+	CU_ASSERT_EQUAL(firefly_rto_timeout_ms(&rto), 200);
+	t = re->resend_at;
+	firefly_resend_readd(rq, id);
+	CU_ASSERT_EQUAL(timespec_diff_ms(&t, &re->resend_at), 350);
+	CU_ASSERT_EQUAL(firefly_rto_timeout_ms(&rto), 350);
+
+	// The ack of a resent packet is not sampled, Karn's rule.
+	firefly_resend_remove(rq, id);
+	CU_ASSERT_EQUAL(rto.srtt_us, 0);
+	CU_ASSERT_EQUAL(firefly_rto_timeout_ms(&rto), 350);
+
+	// New packets start from the backed off timeout.
+	id = firefly_resend_add(rq, data_test_new(), DATA_SIZE, 0, 3, &rto,
+			0, NULL);
+	re = firefly_resend_top(rq);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(re);
+	CU_ASSERT_EQUAL(re->timeout, 350);
+	firefly_resend_remove(rq, id);
+	CU_ASSERT_NOT_EQUAL(rto.srtt_us, 0);
+	CU_ASSERT_TRUE(firefly_rto_timeout_ms(&rto) < 350);
 
 	firefly_resend_queue_free(rq);
 }
@@ -324,6 +466,12 @@ int main()
 		(CU_add_test(resend_posix, "test_top_simple",
 				test_top_simple) == NULL)
 			   ||
+		(CU_add_test(resend_posix, "test_top_timeout_order",
+				test_top_timeout_order) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_add_remove_wide_ids",
+				test_add_remove_wide_ids) == NULL)
+			   ||
 		(CU_add_test(resend_posix, "test_readd_simple",
 				test_readd_simple) == NULL)
 			   ||
@@ -332,6 +480,15 @@ int main()
 			   ||
 		(CU_add_test(resend_posix, "test_readd_removed",
 				test_readd_removed) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_add_buffer",
+				test_add_buffer) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_rto_estimate",
+				test_rto_estimate) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_rto_backoff",
+				test_rto_backoff) == NULL)
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
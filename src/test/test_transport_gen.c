@@ -1,5 +1,6 @@
 
 #include <stdbool.h>
+#include <string.h>
 
 #include "CUnit/Basic.h"
 #include "CUnit/Console.h"
@@ -163,3 +164,62 @@ void test_find_conn_by_addr()
 	}
 	free(llp);
 }
+
+size_t conn_key_test(struct firefly_connection *conn, unsigned char *key)
+{
+	memcpy(key, conn->transport->context, sizeof(long));
+	return sizeof(long);
+}
+
+#define NBR_KEYED_CONNS (100)
+
+void test_find_conn_by_key()
+{
+	struct firefly_transport_llp *llp = calloc(1, sizeof(*llp));
+	struct firefly_transport_connection tc[NBR_KEYED_CONNS];
+	struct firefly_connection conn[NBR_KEYED_CONNS];
+	struct llp_connection_list_node *node[NBR_KEYED_CONNS];
+	long data[NBR_KEYED_CONNS];
+
+	llp_connections_init(llp, conn_key_test);
+	CU_ASSERT_PTR_NULL(find_connection_by_key(llp, &data[0], sizeof(long)));
+	for (int i = 0; i < NBR_KEYED_CONNS; i++) {
+		data[i] = 1000 + i;
+		tc[i].context = &data[i];
+		conn[i].transport = &tc[i];
+		node[i] = add_connection_to_llp(&conn[i], llp);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(node[i]);
+	}
+	CU_ASSERT_PTR_EQUAL(llp->conn_list, node[NBR_KEYED_CONNS - 1]);
+	for (int i = 0; i < NBR_KEYED_CONNS; i++) {
+		CU_ASSERT_PTR_EQUAL(find_connection_by_key(llp, &data[i],
+					sizeof(long)), &conn[i]);
+		CU_ASSERT_PTR_EQUAL(find_connection(llp, &data[i], conn_eq_test),
+					&conn[i]);
+	}
+	long missing = 1;
+	CU_ASSERT_PTR_NULL(find_connection_by_key(llp, &missing, sizeof(long)));
+
+	// Removed connections are neither found in the list nor by key.
+	CU_ASSERT_PTR_EQUAL(remove_connection_ptr_from_llp(llp, &conn[10]),
+			&conn[10]);
+	CU_ASSERT_PTR_NULL(remove_connection_ptr_from_llp(llp, &conn[10]));
+	remove_connection_node_from_llp(llp, node[20]);
+	CU_ASSERT_PTR_EQUAL(remove_connection_from_llp(llp, &data[30],
+				conn_eq_test), &conn[30]);
+	CU_ASSERT_PTR_NULL(find_connection_by_key(llp, &data[10], sizeof(long)));
+	CU_ASSERT_PTR_NULL(find_connection_by_key(llp, &data[20], sizeof(long)));
+	CU_ASSERT_PTR_NULL(find_connection_by_key(llp, &data[30], sizeof(long)));
+	CU_ASSERT_PTR_NULL(find_connection(llp, &data[20], conn_eq_test));
+	CU_ASSERT_PTR_EQUAL(find_connection_by_key(llp, &data[21],
+				sizeof(long)), &conn[21]);
+
+	for (int i = 0; i < NBR_KEYED_CONNS; i++) {
+		if (i != 10 && i != 20 && i != 30)
+			remove_connection_ptr_from_llp(llp, &conn[i]);
+	}
+	CU_ASSERT_PTR_NULL(llp->conn_list);
+	CU_ASSERT_EQUAL(llp->nbr_keyed_conns, 0);
+	llp_connections_free(llp);
+	free(llp);
+}
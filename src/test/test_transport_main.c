@@ -31,6 +31,9 @@ int main()
 			   ||
 		(CU_add_test(trans_gen, "test_remove_conn_by_addr",
 				test_remove_conn_by_addr) == NULL)
+			   ||
+		(CU_add_test(trans_gen, "test_find_conn_by_key",
+				test_find_conn_by_key) == NULL)
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -805,24 +805,25 @@ void test_send_important()
 	conn = tmp_conn;
 	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
 
-	unsigned char id;
+	unsigned int id;
 	struct timespec before;
 	clock_gettime(CLOCK_REALTIME, &before);
 	firefly_transport_udp_posix_write(send_buf, sizeof(send_buf), conn, true, &id);
 	struct timespec after;
 	clock_gettime(CLOCK_REALTIME, &after);
 
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->last);
+	struct resend_elem *re = firefly_resend_top(llp_udp->resend_queue);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(re);
+	CU_ASSERT_EQUAL(re->id, id);
 
-	CU_ASSERT_TRUE(memcmp(send_buf, llp_udp->resend_queue->first->data,
+	CU_ASSERT_TRUE(memcmp(send_buf, re->data,
 				sizeof(send_buf)) == 0);
 
 	bool test_before = time_ms_diff(&before,
-			&llp_udp->resend_queue->first->resend_at) >=
+			&re->resend_at) >=
 			FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_TIMEOUT;
 	bool test_after = time_ms_diff(&after,
-			&llp_udp->resend_queue->first->resend_at) <=
+			&re->resend_at) <=
 			FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_TIMEOUT;
 	CU_ASSERT_TRUE(test_before);
 	CU_ASSERT_TRUE(test_after);
@@ -832,10 +833,10 @@ void test_send_important()
 		print_timepsec(before);
 		printf("\n");
 		printf("at:\t");
-		print_timepsec(llp_udp->resend_queue->first->resend_at);
+		print_timepsec(re->resend_at);
 		printf("\n");
 		printf("diff:\t%d\n", time_ms_diff(&before,
-					&llp_udp->resend_queue->first->resend_at));
+					&re->resend_at));
 	}
 	if (!test_after) {
 		printf("\n");
@@ -843,10 +844,10 @@ void test_send_important()
 		print_timepsec(after);
 		printf("\n");
 		printf("at:\t");
-		print_timepsec(llp_udp->resend_queue->first->resend_at);
+		print_timepsec(re->resend_at);
 		printf("\n");
 		printf("diff:\t%d\n", time_ms_diff(&after,
-					&llp_udp->resend_queue->first->resend_at));
+					&re->resend_at));
 	}
 
 	firefly_transport_llp_udp_posix_free(llp);
@@ -873,16 +874,15 @@ void test_send_important_ack()
 	conn = tmp_conn;
 	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
 
-	unsigned char id;
+	unsigned int id;
 	firefly_transport_udp_posix_write(send_buf, sizeof(send_buf), conn, true, &id);
 
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->last);
+	CU_ASSERT_EQUAL(llp_udp->resend_queue->count, 1);
 
 	firefly_transport_udp_posix_ack(id, conn);
 
-	CU_ASSERT_PTR_NULL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NULL(llp_udp->resend_queue->last);
+	CU_ASSERT_EQUAL(llp_udp->resend_queue->count, 0);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(llp_udp->resend_queue));
 
 	firefly_transport_llp_udp_posix_free(llp);
 	event_execute_all_test(eq);
@@ -912,8 +912,7 @@ void test_send_important_id_null()
 	firefly_transport_udp_posix_write(send_buf, sizeof(send_buf), conn, true, NULL);
 	CU_ASSERT_TRUE(was_in_error);
 
-	CU_ASSERT_PTR_NULL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NULL(llp_udp->resend_queue->last);
+	CU_ASSERT_PTR_NULL(firefly_resend_top(llp_udp->resend_queue));
 
 	firefly_transport_llp_udp_posix_free(llp);
 	event_execute_all_test(eq);
@@ -940,23 +939,24 @@ void test_send_important_long_timeout()
 	conn = tmp_conn;
 	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
 
-	unsigned char id;
+	unsigned int id;
 	struct timespec before;
 	clock_gettime(CLOCK_REALTIME, &before);
 	firefly_transport_udp_posix_write(send_buf, sizeof(send_buf), conn, true, &id);
 	struct timespec after;
 	clock_gettime(CLOCK_REALTIME, &after);
 
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->last);
+	struct resend_elem *re = firefly_resend_top(llp_udp->resend_queue);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(re);
+	CU_ASSERT_EQUAL(re->id, id);
 
-	CU_ASSERT_TRUE(memcmp(send_buf, llp_udp->resend_queue->first->data,
+	CU_ASSERT_TRUE(memcmp(send_buf, re->data,
 				sizeof(send_buf)) == 0);
 
 	bool test_before = time_ms_diff(&before,
-			&llp_udp->resend_queue->first->resend_at) >= long_timeout;
+			&re->resend_at) >= long_timeout;
 	bool test_after = time_ms_diff(&after,
-			&llp_udp->resend_queue->first->resend_at) <= long_timeout;
+			&re->resend_at) <= long_timeout;
 	CU_ASSERT_TRUE(test_before);
 	CU_ASSERT_TRUE(test_after);
 	if (!test_before) {
@@ -965,7 +965,7 @@ void test_send_important_long_timeout()
 		print_timepsec(before);
 		printf("\n");
 		printf("at:\t");
-		print_timepsec(llp_udp->resend_queue->first->resend_at);
+		print_timepsec(re->resend_at);
 		printf("\n");
 	}
 	if (!test_after) {
@@ -974,7 +974,7 @@ void test_send_important_long_timeout()
 		print_timepsec(after);
 		printf("\n");
 		printf("at:\t");
-		print_timepsec(llp_udp->resend_queue->first->resend_at);
+		print_timepsec(re->resend_at);
 		printf("\n");
 	}
 
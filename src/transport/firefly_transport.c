@@ -5,47 +5,201 @@
 #include "transport/firefly_transport_private.h"
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <transport/firefly_transport.h>
 
 #include "protocol/firefly_protocol_private.h"
 #include "utils/firefly_errors.h"
 
-void add_connection_to_llp(struct firefly_connection *conn,
-		struct firefly_transport_llp *llp)
+void llp_connections_init(struct firefly_transport_llp *llp,
+		conn_key_f conn_key)
+{
+	llp->conn_list = NULL;
+	llp->conn_key = conn_key;
+	llp->conn_buckets = NULL;
+	llp->nbr_conn_buckets = 0;
+	llp->nbr_keyed_conns = 0;
+}
+
+void llp_connections_free(struct firefly_transport_llp *llp)
+{
+	FIREFLY_FREE(llp->conn_buckets);
+	llp->conn_buckets = NULL;
+	llp->nbr_conn_buckets = 0;
+}
+
+/* FNV-1a */
+static unsigned int llp_key_hash(const unsigned char *key, size_t key_size)
+{
+	unsigned int hash = 2166136261u;
+
+	for (size_t i = 0; i < key_size; i++) {
+		hash ^= key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void llp_bucket_insert(struct firefly_transport_llp *llp,
+		struct llp_connection_list_node *node)
+{
+	size_t b = node->hash & (llp->nbr_conn_buckets - 1);
+
+	node->bucket_next = llp->conn_buckets[b];
+	llp->conn_buckets[b] = node;
+}
+
+static void llp_bucket_remove(struct firefly_transport_llp *llp,
+		struct llp_connection_list_node *node)
+{
+	struct llp_connection_list_node **n;
+
+	n = &llp->conn_buckets[node->hash & (llp->nbr_conn_buckets - 1)];
+	while (*n != NULL && *n != node)
+		n = &(*n)->bucket_next;
+	if (*n != NULL) {
+		*n = node->bucket_next;
+		llp->nbr_keyed_conns--;
+	}
+}
+
+/*
+ * Make room for one more keyed connection, doubling the buckets when there
+ * would be more connections than buckets.
+ */
+static int llp_buckets_reserve(struct firefly_transport_llp *llp)
+{
+	struct llp_connection_list_node **old = llp->conn_buckets;
+	struct llp_connection_list_node *node;
+	size_t old_size = llp->nbr_conn_buckets;
+	size_t size;
+
+	if (llp->nbr_keyed_conns < old_size)
+		return 0;
+	size = old_size > 0 ? old_size * 2 : FIREFLY_LLP_CONN_BUCKETS;
+	llp->conn_buckets = FIREFLY_MALLOC(size * sizeof(*llp->conn_buckets));
+	if (llp->conn_buckets == NULL) {
+		llp->conn_buckets = old;
+		// Long chains are still better than no connection.
+		return old != NULL ? 0 : -1;
+	}
+	memset(llp->conn_buckets, 0, size * sizeof(*llp->conn_buckets));
+	llp->nbr_conn_buckets = size;
+	for (size_t i = 0; i < old_size; i++) {
+		while ((node = old[i]) != NULL) {
+			old[i] = node->bucket_next;
+			llp_bucket_insert(llp, node);
+		}
+	}
+	FIREFLY_FREE(old);
+	return 0;
+}
+
+struct llp_connection_list_node *add_connection_to_llp(
+		struct firefly_connection *conn, struct firefly_transport_llp *llp)
 {
-	struct llp_connection_list_node *tmp;
 	struct llp_connection_list_node *new_node;
 
-	tmp = llp->conn_list;
 	new_node = FIREFLY_MALLOC(sizeof(*new_node));
 	if (!new_node) {
 		FFL(FIREFLY_ERROR_ALLOC);
-		return;
+		return NULL;
 	}
 	new_node->conn = conn;
-	new_node->next = tmp;
+	new_node->key_size = 0;
+	new_node->bucket_next = NULL;
+	if (llp->conn_key != NULL) {
+		if (llp_buckets_reserve(llp)) {
+			FIREFLY_FREE(new_node);
+			FFL(FIREFLY_ERROR_ALLOC);
+			return NULL;
+		}
+		new_node->key_size = llp->conn_key(conn, new_node->key);
+		new_node->hash = llp_key_hash(new_node->key, new_node->key_size);
+		llp_bucket_insert(llp, new_node);
+		llp->nbr_keyed_conns++;
+	}
+	new_node->prev = NULL;
+	new_node->next = llp->conn_list;
+	if (llp->conn_list != NULL)
+		llp->conn_list->prev = new_node;
 	llp->conn_list = new_node;
+	return new_node;
+}
+
+void remove_connection_node_from_llp(struct firefly_transport_llp *llp,
+		struct llp_connection_list_node *node)
+{
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else
+		llp->conn_list = node->next;
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	if (llp->conn_key != NULL)
+		llp_bucket_remove(llp, node);
+	FIREFLY_FREE(node);
+}
+
+struct firefly_connection *remove_connection_ptr_from_llp(
+		struct firefly_transport_llp *llp, struct firefly_connection *conn)
+{
+	struct llp_connection_list_node *node;
+	unsigned char key[FIREFLY_LLP_CONN_KEY_MAX];
+	unsigned int hash;
+
+	if (llp->conn_key == NULL || llp->nbr_keyed_conns == 0)
+		return remove_connection_from_llp(llp, conn,
+				firefly_connection_eq_ptr);
+	hash = llp_key_hash(key, llp->conn_key(conn, key));
+	node = llp->conn_buckets[hash & (llp->nbr_conn_buckets - 1)];
+	while (node != NULL && node->conn != conn)
+		node = node->bucket_next;
+	if (node == NULL)
+		return NULL;
+	remove_connection_node_from_llp(llp, node);
+	return conn;
+}
+
+struct llp_connection_list_node *find_connection_node(
+		struct firefly_transport_llp *llp, const void *key, size_t key_size)
+{
+	struct llp_connection_list_node *node;
+	unsigned int hash;
+
+	if (llp->nbr_keyed_conns == 0)
+		return NULL;
+	hash = llp_key_hash(key, key_size);
+	node = llp->conn_buckets[hash & (llp->nbr_conn_buckets - 1)];
+	while (node != NULL && (node->hash != hash ||
+				node->key_size != key_size ||
+				memcmp(node->key, key, key_size) != 0))
+		node = node->bucket_next;
+	return node;
 }
 
 struct firefly_connection *remove_connection_from_llp(
 		struct firefly_transport_llp *llp,
 		void *context, conn_eq_f conn_eq)
 {
-	struct firefly_connection *ret = NULL;
 	struct llp_connection_list_node **head = &llp->conn_list;
-	/*printf("head: %p\n", head);*/
-	while (head != NULL && (*head) != NULL) {
-		if (conn_eq((*head)->conn, context)) {
-			ret = (*head)->conn;
-			struct llp_connection_list_node *tmp = (*head)->next;
-			FIREFLY_FREE(*head);
-			*head = tmp;
-			head = NULL;
-		} else {
-			*head = (*head)->next;
-		}
-	}
+	struct llp_connection_list_node *node;
+	struct firefly_connection *ret;
+
+	while (*head != NULL && !conn_eq((*head)->conn, context))
+		head = &(*head)->next;
+	if (*head == NULL)
+		return NULL;
+	node = *head;
+	ret = node->conn;
+	*head = node->next;
+	if (node->next != NULL)
+		node->next->prev = head == &llp->conn_list ? NULL : node->prev;
+	if (llp->conn_key != NULL)
+		llp_bucket_remove(llp, node);
+	FIREFLY_FREE(node);
 	return ret;
 }
 
@@ -71,8 +225,53 @@ bool firefly_connection_eq_ptr(struct firefly_connection *conn, void *context)
 	return conn == context;
 }
 
+void transport_buffer_received(struct firefly_transport_llp *llp,
+		struct firefly_connection *conn, struct firefly_buffer *buf)
+{
+	unsigned char *data;
+
+	if (llp->protocol_buffer_received_cb != NULL) {
+		llp->protocol_buffer_received_cb(conn, buf);
+		return;
+	}
+	data = malloc(buf->size);
+	if (data == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+	} else {
+		memcpy(data, buf->data, buf->size);
+		llp->protocol_data_received_cb(conn, data, buf->size);
+	}
+	firefly_buffer_unref(buf);
+}
+
 void replace_protocol_data_received_cb(struct firefly_transport_llp *llp,
 		protocol_data_received_f protocol_data_received_cb)
 {
 	llp->protocol_data_received_cb = protocol_data_received_cb;
+	llp->protocol_buffer_received_cb = NULL;
+}
+
+int transport_socket_priority(enum firefly_channel_priority priority)
+{
+	switch (priority) {
+	case FIREFLY_CHANNEL_PRIORITY_BULK:
+		return 1;
+	case FIREFLY_CHANNEL_PRIORITY_CONTROL:
+		// The highest priority settable without CAP_NET_ADMIN.
+		return 6;
+	default:
+		return 0;
+	}
+}
+
+int transport_dscp(enum firefly_channel_priority priority)
+{
+	switch (priority) {
+	case FIREFLY_CHANNEL_PRIORITY_BULK:
+		return 8;
+	case FIREFLY_CHANNEL_PRIORITY_CONTROL:
+		return 46;
+	default:
+		return 0;
+	}
 }
@@ -20,6 +20,7 @@
 #include <netinet/ether.h>	// defines ETH_P_ALL, AF_PACKET
 #include <arpa/inet.h>		// defines htons
 #include <linux/if.h>		// defines ifreq, IFNAMSIZ
+#include <asm/socket.h>		// defines SO_PRIORITY
 
 #include <utils/firefly_event_queue.h>
 #include <utils/firefly_errors.h>
@@ -96,6 +97,8 @@ struct firefly_transport_llp *firefly_transport_llp_eth_posix_new(
 	memset(&llp_eth->read_thread, 0, sizeof(llp_eth->read_thread));
 	memset(&llp_eth->resend_thread, 0, sizeof(llp_eth->read_thread));
 	llp_eth->running = false;
+	llp_eth->reactor = NULL;
+	llp_eth->reactor_largs = NULL;
 
 	llp				= malloc(sizeof(*llp));
 	if (!llp) {
@@ -104,9 +107,13 @@ struct firefly_transport_llp *firefly_transport_llp_eth_posix_new(
 		FFL(FIREFLY_ERROR_ALLOC);
 		return NULL;
 	}
+	pthread_mutex_init(&llp_eth->write_lock, NULL);
+	pthread_mutex_init(&llp_eth->conn_lock, NULL);
+	llp_eth->tx_priority = -1;
 	llp->llp_platspec		= llp_eth;
-	llp->conn_list			= NULL;
+	llp_connections_init(llp, connection_key_addr);
 	llp->protocol_data_received_cb	= protocol_data_received;
+	llp->protocol_buffer_received_cb	= protocol_buffer_received;
 	llp->state				= FIREFLY_LLP_OPEN;
 	return llp;
 }
@@ -128,7 +135,10 @@ static void check_llp_free(struct firefly_transport_llp *llp)
 		llp_eth = llp->llp_platspec;
 		close(llp_eth->socket);
 		firefly_resend_queue_free(llp_eth->resend_queue);
+		pthread_mutex_destroy(&llp_eth->write_lock);
+		pthread_mutex_destroy(&llp_eth->conn_lock);
 		free(llp_eth);
+		llp_connections_free(llp);
 		free(llp);
 	}
 }
@@ -153,8 +163,12 @@ int firefly_transport_llp_eth_posix_free_event(void *event_arg)
 static int connection_open(struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_eth_posix *tcep;
+	struct transport_llp_eth_posix *llp_eth;
 	tcep = conn->transport->context;
+	llp_eth = tcep->llp->llp_platspec;
+	pthread_mutex_lock(&llp_eth->conn_lock);
 	add_connection_to_llp(conn, tcep->llp);
+	pthread_mutex_unlock(&llp_eth->conn_lock);
 	return 0;
 }
 
@@ -162,11 +176,14 @@ static int connection_close(struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_eth_posix *tcep;
 	struct firefly_transport_llp *llp;
+	struct transport_llp_eth_posix *llp_eth;
 	tcep = conn->transport->context;
 	llp = tcep->llp;
+	llp_eth = llp->llp_platspec;
 
-	remove_connection_from_llp(tcep->llp, conn,
-			firefly_connection_eq_ptr);
+	pthread_mutex_lock(&llp_eth->conn_lock);
+	remove_connection_ptr_from_llp(tcep->llp, conn);
+	pthread_mutex_unlock(&llp_eth->conn_lock);
 	free(tcep->remote_addr);
 	free(tcep);
 	free(conn->transport);
@@ -222,25 +239,57 @@ struct firefly_transport_connection *firefly_transport_connection_eth_posix_new(
 
 	tcep->socket = llp_eth->socket;
 	tcep->llp = llp;
-	tcep->timeout = FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_TIMEOUT;
+	firefly_rto_init(&tcep->rto, FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_TIMEOUT,
+			FIREFLY_TRANSPORT_ETH_POSIX_MIN_TIMEOUT,
+			FIREFLY_TRANSPORT_ETH_POSIX_MAX_TIMEOUT);
 	tc->context = tcep;
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_eth_posix_write;
+	tc->write_buffer = firefly_transport_eth_posix_write_buffer;
 	tc->ack = firefly_transport_eth_posix_ack;
 
 	return tc;
 }
 
+/*
+ * Send a frame on the socket of a connection with the socket priority of the
+ * priority class of the frame. The socket is shared by all connections of the
+ * llp so the option and the send are serialized by the write lock.
+ */
+static int eth_posix_send(struct firefly_connection *conn,
+		unsigned char *data, size_t data_size, int priority)
+{
+	struct firefly_transport_connection_eth_posix *tcep;
+	struct transport_llp_eth_posix *llp_eth;
+	int opt;
+	int res;
+
+	tcep = conn->transport->context;
+	llp_eth = tcep->llp->llp_platspec;
+	pthread_mutex_lock(&llp_eth->write_lock);
+	if (priority != llp_eth->tx_priority) {
+		opt = transport_socket_priority(priority);
+		setsockopt(tcep->socket, SOL_SOCKET, SO_PRIORITY, &opt, sizeof(opt));
+		llp_eth->tx_priority = priority;
+	}
+	res = sendto(tcep->socket, data, data_size, 0,
+			(struct sockaddr *)tcep->remote_addr,
+			sizeof(*tcep->remote_addr));
+	pthread_mutex_unlock(&llp_eth->write_lock);
+	return res;
+}
+
 void firefly_transport_eth_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, unsigned int *id)
 {
 	int err;
+	int priority;
 	struct firefly_transport_connection_eth_posix *tcep =
 		 conn->transport->context;
-	err = sendto(tcep->socket, data, data_size, 0,
-			(struct sockaddr *)tcep->remote_addr,
-			sizeof(*tcep->remote_addr));
+	// The class of the frame is set by the event writing it.
+	priority = firefly_connection_tx_priority(conn);
+	err = eth_posix_send(conn, data, data_size, priority);
 	if (err < 0) {
 		FFL(FIREFLY_ERROR_SOCKET);
 		firefly_connection_raise_later(conn,
@@ -258,12 +307,39 @@ void firefly_transport_eth_posix_write(unsigned char *data, size_t data_size,
 		memcpy(new_data, data, data_size);
 		llp_ps = tcep->llp->llp_platspec;
 		*id = firefly_resend_add(llp_ps->resend_queue,
-				new_data, data_size, tcep->timeout,
-				FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_RETRIES, conn);
+				new_data, data_size, 0,
+				FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_RETRIES, &tcep->rto,
+				priority, conn);
 	}
 }
 
-void firefly_transport_eth_posix_ack(unsigned char pkt_id,
+void firefly_transport_eth_posix_write_buffer(struct firefly_buffer *frame,
+		struct firefly_connection *conn, bool important, unsigned int *id)
+{
+	int err;
+	int priority;
+	struct transport_llp_eth_posix *llp_ps;
+	struct firefly_transport_connection_eth_posix *tcep =
+		 conn->transport->context;
+
+	priority = firefly_connection_tx_priority(conn);
+	err = eth_posix_send(conn, frame->data, frame->size, priority);
+	if (err < 0) {
+		FFL(FIREFLY_ERROR_SOCKET);
+		firefly_connection_raise_later(conn,
+				FIREFLY_ERROR_TRANS_WRITE, "sendto() failed");
+	}
+	if (important && id != NULL) {
+		llp_ps = tcep->llp->llp_platspec;
+		*id = firefly_resend_add_buffer(llp_ps->resend_queue, frame,
+				0, FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_RETRIES, &tcep->rto,
+				priority, conn);
+	} else {
+		firefly_buffer_unref(frame);
+	}
+}
+
+void firefly_transport_eth_posix_ack(unsigned int pkt_id,
 		struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_eth_posix *conn_eth;
@@ -277,10 +353,31 @@ void firefly_transport_eth_posix_ack(unsigned char pkt_id,
 struct firefly_event_llp_read_eth_posix {
 	struct firefly_transport_llp *llp;
 	struct sockaddr_ll addr;
-	size_t len;
-	unsigned char *data;
+	struct firefly_buffer *buf;
+	struct firefly_connection *conn; /* The strand of the event. */
 };
 
+/*
+ * Find the connection of a remote address under the connection lock, the
+ * reader thread looks up connections while events open and close them.
+ */
+static struct firefly_connection *eth_posix_find_connection(
+		struct firefly_transport_llp *llp, struct sockaddr_ll *addr)
+{
+	struct transport_llp_eth_posix *llp_eth = llp->llp_platspec;
+	struct firefly_connection *conn;
+
+	pthread_mutex_lock(&llp_eth->conn_lock);
+	conn = find_connection_by_key(llp, addr->sll_addr, addr->sll_halen);
+	pthread_mutex_unlock(&llp_eth->conn_lock);
+	return conn;
+}
+
+/*
+ * Read events run on the strand of the connection the packet was received
+ * on, packets from unknown remote nodes run without strand since they may
+ * open a connection.
+ */
 static int firefly_transport_eth_posix_read_event(void *event_args)
 {
 	struct firefly_event_llp_read_eth_posix *ev_a;
@@ -289,7 +386,15 @@ static int firefly_transport_eth_posix_read_event(void *event_args)
 
 	ev_a = event_args;
 	llp_eth = ev_a->llp->llp_platspec;
-	conn = find_connection(ev_a->llp, &ev_a->addr, connection_eq_addr);
+	conn = eth_posix_find_connection(ev_a->llp, &ev_a->addr);
+	if (conn != ev_a->conn) {
+		// The connection was opened or closed after the packet was
+		// received, move the event to the strand of the current one.
+		ev_a->conn = conn;
+		return firefly_event_offer_strand(llp_eth->event_queue, conn,
+				FIREFLY_PRIORITY_HIGH,
+				firefly_transport_eth_posix_read_event, ev_a, 0, NULL);
+	}
 	if (conn == NULL) {
 		char mac_addr[MACADDR_STRLEN];
 		get_mac_addr(&ev_a->addr, mac_addr);
@@ -303,42 +408,43 @@ static int firefly_transport_eth_posix_read_event(void *event_args)
 					firefly_transport_eth_posix_read_event,
 					ev_a, 1, &ev_id);
 		} else {
-			free(ev_a->data);
+			firefly_buffer_unref(ev_a->buf);
 		}
 	} else {
-		ev_a->llp->protocol_data_received_cb(conn, ev_a->data, ev_a->len);
+		transport_buffer_received(ev_a->llp, conn, ev_a->buf);
 	}
 	free(ev_a);
 
 	return 0;
 }
 
-void firefly_transport_eth_posix_read(struct firefly_transport_llp *llp,
-		struct timeval *tv)
+/*
+ * Receive one packet from the socket, which must be readable, and offer it to
+ * the event queue.
+ */
+static void firefly_transport_eth_posix_receive(
+		struct firefly_transport_llp *llp)
 {
 	struct firefly_event_llp_read_eth_posix *ev_arg;
 	struct transport_llp_eth_posix *llp_eth;
 	socklen_t addr_len;
-	unsigned char tmp_buffer[1500];
+	struct firefly_buffer *buf;
 	struct sockaddr_ll tmp_address;
-	fd_set fs;
 	int res;
 
 	llp_eth = llp->llp_platspec;
-	FD_ZERO(&fs);
-	FD_SET(llp_eth->socket, &fs);
-	res = select(llp_eth->socket + 1, &fs, NULL, NULL, tv);
-	if (res == 0)
-		return;
-	if (res == -1) {
-		FFL(FIREFLY_ERROR_SOCKET);
+	// The frame is received straight into the buffer passed on to the
+	// protocol layer.
+	buf = firefly_buffer_new(1500);
+	if (!buf) {
+		FFL(FIREFLY_ERROR_ALLOC);
 		return;
 	}
-
 	addr_len = sizeof(tmp_address);
-	res = recvfrom(llp_eth->socket, tmp_buffer, 1500, MSG_DONTWAIT,
+	res = recvfrom(llp_eth->socket, buf->data, 1500, MSG_DONTWAIT,
 			(struct sockaddr *) &tmp_address, &addr_len);
 	if (res == -EWOULDBLOCK || res == -EAGAIN) {
+		firefly_buffer_unref(buf);
 		return;
 	} else if (res < 0) {
 		char err_buf[ERROR_STR_MAX_LEN];
@@ -346,28 +452,46 @@ void firefly_transport_eth_posix_read(struct firefly_transport_llp *llp,
 		firefly_error(FIREFLY_ERROR_SOCKET, 3,
 			      "recvfrom() failed in %s.\n%s()\n",
 			      __FUNCTION__, err_buf);
+		firefly_buffer_unref(buf);
 		return;
 	}
+	buf->size = res;
 	ev_arg = malloc(sizeof(*ev_arg));
 	if (!ev_arg) {
 		FFL(FIREFLY_ERROR_ALLOC);
+		firefly_buffer_unref(buf);
 		return;
 	}
-	ev_arg->data = malloc(res);
-	if (!ev_arg->data) {
-		FFL(FIREFLY_ERROR_ALLOC);
-		return;
-	}
-	ev_arg->len = res;
+	ev_arg->buf = buf;
 	ev_arg->addr = tmp_address;
 	ev_arg->llp = llp;
-	memcpy(ev_arg->data, tmp_buffer, ev_arg->len);
+	ev_arg->conn = eth_posix_find_connection(llp, &tmp_address);
 
-	llp_eth->event_queue->offer_event_cb(llp_eth->event_queue,
+	firefly_event_offer_strand(llp_eth->event_queue, ev_arg->conn,
 			FIREFLY_PRIORITY_HIGH,
 			firefly_transport_eth_posix_read_event, ev_arg, 0, NULL);
 }
 
+void firefly_transport_eth_posix_read(struct firefly_transport_llp *llp,
+		struct timeval *tv)
+{
+	struct transport_llp_eth_posix *llp_eth;
+	fd_set fs;
+	int res;
+
+	llp_eth = llp->llp_platspec;
+	FD_ZERO(&fs);
+	FD_SET(llp_eth->socket, &fs);
+	res = select(llp_eth->socket + 1, &fs, NULL, NULL, tv);
+	if (res == 0)
+		return;
+	if (res == -1) {
+		FFL(FIREFLY_ERROR_SOCKET);
+		return;
+	}
+	firefly_transport_eth_posix_receive(llp);
+}
+
 void *firefly_transport_eth_posix_read_run(void *arg)
 {
 	struct firefly_transport_llp *llp;
@@ -390,6 +514,20 @@ static void resend_on_no_ack(struct firefly_connection *conn)
 	firefly_connection_raise_later(conn, FIREFLY_ERROR_TRANS_WRITE, NULL);
 }
 
+/*
+ * Resend a packet with the class it was first sent with, the class of the
+ * frame last written on the connection may be another one.
+ */
+static void resend_packet(struct firefly_connection *conn,
+		unsigned char *data, size_t size, int priority)
+{
+	if (eth_posix_send(conn, data, size, priority) < 0) {
+		FFL(FIREFLY_ERROR_SOCKET);
+		firefly_connection_raise_later(conn,
+				FIREFLY_ERROR_TRANS_WRITE, "sendto() failed");
+	}
+}
+
 int firefly_transport_eth_posix_run(struct firefly_transport_llp *llp)
 {
 	int res;
@@ -409,6 +547,8 @@ int firefly_transport_eth_posix_run(struct firefly_transport_llp *llp)
 	}
 	largs->rq = llp_eth->resend_queue;
 	largs->on_no_ack = resend_on_no_ack;
+	largs->on_resend = firefly_connection_resend_timeout;
+	largs->resend = resend_packet;
 	res = pthread_create(&llp_eth->resend_thread, NULL,
 				 firefly_resend_run, largs);
 	if (res < 0) {
@@ -418,6 +558,58 @@ int firefly_transport_eth_posix_run(struct firefly_transport_llp *llp)
 	return 0;
 }
 
+static void firefly_transport_eth_posix_ready(int fd, void *context)
+{
+	UNUSED_VAR(fd);
+	firefly_transport_eth_posix_receive(context);
+}
+
+int firefly_transport_eth_posix_attach(struct firefly_transport_llp *llp,
+		struct firefly_reactor_posix *reactor)
+{
+	struct transport_llp_eth_posix *llp_eth;
+	struct firefly_resend_loop_args *largs;
+
+	llp_eth = llp->llp_platspec;
+	if (llp_eth->reactor != NULL)
+		return -1;
+	largs = malloc(sizeof(*largs));
+	if (!largs)
+		return -1;
+	largs->rq = llp_eth->resend_queue;
+	largs->on_no_ack = resend_on_no_ack;
+	largs->on_resend = firefly_connection_resend_timeout;
+	largs->resend = resend_packet;
+	if (firefly_resend_attach(largs, reactor) < 0) {
+		free(largs);
+		return -1;
+	}
+	if (firefly_reactor_posix_add(reactor, llp_eth->socket,
+				firefly_transport_eth_posix_ready, llp) < 0) {
+		firefly_resend_detach(largs, reactor);
+		free(largs);
+		return -1;
+	}
+	llp_eth->reactor = reactor;
+	llp_eth->reactor_largs = largs;
+	return 0;
+}
+
+int firefly_transport_eth_posix_detach(struct firefly_transport_llp *llp)
+{
+	struct transport_llp_eth_posix *llp_eth;
+
+	llp_eth = llp->llp_platspec;
+	if (llp_eth->reactor == NULL)
+		return -1;
+	firefly_reactor_posix_remove(llp_eth->reactor, llp_eth->socket);
+	firefly_resend_detach(llp_eth->reactor_largs, llp_eth->reactor);
+	free(llp_eth->reactor_largs);
+	llp_eth->reactor = NULL;
+	llp_eth->reactor_largs = NULL;
+	return 0;
+}
+
 int firefly_transport_eth_posix_stop(struct firefly_transport_llp *llp)
 {
 	struct transport_llp_eth_posix *llp_eth;
@@ -458,3 +650,14 @@ bool connection_eq_addr(struct firefly_connection *conn, void *context)
 	}
 	return result == 0;
 }
+
+size_t connection_key_addr(struct firefly_connection *conn,
+		unsigned char *key)
+{
+	struct firefly_transport_connection_eth_posix *conn_eth;
+
+	conn_eth = conn->transport->context;
+	memcpy(key, conn_eth->remote_addr->sll_addr,
+			conn_eth->remote_addr->sll_halen);
+	return conn_eth->remote_addr->sll_halen;
+}
@@ -9,6 +9,7 @@
 
 #include <transport/firefly_transport.h>
 #include <transport/firefly_transport_eth_posix.h>
+#include <utils/firefly_resend_posix.h>
 
 #include "transport/firefly_transport_private.h"
 
@@ -40,6 +41,17 @@ struct transport_llp_eth_posix {
 	pthread_t resend_thread; /**< The handle to the thread running the resend
 							   loop. */
 	bool running; /**< Whether or not the read loop should exit. */
+	struct firefly_reactor_posix *reactor; /**< The reactor the llp is attached
+											 to or NULL. */
+	struct firefly_resend_loop_args *reactor_largs; /**< The resend queue
+													  polled by the reactor. */
+	pthread_mutex_t write_lock; /**< Serializes the writes on the socket and
+								  the priority option they are sent with. */
+	pthread_mutex_t conn_lock; /**< Guards the connections of the llp, which
+								 the reader thread looks up to find the
+								 strand of read events. */
+	int tx_priority; /**< The channel priority class the socket option is set
+					   for or -1. */
 };
 
 /**
@@ -51,7 +63,8 @@ struct firefly_transport_connection_eth_posix {
 	struct firefly_transport_llp *llp; /**< The \a llp this connection is
 										 associated with. */
 	int socket; /**< The socket. */
-	unsigned int timeout; /**< The time between resends on this connection. */
+	struct firefly_rto rto; /**< The time between resends on this connection
+							  estimated from its round trip time. */
 };
 
 /**
@@ -76,7 +89,22 @@ int firefly_transport_llp_eth_posix_free_event(void *event_arg);
  * @see #firefly_transport_eth_posix_ack()
  */
 void firefly_transport_eth_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, unsigned int *id);
+
+/**
+ * @brief Write a frame on the specified connection without copying it.
+ * Implements #firefly_transport_connection_write_buffer_f.
+ *
+ * @param frame The frame to be written, the reference is handed over.
+ * @param conn The connection to written the data on.
+ * @param important If true the frame is kept in the resend queue until it is
+ * acked by calling #firefly_transport_eth_posix_ack or max retries is reached.
+ * @param id The variable to save the resend packed id in.
+ * @see #firefly_transport_connection_write_buffer_f()
+ * @see #firefly_transport_eth_posix_ack()
+ */
+void firefly_transport_eth_posix_write_buffer(struct firefly_buffer *frame,
+		struct firefly_connection *conn, bool important, unsigned int *id);
 
 /**
  * @brief Ack an important packed. Removes the packet from the resend queue.
@@ -87,7 +115,7 @@ void firefly_transport_eth_posix_write(unsigned char *data, size_t data_size,
  * @see #firefly_transport_connection_ack_f()
  * @see #firefly_transport_eth_posix_write()
  */
-void firefly_transport_eth_posix_ack(unsigned char pkt_id,
+void firefly_transport_eth_posix_ack(unsigned int pkt_id,
 		struct firefly_connection *conn);
 
 /**
@@ -112,4 +140,16 @@ void get_mac_addr(struct sockaddr_ll *addr, char *mac_addr);
  */
 bool connection_eq_addr(struct firefly_connection *conn, void *context);
 
+/**
+ * @brief Get the key of a connection, the MAC address of the remote node.
+ * Implements #conn_key_f.
+ *
+ * @param conn The connection.
+ * @param key The buffer to write the key to.
+ * @return The size of the key.
+ * @see #conn_key_f()
+ */
+size_t connection_key_addr(struct firefly_connection *conn,
+		unsigned char *key);
+
 #endif
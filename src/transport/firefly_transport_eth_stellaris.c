@@ -114,7 +114,7 @@ struct firefly_transport_llp *firefly_transport_llp_eth_stellaris_new(
 		return NULL;
 	}
 	llp->llp_platspec = llp_eth_stellaris;
-	llp->conn_list    = NULL;
+	llp_connections_init(llp, NULL);
 
 	return llp;
 }
@@ -144,6 +144,7 @@ int firefly_transport_llp_eth_stellaris_free_event(void *event_arg)
 	if (empty) {
 		struct transport_llp_eth_stellaris *llp_eth = llp->llp_platspec;
 		free(llp_eth);
+		llp_connections_free(llp);
 		free(llp);
 	} else {
 		firefly_transport_llp_eth_stellaris_free(llp);
@@ -197,13 +198,14 @@ firefly_transport_connection_eth_stellaris_new(
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_eth_stellaris_write;
+	tc->write_buffer = NULL;
 	tc->ack = firefly_transport_eth_stellaris_ack;
 
 	return tc;
 }
 
 void firefly_transport_eth_stellaris_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, unsigned int *id)
 {
 	struct firefly_transport_connection_eth_stellaris *conn_eth;
 	struct transport_llp_eth_stellaris *llp_eth;
@@ -231,7 +233,7 @@ void firefly_transport_eth_stellaris_write(unsigned char *data, size_t data_size
 	}
 }
 
-void firefly_transport_eth_stellaris_ack(unsigned char pkg_id,
+void firefly_transport_eth_stellaris_ack(unsigned int pkg_id,
 		struct firefly_connection *conn)
 {
 	UNUSED_VAR(pkg_id);
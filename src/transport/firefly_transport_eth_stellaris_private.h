@@ -184,7 +184,7 @@ int firefly_transport_llp_eth_stellaris_free_event(void *event_arg);
  * @see #firefly_transport_eth_stellaris_ack()
  */
 void firefly_transport_eth_stellaris_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, unsigned int *id);
 
 /**
  * @brief Ack an important packed. Removes the packet from the resend queue.
@@ -196,7 +196,7 @@ void firefly_transport_eth_stellaris_write(unsigned char *data, size_t data_size
  * @see #firefly_transport_connection_ack_f()
  * @see #firefly_transport_eth_posix_write()
  */
-void firefly_transport_eth_stellaris_ack(unsigned char pkt_id,
+void firefly_transport_eth_stellaris_ack(unsigned int pkt_id,
 		struct firefly_connection *conn);
 
 /**
@@ -125,7 +125,7 @@ struct firefly_transport_llp *firefly_transport_llp_eth_xeno_new(
 		return NULL;
 	}
 	llp->llp_platspec		= llp_eth;
-	llp->conn_list			= NULL;
+	llp_connections_init(llp, connection_key_addr);
 	llp->protocol_data_received_cb	= protocol_data_received;
 
 	return llp;
@@ -149,6 +149,7 @@ static void check_llp_free(struct firefly_transport_llp *llp)
 		rt_dev_close(llp_eth->socket);
 		rt_heap_delete(&llp_eth->dyn_mem);
 		free(llp_eth);
+		llp_connections_free(llp);
 		free(llp);
 	}
 }
@@ -234,8 +235,7 @@ static int connection_close(struct firefly_connection *conn)
 	tcex = conn->transport->context;
 	llp = tcex->llp;
 
-	remove_connection_from_llp(tcex->llp, conn,
-			firefly_connection_eq_ptr);
+	remove_connection_ptr_from_llp(tcex->llp, conn);
 	free(tcex->remote_addr);
 	free(tcex);
 	free(conn->transport);
@@ -294,13 +294,14 @@ struct firefly_transport_connection *firefly_transport_connection_eth_xeno_new(
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_eth_xeno_write;
+	tc->write_buffer = NULL;
 	tc->ack = firefly_transport_eth_xeno_ack;
 
 	return tc;
 }
 
 void firefly_transport_eth_xeno_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, unsigned int *id)
 {
 	int err;
 	struct firefly_transport_connection_eth_xeno *conn_eth =
@@ -317,7 +318,7 @@ void firefly_transport_eth_xeno_write(unsigned char *data, size_t data_size,
 	}
 }
 
-void firefly_transport_eth_xeno_ack(unsigned char pkt_id,
+void firefly_transport_eth_xeno_ack(unsigned int pkt_id,
 		struct firefly_connection *conn)
 {
 	UNUSED_VAR(pkt_id);
@@ -336,8 +337,8 @@ static int firefly_transport_eth_xeno_read_event(void *event_args)
 	struct firefly_event_llp_read_eth_xeno *ev_a = event_args;
 	struct transport_llp_eth_xeno *llp_eth = ev_a->llp->llp_platspec;
 
-	struct firefly_connection *conn = find_connection(ev_a->llp, &ev_a->addr,
-			connection_eq_addr);
+	struct firefly_connection *conn = find_connection_by_key(ev_a->llp,
+			ev_a->addr.sll_addr, ev_a->addr.sll_halen);
 	if (conn == NULL) {
 		char mac_addr[18];
 		get_mac_addr(&ev_a->addr, mac_addr);
@@ -509,3 +510,14 @@ bool connection_eq_addr(struct firefly_connection *conn, void *context)
 	}
 	return result == 0;
 }
+
+size_t connection_key_addr(struct firefly_connection *conn,
+		unsigned char *key)
+{
+	struct firefly_transport_connection_eth_xeno *conn_eth;
+
+	conn_eth = conn->transport->context;
+	memcpy(key, conn_eth->remote_addr->sll_addr,
+			conn_eth->remote_addr->sll_halen);
+	return conn_eth->remote_addr->sll_halen;
+}
@@ -78,7 +78,7 @@ int firefly_transport_llp_eth_xeno_free_event(void *event_arg);
  * @see #firefly_transport_eth_xeno_ack()
  */
 void firefly_transport_eth_xeno_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, unsigned int *id);
 
 /**
  * @brief Ack an important packed. Removes the packet from the resend queue.
@@ -89,7 +89,7 @@ void firefly_transport_eth_xeno_write(unsigned char *data, size_t data_size,
  * @see #firefly_transport_connection_ack_f()
  * @see #firefly_transport_eth_xeno_write()
  */
-void firefly_transport_eth_xeno_ack(unsigned char pkt_id,
+void firefly_transport_eth_xeno_ack(unsigned int pkt_id,
 		struct firefly_connection *conn);
 
 /**
@@ -114,4 +114,15 @@ void get_mac_addr(struct sockaddr_ll *addr, char *mac_addr);
  */
 bool connection_eq_addr(struct firefly_connection *conn, void *context);
 
+/**
+ * @brief Get the key of a connection, the MAC address of the remote node.
+ * Implements #conn_key_f.
+ *
+ * @param conn The connection.
+ * @param key The buffer to write the key to.
+ * @return The size of the key.
+ */
+size_t connection_key_addr(struct firefly_connection *conn,
+		unsigned char *key);
+
 #endif
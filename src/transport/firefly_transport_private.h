@@ -8,8 +8,20 @@
 #define FIREFLY_TRANSPORT_PRIVATE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <protocol/firefly_protocol_private.h>
 
+/**
+ * @brief The maximum size of the key identifying a connection of a llp, e.g.
+ * a MAC address or an IPv4 address and port.
+ */
+#define FIREFLY_LLP_CONN_KEY_MAX (8)
+
+/**
+ * @brief The initial number of connection hash buckets of a llp.
+ */
+#define FIREFLY_LLP_CONN_BUCKETS (16)
+
 /**
  * @brief The different states a llp may have. Used to enable multiple
  * asynchronous actions which depends on each other.
@@ -19,6 +31,18 @@ enum firefly_llp_state {
 	FIREFLY_LLP_CLOSING /**< Defines the closed state of a \a llp. */
 };
 
+/**
+ * @brief Gets the key identifying a connection of a llp, e.g. the address
+ * of the remote node.
+ *
+ * @param conn The connection.
+ * @param key The buffer to write the key to, #FIREFLY_LLP_CONN_KEY_MAX
+ * bytes.
+ * @return The size of the key.
+ */
+typedef size_t (*conn_key_f)(struct firefly_connection *conn,
+		unsigned char *key);
+
 /**
  * @brief A general data structure representing a link layer port on the
  * transport layer.
@@ -29,12 +53,28 @@ struct firefly_transport_llp {
 									layer. */
 	struct llp_connection_list_node *conn_list; /**< A linked list of all
 												  connections. */
+	conn_key_f conn_key; /**< Gets the key identifying a connection, NULL
+						   if the connections are not hashed. */
+	struct llp_connection_list_node **conn_buckets; /**< The connections
+													  hashed by key,
+													  allocated on the first
+													  add. */
+	size_t nbr_conn_buckets; /**< The number of conn_buckets, a power of
+							   two. */
+	size_t nbr_keyed_conns; /**< The number of connections in
+							  conn_buckets. */
 	void *llp_platspec; /**< Platform, and transport method, specific data. */
 	protocol_data_received_f protocol_data_received_cb; /** The function which
 														  passes data received
 														  by the transport
 														  layer. Replacable for
 														  testability. */
+	protocol_buffer_received_f protocol_buffer_received_cb; /** The function
+															  which passes
+															  received buffers,
+															  NULL if
+															  protocol_data_received_cb
+															  is replaced. */
 };
 
 /**
@@ -43,8 +83,33 @@ struct firefly_transport_llp {
 struct llp_connection_list_node {
 	struct llp_connection_list_node *next;
 	struct firefly_connection *conn;
+	struct llp_connection_list_node *prev; /**< The previous node. */
+	struct llp_connection_list_node *bucket_next; /**< The next node with
+													the same key hash. */
+	unsigned int hash; /**< The hash of the key. */
+	size_t key_size; /**< The size of key, 0 if the node has no key. */
+	unsigned char key[FIREFLY_LLP_CONN_KEY_MAX]; /**< The key identifying
+												   the connection. */
 };
 
+/**
+ * @brief Initialize the connection list and hash of a llp.
+ *
+ * @param llp The llp to initialize.
+ * @param conn_key The function getting the key of a connection, NULL if
+ * connections are only found with find_connection().
+ */
+void llp_connections_init(struct firefly_transport_llp *llp,
+		conn_key_f conn_key);
+
+/**
+ * @brief Free the connection hash of a llp, all connections must have been
+ * removed.
+ *
+ * @param llp The llp to free the hash of.
+ */
+void llp_connections_free(struct firefly_transport_llp *llp);
+
 /**
  * @brief Compares a connection to some value. This function is used by
  * find_connection to test if a connection is the one searched for.
@@ -57,13 +122,70 @@ struct llp_connection_list_node {
 typedef bool (*conn_eq_f)(struct firefly_connection *conn, void *context);
 
 /**
- * @brief Adds a connection to the connection list in \a llp.
+ * @brief Adds a connection to the connection list in \a llp. If the llp has
+ * a #conn_key_f the connection is also hashed by its key, so that it can be
+ * found in constant time with find_connection_by_key().
  *
  * @param conn The connection to add.
  * @param llp The link layer port structure to add the connection to.
+ * @return The list node of the connection.
+ * @retval NULL on failure.
+ */
+struct llp_connection_list_node *add_connection_to_llp(
+		struct firefly_connection *conn, struct firefly_transport_llp *llp);
+
+/**
+ * @brief Remove and free a list node previously returned by
+ * add_connection_to_llp(). Constant time.
+ *
+ * @param llp The llp to remove the node from.
+ * @param node The node to remove.
+ */
+void remove_connection_node_from_llp(struct firefly_transport_llp *llp,
+		struct llp_connection_list_node *node);
+
+/**
+ * @brief Remove a connection from \a llp. Constant time if the llp has a
+ * #conn_key_f.
+ *
+ * @param llp The llp to remove the connection from.
+ * @param conn The connection to remove.
+ * @return The removed connection.
+ * @retval NULL If the connection was not found.
+ */
+struct firefly_connection *remove_connection_ptr_from_llp(
+		struct firefly_transport_llp *llp, struct firefly_connection *conn);
+
+/**
+ * @brief Find the list node of the first connection added with a key.
+ *
+ * @param llp The llp to search.
+ * @param key The key of the connection.
+ * @param key_size The size of \p key.
+ * @return The list node of the connection.
+ * @retval NULL if no connection has the key.
  */
-void add_connection_to_llp(struct firefly_connection *conn,
-		struct firefly_transport_llp *llp);
+struct llp_connection_list_node *find_connection_node(
+		struct firefly_transport_llp *llp, const void *key, size_t key_size);
+
+/**
+ * @brief Find the first connection added with a key.
+ *
+ * @param llp The llp to search.
+ * @param key The key of the connection.
+ * @param key_size The size of \p key.
+ * @return The connection.
+ * @retval NULL if no connection has the key.
+ * @see find_connection_node()
+ */
+static inline struct firefly_connection *find_connection_by_key(
+		struct firefly_transport_llp *llp, const void *key, size_t key_size)
+{
+	struct llp_connection_list_node *node;
+
+	node = find_connection_node(llp, key, key_size);
+	return node != NULL ? node->conn : NULL;
+}
 
 /**
  * @brief Removes the first \c struct #firefly_connection for which the equals
@@ -105,11 +227,44 @@ struct firefly_connection *find_connection(struct firefly_transport_llp *llp,
 bool firefly_connection_eq_ptr(struct firefly_connection *conn, void *context);
 
 /**
- * @brief Replaces the callback called when data is received.
+ * @brief Pass a received buffer to the protocol layer of a connection.
+ *
+ * If the data callback of the llp is replaced, it is passed a copy of the
+ * data instead.
+ *
+ * @param llp The llp the buffer was received on.
+ * @param conn The connection the buffer was received on.
+ * @param buf The received buffer, the reference of the caller is handed
+ * over.
+ */
+void transport_buffer_received(struct firefly_transport_llp *llp,
+		struct firefly_connection *conn, struct firefly_buffer *buf);
+
+/**
+ * @brief Replaces the callback called when data is received. Received
+ * buffers are passed to the new callback as copies.
  *
  * Should normally not be used except when testing *only* transport layers.
  */
 void replace_protocol_data_received_cb(struct firefly_transport_llp *llp,
 		protocol_data_received_f protocol_data_received_cb);
 
+/**
+ * @brief Get the socket priority, e.g. \c SO_PRIORITY, the frames of a
+ * channel priority class are sent with.
+ *
+ * @param priority The class of the frame.
+ * @return The socket priority of \p priority.
+ */
+int transport_socket_priority(enum firefly_channel_priority priority);
+
+/**
+ * @brief Get the differentiated services code point the IP packets of a
+ * channel priority class are marked with.
+ *
+ * @param priority The class of the packet.
+ * @return The DSCP of \p priority, CS1 for bulk and EF for control traffic.
+ */
+int transport_dscp(enum firefly_channel_priority priority);
+
 #endif
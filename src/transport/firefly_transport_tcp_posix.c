@@ -28,17 +28,6 @@
 #define ERROR_STR_MAX_LEN        (256)
 #define SOCK_LISTEN_BACKLOG_SIZE (10)
 
-static bool connection_eq_sock(struct firefly_connection *conn, void *context)
-{
-	struct firefly_transport_connection_tcp_posix *tc_tcp;
-	int socket;
-
-	tc_tcp = conn->transport->context;
-	socket = *(int *) context;
-
-	return tc_tcp->socket == socket;
-}
-
 static void sockaddr_get_addr(struct sockaddr_in *addr, char *ip_addr)
 {
 	if (!inet_ntop(AF_INET, &addr->sin_addr.s_addr, ip_addr, INET_ADDRSTRLEN)) {
@@ -144,9 +133,13 @@ struct firefly_transport_llp *firefly_transport_llp_tcp_posix_new(
 
 	llp_tcp->on_conn_recv          = on_conn_recv;
 	llp_tcp->event_queue           = event_queue;
+	llp_tcp->reactor               = NULL;
+	llp_tcp->conn_by_sock          = NULL;
+	llp_tcp->nbr_conn_by_sock      = 0;
 	llp->llp_platspec              = llp_tcp;
-	llp->conn_list                 = NULL;
+	llp_connections_init(llp, NULL);
 	llp->protocol_data_received_cb = protocol_data_received;
+	llp->protocol_buffer_received_cb = protocol_buffer_received;
 	llp->state                     = FIREFLY_LLP_OPEN;
 
 	return llp;
@@ -170,7 +163,9 @@ static void check_llp_free(struct firefly_transport_llp *llp)
 						  __func__, __LINE__, err_buf);
 		}
 		free(llp_tcp->local_addr);
+		free(llp_tcp->conn_by_sock);
 		free(llp_tcp);
+		llp_connections_free(llp);
 		free(llp);
 	}
 }
@@ -210,25 +205,89 @@ void firefly_transport_llp_tcp_posix_free(struct firefly_transport_llp *llp)
 	FFLIF(ret < 0, FIREFLY_ERROR_EVENT);
 }
 
+static void firefly_transport_tcp_posix_ready(int fd, void *context);
+
+static void read_socket(struct firefly_transport_llp *llp, int i);
+
+/*
+ * Start reading from a connection socket, with the reactor if the llp is
+ * attached to one.
+ */
+static void add_socket(struct firefly_transport_llp *llp, int sock)
+{
+	struct transport_llp_tcp_posix *llp_tcp;
+
+	llp_tcp = llp->llp_platspec;
+	FD_SET(sock, &llp_tcp->master_set);
+	if (sock > llp_tcp->max_sock) {
+		llp_tcp->max_sock = sock;
+	}
+	if (llp_tcp->reactor != NULL)
+		firefly_reactor_posix_add(llp_tcp->reactor, sock,
+				firefly_transport_tcp_posix_ready, llp);
+}
+
 static int connection_open(struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_tcp_posix *tcup;
+	struct transport_llp_tcp_posix *llp_tcp;
+	struct llp_connection_list_node **by_sock;
+	int size;
 
 	tcup = conn->transport->context;
-	add_connection_to_llp(conn, tcup->llp);
+	llp_tcp = tcup->llp->llp_platspec;
+	if (tcup->socket >= llp_tcp->nbr_conn_by_sock) {
+		size = llp_tcp->nbr_conn_by_sock > 0 ?
+			llp_tcp->nbr_conn_by_sock : FD_SETSIZE;
+		while (size <= tcup->socket)
+			size *= 2;
+		by_sock = realloc(llp_tcp->conn_by_sock, size * sizeof(*by_sock));
+		if (by_sock == NULL) {
+			FFL(FIREFLY_ERROR_ALLOC);
+			return -1;
+		}
+		memset(by_sock + llp_tcp->nbr_conn_by_sock, 0,
+				(size - llp_tcp->nbr_conn_by_sock) * sizeof(*by_sock));
+		llp_tcp->conn_by_sock = by_sock;
+		llp_tcp->nbr_conn_by_sock = size;
+	}
+	llp_tcp->conn_by_sock[tcup->socket] = add_connection_to_llp(conn,
+			tcup->llp);
 
 	return 0;
 }
 
+/*
+ * Get the connection reading from a socket, NULL if there is none.
+ */
+static struct firefly_connection *find_connection_by_sock(
+		struct transport_llp_tcp_posix *llp_tcp, int sock)
+{
+	if (sock < 0 || sock >= llp_tcp->nbr_conn_by_sock ||
+			llp_tcp->conn_by_sock[sock] == NULL)
+		return NULL;
+	return llp_tcp->conn_by_sock[sock]->conn;
+}
+
 static int connection_close(struct firefly_connection *conn)
 {
 	struct firefly_transport_llp *llp;
+	struct transport_llp_tcp_posix *llp_tcp;
 	struct firefly_transport_connection_tcp_posix *tcup;
 
 	tcup = conn->transport->context;
 	llp = tcup->llp;
+	llp_tcp = llp->llp_platspec;
 
-	remove_connection_from_llp(tcup->llp, conn, firefly_connection_eq_ptr);
+	if (tcup->socket < llp_tcp->nbr_conn_by_sock &&
+			llp_tcp->conn_by_sock[tcup->socket] != NULL) {
+		remove_connection_node_from_llp(llp,
+				llp_tcp->conn_by_sock[tcup->socket]);
+		llp_tcp->conn_by_sock[tcup->socket] = NULL;
+	}
+	FD_CLR(tcup->socket, &llp_tcp->master_set);
+	if (llp_tcp->reactor != NULL)
+		firefly_reactor_posix_remove(llp_tcp->reactor, tcup->socket);
 	close(tcup->socket);
 	free(tcup->remote_addr);
 	free(conn->transport);
@@ -246,11 +305,9 @@ struct firefly_transport_connection *firefly_transport_connection_tcp_posix_new(
 {
 	struct firefly_transport_connection *tc;
 	struct firefly_transport_connection_tcp_posix *tcup;
-	struct transport_llp_tcp_posix *llp_tcp;
 	struct sockaddr_in *remote_addr;
 	int res;
 
-	llp_tcp     = llp->llp_platspec;
 	tc          = malloc(sizeof(*tc));
 	tcup        = malloc(sizeof(*tcup));
 	remote_addr = calloc(1, sizeof(*remote_addr));
@@ -287,10 +344,7 @@ struct firefly_transport_connection *firefly_transport_connection_tcp_posix_new(
 						  __func__, __LINE__, err_buf);
 		}
 
-		FD_SET(tcup->socket, &llp_tcp->master_set);
-		if (tcup->socket > llp_tcp->max_sock) {
-			llp_tcp->max_sock = tcup->socket;
-		}
+		add_socket(llp, tcup->socket);
 
 		res = connect(tcup->socket, (struct sockaddr *) tcup->remote_addr,
 					  sizeof(*tcup->remote_addr));
@@ -312,13 +366,14 @@ struct firefly_transport_connection *firefly_transport_connection_tcp_posix_new(
 	tc->open      = connection_open;
 	tc->close     = connection_close;
 	tc->write     = firefly_transport_tcp_posix_write;
+	tc->write_buffer = NULL;
 	tc->ack       = NULL;
 
 	return tc;
 }
 
 void firefly_transport_tcp_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, unsigned int *id)
 {
 	struct firefly_transport_connection_tcp_posix *conn_tcp;
 	int res;
@@ -367,6 +422,49 @@ int firefly_transport_tcp_posix_run(struct firefly_transport_llp *llp)
 	return res;
 }
 
+static void firefly_transport_tcp_posix_ready(int fd, void *context)
+{
+	read_socket(context, fd);
+}
+
+int firefly_transport_tcp_posix_attach(struct firefly_transport_llp *llp,
+		struct firefly_reactor_posix *reactor)
+{
+	struct transport_llp_tcp_posix *llp_tcp;
+
+	llp_tcp = llp->llp_platspec;
+	if (llp_tcp->reactor != NULL)
+		return -1;
+	for (int i = 0; i <= llp_tcp->max_sock; i++) {
+		if (FD_ISSET(i, &llp_tcp->master_set) &&
+				firefly_reactor_posix_add(reactor, i,
+					firefly_transport_tcp_posix_ready, llp) < 0) {
+			while (--i >= 0) {
+				if (FD_ISSET(i, &llp_tcp->master_set))
+					firefly_reactor_posix_remove(reactor, i);
+			}
+			return -1;
+		}
+	}
+	llp_tcp->reactor = reactor;
+	return 0;
+}
+
+int firefly_transport_tcp_posix_detach(struct firefly_transport_llp *llp)
+{
+	struct transport_llp_tcp_posix *llp_tcp;
+
+	llp_tcp = llp->llp_platspec;
+	if (llp_tcp->reactor == NULL)
+		return -1;
+	for (int i = 0; i <= llp_tcp->max_sock; i++) {
+		if (FD_ISSET(i, &llp_tcp->master_set))
+			firefly_reactor_posix_remove(llp_tcp->reactor, i);
+	}
+	llp_tcp->reactor = NULL;
+	return 0;
+}
+
 int firefly_transport_tcp_posix_stop(struct firefly_transport_llp *llp)
 {
 	struct transport_llp_tcp_posix *llp_tcp;
@@ -389,8 +487,7 @@ struct firefly_event_llp_read_tcp_posix {
 	struct firefly_transport_llp *llp;
 	struct sockaddr_in addr;
 	int socket;
-	size_t len;
-	unsigned char *data;
+	struct firefly_buffer *buf;
 };
 
 static int read_event(void *event_arg)
@@ -407,127 +504,141 @@ static int read_event(void *event_arg)
 	on_conn_recv = llp_tcp->on_conn_recv;
 
 	// Find existing connection.
-	conn = find_connection(ev_arg->llp, &ev_arg->socket, connection_eq_sock);
+	conn = find_connection_by_sock(llp_tcp, ev_arg->socket);
 	if (conn != NULL)
-		ev_arg->llp->protocol_data_received_cb(conn, ev_arg->data, ev_arg->len);
+		transport_buffer_received(ev_arg->llp, conn, ev_arg->buf);
+	else
+		firefly_buffer_unref(ev_arg->buf);
 
 	free(ev_arg);
 
 	return 0;
 }
 
-void firefly_transport_tcp_posix_read(struct firefly_transport_llp *llp)
+/*
+ * Accept a connection on the listening socket or read data from the
+ * connection socket \p i that is ready.
+ */
+static void read_socket(struct firefly_transport_llp *llp, int i)
 {
 	struct transport_llp_tcp_posix *llp_tcp;
 	size_t pkg_len;
 	struct firefly_event_queue *eq;
 	firefly_on_conn_recv_ptcp on_conn_recv;
-	fd_set fs;
 	int res;
+	int sock;
+	struct sockaddr_in remote_addr;
+	socklen_t len;
+	int64_t eid;
+	struct firefly_event_llp_read_tcp_posix *ev_arg;
 
 	llp_tcp      = llp->llp_platspec;
 	pkg_len      = 0; /* ioctl() sets only the lower 32 bit. */
 	eq           = llp_tcp->event_queue;
 	on_conn_recv = llp_tcp->on_conn_recv;
+	eid          = -1;
+	sock         = -1;
+	len          = sizeof(remote_addr);
 
-	do {
-		FD_ZERO(&fs); // Probably unnecessary 'cause memcpy but better safe than sorry.
-		memcpy(&fs, &llp_tcp->master_set, sizeof(llp_tcp->master_set));
-		res = select(llp_tcp->max_sock + 1, &fs, NULL, NULL, NULL);
-	} while (res == -1 && errno == EINTR);
+	// Check if there was activity on listen socket:
+	if (i == llp_tcp->local_tcp_socket) {
+		sock = accept(llp_tcp->local_tcp_socket,
+					  (struct sockaddr *) &remote_addr, &len);
 
-	for (int i = 0; i <= llp_tcp->max_sock; i++) {
-		int sock;
-		struct sockaddr_in remote_addr;
-		socklen_t len;
-		int64_t eid;
-		struct firefly_event_llp_read_tcp_posix *ev_arg;
+		add_socket(llp, sock);
 
-		eid      = -1;
-		sock     = -1;
-		len      = sizeof(remote_addr);
+		unsigned short port = sockaddr_get_port(&remote_addr);
+		char ip[INET_ADDRSTRLEN];
+		sockaddr_get_addr(&remote_addr, ip);
+		eid = on_conn_recv ? on_conn_recv(llp, sock, ip, port) : -1;
+	}
 
-		// Check if descriptor is in set that was ready:
-		if (FD_ISSET(i, &fs)) {
-			// Check if there was activity on listen socket:
-			if (i == llp_tcp->local_tcp_socket) {
-				sock = accept(llp_tcp->local_tcp_socket,
-							  (struct sockaddr *) &remote_addr, &len);
-
-				FD_SET(sock, &llp_tcp->master_set);
-				if (sock > llp_tcp->max_sock) {
-					llp_tcp->max_sock = sock;
-				}
-
-				unsigned short port = sockaddr_get_port(&remote_addr);
-				char ip[INET_ADDRSTRLEN];
-				sockaddr_get_addr(&remote_addr, ip);
-				eid = on_conn_recv ? on_conn_recv(llp, sock, ip, port) : -1;
-			}
+	// Try to read data
+	sock = sock != -1 ? sock : i;
 
-			// Try to read data
-			sock = sock != -1 ? sock : i;
+	res = ioctl(sock, FIONREAD, &pkg_len);
+	if (res == -1) {
+		char err_buf[ERROR_STR_MAX_LEN];
+		strerror_r(errno, err_buf, ERROR_STR_MAX_LEN);
+		firefly_error(FIREFLY_ERROR_SOCKET, 3,
+					  "ioctl() failed in %s().\n%s\n",
+					  __FUNCTION__, err_buf);
 
-			res = ioctl(sock, FIONREAD, &pkg_len);
-			if (res == -1) {
-				char err_buf[ERROR_STR_MAX_LEN];
-				strerror_r(errno, err_buf, ERROR_STR_MAX_LEN);
-				firefly_error(FIREFLY_ERROR_SOCKET, 3,
-							  "ioctl() failed in %s().\n%s\n",
-							  __FUNCTION__, err_buf);
+		pkg_len = 0;
+	}
+	if (pkg_len == 0) // If there's nothing to read, return
+		return;
 
-				pkg_len = 0;
-			}
-			if (pkg_len == 0) // If there's nothing to read, continue loop
-				continue;
+	ev_arg = malloc(sizeof(*ev_arg));
+	if (!ev_arg) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		return;
+	}
+	// The data is received straight into the buffer passed on to the
+	// protocol layer.
+	ev_arg->buf = firefly_buffer_new(pkg_len);
+	if (!ev_arg->buf) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		free(ev_arg);
+		return;
+	}
 
-			ev_arg = malloc(sizeof(*ev_arg) + pkg_len);
-			if (!ev_arg) {
-				FFL(FIREFLY_ERROR_ALLOC);
-				return;
-			}
-			ev_arg->data = malloc(pkg_len);
-			if (!ev_arg->data) {
-				FFL(FIREFLY_ERROR_ALLOC);
-				free(ev_arg);
-				return;
-			}
+	res = recv(sock, ev_arg->buf->data, pkg_len, 0);
+	if (res == -1) {
+		char err_buf[ERROR_STR_MAX_LEN];
+		strerror_r(errno, err_buf, ERROR_STR_MAX_LEN);
+		firefly_error(FIREFLY_ERROR_SOCKET, 4,
+					  "recv() on socket %d failed in %s().\n%s\n",
+					  sock, __FUNCTION__, err_buf);
+		firefly_buffer_unref(ev_arg->buf);
+		free(ev_arg);
+		return;
+	}
+	ev_arg->buf->size = res;
+
+	res = getpeername(sock, (struct sockaddr *) &remote_addr, &len);
+	if (res == -1) {
+		char err_buf[ERROR_STR_MAX_LEN];
+		strerror_r(errno, err_buf, ERROR_STR_MAX_LEN);
+		firefly_error(FIREFLY_ERROR_SOCKET, 4,
+					  "getpeername() failed in %s():%d:\n%s\n",
+					  __func__, __LINE__, err_buf);
+		firefly_buffer_unref(ev_arg->buf);
+		free(ev_arg);
+		return;
+	}
 
-			res = recv(sock, ev_arg->data, pkg_len, 0);
-			if (res == -1) {
-				char err_buf[ERROR_STR_MAX_LEN];
-				strerror_r(errno, err_buf, ERROR_STR_MAX_LEN);
-				firefly_error(FIREFLY_ERROR_SOCKET, 4,
-							  "recv() on socket %d failed in %s().\n%s\n",
-							  sock, __FUNCTION__, err_buf);
+	ev_arg->llp    = llp;
+	ev_arg->socket = sock;
+	ev_arg->addr   = remote_addr;
+	/* Data of member 'buf' already filled in recv(). */
 
-				return;
-			}
+	if (eid != -1) {
+		eq->offer_event_cb(eq, FIREFLY_PRIORITY_HIGH, read_event,
+						   ev_arg, 1, &eid);
+	} else {
+		eq->offer_event_cb(eq, FIREFLY_PRIORITY_HIGH, read_event,
+						   ev_arg, 0, NULL);
+	}
+}
 
-			res = getpeername(sock, (struct sockaddr *) &remote_addr, &len);
-			if (res == -1) {
-				char err_buf[ERROR_STR_MAX_LEN];
-				strerror_r(errno, err_buf, ERROR_STR_MAX_LEN);
-				firefly_error(FIREFLY_ERROR_SOCKET, 4,
-							  "getpeername() failed in %s():%d:\n%s\n",
-							  __func__, __LINE__, err_buf);
+void firefly_transport_tcp_posix_read(struct firefly_transport_llp *llp)
+{
+	struct transport_llp_tcp_posix *llp_tcp;
+	fd_set fs;
+	int res;
 
-				return;
-			}
+	llp_tcp = llp->llp_platspec;
 
-			ev_arg->llp    = llp;
-			ev_arg->socket = sock;
-			ev_arg->len    = pkg_len;
-			ev_arg->addr   = remote_addr;
-			/* Member 'data' already filled in recvfrom(). */
-
-			if (eid != -1) {
-				eq->offer_event_cb(eq, FIREFLY_PRIORITY_HIGH, read_event,
-								   ev_arg, 1, &eid);
-			} else {
-				eq->offer_event_cb(eq, FIREFLY_PRIORITY_HIGH, read_event,
-								   ev_arg, 0, NULL);
-			}
-		}
+	do {
+		FD_ZERO(&fs); // Probably unnecessary 'cause memcpy but better safe than sorry.
+		memcpy(&fs, &llp_tcp->master_set, sizeof(llp_tcp->master_set));
+		res = select(llp_tcp->max_sock + 1, &fs, NULL, NULL, NULL);
+	} while (res == -1 && errno == EINTR);
+
+	for (int i = 0; i <= llp_tcp->max_sock; i++) {
+		// Check if descriptor is in set that was ready:
+		if (FD_ISSET(i, &fs))
+			read_socket(llp, i);
 	}
 }
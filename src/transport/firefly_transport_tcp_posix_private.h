@@ -26,6 +26,9 @@ struct transport_llp_tcp_posix {
 	firefly_on_conn_recv_ptcp on_conn_recv;  /**< Callback when receiving new connection */
 	struct firefly_event_queue *event_queue; /**< Event queue */
 	pthread_t read_thread;                   /**< Thread running the read loop */
+	struct firefly_reactor_posix *reactor;   /**< Reactor the llp is attached to or NULL */
+	struct llp_connection_list_node **conn_by_sock; /**< The connections indexed by socket fd */
+	int nbr_conn_by_sock;                    /**< The number of elements of conn_by_sock */
 };
 
 /**
@@ -49,6 +52,6 @@ struct firefly_transport_connection_tcp_posix {
  * @see #firefly_transport_connection_write_f()
  */
 void firefly_transport_tcp_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, unsigned int *id);
 
 #endif
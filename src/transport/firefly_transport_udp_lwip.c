@@ -134,7 +134,7 @@ struct firefly_transport_llp *firefly_transport_llp_udp_lwip_new(
 	}
 
 	llp->llp_platspec = llp_udp;
-	llp->conn_list = NULL;
+	llp_connections_init(llp, NULL);
 	// Set recieve callback.
 	udp_recv(llp_udp->upcb, udp_lwip_recv_callback, llp);
 
@@ -168,6 +168,7 @@ int firefly_transport_llp_udp_lwip_free_event(void *event_arg)
 		udp_remove(llp_udp->upcb);
 		free(llp_udp->local_ip_addr);
 		free(llp_udp);
+		llp_connections_free(llp);
 		free(llp);
 	} else {
 		firefly_transport_llp_udp_lwip_free(llp);
@@ -199,7 +200,7 @@ static int connection_close(struct firefly_connection *conn)
 // TODO we should not have to memcpy the data to write. Can we make memory alloc
 // transport specific or avoid this problem somehow?
 void firefly_transport_udp_lwip_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, unsigned int *id)
 {
 	struct firefly_transport_connection_udp_lwip *conn_udp;
 	conn_udp = conn->transport->context;
@@ -224,7 +225,7 @@ void firefly_transport_udp_lwip_write(unsigned char *data, size_t data_size,
 	}
 }
 
-void firefly_transport_udp_lwip_ack(unsigned char pkt_id,
+void firefly_transport_udp_lwip_ack(unsigned int pkt_id,
 		struct firefly_connection *conn)
 {
 	UNUSED_VAR(pkt_id);
@@ -264,6 +265,7 @@ struct firefly_transport_connection *firefly_transport_connection_udp_lwip_new(
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_udp_lwip_write;
+	tc->write_buffer = NULL;
 	tc->ack = firefly_transport_udp_lwip_ack;
 
 	return tc;
@@ -63,7 +63,7 @@ struct firefly_event_llp_read_udp_lwip {
  * should be removed.
  * @param conn The conn the packet was sent on.
  */
-void firefly_transport_udp_lwip_ack(unsigned char pkt_id,
+void firefly_transport_udp_lwip_ack(unsigned int pkt_id,
 		struct firefly_connection *conn);
 
 /**
@@ -29,6 +29,8 @@
 #else
 
 #include <sys/select.h>
+#include <netinet/in.h>
+#include <asm/socket.h>		// defines SO_PRIORITY
 #include <utils/firefly_resend_posix.h>
 
 #endif
@@ -118,10 +120,19 @@ struct firefly_transport_llp *firefly_transport_llp_udp_posix_new(
 	llp_udp->on_conn_recv = on_conn_recv;
 	llp_udp->event_queue = event_queue;
 	llp_udp->resend_queue = firefly_resend_queue_new();
+	llp_udp->inline_read = false;
+#ifndef LABCOMM_COMPAT
+	llp_udp->reactor = NULL;
+	llp_udp->reactor_largs = NULL;
+	pthread_mutex_init(&llp_udp->write_lock, NULL);
+	pthread_mutex_init(&llp_udp->conn_lock, NULL);
+	llp_udp->tx_priority = -1;
+#endif
 
 	llp->llp_platspec = llp_udp;
-	llp->conn_list = NULL;
+	llp_connections_init(llp, connection_key_inaddr);
 	llp->protocol_data_received_cb = protocol_data_received;
+	llp->protocol_buffer_received_cb = protocol_buffer_received;
 	llp->state = FIREFLY_LLP_OPEN;
 
 	return llp;
@@ -150,7 +161,12 @@ static void check_llp_free(struct firefly_transport_llp *llp)
 		close(llp_udp->local_udp_socket);
 		free(llp_udp->local_addr);
 		firefly_resend_queue_free(llp_udp->resend_queue);
+#ifndef LABCOMM_COMPAT
+		pthread_mutex_destroy(&llp_udp->write_lock);
+		pthread_mutex_destroy(&llp_udp->conn_lock);
+#endif
 		free(llp_udp);
+		llp_connections_free(llp);
 		free(llp);
 	}
 }
@@ -177,7 +193,14 @@ static int connection_open(struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_udp_posix *tcup;
 	tcup = conn->transport->context;
+#ifndef LABCOMM_COMPAT
+	struct transport_llp_udp_posix *llp_udp = tcup->llp->llp_platspec;
+	pthread_mutex_lock(&llp_udp->conn_lock);
+#endif
 	add_connection_to_llp(conn, tcup->llp);
+#ifndef LABCOMM_COMPAT
+	pthread_mutex_unlock(&llp_udp->conn_lock);
+#endif
 	return 0;
 }
 
@@ -188,8 +211,14 @@ static int connection_close(struct firefly_connection *conn)
 	tcup = conn->transport->context;
 	llp = tcup->llp;
 
-	remove_connection_from_llp(tcup->llp, conn,
-			firefly_connection_eq_ptr);
+#ifndef LABCOMM_COMPAT
+	struct transport_llp_udp_posix *llp_udp = llp->llp_platspec;
+	pthread_mutex_lock(&llp_udp->conn_lock);
+#endif
+	remove_connection_ptr_from_llp(tcup->llp, conn);
+#ifndef LABCOMM_COMPAT
+	pthread_mutex_unlock(&llp_udp->conn_lock);
+#endif
 	free(tcup->remote_addr);
 	free(conn->transport);
 	free(tcup);
@@ -232,16 +261,27 @@ struct firefly_transport_connection *firefly_transport_connection_udp_posix_new(
 	}
 	tcup->socket = llp_udp->local_udp_socket;
 	tcup->llp = llp;
+#ifndef LABCOMM_COMPAT
+	firefly_rto_init(&tcup->rto, timeout,
+			FIREFLY_TRANSPORT_UDP_POSIX_MIN_TIMEOUT,
+			FIREFLY_TRANSPORT_UDP_POSIX_MAX_TIMEOUT);
+#else
 	tcup->timeout = timeout;
+#endif
 	tc->context = tcup;
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_udp_posix_write;
+#ifndef LABCOMM_COMPAT
+	tc->write_buffer = firefly_transport_udp_posix_write_buffer;
+#else
+	tc->write_buffer = NULL;
+#endif
 	tc->ack = firefly_transport_udp_posix_ack;
 	return tc;
 }
 
-void firefly_transport_udp_posix_ack(unsigned char pkt_id,
+void firefly_transport_udp_posix_ack(unsigned int pkt_id,
 		struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_udp_posix *conn_udp;
@@ -252,16 +292,57 @@ void firefly_transport_udp_posix_ack(unsigned char pkt_id,
 	firefly_resend_remove(llpup->resend_queue, pkt_id);
 }
 
-void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+/*
+ * Send a frame on the socket of a connection. On posix the socket priority and
+ * DSCP are first set to those of the priority class of the frame. The socket
+ * is shared by all connections of the llp so the options and the send are
+ * serialized by the write lock.
+ */
+static int udp_posix_send(struct firefly_connection *conn,
+		unsigned char *data, size_t data_size, int priority)
 {
 	struct firefly_transport_connection_udp_posix *conn_udp;
 	int res;
+#ifndef LABCOMM_COMPAT
+	struct transport_llp_udp_posix *llp_udp;
+	int opt;
 
 	conn_udp = conn->transport->context;
+	llp_udp = conn_udp->llp->llp_platspec;
+	pthread_mutex_lock(&llp_udp->write_lock);
+	if (priority != llp_udp->tx_priority) {
+		// Setting IP_TOS resets the socket priority on Linux, set it first.
+		opt = transport_dscp(priority) << 2;
+		setsockopt(conn_udp->socket, IPPROTO_IP, IP_TOS, &opt, sizeof(opt));
+		opt = transport_socket_priority(priority);
+		setsockopt(conn_udp->socket, SOL_SOCKET, SO_PRIORITY, &opt,
+				sizeof(opt));
+		llp_udp->tx_priority = priority;
+	}
+#else
+	UNUSED_VAR(priority);
+	conn_udp = conn->transport->context;
+#endif
 	res = sendto(conn_udp->socket, (void *) data, data_size, 0,
 		     (struct sockaddr *) conn_udp->remote_addr,
 		     sizeof(*conn_udp->remote_addr));
+#ifndef LABCOMM_COMPAT
+	pthread_mutex_unlock(&llp_udp->write_lock);
+#endif
+	return res;
+}
+
+void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
+		struct firefly_connection *conn, bool important, unsigned int *id)
+{
+	struct firefly_transport_connection_udp_posix *conn_udp;
+	int priority;
+	int res;
+
+	conn_udp = conn->transport->context;
+	// The class of the frame is set by the event writing it.
+	priority = firefly_connection_tx_priority(conn);
+	res = udp_posix_send(conn, data, data_size, priority);
 	if (res == -1) {
 		firefly_error(FIREFLY_ERROR_TRANS_WRITE, 1, "sendto() failed");
 		firefly_connection_raise_later(conn,
@@ -283,11 +364,53 @@ void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
 		}
 		memcpy(new_data, data, data_size);
 		llp_ps = conn_udp->llp->llp_platspec;
+#ifndef LABCOMM_COMPAT
+		*id = firefly_resend_add(llp_ps->resend_queue,
+				new_data, data_size, 0,
+				FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_RETRIES, &conn_udp->rto,
+				priority, conn);
+#else
 		*id = firefly_resend_add(llp_ps->resend_queue,
 				new_data, data_size, conn_udp->timeout,
 				FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_RETRIES, conn);
+#endif
+	}
+}
+
+#ifndef LABCOMM_COMPAT
+void firefly_transport_udp_posix_write_buffer(struct firefly_buffer *frame,
+		struct firefly_connection *conn, bool important, unsigned int *id)
+{
+	struct firefly_transport_connection_udp_posix *conn_udp;
+	struct transport_llp_udp_posix *llp_ps;
+	int priority;
+	int res;
+
+	conn_udp = conn->transport->context;
+	priority = firefly_connection_tx_priority(conn);
+	res = udp_posix_send(conn, frame->data, frame->size, priority);
+	if (res == -1) {
+		firefly_error(FIREFLY_ERROR_TRANS_WRITE, 1, "sendto() failed");
+		firefly_connection_raise_later(conn,
+				FIREFLY_ERROR_TRANS_WRITE, "sendto() failed");
+	}
+	if (!important) {
+		firefly_buffer_unref(frame);
+		return;
+	}
+	if (!id) {
+		firefly_error(FIREFLY_ERROR_TRANS_WRITE, 1,
+				"Parameter id was NULL.\n");
+		firefly_buffer_unref(frame);
+		return;
 	}
+	// The resend queue keeps the frame until it is acked.
+	llp_ps = conn_udp->llp->llp_platspec;
+	*id = firefly_resend_add_buffer(llp_ps->resend_queue, frame,
+			0, FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_RETRIES, &conn_udp->rto,
+			priority, conn);
 }
+#endif
 
 void *firefly_transport_udp_posix_read_run(void *args)
 {
@@ -305,6 +428,20 @@ static void resend_on_no_ack(struct firefly_connection *conn)
 	firefly_connection_raise_later(conn, FIREFLY_ERROR_TRANS_WRITE, NULL);
 }
 
+/*
+ * Resend a packet with the class it was first sent with, the class of the
+ * frame last written on the connection may be another one.
+ */
+static void resend_packet(struct firefly_connection *conn,
+		unsigned char *data, size_t size, int priority)
+{
+	if (udp_posix_send(conn, data, size, priority) == -1) {
+		firefly_error(FIREFLY_ERROR_TRANS_WRITE, 1, "sendto() failed");
+		firefly_connection_raise_later(conn,
+				FIREFLY_ERROR_TRANS_WRITE, "sendto() failed");
+	}
+}
+
 int firefly_transport_udp_posix_run(struct firefly_transport_llp *llp)
 {
 	int res;
@@ -317,6 +454,8 @@ int firefly_transport_udp_posix_run(struct firefly_transport_llp *llp)
 		return -1;
 	largs->rq = llp_udp->resend_queue;
 	largs->on_no_ack = resend_on_no_ack;
+	largs->on_resend = firefly_connection_resend_timeout;
+	largs->resend = resend_packet;
 
 	/* TODO: Clean this up. */
 #ifndef LABCOMM_COMPAT
@@ -357,6 +496,63 @@ int firefly_transport_udp_posix_run(struct firefly_transport_llp *llp)
 	return res;
 }
 
+static void firefly_transport_udp_posix_receive(
+		struct firefly_transport_llp *llp);
+
+#ifndef LABCOMM_COMPAT
+static void firefly_transport_udp_posix_ready(int fd, void *context)
+{
+	UNUSED_VAR(fd);
+	firefly_transport_udp_posix_receive(context);
+}
+
+int firefly_transport_udp_posix_attach(struct firefly_transport_llp *llp,
+		struct firefly_reactor_posix *reactor)
+{
+	struct transport_llp_udp_posix *llp_udp;
+	struct firefly_resend_loop_args *largs;
+
+	llp_udp = llp->llp_platspec;
+	if (llp_udp->reactor != NULL)
+		return -1;
+	largs = malloc(sizeof(*largs));
+	if (!largs)
+		return -1;
+	largs->rq = llp_udp->resend_queue;
+	largs->on_no_ack = resend_on_no_ack;
+	largs->on_resend = firefly_connection_resend_timeout;
+	largs->resend = resend_packet;
+	if (firefly_resend_attach(largs, reactor) < 0) {
+		free(largs);
+		return -1;
+	}
+	if (firefly_reactor_posix_add(reactor, llp_udp->local_udp_socket,
+				firefly_transport_udp_posix_ready, llp) < 0) {
+		firefly_resend_detach(largs, reactor);
+		free(largs);
+		return -1;
+	}
+	llp_udp->reactor = reactor;
+	llp_udp->reactor_largs = largs;
+	return 0;
+}
+
+int firefly_transport_udp_posix_detach(struct firefly_transport_llp *llp)
+{
+	struct transport_llp_udp_posix *llp_udp;
+
+	llp_udp = llp->llp_platspec;
+	if (llp_udp->reactor == NULL)
+		return -1;
+	firefly_reactor_posix_remove(llp_udp->reactor, llp_udp->local_udp_socket);
+	firefly_resend_detach(llp_udp->reactor_largs, llp_udp->reactor);
+	free(llp_udp->reactor_largs);
+	llp_udp->reactor = NULL;
+	llp_udp->reactor_largs = NULL;
+	return 0;
+}
+#endif
+
 int firefly_transport_udp_posix_stop(struct firefly_transport_llp *llp)
 {
 	struct transport_llp_udp_posix *llp_udp;
@@ -378,10 +574,38 @@ int firefly_transport_udp_posix_stop(struct firefly_transport_llp *llp)
 struct firefly_event_llp_read_udp_posix {
 	struct firefly_transport_llp *llp;
 	struct sockaddr_in addr;
-	size_t len;
-	unsigned char *data;
+	struct firefly_buffer *buf;
+	struct firefly_connection *conn; /* The strand of the event. */
 };
 
+/*
+ * Find the connection of a remote address. The reader thread looks up the
+ * connection of every datagram while events open and close connections, so
+ * the lookup is done under the connection lock of the llp.
+ */
+static struct firefly_connection *udp_posix_find_connection(
+		struct firefly_transport_llp *llp, struct sockaddr_in *addr)
+{
+	struct firefly_connection *conn;
+	unsigned char key[FIREFLY_LLP_CONN_KEY_MAX];
+#ifndef LABCOMM_COMPAT
+	struct transport_llp_udp_posix *llp_udp = llp->llp_platspec;
+
+	pthread_mutex_lock(&llp_udp->conn_lock);
+#endif
+	conn = find_connection_by_key(llp, key, sockaddr_in_key(addr, key));
+#ifndef LABCOMM_COMPAT
+	pthread_mutex_unlock(&llp_udp->conn_lock);
+#endif
+	return conn;
+}
+
+/*
+ * Read events run on the strand of the connection the datagram was received
+ * on, so the datagrams of different connections are decoded in parallel by a
+ * worker pool. Datagrams from unknown remote nodes run without strand since
+ * they may open a connection.
+ */
 static int firefly_transport_udp_posix_read_event(void *event_arg)
 {
 	struct firefly_event_llp_read_udp_posix *ev_arg;
@@ -392,7 +616,15 @@ static int firefly_transport_udp_posix_read_event(void *event_arg)
 	llp_udp = ev_arg->llp->llp_platspec;
 
 	// Find existing connection or create new.
-	conn = find_connection(ev_arg->llp, &ev_arg->addr, connection_eq_inaddr);
+	conn = udp_posix_find_connection(ev_arg->llp, &ev_arg->addr);
+	if (conn != ev_arg->conn) {
+		// The connection was opened or closed after the datagram was
+		// received, move the event to the strand of the current one.
+		ev_arg->conn = conn;
+		return firefly_event_offer_strand(llp_udp->event_queue, conn,
+				FIREFLY_PRIORITY_HIGH,
+				firefly_transport_udp_posix_read_event, ev_arg, 0, NULL);
+	}
 	if (conn == NULL) {
 		char ip_addr[INET_ADDRSTRLEN];
 		sockaddr_in_ipaddr(&ev_arg->addr, ip_addr);
@@ -406,25 +638,51 @@ static int firefly_transport_udp_posix_read_event(void *event_arg)
 					firefly_transport_udp_posix_read_event,
 					ev_arg, 1, &ev_id);
 		} else {
-			free(ev_arg->data);
+			firefly_buffer_unref(ev_arg->buf);
 		}
 	} else {
-		ev_arg->llp->protocol_data_received_cb(conn, ev_arg->data, ev_arg->len);
+		transport_buffer_received(ev_arg->llp, conn, ev_arg->buf);
 	}
 	free(ev_arg);
 
 	return 0;
 }
 
+/*
+ * Executed inline on the reader thread on the strand of the connection found
+ * when the datagram was received. Data to unknown remote nodes, or if the
+ * connection has changed since, is left in the event argument to be handled
+ * by an event.
+ */
+static int firefly_transport_udp_posix_read_inline(void *event_arg)
+{
+	struct firefly_event_llp_read_udp_posix *ev_arg;
+	struct firefly_connection *conn;
+
+	ev_arg = event_arg;
+	conn = udp_posix_find_connection(ev_arg->llp, &ev_arg->addr);
+	if (conn != NULL && conn == ev_arg->conn) {
+		protocol_buffer_received_inline(conn, ev_arg->buf);
+		ev_arg->buf = NULL;
+	}
+
+	return 0;
+}
+
+void firefly_transport_udp_posix_set_inline_read(
+		struct firefly_transport_llp *llp, bool inline_read)
+{
+	struct transport_llp_udp_posix *llp_udp;
+
+	llp_udp = llp->llp_platspec;
+	llp_udp->inline_read = inline_read;
+}
+
 void firefly_transport_udp_posix_read(struct firefly_transport_llp *llp)
 {
 	struct transport_llp_udp_posix *llp_udp;
 	fd_set fs;
 	int res;
-	size_t pkg_len = 0;	/* ioctl() sets only the lower 32 bit. */
-	struct sockaddr_in remote_addr;
-	struct firefly_event_llp_read_udp_posix *ev_arg;
-	socklen_t len;
 
 	llp_udp = llp->llp_platspec;
 	do {
@@ -441,6 +699,20 @@ void firefly_transport_udp_posix_read(struct firefly_transport_llp *llp)
 		}
 		return;
 	}
+	firefly_transport_udp_posix_receive(llp);
+}
+
+static void firefly_transport_udp_posix_receive(
+		struct firefly_transport_llp *llp)
+{
+	struct transport_llp_udp_posix *llp_udp;
+	int res;
+	size_t pkg_len = 0;	/* ioctl() sets only the lower 32 bit. */
+	struct sockaddr_in remote_addr;
+	struct firefly_event_llp_read_udp_posix *ev_arg;
+	socklen_t len;
+
+	llp_udp = llp->llp_platspec;
 #ifdef LABCOMM_COMPAT
 	/* Length of whole buffer? */
 	res = ioctl(llp_udp->local_udp_socket, FIONREAD, (int) &pkg_len);
@@ -468,15 +740,17 @@ void firefly_transport_udp_posix_read(struct firefly_transport_llp *llp)
 		free(ev_arg);
 		return;
 	}
-	ev_arg->data = malloc(pkg_len);
-	if (!ev_arg->data) {
+	// The datagram is received straight into the buffer passed on to the
+	// protocol layer.
+	ev_arg->buf = firefly_buffer_new(pkg_len);
+	if (!ev_arg->buf) {
 		FFL(FIREFLY_ERROR_ALLOC);
 		free(ev_arg);
 		return;
 	}
 	len = sizeof(remote_addr);
 	res = recvfrom(llp_udp->local_udp_socket,
-				   (void *) ev_arg->data,
+				   (void *) ev_arg->buf->data,
 				   pkg_len,
 				   0, (struct sockaddr *) &remote_addr, (void *) &len);
 
@@ -489,14 +763,25 @@ void firefly_transport_udp_posix_read(struct firefly_transport_llp *llp)
 #endif
 		firefly_error(FIREFLY_ERROR_SOCKET, 3, "Failed in %s.\n%s()\n",
 			      __FUNCTION__, err_buf);
+		firefly_buffer_unref(ev_arg->buf);
+		free(ev_arg);
+		return;
 	}
 
 	ev_arg->llp	= llp;
 	ev_arg->addr = remote_addr;
-	ev_arg->len	= res;
-	/* Member 'data' already filled in recvfrom(). */
-
-	llp_udp->event_queue->offer_event_cb(llp_udp->event_queue,
+	ev_arg->buf->size = res;
+	ev_arg->conn = udp_posix_find_connection(llp, &remote_addr);
+	/* Data of member 'buf' already filled in recvfrom(). */
+
+	if (llp_udp->inline_read && res > 0 && ev_arg->conn != NULL &&
+			firefly_event_run_inline(llp_udp->event_queue, ev_arg->conn,
+				firefly_transport_udp_posix_read_inline, ev_arg) == 0 &&
+			ev_arg->buf == NULL) {
+		free(ev_arg);
+		return;
+	}
+	firefly_event_offer_strand(llp_udp->event_queue, ev_arg->conn,
 			FIREFLY_PRIORITY_HIGH,
 			firefly_transport_udp_posix_read_event,
 			ev_arg, 0, NULL);
@@ -517,6 +802,21 @@ bool connection_eq_inaddr(struct firefly_connection *conn, void *context)
 					*) context);
 }
 
+size_t sockaddr_in_key(struct sockaddr_in *addr, unsigned char *key)
+{
+	memcpy(key, &addr->sin_addr, sizeof(addr->sin_addr));
+	memcpy(key + sizeof(addr->sin_addr), &addr->sin_port,
+			sizeof(addr->sin_port));
+	return sizeof(addr->sin_addr) + sizeof(addr->sin_port);
+}
+
+size_t connection_key_inaddr(struct firefly_connection *conn,
+		unsigned char *key)
+{
+	return sockaddr_in_key(((struct firefly_transport_connection_udp_posix *)
+				conn->transport->context)->remote_addr, key);
+}
+
 void sockaddr_in_ipaddr(struct sockaddr_in *addr, char *ip_addr)
 {
 	inet_ntop(AF_INET, &addr->sin_addr.s_addr, ip_addr, INET_ADDRSTRLEN);
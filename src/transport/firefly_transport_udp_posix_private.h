@@ -30,10 +30,23 @@ struct transport_llp_udp_posix {
 											   events on. */
 	struct resend_queue *resend_queue; /**< The resend queue managing important
 										 packets. */
+	bool inline_read; /**< Whether read data is run to completion on the
+						reader thread when possible. */
 #ifndef LABCOMM_COMPAT
 	pthread_t read_thread; /**< The handle to the thread running the read loop. */
 	pthread_t resend_thread; /**< The handle to the thread running the resend
 							   loop. */
+	struct firefly_reactor_posix *reactor; /**< The reactor the llp is attached
+											 to or NULL. */
+	struct firefly_resend_loop_args *reactor_largs; /**< The resend queue
+													  polled by the reactor. */
+	pthread_mutex_t write_lock; /**< Serializes the writes on the socket and
+								  the priority options they are sent with. */
+	pthread_mutex_t conn_lock; /**< Guards the connections of the llp, which
+								 the reader thread looks up to find the
+								 strand of read events. */
+	int tx_priority; /**< The channel priority class the socket options are
+					   set for or -1. */
 #else
 	int tid_read;
 	int tid_resend;
@@ -50,7 +63,12 @@ struct firefly_transport_connection_udp_posix {
 				  connection. */
 	struct firefly_transport_llp *llp; /**< The \a llp this connection is
 										 associated with. */
+#ifndef LABCOMM_COMPAT
+	struct firefly_rto rto; /**< The time between resends on this connection
+							  estimated from its round trip time. */
+#else
 	unsigned int timeout; /**< The time between resends on this connection. */
+#endif
 };
 
 /**
@@ -73,6 +91,28 @@ int firefly_transport_llp_udp_posix_free_event(void *event_arg);
  */
 bool connection_eq_inaddr(struct firefly_connection *conn, void *context);
 
+/**
+ * @brief Get the key of a \c struct \c sockaddr_in, its ip address and port
+ * number.
+ *
+ * @param addr The address.
+ * @param key The buffer to write the key to, #FIREFLY_LLP_CONN_KEY_MAX bytes.
+ * @return The size of the key.
+ */
+size_t sockaddr_in_key(struct sockaddr_in *addr, unsigned char *key);
+
+/**
+ * @brief Get the key of a connection, the key of its remote address.
+ * Implements #conn_key_f.
+ *
+ * @param conn The connection.
+ * @param key The buffer to write the key to.
+ * @return The size of the key.
+ * @see sockaddr_in_key()
+ */
+size_t connection_key_inaddr(struct firefly_connection *conn,
+		unsigned char *key);
+
 
 /**
  * @brief Compares two \c struct \c sockaddr_in.
@@ -115,7 +155,21 @@ unsigned short sockaddr_in_port(struct sockaddr_in *addr);
  * @see #firefly_transport_connection_write_f()
  */
 void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, unsigned int *id);
+
+/**
+ * @brief Write a frame on the specified connection without copying it.
+ * Implements #firefly_transport_connection_write_buffer_f.
+ *
+ * @param frame The frame to be written, the reference is handed over.
+ * @param conn The connection to written the data on.
+ * @param important If true the frame is kept in the resend queue until it is
+ * acked by calling #firefly_transport_udp_posix_ack or max retries is reached.
+ * @param id The variable to save the resend packed id in.
+ * @see #firefly_transport_connection_write_buffer_f()
+ */
+void firefly_transport_udp_posix_write_buffer(struct firefly_buffer *frame,
+		struct firefly_connection *conn, bool important, unsigned int *id);
 
 /**
  * @brief Ack an important packed. Removes the packet from the resend queue.
@@ -125,7 +179,7 @@ void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
  * @param conn The connection the packet was sent on.
  * @see #firefly_transport_connection_ack_f()
  */
-void firefly_transport_udp_posix_ack(unsigned char pkt_id,
+void firefly_transport_udp_posix_ack(unsigned int pkt_id,
 		struct firefly_connection *conn);
 
 #endif
@@ -16,20 +16,65 @@
 #include <utils/firefly_errors.h>
 #include "protocol/firefly_protocol_private.h"
 
+/*
+ * Allocate a slab of events and put them in the given slots of the pool.
+ */
+static bool firefly_event_slab_add(struct firefly_event_queue *q,
+		struct firefly_event **slots, size_t nbr_events)
+{
+	struct firefly_event_slab *slab;
+
+	if (nbr_events == 0)
+		return true;
+	slab = FIREFLY_MALLOC(sizeof(struct firefly_event_slab) +
+			sizeof(struct firefly_event)*nbr_events);
+	if (slab == NULL)
+		return false;
+	slab->events = (struct firefly_event *) (slab + 1);
+	slab->nbr_events = nbr_events;
+	slab->next = q->slabs;
+	q->slabs = slab;
+	for (size_t i = 0; i < nbr_events; i++) {
+		slots[i] = &slab->events[i];
+	}
+	return true;
+}
+
 struct firefly_event_queue *firefly_event_queue_new(
 		firefly_offer_event offer_cb, size_t pool_size, void *context)
 {
 	struct firefly_event_queue *q = NULL;
 
 	if ((q = FIREFLY_MALLOC(sizeof(struct firefly_event_queue))) != NULL) {
-		q->head = NULL;
+		memset(q->buckets, 0, sizeof(q->buckets));
+		memset(q->occupied, 0, sizeof(q->occupied));
+		q->length = 0;
+		q->index_size = FIREFLY_EVENT_QUEUE_MIN_INDEX_SIZE;
+		while (q->index_size < pool_size)
+			q->index_size *= 2;
+		q->index = FIREFLY_MALLOC(sizeof(struct firefly_event *)*q->index_size);
+		if (q->index == NULL) {
+			FIREFLY_FREE(q);
+			return NULL;
+		}
+		memset(q->index, 0, sizeof(struct firefly_event *)*q->index_size);
 		q->offer_event_cb = offer_cb;
+		q->offer_strand_event_cb = NULL;
+		q->offer_batch_cb = NULL;
+		q->offer_timed_cb = NULL;
+		q->cancel_cb = NULL;
+		q->run_inline_cb = NULL;
+		q->run_pending_cb = NULL;
+		q->clock_cb = NULL;
+		memset(q->timers, 0, sizeof(q->timers));
+		memset(q->timers_occupied, 0, sizeof(q->timers_occupied));
+		q->timer_time = 0;
+		q->nbr_timers = 0;
 		q->event_id = 0;
 		q->context = context;
 		q->event_pool = FIREFLY_MALLOC(sizeof(struct firefly_event *)*pool_size);
-		for (size_t i = 0; i < pool_size; i++) {
-			q->event_pool[i] = FIREFLY_MALLOC(sizeof(struct firefly_event));
-		}
+		q->slabs = NULL;
+		firefly_event_slab_add(q, q->event_pool, pool_size);
 		q->event_pool_size = pool_size;
 		q->event_pool_in_use = 0;
 		q->event_pool_strict_size = false;
@@ -41,13 +86,24 @@ struct firefly_event_queue *firefly_event_queue_new(
 void firefly_event_queue_free(struct firefly_event_queue **q)
 {
 	struct firefly_event *ev;
+	struct firefly_event_slab *slab;
 
 	while ((ev = firefly_event_pop(*q)) != NULL)
 		firefly_event_return(*q, &ev);
-	for (size_t i = 0; i < (*q)->event_pool_size; i++) {
-		firefly_event_free((*q)->event_pool[i]);
+	for (int l = 0; l < FIREFLY_EVENT_TIMER_LEVELS; l++) {
+		for (int i = 0; i < FIREFLY_EVENT_TIMER_SLOTS; i++) {
+			while ((ev = (*q)->timers[l][i]) != NULL) {
+				(*q)->timers[l][i] = ev->next;
+				firefly_event_return(*q, &ev);
+			}
+		}
+	}
+	while ((slab = (*q)->slabs) != NULL) {
+		(*q)->slabs = slab->next;
+		FIREFLY_FREE(slab);
 	}
 	FIREFLY_FREE((*q)->event_pool);
+	FIREFLY_FREE((*q)->index);
 	FIREFLY_FREE(*q);
 	*q = NULL;
 }
@@ -58,37 +114,265 @@ void firefly_event_queue_set_strict_pool_size(struct firefly_event_queue *eq,
 	eq->event_pool_strict_size = strict_size;
 }
 
-struct firefly_event *firefly_event_new(unsigned char prio,
+void firefly_event_queue_set_strand_offer(struct firefly_event_queue *eq,
+		firefly_offer_strand_event offer_strand_cb)
+{
+	eq->offer_strand_event_cb = offer_strand_cb;
+}
+
+int64_t firefly_event_offer_strand(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, unsigned int nbr_depends, const int64_t *depends)
+{
+	if (eq->offer_strand_event_cb != NULL)
+		return eq->offer_strand_event_cb(eq, strand, prio, execute, context,
+				nbr_depends, depends);
+	return eq->offer_event_cb(eq, prio, execute, context, nbr_depends,
+			depends);
+}
+
+void firefly_event_queue_set_timed_offer(struct firefly_event_queue *eq,
+		firefly_offer_timed_event offer_timed_cb,
+		firefly_cancel_event cancel_cb)
+{
+	eq->offer_timed_cb = offer_timed_cb;
+	eq->cancel_cb = cancel_cb;
+}
+
+/*
+ * The default offer does no locking so the default implementations can be
+ * called directly.
+ */
+static inline bool firefly_event_queue_is_default(
+		struct firefly_event_queue *eq)
+{
+	return eq->offer_event_cb == firefly_event_add &&
+		eq->offer_strand_event_cb == NULL;
+}
+
+int64_t firefly_event_offer_after(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, int64_t delay)
+{
+	if (eq->offer_timed_cb != NULL)
+		return eq->offer_timed_cb(eq, strand, prio, execute, context, delay);
+	if (firefly_event_queue_is_default(eq))
+		return firefly_event_add_after(eq, strand, prio, execute, context,
+				delay);
+	return -1;
+}
+
+int firefly_event_offer_cancel(struct firefly_event_queue *eq, int64_t id)
+{
+	if (eq->cancel_cb != NULL)
+		return eq->cancel_cb(eq, id);
+	if (firefly_event_queue_is_default(eq))
+		return firefly_event_cancel(eq, id);
+	return -1;
+}
+
+void firefly_event_queue_set_inline_run(struct firefly_event_queue *eq,
+		firefly_run_inline_event run_inline_cb)
+{
+	eq->run_inline_cb = run_inline_cb;
+}
+
+int firefly_event_run_inline(struct firefly_event_queue *eq, void *strand,
 		firefly_event_execute_f execute, void *context)
 {
-	struct firefly_event *ev;
+	if (eq->run_inline_cb != NULL)
+		return eq->run_inline_cb(eq, strand, execute, context);
+	return -1;
+}
 
-	if ((ev = FIREFLY_MALLOC(sizeof(struct firefly_event))) != NULL) {
-		ev->prio = prio;
-		ev->execute = execute;
-		ev->context = context;
-		memset(ev->depends, 0, FIREFLY_EVENT_QUEUE_MAX_DEPENDS);
+void firefly_event_queue_set_pending_run(struct firefly_event_queue *eq,
+		firefly_run_pending_events run_pending_cb)
+{
+	eq->run_pending_cb = run_pending_cb;
+}
+
+size_t firefly_event_queue_run_pending(struct firefly_event_queue *eq,
+		size_t budget)
+{
+	struct firefly_event *ev;
+	size_t nbr_executed = 0;
+
+	if (eq->run_pending_cb != NULL)
+		return eq->run_pending_cb(eq, budget);
+	if (!firefly_event_queue_is_default(eq))
+		return 0;
+	while (nbr_executed < budget && (ev = firefly_event_pop(eq)) != NULL) {
+		firefly_event_execute(ev);
+		firefly_event_return(eq, &ev);
+		nbr_executed++;
 	}
+	return nbr_executed;
+}
 
-	return ev;
+void firefly_event_queue_set_clock(struct firefly_event_queue *eq,
+		firefly_event_clock clock_cb)
+{
+	eq->clock_cb = clock_cb;
+}
+
+int64_t firefly_event_queue_now(struct firefly_event_queue *eq)
+{
+	if (eq->clock_cb != NULL)
+		return eq->clock_cb(eq);
+	return eq->timer_time;
+}
+
+void firefly_event_queue_set_batch_offer(struct firefly_event_queue *eq,
+		firefly_offer_event_batch offer_batch_cb)
+{
+	eq->offer_batch_cb = offer_batch_cb;
+}
+
+/*
+ * A context copied for a queue adding events without copying them, the copy
+ * follows right after the struct.
+ */
+struct firefly_event_copy {
+	firefly_event_execute_f execute;
+	union {
+		void *align_ptr;
+		int64_t align_int;
+		double align_double;
+	} align;
+};
+
+static int firefly_event_copy_execute(void *event_arg)
+{
+	struct firefly_event_copy *c = event_arg;
+	int res = c->execute(c + 1);
+
+	FIREFLY_FREE(c);
+	return res;
+}
+
+int64_t firefly_event_offer_copy(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		const void *context, size_t context_size, unsigned int nbr_depends,
+		const int64_t *depends)
+{
+	struct firefly_event_copy *c;
+	int64_t id;
+
+	if (eq->offer_batch_cb != NULL) {
+		struct firefly_event_batch_entry e;
+		e.strand = strand;
+		e.prio = prio;
+		e.execute = execute;
+		e.context = (void *) context;
+		e.context_size = context_size;
+		e.nbr_depends = nbr_depends;
+		e.depends = depends;
+		eq->offer_batch_cb(eq, &e, 1);
+		return e.id;
+	}
+	if (firefly_event_queue_is_default(eq))
+		return firefly_event_add_copy(eq, strand, prio, execute, context,
+				context_size, nbr_depends, depends);
+	c = FIREFLY_MALLOC(sizeof(struct firefly_event_copy) + context_size);
+	if (c == NULL)
+		return -1;
+	c->execute = execute;
+	memcpy(c + 1, context, context_size);
+	id = firefly_event_offer_strand(eq, strand, prio,
+			firefly_event_copy_execute, c, nbr_depends, depends);
+	if (id < 0)
+		FIREFLY_FREE(c);
+	return id;
 }
 
-void firefly_event_free(struct firefly_event *ev)
+size_t firefly_event_add_batch(struct firefly_event_queue *eq,
+		struct firefly_event_batch_entry *entries, size_t nbr_entries)
 {
-	FIREFLY_FREE(ev);
+	size_t nbr_added = 0;
+
+	if (eq->offer_batch_cb != NULL)
+		return eq->offer_batch_cb(eq, entries, nbr_entries);
+	for (size_t i = 0; i < nbr_entries; i++) {
+		struct firefly_event_batch_entry *e = &entries[i];
+		if (e->context_size > 0)
+			e->id = firefly_event_offer_copy(eq, e->strand, e->prio,
+					e->execute, e->context, e->context_size, e->nbr_depends,
+					e->depends);
+		else
+			e->id = firefly_event_offer_strand(eq, e->strand, e->prio,
+					e->execute, e->context, e->nbr_depends, e->depends);
+		if (e->id > 0)
+			nbr_added++;
+	}
+	return nbr_added;
 }
 
 void firefly_event_init(struct firefly_event *ev, int64_t id, unsigned char prio,
-		firefly_event_execute_f execute, void *context,
-		unsigned int nbr_depends, const int64_t *depends)
+		firefly_event_execute_f execute, void *context)
 {
 		ev->prio = prio;
 		ev->id = id;
 		ev->execute = execute;
 		ev->context = context;
-		memset(ev->depends, 0, sizeof(ev->depends));
-		if (nbr_depends > 0)
-			memcpy(ev->depends, depends, nbr_depends);
+		ev->context_allocated = false;
+		ev->timer_slot = FIREFLY_EVENT_NOT_TIMED;
+		ev->strand = NULL;
+		ev->edges = ev->inline_edges;
+		ev->nbr_edges = 0;
+		ev->nbr_pending = 0;
+		ev->dependents = NULL;
+		ev->index_next = NULL;
+		ev->held = false;
+}
+
+static inline size_t firefly_event_index_slot(struct firefly_event_queue *eq,
+		int64_t id)
+{
+	return (size_t) id & (eq->index_size - 1);
+}
+
+static void firefly_event_index_insert(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	size_t slot = firefly_event_index_slot(eq, ev->id);
+
+	ev->index_next = eq->index[slot];
+	eq->index[slot] = ev;
+}
+
+static void firefly_event_index_remove(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event **n = &eq->index[firefly_event_index_slot(eq, ev->id)];
+
+	while (*n != NULL && *n != ev)
+		n = &(*n)->index_next;
+	if (*n != NULL)
+		*n = ev->index_next;
+	ev->index_next = NULL;
+}
+
+static void firefly_event_index_resize(struct firefly_event_queue *eq,
+		size_t new_size)
+{
+	struct firefly_event **new_index =
+		FIREFLY_MALLOC(sizeof(struct firefly_event *)*new_size);
+	if (new_index == NULL)
+		return;
+	memset(new_index, 0, sizeof(struct firefly_event *)*new_size);
+	for (size_t i = 0; i < eq->index_size; i++) {
+		struct firefly_event *ev = eq->index[i];
+		while (ev != NULL) {
+			struct firefly_event *next = ev->index_next;
+			size_t slot = (size_t) ev->id & (new_size - 1);
+			ev->index_next = new_index[slot];
+			new_index[slot] = ev;
+			ev = next;
+		}
+	}
+	FIREFLY_FREE(eq->index);
+	eq->index = new_index;
+	eq->index_size = new_size;
 }
 
 struct firefly_event *firefly_event_take(struct firefly_event_queue *q)
@@ -107,13 +391,21 @@ struct firefly_event *firefly_event_take(struct firefly_event_queue *q)
 			size_t new_size = q->event_pool_size*2;
 			struct firefly_event **new_pool =
 				FIREFLY_MALLOC(sizeof(struct firefly_event*)*new_size);
-			memcpy(new_pool, q->event_pool, q->event_pool_size);
-			for (size_t i = q->event_pool_in_use; i < new_size; i++) {
-				new_pool[i] = FIREFLY_MALLOC(sizeof(struct firefly_event));
+			if (new_pool == NULL || !firefly_event_slab_add(q,
+						new_pool + q->event_pool_size,
+						new_size - q->event_pool_size)) {
+				FIREFLY_FREE(new_pool);
+				firefly_error(FIREFLY_ERROR_ALLOC, 1,
+						"Could not grow the event pool.");
+				return NULL;
 			}
+			memcpy(new_pool, q->event_pool,
+					sizeof(struct firefly_event *)*q->event_pool_size);
 			FIREFLY_FREE(q->event_pool);
 			q->event_pool = new_pool;
 			q->event_pool_size = new_size;
+			if (q->index_size < new_size)
+				firefly_event_index_resize(q, q->index_size*2);
 		}
 	}
 	struct firefly_event *ev = q->event_pool[q->event_pool_in_use];
@@ -131,76 +423,437 @@ void firefly_event_return(struct firefly_event_queue *q,
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 				"EVENT: Inconsistent state, more events in use than possible.");
 	} else {
+		if ((*ev)->edges != (*ev)->inline_edges)
+			FIREFLY_FREE((*ev)->edges);
+		if ((*ev)->context_allocated)
+			FIREFLY_FREE((*ev)->context);
 		q->event_pool_in_use--;
 		q->event_pool[q->event_pool_in_use] = *ev;
 		*ev = NULL;
 	}
 }
 
+/**
+ * @brief Returns the index of the most significant set bit in a non-zero word.
+ */
+static inline int firefly_event_msb(uint64_t w)
+{
+#ifdef __GNUC__
+	return 63 - __builtin_clzll(w);
+#else
+	int i = 0;
+	while (w >>= 1)
+		i++;
+	return i;
+#endif
+}
+
+/**
+ * @brief Returns the index of the least significant set bit in a non-zero
+ * word.
+ */
+static inline int firefly_event_lsb(uint64_t w)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(w);
+#else
+	int i = 0;
+	while (!(w & 1)) {
+		w >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+static void firefly_event_enqueue(struct firefly_event_queue *eq,
+		struct firefly_event *ev, unsigned int nbr_depends,
+		const int64_t *depends)
+{
+	struct firefly_event_bucket *b = &eq->buckets[ev->prio];
+
+	ev->next = NULL;
+	ev->prev = b->tail;
+	if (b->tail != NULL)
+		b->tail->next = ev;
+	else
+		b->head = ev;
+	b->tail = ev;
+	eq->occupied[ev->prio / 64] |= UINT64_C(1) << (ev->prio % 64);
+	eq->length++;
+	firefly_event_index_insert(eq, ev);
+
+	for (unsigned int i = 0; i < nbr_depends; i++) {
+		struct firefly_event *target = firefly_event_find(eq, depends[i]);
+		// An event still in the timer wheel is not popped by following the
+		// dependencies, so the dependency can not be kept.
+		if (target != NULL && target->timer_slot != FIREFLY_EVENT_NOT_TIMED) {
+			firefly_error(FIREFLY_ERROR_EVENT, 1,
+					"Ignoring dependency on an event that is not due.");
+			continue;
+		}
+		// A held event releases its dependents once it is executed.
+		if (target != NULL && target != ev) {
+			struct firefly_event_edge *e = &ev->edges[ev->nbr_edges++];
+			e->owner = ev;
+			e->target = target;
+			e->next = target->dependents;
+			target->dependents = e;
+			ev->nbr_pending++;
+		}
+	}
+}
+
+/*
+ * Remove an event from its bucket, it stays in the index and keeps its
+ * dependents waiting.
+ */
+static void firefly_event_bucket_remove(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event_bucket *b = &eq->buckets[ev->prio];
+
+	if (ev->prev != NULL)
+		ev->prev->next = ev->next;
+	else
+		b->head = ev->next;
+	if (ev->next != NULL)
+		ev->next->prev = ev->prev;
+	else
+		b->tail = ev->prev;
+	if (b->head == NULL)
+		eq->occupied[ev->prio / 64] &= ~(UINT64_C(1) << (ev->prio % 64));
+	ev->next = NULL;
+	ev->prev = NULL;
+	eq->length--;
+}
+
+void firefly_event_release(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	firefly_event_index_remove(eq, ev);
+	ev->held = false;
+
+	// Release every queued event waiting for this one.
+	for (struct firefly_event_edge *e = ev->dependents; e != NULL; e = e->next) {
+		e->target = NULL;
+		e->owner->nbr_pending--;
+	}
+	ev->dependents = NULL;
+}
+
+static void firefly_event_unlink(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	firefly_event_bucket_remove(eq, ev);
+	firefly_event_release(eq, ev);
+}
+
 int64_t firefly_event_add(struct firefly_event_queue *eq, unsigned char prio,
 		firefly_event_execute_f execute, void *context,
 		unsigned int nbr_depends, const int64_t *depends)
 {
-	struct firefly_event **n = &eq->head;
+	return firefly_event_add_strand(eq, NULL, prio, execute, context,
+			nbr_depends, depends);
+}
+
+int64_t firefly_event_add_strand(struct firefly_event_queue *eq, void *strand,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		unsigned int nbr_depends, const int64_t *depends)
+{
+	return firefly_event_add_copy(eq, strand, prio, execute, context, 0,
+			nbr_depends, depends);
+}
+
+int64_t firefly_event_add_copy(struct firefly_event_queue *eq, void *strand,
+		unsigned char prio, firefly_event_execute_f execute,
+		const void *context, size_t context_size, unsigned int nbr_depends,
+		const int64_t *depends)
+{
+	int64_t res;
+
 	if (nbr_depends > FIREFLY_EVENT_QUEUE_MAX_DEPENDS)
 		return -2;
+	res = firefly_event_add_id(eq, eq->event_id + 1, strand, prio, execute,
+			(void *) context, context_size, nbr_depends, depends);
+	if (res > 0) {
+		eq->event_id = res;
+		if (eq->event_id == INT64_MAX) {
+			eq->event_id = 0;
+		}
+	}
+	return res;
+}
 
-	// Find the node to insert the event before, it may be NULL and eq->head
-	while (*n != NULL && (*n)->prio >= prio) {
-		n = &(*n)->next;
+static void firefly_event_timer_insert(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	const int64_t range = INT64_C(1) <<
+		(FIREFLY_EVENT_TIMER_SLOT_BITS * FIREFLY_EVENT_TIMER_LEVELS);
+	int64_t when = ev->when;
+	int level = 0;
+	size_t slot;
+
+	// Too far away, wait in the last slot of the top level.
+	if (when - eq->timer_time >= range)
+		when = eq->timer_time + range - 1;
+	while (level < FIREFLY_EVENT_TIMER_LEVELS - 1 && when - eq->timer_time >=
+			INT64_C(1) << (FIREFLY_EVENT_TIMER_SLOT_BITS * (level + 1)))
+		level++;
+	slot = (when >> (FIREFLY_EVENT_TIMER_SLOT_BITS * level)) &
+		(FIREFLY_EVENT_TIMER_SLOTS - 1);
+	ev->prev = NULL;
+	ev->next = eq->timers[level][slot];
+	if (ev->next != NULL)
+		ev->next->prev = ev;
+	eq->timers[level][slot] = ev;
+	eq->timers_occupied[level] |= UINT64_C(1) << slot;
+	ev->timer_slot = level * FIREFLY_EVENT_TIMER_SLOTS + slot;
+	eq->nbr_timers++;
+}
+
+static void firefly_event_timer_remove(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	int level = ev->timer_slot / FIREFLY_EVENT_TIMER_SLOTS;
+	size_t slot = ev->timer_slot % FIREFLY_EVENT_TIMER_SLOTS;
+
+	if (ev->prev != NULL)
+		ev->prev->next = ev->next;
+	else
+		eq->timers[level][slot] = ev->next;
+	if (ev->next != NULL)
+		ev->next->prev = ev->prev;
+	if (eq->timers[level][slot] == NULL)
+		eq->timers_occupied[level] &= ~(UINT64_C(1) << slot);
+	ev->next = NULL;
+	ev->prev = NULL;
+	ev->timer_slot = FIREFLY_EVENT_NOT_TIMED;
+	eq->nbr_timers--;
+}
+
+/*
+ * Empty a slot of the timer wheel, each event is either queued if it is due
+ * or put back in the slot matching the current time. The slot is walked from
+ * the oldest event to keep the order of events due at the same time.
+ */
+static void firefly_event_timer_flush(struct firefly_event_queue *eq,
+		int level, size_t slot)
+{
+	struct firefly_event *ev = eq->timers[level][slot];
+	struct firefly_event *prev;
+
+	if (ev == NULL)
+		return;
+	while (ev->next != NULL)
+		ev = ev->next;
+	for (; ev != NULL; ev = prev) {
+		prev = ev->prev;
+		firefly_event_timer_remove(eq, ev);
+		if (ev->when <= eq->timer_time) {
+			firefly_event_index_remove(eq, ev);
+			firefly_event_enqueue(eq, ev, 0, NULL);
+		} else {
+			firefly_event_timer_insert(eq, ev);
+		}
+	}
+}
+
+void firefly_event_queue_advance(struct firefly_event_queue *eq, int64_t now)
+{
+	while (eq->timer_time < now) {
+		if (eq->nbr_timers == 0) {
+			eq->timer_time = now;
+			break;
+		}
+		if (eq->timers_occupied[0] == 0) {
+			// Nothing is due before the lowest level wraps, skip ahead.
+			int64_t next = (eq->timer_time | (FIREFLY_EVENT_TIMER_SLOTS - 1));
+			if (next >= now) {
+				eq->timer_time = now;
+				break;
+			}
+			eq->timer_time = next;
+		}
+		int64_t t = ++eq->timer_time;
+		size_t slot = t & (FIREFLY_EVENT_TIMER_SLOTS - 1);
+		// Move the events of the next slot of each wrapping level down.
+		for (int level = 1; slot == 0 && level < FIREFLY_EVENT_TIMER_LEVELS;
+				level++) {
+			slot = (t >> (FIREFLY_EVENT_TIMER_SLOT_BITS * level)) &
+				(FIREFLY_EVENT_TIMER_SLOTS - 1);
+			firefly_event_timer_flush(eq, level, slot);
+		}
+		firefly_event_timer_flush(eq, 0, t & (FIREFLY_EVENT_TIMER_SLOTS - 1));
 	}
+}
+
+int64_t firefly_event_queue_next_timer(struct firefly_event_queue *eq)
+{
+	int64_t next = -1;
+
+	if (eq->nbr_timers == 0)
+		return -1;
+	for (int level = 0; level < FIREFLY_EVENT_TIMER_LEVELS; level++) {
+		int shift = FIREFLY_EVENT_TIMER_SLOT_BITS * level;
+		uint64_t bits = eq->timers_occupied[level];
+		// The first time after timer_time the slots of the level are emptied.
+		int64_t base = ((eq->timer_time >> shift) + 1) << shift;
+		int start = (base >> shift) & (FIREFLY_EVENT_TIMER_SLOTS - 1);
+		int64_t t;
+
+		if (bits == 0)
+			continue;
+		if (start != 0)
+			bits = (bits >> start) | (bits << (FIREFLY_EVENT_TIMER_SLOTS - start));
+		t = base + ((int64_t) firefly_event_lsb(bits) << shift);
+		if (next < 0 || t < next)
+			next = t;
+	}
+	return next;
+}
+
+int64_t firefly_event_add_at_id(struct firefly_event_queue *eq, int64_t id,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, int64_t when)
+{
+	struct firefly_event *ev = firefly_event_take(eq);
+
+	if (ev == NULL)
+		return -1;
+	firefly_event_init(ev, id, prio, execute, context);
+	ev->strand = strand;
+	ev->when = when;
+	if (when <= eq->timer_time) {
+		firefly_event_enqueue(eq, ev, 0, NULL);
+	} else {
+		firefly_event_index_insert(eq, ev);
+		firefly_event_timer_insert(eq, ev);
+	}
+	return ev->id;
+}
+
+int64_t firefly_event_add_at(struct firefly_event_queue *eq, void *strand,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		int64_t when)
+{
+	int64_t res;
+
+	res = firefly_event_add_at_id(eq, eq->event_id + 1, strand, prio, execute,
+			context, when);
+	if (res > 0) {
+		eq->event_id = res;
+		if (eq->event_id == INT64_MAX) {
+			eq->event_id = 0;
+		}
+	}
+	return res;
+}
+
+int64_t firefly_event_add_after(struct firefly_event_queue *eq, void *strand,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		int64_t delay)
+{
+	return firefly_event_add_at(eq, strand, prio, execute, context,
+			eq->timer_time + delay);
+}
+
+int firefly_event_cancel(struct firefly_event_queue *eq, int64_t id)
+{
+	struct firefly_event *ev = firefly_event_find(eq, id);
+
+	if (ev == NULL || ev->held)
+		return -1;
+	if (ev->timer_slot != FIREFLY_EVENT_NOT_TIMED) {
+		firefly_event_timer_remove(eq, ev);
+		firefly_event_index_remove(eq, ev);
+	} else {
+		firefly_event_unlink(eq, ev);
+		// Detach the dependencies still waiting for other events.
+		for (unsigned int i = 0; i < ev->nbr_edges; i++) {
+			struct firefly_event_edge **e;
+			if (ev->edges[i].target == NULL)
+				continue;
+			e = &ev->edges[i].target->dependents;
+			while (*e != &ev->edges[i])
+				e = &(*e)->next;
+			*e = ev->edges[i].next;
+		}
+	}
+	firefly_event_return(eq, &ev);
+	return 0;
+}
+
+int64_t firefly_event_add_id(struct firefly_event_queue *eq, int64_t id,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, size_t context_size, unsigned int nbr_depends,
+		const int64_t *depends)
+{
+	if (nbr_depends > FIREFLY_EVENT_QUEUE_MAX_DEPENDS)
+		return -2;
 
 	struct firefly_event *ev = firefly_event_take(eq);
 	if (ev == NULL) {
 		return -1;
 	}
-	firefly_event_init(ev, ++eq->event_id, prio, execute, context,
-			nbr_depends, depends);
-	if (eq->event_id == INT64_MAX) {
-		eq->event_id = 0;
+	firefly_event_init(ev, id, prio, execute, context);
+	ev->strand = strand;
+	if (nbr_depends > FIREFLY_EVENT_INLINE_DEPENDS) {
+		ev->edges = FIREFLY_MALLOC(
+				sizeof(struct firefly_event_edge)*nbr_depends);
+	}
+	if (context_size > FIREFLY_EVENT_PAYLOAD_SIZE) {
+		ev->context = FIREFLY_MALLOC(context_size);
+		ev->context_allocated = ev->context != NULL;
+	} else if (context_size > 0) {
+		ev->context = ev->payload.bytes;
+	}
+	if (ev->edges == NULL || (context_size > 0 && ev->context == NULL)) {
+		if (ev->edges == NULL)
+			ev->edges = ev->inline_edges;
+		firefly_event_return(eq, &ev);
+		firefly_error(FIREFLY_ERROR_ALLOC, 1, "Could not allocate event.");
+		return -1;
 	}
-	ev->next = (*n);
-	*n = ev;
+	if (context_size > 0)
+		memcpy(ev->context, context, context_size);
+	firefly_event_enqueue(eq, ev, nbr_depends, depends);
 
 	return ev->id;
 }
 
-void firefly_event_remove(struct firefly_event **ev)
+struct firefly_event *firefly_event_queue_head(struct firefly_event_queue *eq)
 {
-	*ev = (*ev)->next;
+	for (int i = FIREFLY_EVENT_QUEUE_BITMAP_WORDS - 1; i >= 0; i--) {
+		if (eq->occupied[i] != 0) {
+			int prio = i * 64 + firefly_event_msb(eq->occupied[i]);
+			return eq->buckets[prio].head;
+		}
+	}
+	return NULL;
 }
 
-struct firefly_event **firefly_event_find(struct firefly_event_queue *eq,
+struct firefly_event *firefly_event_find(struct firefly_event_queue *eq,
 		int64_t id)
 {
-	struct firefly_event *ev;
-	if (eq->head == NULL)
-		return NULL;
-	else if (eq->head->id == id)
-		return &eq->head;
-	ev = eq->head;
-	while (ev->next != NULL && ev->next->id != id) {
-		ev = ev->next;
-	}
+	struct firefly_event *ev = eq->index[firefly_event_index_slot(eq, id)];
 
-	return &ev->next;
+	while (ev != NULL && ev->id != id)
+		ev = ev->index_next;
+	return ev;
 }
 
-struct firefly_event **firefly_event_get_depends(struct firefly_event_queue *eq,
-		struct firefly_event **ev)
+/*
+ * Follows the first unreleased dependency until an event without queued
+ * dependencies is found.
+ */
+static struct firefly_event *firefly_event_get_depends(struct firefly_event *ev)
 {
-	for (int i = 0; i < FIREFLY_EVENT_QUEUE_MAX_DEPENDS; i++) {
-		if ((*ev)->depends[i] != 0) {
-			struct firefly_event **tmp =
-				firefly_event_find(eq, (*ev)->depends[i]);
-			if (*tmp != NULL) {
-				struct firefly_event **tmp2 =
-					firefly_event_get_depends(eq, tmp);
-				if (*tmp2 == *tmp)
-					(*ev)->depends[i] = 0;
-				return tmp2;
-			} else {
-				(*ev)->depends[i] = 0;
+	while (ev->nbr_pending > 0) {
+		for (unsigned int i = 0; i < ev->nbr_edges; i++) {
+			if (ev->edges[i].target != NULL) {
+				ev = ev->edges[i].target;
+				break;
 			}
 		}
 	}
@@ -209,19 +862,40 @@ struct firefly_event **firefly_event_get_depends(struct firefly_event_queue *eq,
 
 struct firefly_event *firefly_event_pop(struct firefly_event_queue *eq)
 {
-	// The actual event
-	struct firefly_event **ev;
-	struct firefly_event *tmp;
+	struct firefly_event *ev;
 
-	ev = &eq->head;
-	if ((*ev) == NULL) {
+	ev = firefly_event_queue_head(eq);
+	if (ev == NULL) {
 		return NULL;
 	}
-	ev = firefly_event_get_depends(eq, ev);
-	tmp = *ev;
-	firefly_event_remove(ev);
+	ev = firefly_event_get_depends(ev);
+	firefly_event_unlink(eq, ev);
 
-	return tmp;
+	return ev;
+}
+
+struct firefly_event *firefly_event_pop_held(struct firefly_event_queue *eq)
+{
+	struct firefly_event *ev;
+	struct firefly_event *next;
+	uint64_t w;
+	int prio;
+
+	for (int i = FIREFLY_EVENT_QUEUE_BITMAP_WORDS - 1; i >= 0; i--) {
+		for (w = eq->occupied[i]; w != 0; w &= ~(UINT64_C(1) << (prio % 64))) {
+			prio = i * 64 + firefly_event_msb(w);
+			for (ev = eq->buckets[prio].head; ev != NULL; ev = ev->next) {
+				// Skip events waiting for an event that is executing.
+				next = firefly_event_get_depends(ev);
+				if (!next->held) {
+					firefly_event_bucket_remove(eq, next);
+					next->held = true;
+					return next;
+				}
+			}
+		}
+	}
+	return NULL;
 }
 
 int firefly_event_execute(struct firefly_event *ev)
@@ -238,16 +912,7 @@ int firefly_event_execute(struct firefly_event *ev)
 
 size_t firefly_event_queue_length(struct firefly_event_queue *eq)
 {
-	struct firefly_event *ev;
-	size_t n = 0;
-
-	ev = eq->head;
-	while (ev) {
-		ev = ev->next;
-		n++;
-	}
-
-	return n;
+	return eq->length;
 }
 
 void *firefly_event_queue_get_context(struct firefly_event_queue *eq)
@@ -255,6 +920,11 @@ void *firefly_event_queue_get_context(struct firefly_event_queue *eq)
 	return eq->context;
 }
 
+void *firefly_event_strand(struct firefly_event *ev)
+{
+	return ev->strand;
+}
+
 int64_t firefly_event_queue_event_id(struct firefly_event *ev)
 {
 	return ev->id;
@@ -2,40 +2,533 @@
 #include <pthread.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <utils/firefly_event_queue_posix.h>
 #include <utils/firefly_event_queue.h>
 
+#include "utils/firefly_event_queue_private.h"
+#include "utils/cppmacros.h"
+
+#define FIREFLY_EVENT_QUEUE_POSIX_STRAND_SLOTS (64)
+
+/*
+ * The state of a strand while any of its events are executing or waiting for
+ * an earlier event of the strand to finish.
+ */
+struct firefly_event_strand {
+	void *key;
+	bool busy;
+	struct firefly_event *first; /* Deferred events, linked through next. */
+	struct firefly_event *last;
+	struct firefly_event_strand *next; /* Next strand in the same slot. */
+	struct firefly_event_strand *ready_next; /* Next strand ready to run. */
+};
+
+/*
+ * An event offered to a lock free queue, waiting in the intake until the
+ * consumer merges it into the priority queue. The nodes are taken from a
+ * preallocated freelist, nodes are only allocated when the freelist is empty
+ * or a copied context does not fit in the payload.
+ */
+struct firefly_event_intake_node {
+	struct firefly_event_intake_node *next;
+	int64_t id;
+	void *strand;
+	unsigned char prio;
+	firefly_event_execute_f execute;
+	void *context; /* Points to the payload or right after the node if
+					  copied. */
+	size_t context_size;
+	unsigned int nbr_deps;
+	int64_t deps[FIREFLY_EVENT_QUEUE_MAX_DEPENDS];
+	uint32_t free_next; /* The index plus one of the next free node, 0 if
+						   last. */
+	bool pooled; /* The node belongs to the preallocated nodes. */
+	union {
+		unsigned char bytes[FIREFLY_EVENT_PAYLOAD_SIZE];
+		void *align_ptr;
+		int64_t align_int;
+		double align_double;
+	} payload;
+};
+
+/*
+ * Intrusive multi producer single consumer queue. Producers exchange the head
+ * and then link the previous head to the new node, the consumer owns tail
+ * and must hold the context lock.
+ */
+struct firefly_event_intake {
+	struct firefly_event_intake_node *head;
+	struct firefly_event_intake_node *tail;
+	struct firefly_event_intake_node stub;
+};
+
 struct firefly_event_queue_posix_context {
 	pthread_mutex_t lock;
 	pthread_cond_t signal;
 	pthread_t event_loop;
+	bool event_loop_started;
 	bool event_loop_stop;
+	pthread_t *workers;
+	size_t nbr_workers;
+	size_t running; /* The number of events being executed. */
+	bool exclusive; /* An event without strand is being executed. */
+	struct firefly_event *barrier; /* Popped event without strand waiting
+									  for all other events to finish. */
+	size_t nbr_deferred;
+	struct firefly_event_strand *strands[FIREFLY_EVENT_QUEUE_POSIX_STRAND_SLOTS];
+	struct firefly_event_strand *ready_first;
+	struct firefly_event_strand *ready_last;
+	bool lockfree; /* Events are offered through the intake. */
+	struct firefly_event_intake intake;
+	struct firefly_event_intake_node *intake_pending; /* Popped from the
+											 intake but not yet merged. */
+	int64_t intake_id; /* The last ID handed out by the intake. */
+	struct firefly_event_intake_node *intake_nodes; /* The preallocated
+													   intake nodes. */
+	uint64_t intake_free; /* The head of the free intake nodes, a tag in
+							 the upper and the index plus one of the node in
+							 the lower 32 bits. */
+	int nbr_sleeping; /* The number of consumers waiting for events. */
+	size_t batch_size; /* The number of events the event loop pops and
+						  returns per lock acquisition. */
+	int event_fd; /* Signaled when events may be ready, -1 if the queue is
+					 not executed by the application. */
 };
 
 int64_t firefly_event_queue_posix_add(struct firefly_event_queue *eq,
 		unsigned char prio, firefly_event_execute_f execute, void *context,
 		unsigned int nbr_deps, const int64_t *deps);
 
+int64_t firefly_event_queue_posix_add_strand(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, unsigned int nbr_deps, const int64_t *deps);
+
+size_t firefly_event_queue_posix_add_batch(struct firefly_event_queue *eq,
+		struct firefly_event_batch_entry *entries, size_t nbr_entries);
+
+int64_t firefly_event_queue_posix_add_lockfree(struct firefly_event_queue *eq,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		unsigned int nbr_deps, const int64_t *deps);
+
+size_t firefly_event_queue_posix_add_lockfree_batch(
+		struct firefly_event_queue *eq,
+		struct firefly_event_batch_entry *entries, size_t nbr_entries);
+
+int64_t firefly_event_queue_posix_add_lockfree_strand(
+		struct firefly_event_queue *eq, void *strand, unsigned char prio,
+		firefly_event_execute_f execute, void *context, unsigned int nbr_deps,
+		const int64_t *deps);
+
+int64_t firefly_event_queue_posix_add_after(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, int64_t delay);
+
+int firefly_event_queue_posix_cancel(struct firefly_event_queue *eq,
+		int64_t id);
+
+int firefly_event_queue_posix_run_inline(struct firefly_event_queue *eq,
+		void *strand, firefly_event_execute_f execute, void *context);
+
+size_t firefly_event_queue_posix_run_pending(struct firefly_event_queue *eq,
+		size_t budget);
+
+static void firefly_event_intake_merge(struct firefly_event_queue *eq,
+		struct firefly_event_queue_posix_context *ctx);
+
+/*
+ * The time in milliseconds of the clock the timed events of the queue and the
+ * condition variable use.
+ */
+static int64_t firefly_event_queue_posix_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Implements firefly_event_clock.
+ */
+static int64_t firefly_event_queue_posix_clock(struct firefly_event_queue *eq)
+{
+	UNUSED_VAR(eq);
+	return firefly_event_queue_posix_now();
+}
+
+/*
+ * Signal the event descriptor of a queue executed by the application that
+ * events may be ready.
+ */
+static void firefly_event_queue_posix_notify(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	uint64_t one = 1;
+	ssize_t res;
+
+	if (ctx->event_fd < 0)
+		return;
+	res = write(ctx->event_fd, &one, sizeof(one));
+	(void) res; /* The counter is already non-zero if the write fails. */
+}
+
 struct firefly_event_queue *firefly_event_queue_posix_new(size_t pool_size)
 {
 	int res;
+	pthread_condattr_t cond_attr;
 	struct firefly_event_queue_posix_context *ctx =
 		malloc(sizeof(struct firefly_event_queue_posix_context));
 	res = pthread_mutex_init(&ctx->lock, NULL);
 	if (res) {
 		fprintf(stderr, "ERROR: init mutex.\n");
 	}
-	res = pthread_cond_init(&ctx->signal, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	res = pthread_cond_init(&ctx->signal, &cond_attr);
 	if (res) {
 		fprintf(stderr, "ERROR: init cond variable.\n");
 	}
+	pthread_condattr_destroy(&cond_attr);
+	ctx->event_loop_started = false;
 	ctx->event_loop_stop = false;
+	ctx->workers = NULL;
+	ctx->nbr_workers = 0;
+	ctx->running = 0;
+	ctx->exclusive = false;
+	ctx->barrier = NULL;
+	ctx->nbr_deferred = 0;
+	memset(ctx->strands, 0, sizeof(ctx->strands));
+	ctx->ready_first = NULL;
+	ctx->ready_last = NULL;
+	ctx->lockfree = false;
+	ctx->intake.stub.next = NULL;
+	ctx->intake.head = &ctx->intake.stub;
+	ctx->intake.tail = &ctx->intake.stub;
+	ctx->intake_pending = NULL;
+	ctx->intake_id = 0;
+	ctx->intake_nodes = NULL;
+	ctx->intake_free = 0;
+	ctx->nbr_sleeping = 0;
+	ctx->batch_size = 1;
+	ctx->event_fd = -1;
 	struct firefly_event_queue *eq =
 		firefly_event_queue_new(firefly_event_queue_posix_add, pool_size, ctx);
+	if (eq != NULL) {
+		firefly_event_queue_set_strand_offer(eq,
+				firefly_event_queue_posix_add_strand);
+		firefly_event_queue_set_batch_offer(eq,
+				firefly_event_queue_posix_add_batch);
+		firefly_event_queue_set_timed_offer(eq,
+				firefly_event_queue_posix_add_after,
+				firefly_event_queue_posix_cancel);
+		firefly_event_queue_set_inline_run(eq,
+				firefly_event_queue_posix_run_inline);
+		firefly_event_queue_set_clock(eq, firefly_event_queue_posix_clock);
+		firefly_event_queue_advance(eq, firefly_event_queue_posix_now());
+	}
 	return eq;
 }
 
+static void firefly_event_intake_push(struct firefly_event_intake *q,
+		struct firefly_event_intake_node *n)
+{
+	struct firefly_event_intake_node *prev;
+
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pop the oldest node of the intake. Returns NULL if the intake is empty or a
+ * producer has not yet linked its node, in which case the node is picked up
+ * by a later call.
+ */
+static struct firefly_event_intake_node *firefly_event_intake_pop(
+		struct firefly_event_intake *q)
+{
+	struct firefly_event_intake_node *tail = q->tail;
+	struct firefly_event_intake_node *next =
+		__atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (next == NULL)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	firefly_event_intake_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/*
+ * Take a node from the freelist. The tag in the head is incremented on every
+ * change so a producer never succeeds with a head it read before the node was
+ * taken and given back by others.
+ */
+static struct firefly_event_intake_node *firefly_event_intake_node_take(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	uint64_t head = __atomic_load_n(&ctx->intake_free, __ATOMIC_ACQUIRE);
+	uint64_t next;
+	struct firefly_event_intake_node *n;
+
+	do {
+		if ((uint32_t) head == 0)
+			return NULL;
+		n = &ctx->intake_nodes[(uint32_t) head - 1];
+		next = ((head >> 32) + 1) << 32 |
+			__atomic_load_n(&n->free_next, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&ctx->intake_free, &head, next,
+				true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return n;
+}
+
+static void firefly_event_intake_node_free(
+		struct firefly_event_queue_posix_context *ctx,
+		struct firefly_event_intake_node *n)
+{
+	uint64_t head;
+	uint64_t next;
+
+	if (!n->pooled) {
+		free(n);
+		return;
+	}
+	head = __atomic_load_n(&ctx->intake_free, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&n->free_next, (uint32_t) head, __ATOMIC_RELAXED);
+		next = ((head >> 32) + 1) << 32 | (uint32_t) (n - ctx->intake_nodes + 1);
+	} while (!__atomic_compare_exchange_n(&ctx->intake_free, &head, next,
+				true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+int64_t firefly_event_queue_posix_add_after(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, int64_t delay)
+{
+	int64_t id;
+	int64_t now = firefly_event_queue_posix_now();
+	struct firefly_event_queue_posix_context *ctx =
+		(struct firefly_event_queue_posix_context *)
+		firefly_event_queue_get_context(eq);
+
+	pthread_mutex_lock(&ctx->lock);
+	firefly_event_queue_advance(eq, now);
+	if (ctx->lockfree) {
+		// The intake hands out the IDs of a lock free queue.
+		id = __atomic_add_fetch(&ctx->intake_id, 1, __ATOMIC_RELAXED);
+		id = firefly_event_add_at_id(eq, id, strand, prio, execute, context,
+				now + delay);
+	} else {
+		id = firefly_event_add_at(eq, strand, prio, execute, context,
+				now + delay);
+	}
+	// The event may be due before any timeout a consumer is waiting for.
+	if (id > 0) {
+		pthread_cond_broadcast(&ctx->signal);
+		firefly_event_queue_posix_notify(ctx);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return id;
+}
+
+int firefly_event_queue_posix_cancel(struct firefly_event_queue *eq,
+		int64_t id)
+{
+	int res;
+	struct firefly_event_queue_posix_context *ctx =
+		(struct firefly_event_queue_posix_context *)
+		firefly_event_queue_get_context(eq);
+
+	pthread_mutex_lock(&ctx->lock);
+	firefly_event_intake_merge(eq, ctx);
+	res = firefly_event_cancel(eq, id);
+	pthread_mutex_unlock(&ctx->lock);
+	return res;
+}
+
+static bool firefly_event_intake_empty(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	return !ctx->lockfree || (ctx->intake_pending == NULL &&
+			ctx->intake.tail == &ctx->intake.stub &&
+			__atomic_load_n(&ctx->intake.head, __ATOMIC_SEQ_CST) ==
+			&ctx->intake.stub);
+}
+
+/*
+ * Move everything in the intake into the priority queue under a single lock
+ * acquisition, the context must be locked. If the event pool is exhausted the
+ * remaining nodes are left for the next merge.
+ */
+static void firefly_event_intake_merge(struct firefly_event_queue *eq,
+		struct firefly_event_queue_posix_context *ctx)
+{
+	struct firefly_event_intake_node *n;
+
+	if (!ctx->lockfree)
+		return;
+	for (;;) {
+		n = ctx->intake_pending;
+		if (n == NULL && (n = firefly_event_intake_pop(&ctx->intake)) == NULL)
+			break;
+		if (firefly_event_add_id(eq, n->id, n->strand, n->prio, n->execute,
+					n->context, n->context_size, n->nbr_deps, n->deps) < 0) {
+			ctx->intake_pending = n;
+			break;
+		}
+		ctx->intake_pending = NULL;
+		firefly_event_intake_node_free(ctx, n);
+	}
+}
+
+static void firefly_event_intake_clear(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	struct firefly_event_intake_node *n;
+
+	if (ctx->intake_pending != NULL)
+		firefly_event_intake_node_free(ctx, ctx->intake_pending);
+	ctx->intake_pending = NULL;
+	while ((n = firefly_event_intake_pop(&ctx->intake)) != NULL)
+		firefly_event_intake_node_free(ctx, n);
+	free(ctx->intake_nodes);
+	ctx->intake_nodes = NULL;
+}
+
+/*
+ * Wait on the condition variable, at most until the next timed event of the
+ * queue is due. The context must be locked.
+ */
+static void firefly_event_queue_posix_sleep(struct firefly_event_queue *eq,
+		struct firefly_event_queue_posix_context *ctx)
+{
+	int64_t next = firefly_event_queue_next_timer(eq);
+	struct timespec abstime;
+
+	if (next < 0) {
+		pthread_cond_wait(&ctx->signal, &ctx->lock);
+		return;
+	}
+	abstime.tv_sec = next / 1000;
+	abstime.tv_nsec = (next % 1000) * 1000000;
+	pthread_cond_timedwait(&ctx->signal, &ctx->lock, &abstime);
+}
+
+/*
+ * Wait for new or due events, the context must be locked. Producers of a lock
+ * free queue only signal when a consumer has announced that it is going to
+ * sleep.
+ */
+static void firefly_event_queue_posix_wait(struct firefly_event_queue *eq,
+		struct firefly_event_queue_posix_context *ctx)
+{
+	if (!ctx->lockfree) {
+		firefly_event_queue_posix_sleep(eq, ctx);
+		return;
+	}
+	__atomic_add_fetch(&ctx->nbr_sleeping, 1, __ATOMIC_SEQ_CST);
+	if (firefly_event_intake_empty(ctx))
+		firefly_event_queue_posix_sleep(eq, ctx);
+	__atomic_sub_fetch(&ctx->nbr_sleeping, 1, __ATOMIC_SEQ_CST);
+}
+
+struct firefly_event_queue *firefly_event_queue_posix_lockfree_new(
+		size_t pool_size)
+{
+	struct firefly_event_queue *eq = firefly_event_queue_posix_new(pool_size);
+	struct firefly_event_queue_posix_context *ctx;
+
+	if (eq != NULL) {
+		ctx = firefly_event_queue_get_context(eq);
+		ctx->lockfree = true;
+		// Nodes are allocated one by one if the freelist can not be.
+		if (pool_size > 0 && pool_size < UINT32_MAX)
+			ctx->intake_nodes = malloc(sizeof(*ctx->intake_nodes)*pool_size);
+		if (ctx->intake_nodes != NULL) {
+			for (size_t i = 0; i < pool_size; i++) {
+				ctx->intake_nodes[i].pooled = true;
+				ctx->intake_nodes[i].free_next = i + 1 < pool_size ? i + 2 : 0;
+			}
+			ctx->intake_free = 1;
+		}
+		eq->offer_event_cb = firefly_event_queue_posix_add_lockfree;
+		firefly_event_queue_set_strand_offer(eq,
+				firefly_event_queue_posix_add_lockfree_strand);
+		firefly_event_queue_set_batch_offer(eq,
+				firefly_event_queue_posix_add_lockfree_batch);
+	}
+	return eq;
+}
+
+struct firefly_event_queue *firefly_event_queue_posix_fd_new(size_t pool_size)
+{
+	struct firefly_event_queue *eq = firefly_event_queue_posix_new(pool_size);
+	struct firefly_event_queue_posix_context *ctx;
+
+	if (eq == NULL)
+		return NULL;
+	ctx = firefly_event_queue_get_context(eq);
+	ctx->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ctx->event_fd < 0) {
+		firefly_event_queue_posix_free(&eq);
+		return NULL;
+	}
+	firefly_event_queue_set_pending_run(eq,
+			firefly_event_queue_posix_run_pending);
+	return eq;
+}
+
+int firefly_event_queue_posix_get_fd(struct firefly_event_queue *eq)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+
+	return ctx->event_fd;
+}
+
+int firefly_event_queue_posix_get_timeout(struct firefly_event_queue *eq)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+	int64_t now = firefly_event_queue_posix_now();
+	int64_t next;
+
+	pthread_mutex_lock(&ctx->lock);
+	firefly_event_queue_advance(eq, now);
+	if (firefly_event_queue_length(eq) > 0 || !firefly_event_intake_empty(ctx))
+		next = now;
+	else
+		next = firefly_event_queue_next_timer(eq);
+	pthread_mutex_unlock(&ctx->lock);
+	if (next < 0)
+		return -1;
+	if (next - now > INT_MAX)
+		return INT_MAX;
+	return next > now ? (int) (next - now) : 0;
+}
+
 void firefly_event_queue_posix_free(struct firefly_event_queue **eq)
 {
 	// make sure loop is stopped, free context and queue
@@ -43,6 +536,9 @@ void firefly_event_queue_posix_free(struct firefly_event_queue **eq)
 		firefly_event_queue_get_context(*eq);
 
 	firefly_event_queue_posix_stop(*eq);
+	firefly_event_intake_clear(ctx);
+	if (ctx->event_fd >= 0)
+		close(ctx->event_fd);
 	pthread_mutex_destroy(&ctx->lock);
 	pthread_cond_destroy(&ctx->signal);
 	free(ctx);
@@ -53,7 +549,15 @@ int64_t firefly_event_queue_posix_add(struct firefly_event_queue *eq,
 		unsigned char prio, firefly_event_execute_f execute, void *context,
 		unsigned int nbr_deps, const int64_t *deps)
 {
-	int res = 0;
+	return firefly_event_queue_posix_add_strand(eq, NULL, prio, execute,
+			context, nbr_deps, deps);
+}
+
+int64_t firefly_event_queue_posix_add_strand(struct firefly_event_queue *eq,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, unsigned int nbr_deps, const int64_t *deps)
+{
+	int64_t res = 0;
 	struct firefly_event_queue_posix_context *ctx =
 		(struct firefly_event_queue_posix_context *)
 		firefly_event_queue_get_context(eq);
@@ -62,47 +566,479 @@ int64_t firefly_event_queue_posix_add(struct firefly_event_queue *eq,
 	if (res) {
 		return res;
 	}
-	res = firefly_event_add(eq, prio, execute, context, nbr_deps, deps);
+	res = firefly_event_add_strand(eq, strand, prio, execute, context,
+			nbr_deps, deps);
 	if (res > 0) {
 		pthread_cond_signal(&ctx->signal);
+		firefly_event_queue_posix_notify(ctx);
 	}
 	pthread_mutex_unlock(&ctx->lock);
 	return res;
 }
 
+size_t firefly_event_queue_posix_add_batch(struct firefly_event_queue *eq,
+		struct firefly_event_batch_entry *entries, size_t nbr_entries)
+{
+	size_t nbr_added = 0;
+	struct firefly_event_queue_posix_context *ctx =
+		(struct firefly_event_queue_posix_context *)
+		firefly_event_queue_get_context(eq);
+
+	if (pthread_mutex_lock(&ctx->lock))
+		return 0;
+	for (size_t i = 0; i < nbr_entries; i++) {
+		struct firefly_event_batch_entry *e = &entries[i];
+		e->id = firefly_event_add_copy(eq, e->strand, e->prio, e->execute,
+				e->context, e->context_size, e->nbr_depends, e->depends);
+		if (e->id > 0)
+			nbr_added++;
+	}
+	if (nbr_added > 0) {
+		pthread_cond_broadcast(&ctx->signal);
+		firefly_event_queue_posix_notify(ctx);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return nbr_added;
+}
+
+int64_t firefly_event_queue_posix_add_lockfree(struct firefly_event_queue *eq,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		unsigned int nbr_deps, const int64_t *deps)
+{
+	return firefly_event_queue_posix_add_lockfree_strand(eq, NULL, prio,
+			execute, context, nbr_deps, deps);
+}
+
+static void firefly_event_queue_posix_wake(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	if (__atomic_load_n(&ctx->nbr_sleeping, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&ctx->lock);
+		pthread_cond_broadcast(&ctx->signal);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+static int64_t firefly_event_intake_offer(
+		struct firefly_event_queue_posix_context *ctx, void *strand,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		size_t context_size, unsigned int nbr_deps, const int64_t *deps)
+{
+	int64_t id;
+	struct firefly_event_intake_node *n;
+
+	if (nbr_deps > FIREFLY_EVENT_QUEUE_MAX_DEPENDS)
+		return -2;
+	n = NULL;
+	if (context_size <= sizeof(n->payload))
+		n = firefly_event_intake_node_take(ctx);
+	if (n == NULL) {
+		n = malloc(sizeof(*n) + context_size);
+		if (n == NULL)
+			return -1;
+		n->pooled = false;
+	}
+	id = __atomic_add_fetch(&ctx->intake_id, 1, __ATOMIC_RELAXED);
+	n->id = id;
+	n->strand = strand;
+	n->prio = prio;
+	n->execute = execute;
+	n->context = context;
+	n->context_size = context_size;
+	if (context_size > 0) {
+		n->context = n->pooled ? (void *) n->payload.bytes : (void *) (n + 1);
+		memcpy(n->context, context, context_size);
+	}
+	n->nbr_deps = nbr_deps;
+	if (nbr_deps > 0)
+		memcpy(n->deps, deps, nbr_deps * sizeof(*deps));
+	// The node may be merged and freed as soon as it is pushed.
+	firefly_event_intake_push(&ctx->intake, n);
+	return id;
+}
+
+int64_t firefly_event_queue_posix_add_lockfree_strand(
+		struct firefly_event_queue *eq, void *strand, unsigned char prio,
+		firefly_event_execute_f execute, void *context, unsigned int nbr_deps,
+		const int64_t *deps)
+{
+	int64_t id;
+	struct firefly_event_queue_posix_context *ctx =
+		(struct firefly_event_queue_posix_context *)
+		firefly_event_queue_get_context(eq);
+
+	id = firefly_event_intake_offer(ctx, strand, prio, execute, context, 0,
+			nbr_deps, deps);
+	if (id > 0)
+		firefly_event_queue_posix_wake(ctx);
+	return id;
+}
+
+size_t firefly_event_queue_posix_add_lockfree_batch(
+		struct firefly_event_queue *eq,
+		struct firefly_event_batch_entry *entries, size_t nbr_entries)
+{
+	size_t nbr_added = 0;
+	struct firefly_event_queue_posix_context *ctx =
+		(struct firefly_event_queue_posix_context *)
+		firefly_event_queue_get_context(eq);
+
+	for (size_t i = 0; i < nbr_entries; i++) {
+		struct firefly_event_batch_entry *e = &entries[i];
+		e->id = firefly_event_intake_offer(ctx, e->strand, e->prio,
+				e->execute, e->context, e->context_size, e->nbr_depends,
+				e->depends);
+		if (e->id > 0)
+			nbr_added++;
+	}
+	if (nbr_added > 0)
+		firefly_event_queue_posix_wake(ctx);
+	return nbr_added;
+}
+
 void *firefly_event_posix_thread_main(void *args)
 {
 	struct firefly_event_queue *eq =
 		(struct firefly_event_queue *) args;
 	struct firefly_event_queue_posix_context *ctx =
 		firefly_event_queue_get_context(eq);
-	struct firefly_event *ev = NULL;
+	struct firefly_event *batch[FIREFLY_EVENT_QUEUE_POSIX_MAX_BATCH];
+	size_t nbr_popped = 0;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		// Return the previous batch and pop the next under the same lock.
+		for (size_t i = 0; i < nbr_popped; i++)
+			firefly_event_return(eq, &batch[i]);
+		nbr_popped = 0;
+		if (ctx->running > 0) {
+			// An event is executing inline, wait for it to finish.
+			pthread_cond_wait(&ctx->signal, &ctx->lock);
+			continue;
+		}
+		firefly_event_intake_merge(eq, ctx);
+		firefly_event_queue_advance(eq, firefly_event_queue_posix_now());
+		while (nbr_popped < ctx->batch_size &&
+				(batch[nbr_popped] = firefly_event_pop(eq)) != NULL)
+			nbr_popped++;
+		if (nbr_popped == 0) {
+			if (ctx->event_loop_stop && firefly_event_intake_empty(ctx))
+				break;
+			firefly_event_queue_posix_wait(eq, ctx);
+			continue;
+		}
+		ctx->running = nbr_popped;
+		pthread_mutex_unlock(&ctx->lock);
+		for (size_t i = 0; i < nbr_popped; i++)
+			firefly_event_execute(batch[i]);
+		pthread_mutex_lock(&ctx->lock);
+		ctx->running = 0;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+int firefly_event_queue_posix_set_batch_size(struct firefly_event_queue *eq,
+		size_t batch_size)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+
+	if (batch_size == 0 || batch_size > FIREFLY_EVENT_QUEUE_POSIX_MAX_BATCH)
+		return -1;
 	pthread_mutex_lock(&ctx->lock);
-	int event_left = firefly_event_queue_length(eq);
-	bool finish = ctx->event_loop_stop;
+	ctx->batch_size = batch_size;
 	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
 
-	while (!finish || event_left > 0) {
+/*
+ * Execute events like the event loop but on the calling thread and only until
+ * the queue is empty or the budget is spent.
+ */
+size_t firefly_event_queue_posix_run_pending(struct firefly_event_queue *eq,
+		size_t budget)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+	struct firefly_event *batch[FIREFLY_EVENT_QUEUE_POSIX_MAX_BATCH];
+	size_t nbr_popped;
+	size_t nbr_executed = 0;
+	uint64_t count;
+	ssize_t res;
+
+	pthread_mutex_lock(&ctx->lock);
+	// Reset the descriptor first, events offered from now on set it again.
+	if (ctx->event_fd >= 0) {
+		res = read(ctx->event_fd, &count, sizeof(count));
+		(void) res; /* The counter is already zero if the read fails. */
+	}
+	while (ctx->running > 0) {
+		// An event is executing inline, wait for it to finish.
+		pthread_cond_wait(&ctx->signal, &ctx->lock);
+	}
+	while (nbr_executed < budget) {
+		firefly_event_intake_merge(eq, ctx);
+		firefly_event_queue_advance(eq, firefly_event_queue_posix_now());
+		nbr_popped = 0;
+		while (nbr_popped < ctx->batch_size &&
+				nbr_executed + nbr_popped < budget &&
+				(batch[nbr_popped] = firefly_event_pop(eq)) != NULL)
+			nbr_popped++;
+		if (nbr_popped == 0)
+			break;
+		ctx->running = nbr_popped;
+		pthread_mutex_unlock(&ctx->lock);
+		for (size_t i = 0; i < nbr_popped; i++)
+			firefly_event_execute(batch[i]);
 		pthread_mutex_lock(&ctx->lock);
-		event_left = firefly_event_queue_length(eq);
-		finish = ctx->event_loop_stop;
-		while (event_left <= 0 && !finish) {
-			pthread_cond_wait(&ctx->signal, &ctx->lock);
-			finish = ctx->event_loop_stop;
-			event_left = firefly_event_queue_length(eq);
+		for (size_t i = 0; i < nbr_popped; i++)
+			firefly_event_return(eq, &batch[i]);
+		ctx->running = 0;
+		nbr_executed += nbr_popped;
+	}
+	// Leave the descriptor readable if the budget ran out first.
+	if (firefly_event_queue_length(eq) > 0 || !firefly_event_intake_empty(ctx))
+		firefly_event_queue_posix_notify(ctx);
+	pthread_mutex_unlock(&ctx->lock);
+	return nbr_executed;
+}
+
+static struct firefly_event_strand **firefly_event_strand_slot(
+		struct firefly_event_queue_posix_context *ctx, void *key)
+{
+	return &ctx->strands[((uintptr_t) key >> 4) %
+		FIREFLY_EVENT_QUEUE_POSIX_STRAND_SLOTS];
+}
+
+static struct firefly_event_strand *firefly_event_strand_get(
+		struct firefly_event_queue_posix_context *ctx, void *key)
+{
+	struct firefly_event_strand **slot = firefly_event_strand_slot(ctx, key);
+	struct firefly_event_strand *st = *slot;
+
+	while (st != NULL && st->key != key)
+		st = st->next;
+	if (st == NULL && (st = malloc(sizeof(*st))) != NULL) {
+		st->key = key;
+		st->busy = false;
+		st->first = NULL;
+		st->last = NULL;
+		st->ready_next = NULL;
+		st->next = *slot;
+		*slot = st;
+	}
+	return st;
+}
+
+static void firefly_event_strand_release(
+		struct firefly_event_queue_posix_context *ctx,
+		struct firefly_event_strand *st)
+{
+	struct firefly_event_strand **n = firefly_event_strand_slot(ctx, st->key);
+
+	while (*n != NULL && *n != st)
+		n = &(*n)->next;
+	if (*n != NULL)
+		*n = st->next;
+	free(st);
+}
+
+/*
+ * Take the next event a worker may execute, the context must be locked. An
+ * event of an idle strand that has deferred events goes first, then an
+ * exclusive event once everything before it is done, then the queue. Events
+ * are held from when they are popped until they have been executed, so an
+ * event never runs alongside an event it depends on.
+ */
+static struct firefly_event *firefly_event_worker_next(
+		struct firefly_event_queue *eq,
+		struct firefly_event_queue_posix_context *ctx,
+		struct firefly_event_strand **strand)
+{
+	struct firefly_event *ev;
+	struct firefly_event_strand *st;
+
+	*strand = NULL;
+	firefly_event_intake_merge(eq, ctx);
+	firefly_event_queue_advance(eq, firefly_event_queue_posix_now());
+	for (;;) {
+		if (ctx->ready_first != NULL) {
+			st = ctx->ready_first;
+			ctx->ready_first = st->ready_next;
+			if (ctx->ready_first == NULL)
+				ctx->ready_last = NULL;
+			ev = st->first;
+			st->first = ev->next;
+			if (st->first == NULL)
+				st->last = NULL;
+			ev->next = NULL;
+			ctx->nbr_deferred--;
+			st->busy = true;
+			*strand = st;
+			return ev;
+		} else if (ctx->exclusive) {
+			return NULL;
+		} else if (ctx->barrier != NULL) {
+			if (ctx->running > 0 || ctx->nbr_deferred > 0)
+				return NULL;
+			ev = ctx->barrier;
+			ctx->barrier = NULL;
+			ctx->exclusive = true;
+			return ev;
+		} else if ((ev = firefly_event_pop_held(eq)) != NULL) {
+			void *key = firefly_event_strand(ev);
+			st = key != NULL ? firefly_event_strand_get(ctx, key) : NULL;
+			if (st == NULL) {
+				ctx->barrier = ev;
+			} else if (st->busy) {
+				ev->next = NULL;
+				if (st->last != NULL)
+					st->last->next = ev;
+				else
+					st->first = ev;
+				st->last = ev;
+				ctx->nbr_deferred++;
+			} else {
+				st->busy = true;
+				*strand = st;
+				return ev;
+			}
+		} else {
+			return NULL;
 		}
-		ev = firefly_event_pop(eq);
-		pthread_mutex_unlock(&ctx->lock);
-		if (ev != NULL) {
-			firefly_event_execute(ev);
-			pthread_mutex_lock(&ctx->lock);
-			firefly_event_return(eq, &ev);
-			pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+/*
+ * Finish an event executed by a worker, the context must be locked.
+ */
+static void firefly_event_worker_done(
+		struct firefly_event_queue_posix_context *ctx,
+		struct firefly_event_strand *st)
+{
+	ctx->running--;
+	if (st == NULL) {
+		ctx->exclusive = false;
+	} else if (st->first != NULL) {
+		st->busy = false;
+		st->ready_next = NULL;
+		if (ctx->ready_last != NULL)
+			ctx->ready_last->ready_next = st;
+		else
+			ctx->ready_first = st;
+		ctx->ready_last = st;
+	} else {
+		firefly_event_strand_release(ctx, st);
+	}
+	pthread_cond_broadcast(&ctx->signal);
+}
+
+void *firefly_event_posix_worker_main(void *args)
+{
+	struct firefly_event_queue *eq =
+		(struct firefly_event_queue *) args;
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+	struct firefly_event *ev;
+	struct firefly_event_strand *st;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		ev = firefly_event_worker_next(eq, ctx, &st);
+		if (ev == NULL) {
+			if (ctx->event_loop_stop && ctx->barrier == NULL &&
+					!ctx->exclusive && firefly_event_queue_length(eq) == 0 &&
+					firefly_event_intake_empty(ctx))
+				break;
+			firefly_event_queue_posix_wait(eq, ctx);
+			continue;
 		}
+		ctx->running++;
+		pthread_mutex_unlock(&ctx->lock);
+		firefly_event_execute(ev);
+		pthread_mutex_lock(&ctx->lock);
+		firefly_event_release(eq, ev);
+		firefly_event_return(eq, &ev);
+		firefly_event_worker_done(ctx, st);
 	}
+	pthread_mutex_unlock(&ctx->lock);
 	return NULL;
 }
 
+/*
+ * An event may run inline when nothing is queued before it, no event without
+ * strand is executing or waiting to and, for the event loop, no event is
+ * executing at all. The worker pool only needs the strand to be idle.
+ */
+int firefly_event_queue_posix_run_inline(struct firefly_event_queue *eq,
+		void *strand, firefly_event_execute_f execute, void *context)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+	struct firefly_event_strand *st = NULL;
+	bool idle;
+
+	pthread_mutex_lock(&ctx->lock);
+	firefly_event_intake_merge(eq, ctx);
+	firefly_event_queue_advance(eq, firefly_event_queue_posix_now());
+	idle = !ctx->event_loop_stop && !ctx->exclusive &&
+		ctx->barrier == NULL && firefly_event_queue_length(eq) == 0 &&
+		firefly_event_intake_empty(ctx);
+	if (idle && ctx->workers == NULL) {
+		idle = ctx->running == 0;
+	} else if (idle && strand == NULL) {
+		idle = ctx->running == 0 && ctx->nbr_deferred == 0;
+	} else if (idle) {
+		st = firefly_event_strand_get(ctx, strand);
+		idle = st != NULL && !st->busy && st->first == NULL;
+	}
+	if (!idle) {
+		pthread_mutex_unlock(&ctx->lock);
+		return -1;
+	}
+	if (st != NULL)
+		st->busy = true;
+	else if (ctx->workers != NULL)
+		ctx->exclusive = true;
+	ctx->running++;
+	pthread_mutex_unlock(&ctx->lock);
+	execute(context);
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->workers != NULL) {
+		firefly_event_worker_done(ctx, st);
+	} else {
+		ctx->running--;
+		pthread_cond_broadcast(&ctx->signal);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+int firefly_event_queue_posix_run_workers(struct firefly_event_queue *eq,
+		pthread_attr_t *attr, size_t nbr_workers)
+{
+	int res = 0;
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+
+	if (nbr_workers == 0)
+		return -1;
+	ctx->workers = malloc(sizeof(pthread_t)*nbr_workers);
+	if (ctx->workers == NULL)
+		return -1;
+	for (ctx->nbr_workers = 0; ctx->nbr_workers < nbr_workers;
+			ctx->nbr_workers++) {
+		res = pthread_create(&ctx->workers[ctx->nbr_workers], attr,
+				firefly_event_posix_worker_main, eq);
+		if (res) {
+			firefly_event_queue_posix_stop(eq);
+			break;
+		}
+	}
+	return res;
+}
+
 int firefly_event_queue_posix_run(struct firefly_event_queue *eq,
 		pthread_attr_t *attr)
 {
@@ -111,6 +1047,8 @@ int firefly_event_queue_posix_run(struct firefly_event_queue *eq,
 		firefly_event_queue_get_context(eq);
 	res = pthread_create(
 			&ctx->event_loop, attr, firefly_event_posix_thread_main, eq);
+	if (!res)
+		ctx->event_loop_started = true;
 	return res;
 }
 
@@ -118,10 +1056,24 @@ int firefly_event_queue_posix_stop(struct firefly_event_queue *eq)
 {
 	struct firefly_event_queue_posix_context *ctx =
 		firefly_event_queue_get_context(eq);
+	int res = 0;
+
 	pthread_mutex_lock(&ctx->lock);
 	ctx->event_loop_stop = true;
-	pthread_cond_signal(&ctx->signal);
+	pthread_cond_broadcast(&ctx->signal);
 	pthread_mutex_unlock(&ctx->lock);
-	int res = pthread_join(ctx->event_loop, NULL);
+	if (ctx->workers != NULL) {
+		for (size_t i = 0; i < ctx->nbr_workers; i++) {
+			int r = pthread_join(ctx->workers[i], NULL);
+			if (r)
+				res = r;
+		}
+		free(ctx->workers);
+		ctx->workers = NULL;
+		ctx->nbr_workers = 0;
+	} else if (ctx->event_loop_started) {
+		res = pthread_join(ctx->event_loop, NULL);
+		ctx->event_loop_started = false;
+	}
 	return res;
 }
@@ -16,18 +16,121 @@
 #include <stdint.h>
 #endif
 
+/**
+ * @brief The number of distinct event priorities, one bucket is kept for each.
+ */
+#define FIREFLY_EVENT_QUEUE_NBR_PRIOS (256)
+
+/**
+ * @brief The number of 64 bit words needed for the bucket occupancy bitmap.
+ */
+#define FIREFLY_EVENT_QUEUE_BITMAP_WORDS (FIREFLY_EVENT_QUEUE_NBR_PRIOS / 64)
+
+/**
+ * @brief The smallest number of slots in the event id index.
+ */
+#define FIREFLY_EVENT_QUEUE_MIN_INDEX_SIZE (16)
+
+/**
+ * @brief The number of dependencies stored inside the event, events with more
+ * dependencies allocate their edges separately.
+ */
+#define FIREFLY_EVENT_INLINE_DEPENDS (2)
+
+/**
+ * @brief The number of bits of the time used to index a level of the timer
+ * wheel.
+ */
+#define FIREFLY_EVENT_TIMER_SLOT_BITS (6)
+
+/**
+ * @brief The number of slots in each level of the timer wheel.
+ */
+#define FIREFLY_EVENT_TIMER_SLOTS (1 << FIREFLY_EVENT_TIMER_SLOT_BITS)
+
+/**
+ * @brief The number of levels of the timer wheel. Level n has a resolution of
+ * 64^n milliseconds, timers further away than 64^4 milliseconds (about four
+ * and a half hours) are kept in the last slot of the top level until they are
+ * within range.
+ */
+#define FIREFLY_EVENT_TIMER_LEVELS (4)
+
+/**
+ * @brief The timer slot of an event that is not waiting in the timer wheel.
+ */
+#define FIREFLY_EVENT_NOT_TIMED (0xFFFF)
+
+/**
+ * @brief A slab of contiguously allocated events.
+ *
+ * The events of the pool are allocated in slabs, one when the queue is
+ * created and one more each time the pool grows. The slabs are only freed
+ * together with the queue.
+ */
+struct firefly_event_slab {
+	struct firefly_event_slab *next; /**< The next slab of the queue. */
+	size_t nbr_events; /**< The number of events in this slab. */
+	struct firefly_event *events; /**< The events of this slab, allocated
+									together with the slab. */
+};
+
+/**
+ * @brief A FIFO list of events all having the same priority.
+ */
+struct firefly_event_bucket {
+	struct firefly_event *head; /**< The oldest event in the bucket. */
+	struct firefly_event *tail; /**< The newest event in the bucket. */
+};
+
 /**
  * @brief An event queue
  *
- * This is a priority queue, the events are placed in order upon insertion.
+ * This is a priority queue, each priority has its own FIFO bucket and a bitmap
+ * keeps track of which buckets are non-empty. Insertion, removal of the first
+ * event and the length are all constant time.
  */
 struct firefly_event_queue {
-	struct firefly_event *head; /**< Reference to the first event in
-						the queue. */
+	struct firefly_event_bucket buckets[FIREFLY_EVENT_QUEUE_NBR_PRIOS]; /**<
+							One FIFO bucket per priority. */
+	uint64_t occupied[FIREFLY_EVENT_QUEUE_BITMAP_WORDS]; /**< Bit n is set if
+							bucket n is non-empty. */
+	size_t length; /**< The number of events in the queue. */
+	struct firefly_event **index; /**< Hash table mapping the ID of every
+							queued event to the event, chained through
+							firefly_event.index_next. */
+	size_t index_size; /**< The number of slots in index, a power of two. */
+	struct firefly_event *timers[FIREFLY_EVENT_TIMER_LEVELS]
+		[FIREFLY_EVENT_TIMER_SLOTS]; /**< The timer wheel, events waiting to
+								become due linked through next and prev. */
+	uint64_t timers_occupied[FIREFLY_EVENT_TIMER_LEVELS]; /**< Bit n of
+								level l is set if slot n of level l is
+								non-empty. */
+	int64_t timer_time; /**< The time in milliseconds the timer wheel was
+						  last advanced to. */
+	size_t nbr_timers; /**< The number of events in the timer wheel. */
 	firefly_offer_event offer_event_cb; /**< The callback used for adding
 							new events. */
+	firefly_offer_strand_event offer_strand_event_cb; /**< The callback used
+							for adding new events belonging to a strand, may
+							be NULL. */
+	firefly_offer_event_batch offer_batch_cb; /**< The callback used for
+							adding batches of events, may be NULL. */
+	firefly_offer_timed_event offer_timed_cb; /**< The callback used for
+							adding timed events, may be NULL. */
+	firefly_cancel_event cancel_cb; /**< The callback used for cancelling
+							events, may be NULL. */
+	firefly_run_inline_event run_inline_cb; /**< The callback used for
+							executing events inline, may be NULL. */
+	firefly_run_pending_events run_pending_cb; /**< The callback used for
+							executing pending events, may be NULL. */
+	firefly_event_clock clock_cb; /**< The callback used for reading the
+							clock, may be NULL. */
 	int64_t event_id; /**< Counter to keep track of used event ID's. */
-	struct firefly_event **event_pool; /**< A pre-allocated pool of events. */
+	struct firefly_event **event_pool; /**< A pre-allocated pool of events,
+								slots before event_pool_in_use are empty. */
+	struct firefly_event_slab *slabs; /**< The slabs holding the events of
+										the pool. */
 	size_t event_pool_size; /**< The number of events in the pool. */
 	size_t event_pool_in_use; /**< The number of events currently in use in the
 								event queue. */
@@ -37,24 +140,69 @@ struct firefly_event_queue {
 							  Possibly a mutex. */
 };
 
+/**
+ * @brief A dependency of a queued event on another queued event.
+ *
+ * Every event owns one edge per entry in its depends list. While the event it
+ * depends on is queued the edge is linked into that event's list of
+ * dependents, when it leaves the queue the edge is released and the pending
+ * counter of the owner is decremented.
+ */
+struct firefly_event_edge {
+	struct firefly_event *owner; /**< The event having the dependency. */
+	struct firefly_event *target; /**< The queued event depended on or NULL
+									if the dependency is released. */
+	struct firefly_event_edge *next; /**< The next edge in the list of
+										dependents of target. */
+};
+
 /**
  * @brief An event.
  *
+ * The members used when queueing and popping come first. The context of an
+ * event added with a context size is copied to \a payload or, if it does not
+ * fit, to a separate allocation freed when the event is returned to the pool.
+ *
  * @warning The largest context of an event is a single firefly_connection. A
  * larger context may (most likely) imply concurrency problems.
  */
 struct firefly_event {
-	unsigned char prio; /**< The priority of the event, higher value means
-					higher priority. */
+	struct firefly_event *next; /**< The next event in the same bucket. */
+	struct firefly_event *prev; /**< The previous event in the same bucket. */
+	struct firefly_event *index_next; /**< The next event in the same index
+										slot. */
 	int64_t id; /**< The unique identifier of this event. */
 	firefly_event_execute_f execute; /**< The function to call when the
 						event is executed. */
 	void *context; /**< The context passed to firefly_event_execute_f() when
 				the event is executed. */
-	int64_t depends[FIREFLY_EVENT_QUEUE_MAX_DEPENDS]; /**< The IDs of the events
-														this event depends on.
-														*/
-	struct firefly_event *next; /**< The next event. */
+	void *strand; /**< The strand the event is serialized within or NULL. */
+	struct firefly_event_edge *dependents; /**< The edges of queued events
+											 depending on this event. */
+	struct firefly_event_edge *edges; /**< The dependencies of this event,
+										either inline_edges or a separate
+										allocation. */
+	unsigned char prio; /**< The priority of the event, higher value means
+					higher priority. */
+	unsigned char nbr_edges; /**< The number of entries in edges. */
+	unsigned char nbr_pending; /**< The number of events this event depends
+								 on that are still queued. */
+	bool context_allocated; /**< Whether context was allocated by the queue
+							  because it did not fit in payload. */
+	bool held; /**< Whether the event is popped with firefly_event_pop_held()
+				 but not yet released. */
+	unsigned short timer_slot; /**< The slot of the timer wheel the event is
+								 in, level * FIREFLY_EVENT_TIMER_SLOTS + slot,
+								 or FIREFLY_EVENT_NOT_TIMED. */
+	int64_t when; /**< The time the event is due if it is timed. */
+	struct firefly_event_edge inline_edges[FIREFLY_EVENT_INLINE_DEPENDS]; /**<
+								Storage for the first dependencies. */
+	union {
+		unsigned char bytes[FIREFLY_EVENT_PAYLOAD_SIZE];
+		void *align_ptr;
+		int64_t align_int;
+		double align_double;
+	} payload; /**< Inline storage for copied contexts. */
 };
 
 /**
@@ -68,24 +216,129 @@ struct firefly_event {
 struct firefly_event *firefly_event_take(struct firefly_event_queue *eq);
 
 /**
- * @brief Frees the memory used by the event
+ * @brief Get the first event of the highest non-empty priority without
+ * removing it or considering its dependencies.
+ *
+ * @param eq The queue to look in.
+ * @return The first event of the highest priority.
+ * @retval NULL if the queue is empty.
+ */
+struct firefly_event *firefly_event_queue_head(struct firefly_event_queue *eq);
+
+/**
+ * @brief Get the next event like firefly_event_pop() but keep the events
+ * depending on it waiting until it is released with firefly_event_release(),
+ * e.g. when it has finished executing.
+ *
+ * Events whose dependencies are held are skipped. A held event can still be
+ * found by its ID, so that new events may depend on it, but not cancelled.
+ *
+ * @param eq The queue to pop an event from.
+ * @return The held event.
+ * @retval NULL if no event is ready.
+ */
+struct firefly_event *firefly_event_pop_held(struct firefly_event_queue *eq);
+
+/**
+ * @brief Release the events depending on an event popped with
+ * firefly_event_pop_held(). The event must be released before it is
+ * returned.
+ *
+ * @param eq The queue the event was popped from.
+ * @param ev The held event.
+ */
+void firefly_event_release(struct firefly_event_queue *eq,
+		struct firefly_event *ev);
+
+/**
+ * @brief Find a queued event by its ID.
+ *
+ * @param eq The queue to look in.
+ * @param id The ID of the event.
+ * @return The queued event with the ID.
+ * @retval NULL if no event with the ID is queued.
+ */
+struct firefly_event *firefly_event_find(struct firefly_event_queue *eq,
+		int64_t id);
+
+/**
+ * @brief Add an event belonging to a strand, optionally copying its context
+ * to the event.
  *
- * @param ev The event to free.
+ * Like firefly_event_add_strand() but the \p context_size first bytes of
+ * \p context are copied to the event if \p context_size is not 0.
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the new event.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function or copied.
+ * @param context_size The number of bytes of \p context to copy or 0.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids this event depends on.
+ * @return The ID of the added event.
+ * @retval A negative value upon error.
  */
-void firefly_event_free(struct firefly_event *ev);
+int64_t firefly_event_add_copy(struct firefly_event_queue *eq, void *strand,
+		unsigned char prio, firefly_event_execute_f execute,
+		const void *context, size_t context_size, unsigned int nbr_depends,
+		const int64_t *depends);
+
+/**
+ * @brief Add an event with an ID chosen by the caller.
+ *
+ * Used by queue implementations that hand out IDs before the event is added
+ * to the queue. The ID must be unique among the queued events and the
+ * counter of the queue is not touched.
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param id The ID of the new event.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the new event.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param context_size The number of bytes of \p context to copy to the event
+ * or 0 to pass \p context as is.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids this event depends on.
+ * @return The ID of the added event.
+ * @retval A negative value upon error.
+ */
+int64_t firefly_event_add_id(struct firefly_event_queue *eq, int64_t id,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, size_t context_size, unsigned int nbr_depends,
+		const int64_t *depends);
+
+/**
+ * @brief Add an event that is due at a given time with an ID chosen by the
+ * caller.
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param id The ID of the new event.
+ * @param strand The strand of the event or NULL.
+ * @param prio The priority of the event once it is due.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param when The time in milliseconds the event is due.
+ * @return The ID of the added event.
+ * @retval A negative value upon error.
+ * @see firefly_event_add_id()
+ */
+int64_t firefly_event_add_at_id(struct firefly_event_queue *eq, int64_t id,
+		void *strand, unsigned char prio, firefly_event_execute_f execute,
+		void *context, int64_t when);
 
 /**
  * @brief Initializes an allocated event.
  *
+ * The dependencies of the event are resolved when it is enqueued.
+ *
  * @param ev The event to initialize.
  * @param id The ID to give the event.
  * @param prio The priority of the event.
  * @param execute The function called when the firefly_event is executed.
  * @param context The argument passed to the execute function when called.
- * @param nbr_depends The number of dependecies this event has.
- * @param depends The list of IDs of events this event depends on.
  */
 void firefly_event_init(struct firefly_event *ev, int64_t id, unsigned char prio,
-		firefly_event_execute_f execute, void *context,
-		unsigned int nbr_depends, const int64_t *depends);
+		firefly_event_execute_f execute, void *context);
 #endif
@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE (200112L)
+#include <pthread.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <utils/firefly_reactor_posix.h>
+
+#define FIREFLY_REACTOR_POSIX_MAX_EVENTS (32)
+
+/*
+ * A registered file descriptor. The epoll data of the descriptor points to
+ * its source, the wake up descriptor has NULL.
+ */
+struct firefly_reactor_source {
+	int fd;
+	firefly_reactor_posix_ready_f ready;
+	void *context;
+	bool removed;
+	struct firefly_reactor_source *next;
+};
+
+struct firefly_reactor_timer {
+	firefly_reactor_posix_timer_f timer;
+	void *context;
+	unsigned int round; /* The last round of the reactor loop the timer was
+						   polled in. */
+	struct firefly_reactor_timer *next;
+};
+
+struct firefly_reactor_posix {
+	int epoll_fd;
+	int wake_fd;
+	pthread_t thread;
+	bool running; /* The reactor thread should keep running. */
+	bool started; /* The reactor thread exists. */
+	pthread_mutex_t lock;
+	pthread_cond_t signal; /* Broadcast when a handler returns. */
+	struct firefly_reactor_source *sources;
+	struct firefly_reactor_source *retired; /* Removed sources an ongoing
+											   epoll_wait() may still return,
+											   freed by the reactor thread. */
+	struct firefly_reactor_source *dispatching; /* The source whose handler
+												   is running. */
+	struct firefly_reactor_timer *timers;
+	struct firefly_reactor_timer *polling; /* The timer being polled. */
+	unsigned int round; /* Incremented each time the timers are polled. */
+};
+
+struct firefly_reactor_posix *firefly_reactor_posix_new(void)
+{
+	struct firefly_reactor_posix *r;
+	struct epoll_event ev;
+
+	r = malloc(sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	r->epoll_fd = epoll_create1(0);
+	r->wake_fd = eventfd(0, EFD_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (r->epoll_fd == -1 || r->wake_fd == -1 ||
+			epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) == -1) {
+		if (r->epoll_fd != -1)
+			close(r->epoll_fd);
+		if (r->wake_fd != -1)
+			close(r->wake_fd);
+		free(r);
+		return NULL;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->signal, NULL);
+	r->running = false;
+	r->started = false;
+	r->sources = NULL;
+	r->retired = NULL;
+	r->dispatching = NULL;
+	r->timers = NULL;
+	r->polling = NULL;
+	r->round = 0;
+	return r;
+}
+
+static void firefly_reactor_sources_free(struct firefly_reactor_source *s)
+{
+	struct firefly_reactor_source *next;
+
+	while (s != NULL) {
+		next = s->next;
+		free(s);
+		s = next;
+	}
+}
+
+void firefly_reactor_posix_free(struct firefly_reactor_posix **reactor)
+{
+	struct firefly_reactor_posix *r = *reactor;
+	struct firefly_reactor_timer *t;
+
+	firefly_reactor_posix_stop(r);
+	firefly_reactor_sources_free(r->sources);
+	firefly_reactor_sources_free(r->retired);
+	while ((t = r->timers) != NULL) {
+		r->timers = t->next;
+		free(t);
+	}
+	close(r->epoll_fd);
+	close(r->wake_fd);
+	pthread_cond_destroy(&r->signal);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+	*reactor = NULL;
+}
+
+int firefly_reactor_posix_add(struct firefly_reactor_posix *reactor, int fd,
+		firefly_reactor_posix_ready_f ready, void *context)
+{
+	struct firefly_reactor_source *s;
+	struct epoll_event ev;
+
+	s = malloc(sizeof(*s));
+	if (s == NULL)
+		return -1;
+	s->fd = fd;
+	s->ready = ready;
+	s->context = context;
+	s->removed = false;
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	pthread_mutex_lock(&reactor->lock);
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		pthread_mutex_unlock(&reactor->lock);
+		free(s);
+		return -1;
+	}
+	s->next = reactor->sources;
+	reactor->sources = s;
+	pthread_mutex_unlock(&reactor->lock);
+	return 0;
+}
+
+int firefly_reactor_posix_remove(struct firefly_reactor_posix *reactor,
+		int fd)
+{
+	struct firefly_reactor_source **n;
+	struct firefly_reactor_source *s;
+
+	pthread_mutex_lock(&reactor->lock);
+	n = &reactor->sources;
+	while (*n != NULL && (*n)->fd != fd)
+		n = &(*n)->next;
+	if (*n == NULL) {
+		pthread_mutex_unlock(&reactor->lock);
+		return -1;
+	}
+	s = *n;
+	*n = s->next;
+	s->removed = true;
+	epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	if (reactor->started) {
+		if (!pthread_equal(pthread_self(), reactor->thread)) {
+			while (reactor->dispatching == s)
+				pthread_cond_wait(&reactor->signal, &reactor->lock);
+		}
+		s->next = reactor->retired;
+		reactor->retired = s;
+	} else {
+		free(s);
+	}
+	pthread_mutex_unlock(&reactor->lock);
+	return 0;
+}
+
+int firefly_reactor_posix_add_timer(struct firefly_reactor_posix *reactor,
+		firefly_reactor_posix_timer_f timer, void *context)
+{
+	struct firefly_reactor_timer *t;
+
+	t = malloc(sizeof(*t));
+	if (t == NULL)
+		return -1;
+	t->timer = timer;
+	t->context = context;
+	pthread_mutex_lock(&reactor->lock);
+	t->round = reactor->round;
+	t->next = reactor->timers;
+	reactor->timers = t;
+	pthread_mutex_unlock(&reactor->lock);
+	firefly_reactor_posix_wake(reactor);
+	return 0;
+}
+
+int firefly_reactor_posix_remove_timer(struct firefly_reactor_posix *reactor,
+		void *context)
+{
+	struct firefly_reactor_timer **n;
+	struct firefly_reactor_timer *t;
+
+	pthread_mutex_lock(&reactor->lock);
+	n = &reactor->timers;
+	while (*n != NULL && (*n)->context != context)
+		n = &(*n)->next;
+	t = *n;
+	if (t != NULL) {
+		*n = t->next;
+		if (reactor->started &&
+				!pthread_equal(pthread_self(), reactor->thread)) {
+			while (reactor->polling == t)
+				pthread_cond_wait(&reactor->signal, &reactor->lock);
+		}
+	}
+	pthread_mutex_unlock(&reactor->lock);
+	free(t);
+	return t != NULL ? 0 : -1;
+}
+
+void firefly_reactor_posix_wake(struct firefly_reactor_posix *reactor)
+{
+	uint64_t one = 1;
+	ssize_t res;
+
+	res = write(reactor->wake_fd, &one, sizeof(one));
+	(void) res; /* The counter is already non-zero if the write fails. */
+}
+
+/*
+ * Poll all timers, the reactor must be locked. The lock is released while a
+ * timer is called so the timers may write to their sockets, timers removed
+ * meanwhile are skipped. Returns the time in milliseconds until the earliest
+ * timer is due or -1.
+ */
+static int firefly_reactor_poll_timers(struct firefly_reactor_posix *r)
+{
+	struct firefly_reactor_timer *t;
+	int timeout = -1;
+	int next;
+
+	r->round++;
+	for (;;) {
+		// The list may have changed, find the next timer not yet polled.
+		for (t = r->timers; t != NULL && t->round == r->round; t = t->next)
+			;
+		if (t == NULL)
+			break;
+		t->round = r->round;
+		r->polling = t;
+		pthread_mutex_unlock(&r->lock);
+		next = t->timer(t->context);
+		pthread_mutex_lock(&r->lock);
+		r->polling = NULL;
+		pthread_cond_broadcast(&r->signal);
+		if (next >= 0 && (timeout < 0 || next < timeout))
+			timeout = next;
+	}
+	return timeout;
+}
+
+static void *firefly_reactor_posix_main(void *arg)
+{
+	struct firefly_reactor_posix *r = arg;
+	struct epoll_event events[FIREFLY_REACTOR_POSIX_MAX_EVENTS];
+	struct firefly_reactor_source *s;
+	int timeout;
+	int n;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->running) {
+		timeout = firefly_reactor_poll_timers(r);
+		pthread_mutex_unlock(&r->lock);
+		n = epoll_wait(r->epoll_fd, events, FIREFLY_REACTOR_POSIX_MAX_EVENTS,
+				timeout);
+		pthread_mutex_lock(&r->lock);
+		for (int i = 0; i < n; i++) {
+			s = events[i].data.ptr;
+			if (s == NULL) {
+				uint64_t count;
+
+				// Reset the counter, the timers are polled by the loop.
+				if (read(r->wake_fd, &count, sizeof(count)) < 0)
+					continue;
+			} else if (!s->removed) {
+				r->dispatching = s;
+				pthread_mutex_unlock(&r->lock);
+				s->ready(s->fd, s->context);
+				pthread_mutex_lock(&r->lock);
+				r->dispatching = NULL;
+				pthread_cond_broadcast(&r->signal);
+			}
+		}
+		// No later epoll_wait() can return a source removed by now.
+		firefly_reactor_sources_free(r->retired);
+		r->retired = NULL;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+int firefly_reactor_posix_run(struct firefly_reactor_posix *reactor,
+		pthread_attr_t *attr)
+{
+	int res;
+
+	pthread_mutex_lock(&reactor->lock);
+	if (reactor->started) {
+		pthread_mutex_unlock(&reactor->lock);
+		return -1;
+	}
+	reactor->running = true;
+	reactor->started = true;
+	res = pthread_create(&reactor->thread, attr, firefly_reactor_posix_main,
+			reactor);
+	if (res) {
+		reactor->running = false;
+		reactor->started = false;
+	}
+	pthread_mutex_unlock(&reactor->lock);
+	return res;
+}
+
+int firefly_reactor_posix_stop(struct firefly_reactor_posix *reactor)
+{
+	int res;
+
+	pthread_mutex_lock(&reactor->lock);
+	if (!reactor->started || !reactor->running) {
+		pthread_mutex_unlock(&reactor->lock);
+		return 0;
+	}
+	reactor->running = false;
+	pthread_mutex_unlock(&reactor->lock);
+	firefly_reactor_posix_wake(reactor);
+	res = pthread_join(reactor->thread, NULL);
+	pthread_mutex_lock(&reactor->lock);
+	reactor->started = false;
+	firefly_reactor_sources_free(reactor->retired);
+	reactor->retired = NULL;
+	pthread_mutex_unlock(&reactor->lock);
+	return res;
+}
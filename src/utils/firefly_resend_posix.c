@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <time.h>
 /* #include <sys/time.h> */
 
@@ -12,38 +13,118 @@
 #include "utils/firefly_resend_posix.h"
 #include "protocol/firefly_protocol_private.h"
 
+#define FIREFLY_RESEND_INITIAL_SIZE (64)
+/* The clock granularity term of the timeout, the resolution of the queue. */
+#define FIREFLY_RTO_GRANULARITY_US (1000)
+/* The largest number of packets firefly_resend_poll() takes per lock. */
+#define FIREFLY_RESEND_POLL_BATCH (16)
+
+void firefly_rto_init(struct firefly_rto *rto, long initial_ms, long min_ms,
+		long max_ms)
+{
+	rto->srtt_us = 0;
+	rto->rttvar_us = 0;
+	rto->min_us = min_ms * 1000;
+	rto->max_us = (max_ms > initial_ms ? max_ms : initial_ms) * 1000;
+	rto->rto_us = initial_ms * 1000;
+}
+
+void firefly_rto_sample(struct firefly_rto *rto, long rtt_us)
+{
+	long delta;
+	long var;
+
+	if (rtt_us < 1)
+		rtt_us = 1;
+	if (rto->srtt_us == 0) {
+		rto->srtt_us = rtt_us;
+		rto->rttvar_us = rtt_us / 2;
+	} else {
+		delta = rto->srtt_us - rtt_us;
+		if (delta < 0)
+			delta = -delta;
+		rto->rttvar_us = (3 * rto->rttvar_us + delta) / 4;
+		rto->srtt_us = (7 * rto->srtt_us + rtt_us) / 8;
+	}
+	var = 4 * rto->rttvar_us;
+	if (var < FIREFLY_RTO_GRANULARITY_US)
+		var = FIREFLY_RTO_GRANULARITY_US;
+	rto->rto_us = rto->srtt_us + var;
+	if (rto->rto_us < rto->min_us)
+		rto->rto_us = rto->min_us;
+	if (rto->rto_us > rto->max_us)
+		rto->rto_us = rto->max_us;
+}
+
+long firefly_rto_timeout_ms(struct firefly_rto *rto)
+{
+	long ms = (rto->rto_us + 999) / 1000;
+
+	return ms > 0 ? ms : 1;
+}
+
+/*
+ * Double the timeout of a resent packet within the bounds of the estimate and
+ * keep the estimate at least as long until a new round trip time is sampled.
+ */
+static long firefly_rto_backoff(struct firefly_rto *rto, long timeout_ms)
+{
+	timeout_ms *= 2;
+	if (timeout_ms * 1000 > rto->max_us)
+		timeout_ms = rto->max_us / 1000 > 0 ? rto->max_us / 1000 : 1;
+	if (rto->rto_us < timeout_ms * 1000)
+		rto->rto_us = timeout_ms * 1000;
+	return timeout_ms;
+}
+
 struct resend_queue *firefly_resend_queue_new()
 {
 	struct resend_queue *rq;
 
 	rq = malloc(sizeof(*rq));
-	if (rq) {
-		rq->next_id = 1;
-		rq->first = NULL;
-		rq->last = NULL;
-		pthread_cond_init(&rq->sig, NULL);
-		pthread_mutex_init(&rq->lock, NULL);
+	if (rq == NULL)
+		return NULL;
+	rq->heap = malloc(FIREFLY_RESEND_INITIAL_SIZE * sizeof(*rq->heap));
+	rq->table = calloc(FIREFLY_RESEND_INITIAL_SIZE, sizeof(*rq->table));
+	if (rq->heap == NULL || rq->table == NULL) {
+		free(rq->heap);
+		free(rq->table);
+		free(rq);
+		return NULL;
 	}
+	rq->heap_len = 0;
+	rq->heap_size = FIREFLY_RESEND_INITIAL_SIZE;
+	rq->table_size = FIREFLY_RESEND_INITIAL_SIZE;
+	rq->count = 0;
+	rq->next_id = 1;
+	rq->notify = NULL;
+	rq->notify_context = NULL;
+	pthread_cond_init(&rq->sig, NULL);
+	pthread_mutex_init(&rq->lock, NULL);
 
 	return rq;
 }
 
 void firefly_resend_queue_free(struct resend_queue *rq)
 {
-	struct resend_elem *re = rq->first;
-	struct resend_elem *tmp;
-
-	while(re != NULL) {
-		tmp = re->prev;
-		firefly_resend_elem_free(re);
-		re = tmp;
-	}
-
+	for (size_t i = 0; i < rq->heap_len; i++)
+		firefly_resend_elem_free(rq->heap[i]);
+	free(rq->heap);
+	free(rq->table);
 	pthread_cond_destroy(&rq->sig);
 	pthread_mutex_destroy(&rq->lock);
 	free(rq);
 }
 
+void firefly_resend_set_notify(struct resend_queue *rq,
+		void (*notify)(void *context), void *context)
+{
+	pthread_mutex_lock(&rq->lock);
+	rq->notify = notify;
+	rq->notify_context = context;
+	pthread_mutex_unlock(&rq->lock);
+}
+
 static inline void timespec_add_ms(struct timespec *t, long d)
 {
 	long long tmp;
@@ -56,105 +137,292 @@ static inline void timespec_add_ms(struct timespec *t, long d)
 	t->tv_nsec = tmp;
 }
 
-unsigned char firefly_resend_add(struct resend_queue *rq,
-		unsigned char *data, size_t size, long timeout_ms,
-		unsigned char retries, struct firefly_connection *conn)
+static inline long timespec_diff_us(struct timespec *from,
+		struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000L +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static inline bool timespec_before(struct timespec *a, struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec ?
+		a->tv_nsec < b->tv_nsec : a->tv_sec < b->tv_sec;
+}
+
+/*
+ * The heap functions below keep the packets of the queue ordered by
+ * resend_at and the heap_index of each packet up to date. The queue must be
+ * locked.
+ */
+static void firefly_resend_heap_set(struct resend_queue *rq, size_t i,
+		struct resend_elem *re)
+{
+	rq->heap[i] = re;
+	re->heap_index = i;
+}
+
+static void firefly_resend_sift_up(struct resend_queue *rq, size_t i)
+{
+	struct resend_elem *re = rq->heap[i];
+
+	while (i > 0 &&
+			timespec_before(&re->resend_at, &rq->heap[(i - 1) / 2]->resend_at)) {
+		firefly_resend_heap_set(rq, i, rq->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	firefly_resend_heap_set(rq, i, re);
+}
+
+static void firefly_resend_sift_down(struct resend_queue *rq, size_t i)
+{
+	struct resend_elem *re = rq->heap[i];
+	size_t c;
+
+	while ((c = 2 * i + 1) < rq->heap_len) {
+		if (c + 1 < rq->heap_len && timespec_before(
+					&rq->heap[c + 1]->resend_at, &rq->heap[c]->resend_at))
+			c++;
+		if (!timespec_before(&rq->heap[c]->resend_at, &re->resend_at))
+			break;
+		firefly_resend_heap_set(rq, i, rq->heap[c]);
+		i = c;
+	}
+	firefly_resend_heap_set(rq, i, re);
+}
+
+static void firefly_resend_heap_remove(struct resend_queue *rq,
+		struct resend_elem *re)
+{
+	struct resend_elem *last;
+	size_t i = re->heap_index;
+
+	last = rq->heap[--rq->heap_len];
+	if (last == re)
+		return;
+	firefly_resend_heap_set(rq, i, last);
+	firefly_resend_sift_up(rq, i);
+	firefly_resend_sift_down(rq, last->heap_index);
+}
+
+static struct resend_elem **firefly_resend_bucket(struct resend_queue *rq,
+		unsigned int id)
+{
+	return &rq->table[id & (rq->table_size - 1)];
+}
+
+static struct resend_elem *firefly_resend_find(struct resend_queue *rq,
+		unsigned int id)
+{
+	struct resend_elem *re = *firefly_resend_bucket(rq, id);
+
+	while (re != NULL && re->id != id)
+		re = re->next;
+	return re;
+}
+
+/*
+ * Double the id table, the ids of the queue are mostly consecutive so each
+ * bucket holds about one packet.
+ */
+static int firefly_resend_table_grow(struct resend_queue *rq)
+{
+	struct resend_elem **old = rq->table;
+	size_t old_size = rq->table_size;
+	struct resend_elem *re;
+	struct resend_elem **b;
+
+	rq->table = calloc(2 * old_size, sizeof(*rq->table));
+	if (rq->table == NULL) {
+		rq->table = old;
+		return -1;
+	}
+	rq->table_size = 2 * old_size;
+	for (size_t i = 0; i < old_size; i++) {
+		while ((re = old[i]) != NULL) {
+			old[i] = re->next;
+			b = firefly_resend_bucket(rq, re->id);
+			re->next = *b;
+			*b = re;
+		}
+	}
+	free(old);
+	return 0;
+}
+
+/*
+ * Remove a packet from the id table, the packet stays in the heap.
+ */
+static struct resend_elem *firefly_resend_unlink(struct resend_queue *rq,
+		unsigned int id)
+{
+	struct resend_elem **n = firefly_resend_bucket(rq, id);
+	struct resend_elem *re;
+
+	while (*n != NULL && (*n)->id != id)
+		n = &(*n)->next;
+	re = *n;
+	if (re != NULL) {
+		*n = re->next;
+		re->next = NULL;
+		rq->count--;
+	}
+	return re;
+}
+
+/*
+ * Get the packet due first, the queue must be locked. Acked packets reaching
+ * the top of the heap are freed.
+ */
+static struct resend_elem *firefly_resend_first(struct resend_queue *rq)
+{
+	struct resend_elem *re;
+
+	while (rq->heap_len > 0 && (re = rq->heap[0])->acked) {
+		firefly_resend_heap_remove(rq, re);
+		firefly_resend_elem_free(re);
+	}
+	return rq->heap_len > 0 ? rq->heap[0] : NULL;
+}
+
+static unsigned int firefly_resend_add_elem(struct resend_queue *rq,
+		unsigned char *data, size_t size, struct firefly_buffer *buf,
+		long timeout_ms, unsigned char retries, struct firefly_rto *rto,
+		int priority, struct firefly_connection *conn)
 {
 	struct resend_elem *re = malloc(sizeof(*re));
+	void (*notify)(void *context) = NULL;
+	void *notify_context = NULL;
+	struct resend_elem **b;
+	unsigned int id;
+
 	if (re == NULL) {
+		firefly_buffer_unref(buf);
 		return 0;
 	}
 	re->data = data;
 	re->size = size;
-	clock_gettime(CLOCK_REALTIME, &re->resend_at);
-	timespec_add_ms(&re->resend_at, timeout_ms);
+	re->buf = buf;
 	re->num_retries = retries;
+	re->priority = priority;
 	re->conn = conn;
-	re->timeout = timeout_ms;
-	re->prev = NULL;
+	re->rto = rto;
+	re->resent = false;
+	re->acked = false;
+	clock_gettime(CLOCK_MONOTONIC, &re->sent_at);
 	pthread_mutex_lock(&rq->lock);
-	re->id = rq->next_id++;
-	if (rq->next_id == 0) {
-		rq->next_id = 1;
+	re->timeout = rto != NULL ? firefly_rto_timeout_ms(rto) : timeout_ms;
+	clock_gettime(CLOCK_REALTIME, &re->resend_at);
+	timespec_add_ms(&re->resend_at, re->timeout);
+	if (rq->heap_len == rq->heap_size) {
+		struct resend_elem **heap;
+
+		heap = realloc(rq->heap, 2 * rq->heap_size * sizeof(*rq->heap));
+		if (heap == NULL) {
+			pthread_mutex_unlock(&rq->lock);
+			firefly_buffer_unref(buf);
+			free(re);
+			return 0;
+		}
+		rq->heap = heap;
+		rq->heap_size *= 2;
 	}
-	if (rq->last == NULL) {
-		rq->first = re;
-	} else {
-		rq->last->prev = re;
+	if (rq->count >= rq->table_size)
+		firefly_resend_table_grow(rq);
+	// Skip ids still in use once the counter wraps.
+	do {
+		id = rq->next_id++;
+		if (rq->next_id == 0)
+			rq->next_id = 1;
+	} while (firefly_resend_find(rq, id) != NULL);
+	re->id = id;
+	b = firefly_resend_bucket(rq, id);
+	re->next = *b;
+	*b = re;
+	rq->count++;
+	rq->heap[rq->heap_len] = re;
+	firefly_resend_sift_up(rq, rq->heap_len++);
+	if (re->heap_index == 0) {
+		notify = rq->notify;
+		notify_context = rq->notify_context;
 	}
-	rq->last = re;
 	pthread_cond_signal(&rq->sig);
 	pthread_mutex_unlock(&rq->lock);
-	return re->id;
+	if (notify != NULL)
+		notify(notify_context);
+	// The element may already be resent and freed.
+	return id;
 }
 
-static inline struct resend_elem *firefly_resend_pop(
-		struct resend_queue *rq, unsigned char id)
+unsigned int firefly_resend_add(struct resend_queue *rq,
+		unsigned char *data, size_t size, long timeout_ms,
+		unsigned char retries, struct firefly_rto *rto, int priority,
+		struct firefly_connection *conn)
 {
-	struct resend_elem *re = rq->first;
-	// If queue is empty return NULL
-	if (re == NULL)
-		return NULL;
-	// If first elem remove it and return it
-	if (re->id == id) {
-		rq->first = re->prev;
-		if (rq->last == re) {
-			rq->last = NULL;
-		}
-		return re;
-	}
-	while (re->prev != NULL) {
-		if (re->prev->id == id) {
-			struct resend_elem *tmp = re->prev;
-			re->prev = re->prev->prev;
-			if (rq->last == tmp) {
-				rq->last = re;
-			}
-			return tmp;
-		} else {
-			re = re->prev;
-		}
-	}
-	return NULL;
+	return firefly_resend_add_elem(rq, data, size, NULL, timeout_ms, retries,
+			rto, priority, conn);
 }
 
-void firefly_resend_readd(struct resend_queue *rq, unsigned char id)
+unsigned int firefly_resend_add_buffer(struct resend_queue *rq,
+		struct firefly_buffer *frame, long timeout_ms,
+		unsigned char retries, struct firefly_rto *rto, int priority,
+		struct firefly_connection *conn)
 {
-	pthread_mutex_lock(&rq->lock);
-	struct resend_elem *re = firefly_resend_pop(rq, id);
-	pthread_mutex_unlock(&rq->lock);
-	if (re == NULL)
-		return;
+	return firefly_resend_add_elem(rq, frame->data, frame->size, frame,
+			timeout_ms, retries, rto, priority, conn);
+}
 
-	// Decrement retries counter
-	re->num_retries--;
+void firefly_resend_readd(struct resend_queue *rq, unsigned int id)
+{
+	struct resend_elem *re;
 
-	timespec_add_ms(&re->resend_at, re->timeout);
-	re->prev = NULL;
 	pthread_mutex_lock(&rq->lock);
-	if (rq->last == NULL) {
-		rq->first = re;
-	} else {
-		rq->last->prev = re;
+	re = firefly_resend_find(rq, id);
+	if (re != NULL) {
+		// Decrement retries counter
+		re->num_retries--;
+		re->resent = true;
+		if (re->rto != NULL)
+			re->timeout = firefly_rto_backoff(re->rto, re->timeout);
+		timespec_add_ms(&re->resend_at, re->timeout);
+		firefly_resend_sift_down(rq, re->heap_index);
+		pthread_cond_signal(&rq->sig);
 	}
-	rq->last = re;
-	pthread_cond_signal(&rq->sig);
 	pthread_mutex_unlock(&rq->lock);
 }
 
-void firefly_resend_remove(struct resend_queue *rq, unsigned char id)
+void firefly_resend_remove(struct resend_queue *rq, unsigned int id)
 {
+	struct resend_elem *re;
+
 	pthread_mutex_lock(&rq->lock);
-	struct resend_elem *re = firefly_resend_pop(rq, id);
-	if (re != NULL)
-		firefly_resend_elem_free(re);
+	re = firefly_resend_unlink(rq, id);
+	if (re != NULL) {
+		if (re->rto != NULL && !re->resent) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			firefly_rto_sample(re->rto, timespec_diff_us(&re->sent_at, &now));
+		}
+		// The element is freed once it reaches the top of the heap.
+		if (re->buf != NULL)
+			firefly_buffer_unref(re->buf);
+		else
+			free(re->data);
+		re->buf = NULL;
+		re->data = NULL;
+		re->acked = true;
+	}
 	pthread_cond_signal(&rq->sig);
 	pthread_mutex_unlock(&rq->lock);
 }
 
 void firefly_resend_elem_free(struct resend_elem *re)
 {
-	free(re->data);
+	if (re->buf != NULL)
+		firefly_buffer_unref(re->buf);
+	else
+		free(re->data);
 	free(re);
 }
 
@@ -162,7 +430,7 @@ struct resend_elem *firefly_resend_top(struct resend_queue *rq)
 {
 	struct resend_elem *re = NULL;
 	pthread_mutex_lock(&rq->lock);
-	re = rq->first;
+	re = firefly_resend_first(rq);
 	pthread_mutex_unlock(&rq->lock);
 	return re;
 }
@@ -173,10 +441,45 @@ static inline bool timespec_past(struct timespec *fixed, struct timespec *var)
 		var->tv_nsec <= fixed->tv_nsec : var->tv_sec < fixed->tv_sec;
 }
 
-int firefly_resend_wait(struct resend_queue *rq,
-		unsigned char **data, size_t *size,
-		struct firefly_connection **conn,
-		unsigned char *id)
+/*
+ * Take a due packet as described for firefly_resend_wait(), the queue must be
+ * locked. The data of a packet kept in a frame is not copied, instead \p buf
+ * is set to a new reference to the frame. Otherwise \p buf is set to NULL.
+ * \p priority is set to the class the packet was first sent with.
+ */
+static int firefly_resend_take(struct resend_queue *rq, struct resend_elem *re,
+		struct firefly_buffer **buf, unsigned char **data, size_t *size,
+		int *priority, struct firefly_connection **conn, unsigned int *id)
+{
+	*conn = re->conn;
+	*buf = NULL;
+	*priority = re->priority;
+	// Check if counter has reached 0
+	if (re->num_retries <= 0) {
+		firefly_resend_unlink(rq, re->id);
+		firefly_resend_heap_remove(rq, re);
+		firefly_resend_elem_free(re);
+		*data = NULL;
+		*id = 0;
+		*size = 0;
+		return -1;
+	}
+	if (re->buf != NULL) {
+		firefly_buffer_ref(re->buf);
+		*buf = re->buf;
+		*data = re->data;
+	} else {
+		*data = malloc(re->size);
+		memcpy(*data, re->data, re->size);
+	}
+	*size = re->size;
+	*id = re->id;
+	return 0;
+}
+
+static int firefly_resend_wait_buffer(struct resend_queue *rq,
+		struct firefly_buffer **buf, unsigned char **data, size_t *size,
+		int *priority, struct firefly_connection **conn, unsigned int *id)
 {
 	int result;
 	struct resend_elem *res = NULL;
@@ -184,7 +487,7 @@ int firefly_resend_wait(struct resend_queue *rq,
 
 	pthread_mutex_lock(&rq->lock);
 	clock_gettime(CLOCK_REALTIME, &now);
-	res = rq->first;
+	res = firefly_resend_first(rq);
 	while (res == NULL || !timespec_past(&now, &res->resend_at)) {
 		if (res == NULL) {
 			pthread_cond_wait(&rq->sig, &rq->lock);
@@ -193,28 +496,33 @@ int firefly_resend_wait(struct resend_queue *rq,
 			pthread_cond_timedwait(&rq->sig, &rq->lock, &at);
 		}
 		clock_gettime(CLOCK_REALTIME, &now);
-		res = rq->first;
-	}
-	*conn = res->conn;
-	// Check if counter has reached 0
-	if (res->num_retries <= 0) {
-		firefly_resend_pop(rq, res->id);
-		firefly_resend_elem_free(res);
-		*data = NULL;
-		*id = 0;
-		*size = 0;
-		result = -1;
-	} else {
-		*data = malloc(res->size);
-		memcpy(*data, res->data, res->size);
-		*size = res->size;
-		*id = res->id;
-		result = 0;
+		res = firefly_resend_first(rq);
 	}
+	result = firefly_resend_take(rq, res, buf, data, size, priority, conn,
+			id);
 	pthread_mutex_unlock(&rq->lock);
 	return result;
 }
 
+int firefly_resend_wait(struct resend_queue *rq,
+		unsigned char **data, size_t *size,
+		struct firefly_connection **conn,
+		unsigned int *id)
+{
+	struct firefly_buffer *buf;
+	int priority;
+	int result;
+
+	result = firefly_resend_wait_buffer(rq, &buf, data, size, &priority, conn,
+			id);
+	if (buf != NULL) {
+		*data = malloc(*size);
+		memcpy(*data, buf->data, *size);
+		firefly_buffer_unref(buf);
+	}
+	return result;
+}
+
 static void firefly_resend_cleanup(void *arg)
 {
 	struct firefly_resend_loop_args *largs;
@@ -226,14 +534,42 @@ static void firefly_resend_cleanup(void *arg)
 	free(arg);
 }
 
+/*
+ * Send a packet taken from the queue again, with the class it was first sent
+ * with if the loop has a resend function, or report that it was not acked.
+ */
+static void firefly_resend_handle(struct firefly_resend_loop_args *largs,
+		int res, struct firefly_buffer *buf, unsigned char *data, size_t size,
+		int priority, struct firefly_connection *conn, unsigned int id)
+{
+	if (res < 0) {
+		if (largs->on_no_ack)
+			largs->on_no_ack(conn);
+	} else {
+		if (largs->resend != NULL)
+			largs->resend(conn, data, size, priority);
+		else
+			conn->transport->write(data, size, conn, false, NULL);
+		if (buf != NULL)
+			firefly_buffer_unref(buf);
+		else
+			free(data);
+		firefly_resend_readd(largs->rq, id);
+		if (largs->on_resend)
+			largs->on_resend(conn);
+	}
+}
+
 void *firefly_resend_run(void *args)
 {
 	struct firefly_resend_loop_args *largs;
 	struct resend_queue *rq;
+	struct firefly_buffer *buf;
 	unsigned char *data;
 	size_t size;
 	struct firefly_connection *conn;
-	unsigned char id;
+	unsigned int id;
+	int priority;
 	int res;
 
 	largs = args;
@@ -244,20 +580,124 @@ void *firefly_resend_run(void *args)
 	while (true) {
 		int prev_state;
 
-		res = firefly_resend_wait(rq, &data, &size, &conn, &id);
+		res = firefly_resend_wait_buffer(rq, &buf, &data, &size, &priority,
+				&conn, &id);
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &prev_state);
-		if (res < 0) {
-			if (largs->on_no_ack)
-				largs->on_no_ack(conn);
-		} else {
-			conn->transport->write(data, size, conn,
-					false, NULL);
-			free(data);
-			firefly_resend_readd(rq, id);
-		}
+		firefly_resend_handle(largs, res, buf, data, size, priority, conn, id);
 		pthread_setcancelstate(prev_state, NULL);
 	}
 
 	pthread_cleanup_pop(1);
 	return NULL;
 }
+
+/*
+ * Collect at most FIREFLY_RESEND_POLL_BATCH packets due at \p now, the queue
+ * must be locked. All ancestors of a due packet in the heap are due as well so
+ * only the subtrees of due packets are searched. Acked packets are skipped.
+ */
+static size_t firefly_resend_collect(struct resend_queue *rq,
+		struct timespec *now, struct resend_elem **due)
+{
+	size_t stack[2 * FIREFLY_RESEND_POLL_BATCH];
+	size_t top = 0;
+	size_t n = 0;
+	size_t i;
+
+	if (rq->heap_len > 0)
+		stack[top++] = 0;
+	while (top > 0 && n < FIREFLY_RESEND_POLL_BATCH) {
+		i = stack[--top];
+		if (!timespec_past(now, &rq->heap[i]->resend_at))
+			continue;
+		if (!rq->heap[i]->acked)
+			due[n++] = rq->heap[i];
+		for (size_t c = 2 * i + 1; c <= 2 * i + 2; c++) {
+			if (c < rq->heap_len && top < 2 * FIREFLY_RESEND_POLL_BATCH)
+				stack[top++] = c;
+		}
+	}
+	return n;
+}
+
+/*
+ * A due packet taken by firefly_resend_poll().
+ */
+struct firefly_resend_due {
+	int res;
+	struct firefly_buffer *buf;
+	unsigned char *data;
+	size_t size;
+	int priority;
+	struct firefly_connection *conn;
+	unsigned int id;
+};
+
+int firefly_resend_poll(void *args)
+{
+	struct firefly_resend_loop_args *largs;
+	struct resend_queue *rq;
+	struct resend_elem *re;
+	struct resend_elem *elems[FIREFLY_RESEND_POLL_BATCH];
+	struct firefly_resend_due due[FIREFLY_RESEND_POLL_BATCH];
+	struct firefly_resend_due *d;
+	struct timespec now;
+	size_t n;
+
+	largs = args;
+	rq = largs->rq;
+	for (;;) {
+		pthread_mutex_lock(&rq->lock);
+		clock_gettime(CLOCK_REALTIME, &now);
+		re = firefly_resend_first(rq);
+		if (re == NULL) {
+			pthread_mutex_unlock(&rq->lock);
+			return -1;
+		}
+		if (!timespec_past(&now, &re->resend_at)) {
+			long long ms;
+
+			ms = (re->resend_at.tv_sec - now.tv_sec) * 1000LL +
+				(re->resend_at.tv_nsec - now.tv_nsec + 999999) / 1000000;
+			pthread_mutex_unlock(&rq->lock);
+			return ms > INT_MAX ? INT_MAX : (int) ms;
+		}
+		// Take the due packets under the lock and send them without it.
+		n = firefly_resend_collect(rq, &now, elems);
+		for (size_t i = 0; i < n; i++) {
+			d = &due[i];
+			d->res = firefly_resend_take(rq, elems[i], &d->buf, &d->data,
+					&d->size, &d->priority, &d->conn, &d->id);
+		}
+		pthread_mutex_unlock(&rq->lock);
+		for (size_t i = 0; i < n; i++) {
+			d = &due[i];
+			firefly_resend_handle(largs, d->res, d->buf, d->data, d->size,
+					d->priority, d->conn, d->id);
+		}
+	}
+}
+
+static void firefly_resend_wake_reactor(void *context)
+{
+	firefly_reactor_posix_wake(context);
+}
+
+int firefly_resend_attach(struct firefly_resend_loop_args *args,
+		struct firefly_reactor_posix *reactor)
+{
+	firefly_resend_set_notify(args->rq, firefly_resend_wake_reactor, reactor);
+	if (firefly_reactor_posix_add_timer(reactor, firefly_resend_poll,
+				args) < 0) {
+		firefly_resend_set_notify(args->rq, NULL, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+void firefly_resend_detach(struct firefly_resend_loop_args *args,
+		struct firefly_reactor_posix *reactor)
+{
+	firefly_reactor_posix_remove_timer(reactor, args);
+	firefly_resend_set_notify(args->rq, NULL, NULL);
+}
@@ -2,6 +2,56 @@
 #define FIREFLY_TRANSPORT_RESEND_QUEUE_H
 
 #include <protocol/firefly_protocol.h>
+#include <utils/firefly_reactor_posix.h>
+
+/**
+ * @brief The retransmission timeout of a connection estimated from the round
+ * trip times of its acked packets.
+ *
+ * The estimate follows RFC 6298: a smoothed round trip time and its variation
+ * are updated with every packet acked without having been resent (Karn's
+ * rule), and the timeout is backed off exponentially while packets are resent.
+ * The timeout is kept between \a min_us and \a max_us. An estimate is only
+ * read and updated by the resend queue it is passed to, under its lock.
+ */
+struct firefly_rto {
+	long srtt_us; /**< The smoothed round trip time, 0 until the first
+					sample. */
+	long rttvar_us; /**< The variation of the round trip time. */
+	long rto_us; /**< The current retransmission timeout. */
+	long min_us; /**< The lower bound of the timeout. */
+	long max_us; /**< The upper bound of the timeout. */
+};
+
+/**
+ * @brief Initialize a retransmission timeout estimate.
+ *
+ * @param rto The estimate to initialize.
+ * @param initial_ms The timeout used until the first round trip time is
+ * measured.
+ * @param min_ms The lower bound of the timeout.
+ * @param max_ms The upper bound of the timeout, raised to \p initial_ms if it
+ * is lower.
+ */
+void firefly_rto_init(struct firefly_rto *rto, long initial_ms, long min_ms,
+		long max_ms);
+
+/**
+ * @brief Update the estimate with a measured round trip time.
+ *
+ * @param rto The estimate to update.
+ * @param rtt_us The round trip time of a packet that was not resent.
+ */
+void firefly_rto_sample(struct firefly_rto *rto, long rtt_us);
+
+/**
+ * @brief Get the current retransmission timeout in the resolution of the
+ * resend queue.
+ *
+ * @param rto The estimate.
+ * @return The timeout in ms rounded up, at least 1.
+ */
+long firefly_rto_timeout_ms(struct firefly_rto *rto);
 
 /**
  * @brief Represents a packet in the resend queue.
@@ -9,26 +59,55 @@
 struct resend_elem {
 	unsigned char *data; /**< The data of the packet. */
 	size_t size; /**< The size of the data. */
-	unsigned char id; /**< The unique identifier of this packet in its queue. */
+	struct firefly_buffer *buf; /**< The referenced frame holding the data,
+								  or NULL if the data is owned by the
+								  element. */
+	unsigned int id; /**< The unique identifier of this packet in its queue. */
 	struct timespec resend_at; /**< The absolute time when this packet must be
 								 sent again. */
 	long timeout; /**< The interval between resends for this packet. */
 	unsigned char num_retries; /**< Number of times left this packet will be
 								 sent until it is removed. */
+	int priority; /**< The priority class the packet was first sent with. */
 	struct firefly_connection *conn; /**< The connection this packet comes from. */
-	struct resend_elem *prev; /**< The next packet in the queue. */
+	struct firefly_rto *rto; /**< The timeout estimate of the connection or
+							   NULL if \a timeout is fixed. */
+	struct timespec sent_at; /**< The monotonic time the packet was first
+							   sent. */
+	bool resent; /**< The packet has been resent, its ack does not give a
+				   round trip time. */
+	bool acked; /**< The packet is removed, its data is released and the
+				  element is freed once it is due. */
+	size_t heap_index; /**< The position of this packet in the heap. */
+	struct resend_elem *next; /**< The next packet in the same bucket of the
+								id table. */
 };
 
 /**
- * @brief The resend queue itself (as a single linked list).
+ * @brief The resend queue itself.
+ *
+ * The packets are kept in a binary min-heap ordered by the time they must be
+ * resent, so packets with different timeouts are resent in time. An acked
+ * packet is found through a hash table indexed by id and only marked as
+ * acked, it is dropped from the heap once it is due.
  */
 struct resend_queue {
-	struct resend_elem *first; /**< The first element in the queue. */
-	struct resend_elem *last; /**< The last element in the queue. */
+	struct resend_elem **heap; /**< The packets ordered by resend_at. */
+	size_t heap_len; /**< The number of packets in the heap, including acked
+					   ones not yet dropped. */
+	size_t heap_size; /**< The allocated size of the heap. */
+	struct resend_elem **table; /**< The buckets of the packets not acked,
+								  indexed by the low bits of their ids. */
+	size_t table_size; /**< The number of buckets, a power of two. */
+	size_t count; /**< The number of packets not acked. */
 	pthread_mutex_t lock; /**< The lock ensuring mutual exclusion when using the
 							queue. */
 	pthread_cond_t sig; /**< Signal used to signal when new packet is added. */
-	unsigned char next_id; /**< Counter keeping track of IDs. */
+	unsigned int next_id; /**< Counter keeping track of IDs. */
+	void (*notify)(void *context); /**< Called when a packet added to the
+									 queue is due before all others, may be
+									 NULL. */
+	void *notify_context; /**< The argument passed to \a notify. */
 };
 
 /**
@@ -53,30 +132,76 @@ struct resend_queue *firefly_resend_queue_new();
 void firefly_resend_queue_free(struct resend_queue *rq);
 
 /**
- * @brief Adds a new element to the back of the provided resend queue with the
- * specified parameters.
+ * @brief Set the function called when a packet is added that is due before
+ * the packets already in the queue, e.g. to wake a thread polling the queue
+ * with firefly_resend_poll().
+ *
+ * @param rq The resend queue.
+ * @param notify The function to call or NULL.
+ * @param context The argument passed to \p notify.
+ */
+void firefly_resend_set_notify(struct resend_queue *rq,
+		void (*notify)(void *context), void *context);
+
+/**
+ * @brief Adds a new element to the provided resend queue with the specified
+ * parameters.
  *
  * @param rq      The queue to add the element to.
  * @param data    The data to resend.
  * @param size    The size of the data to resend.
- * @param timeout_ms      The time to wait before resending this packet.
+ * @param timeout_ms      The time to wait before resending this packet if
+ * \p rto is NULL.
  * @param retries The number of retries before giving up.
+ * @param rto     The timeout estimate of the connection or NULL. If set, the
+ * packet is first resent after the estimated timeout, the interval is doubled
+ * on each resend and the ack of a packet never resent updates the estimate.
+ * @param priority The priority class the packet was sent with, it is passed
+ * to the resend function of the loop resending it.
  * @param conn    The connection to resend on.
  *
- * @return The id assigned to the created resend block.
+ * @return The id assigned to the created resend block, unique among the
+ * packets in the queue.
+ * @retval 0 If the element could not be allocated.
  */
-unsigned char firefly_resend_add(struct resend_queue *rq,
+unsigned int firefly_resend_add(struct resend_queue *rq,
 		unsigned char *data, size_t size, long timeout_ms,
-		unsigned char retries, struct firefly_connection *conn);
+		unsigned char retries, struct firefly_rto *rto, int priority,
+		struct firefly_connection *conn);
+
+/**
+ * @brief Adds a new element like #firefly_resend_add() but keeps the data by
+ * reference to the frame it was sent from instead of taking a copy.
+ *
+ * @param rq      The queue to add the element to.
+ * @param frame   The frame to resend, the reference of the caller is handed
+ * over to the queue.
+ * @param timeout_ms      The time to wait before resending this packet if
+ * \p rto is NULL.
+ * @param retries The number of retries before giving up.
+ * @param rto     The timeout estimate of the connection or NULL.
+ * @param priority The priority class the frame was sent with.
+ * @param conn    The connection to resend on.
+ *
+ * @return The id assigned to the created resend block.
+ * @retval 0 If the element could not be allocated, the frame is released.
+ */
+unsigned int firefly_resend_add_buffer(struct resend_queue *rq,
+		struct firefly_buffer *frame, long timeout_ms,
+		unsigned char retries, struct firefly_rto *rto, int priority,
+		struct firefly_connection *conn);
 
 /**
  * @brief Removes the element from the queue with the provided ID.
  *
+ * The data of the element is released at once, in constant time. If the
+ * packet has a timeout estimate and was never resent its round trip time is
+ * sampled.
  * @param rq The resend queue to remove from.
  * @param id The id of the packet to remove as returned by firefly_resend_add()
  * @see firefly_resend_add()
  */
-void firefly_resend_remove(struct resend_queue *rq, unsigned char id);
+void firefly_resend_remove(struct resend_queue *rq, unsigned int id);
 
 /**
  * @brief Free's a packet including its data.
@@ -86,11 +211,11 @@ void firefly_resend_remove(struct resend_queue *rq, unsigned char id);
 void firefly_resend_elem_free(struct resend_elem *re);
 
 /**
- * @brief Returns, but does not remove, the first element from the queue.
+ * @brief Returns, but does not remove, the element due first in the queue.
  *
  * @param rq The resend_queue to search through.
  *
- * @return The resend element first in the queue.
+ * @return The resend element due first.
  * @retval NULL if the queue is empty.
  */
 struct resend_elem *firefly_resend_top(struct resend_queue *rq);
@@ -107,8 +232,6 @@ struct resend_elem *firefly_resend_top(struct resend_queue *rq);
  * @param conn Result parameter. The pointed to pointer will be set to the
  * connection the returned data shall be sent on.
  * @param id Result parameter. The ID of the packet returned.
- * @param timeout Result parameter. The interval between resends in ms of the
- * packet returned.
  * @return Integer indicating result.
  * @retval 0 If a packet was returned and should be sent again.
  * @retval <0 If a packet was found but its number of retries was exceeded. In
@@ -119,21 +242,23 @@ struct resend_elem *firefly_resend_top(struct resend_queue *rq);
  * @see #firefly_resend_readd()
  */
 int firefly_resend_wait(struct resend_queue *rq, unsigned char **data,
-		size_t *size, struct firefly_connection **conn, unsigned char *id);
+		size_t *size, struct firefly_connection **conn, unsigned int *id);
 
 /**
  * @brief Add a timeout to a packet already in the resend queue.
  *
- * Add to queue again, add timeout to resend_at, return -1 if retries reached 0
+ * The number of retries of the packet is decremented and the timeout of the
+ * packet is added to its resend time. The timeout of a packet with a timeout
+ * estimate is doubled first and the estimate is backed off to at least the
+ * new timeout. Nothing is done if the packet was removed meanwhile.
  * @param rq The resend queue the packet is in.
  * @param id The id of the packet to add the timeout to.
- * @param timeout_ms The timeout in ms to add to the packet.
  *
  * @note This function must be called after calling #firefly_resend_wait() to
- * push the packet to the back of the queue.
+ * move the packet to its new place in the queue.
  * @see #firefly_resend_wait()
  */
-void firefly_resend_readd(struct resend_queue *rq, unsigned char id);
+void firefly_resend_readd(struct resend_queue *rq, unsigned int id);
 
 /**
  * @brief The argument to #firefly_resend_run.
@@ -143,6 +268,16 @@ struct firefly_resend_loop_args {
 	void (*on_no_ack)(struct firefly_connection *conn); /**< A callback called
 														  when a packet is not
 														  acked in time. */
+	void (*on_resend)(struct firefly_connection *conn); /**< A callback called
+														  when a packet is
+														  resent, may be
+														  NULL. */
+	void (*resend)(struct firefly_connection *conn, unsigned char *data,
+			size_t size, int priority); /**< Writes a due packet again with the
+										  priority class it was added with,
+										  or NULL to write it with the write
+										  function of the transport
+										  connection. */
 };
 
 /**
@@ -152,12 +287,55 @@ struct firefly_resend_loop_args {
  * The loop consists of running #firefly_resend_wait(). On error call
  * #firefly_connection_error_f() in the \c struct #firefly_connection_actions of
  * the connection. For each successfully fetched packet it will be written using
+ * the \c resend function of the arguments, or
  * #firefly_transport_connection_write_f() in the \c struct
- * #firefly_transport_connection of the connection and then readded with
- * #firefly_resend_readd().
+ * #firefly_transport_connection of the connection if it is NULL, and then
+ * readded with #firefly_resend_readd().
  *
  * @param args The #firefly_resend_queue.
  * @return Nothing
  */
 void *firefly_resend_run(void *args);
+
+/**
+ * @brief Resend or give up on every packet that is due without blocking.
+ *
+ * Handles due packets like #firefly_resend_run but returns instead of
+ * waiting for the next one. The due packets are taken from the queue in
+ * batches and written, or reported to \c on_no_ack, after the queue is
+ * unlocked. Implements #firefly_reactor_posix_timer_f so the
+ * resend queue of a link layer port can be polled by a reactor instead of a
+ * thread of its own.
+ *
+ * @param args The #firefly_resend_loop_args.
+ * @return The number of milliseconds until the next packet is due.
+ * @retval <0 if the queue is empty.
+ */
+int firefly_resend_poll(void *args);
+
+/**
+ * @brief Let a reactor poll the resend queue instead of running
+ * #firefly_resend_run in a thread of its own.
+ *
+ * The reactor is woken whenever a packet is added that is due before all
+ * packets already in the queue, so it never sleeps past the earliest one.
+ *
+ * @param args The #firefly_resend_loop_args, must stay valid until detached.
+ * @param reactor The reactor to poll the queue.
+ * @return Integer indicating result.
+ * @retval 0 on success.
+ * @retval <0 on failure.
+ * @see #firefly_resend_detach()
+ */
+int firefly_resend_attach(struct firefly_resend_loop_args *args,
+		struct firefly_reactor_posix *reactor);
+
+/**
+ * @brief Stop a reactor from polling the resend queue.
+ *
+ * @param args The #firefly_resend_loop_args given to firefly_resend_attach().
+ * @param reactor The reactor polling the queue.
+ */
+void firefly_resend_detach(struct firefly_resend_loop_args *args,
+		struct firefly_reactor_posix *reactor);
 #endif
@@ -59,7 +59,7 @@ static inline void timespec_add_ms(struct timespec *t, long d)
 	t->tv_nsec = tmp;
 }
 
-unsigned char firefly_resend_add(struct resend_queue *rq,
+unsigned int firefly_resend_add(struct resend_queue *rq,
 		unsigned char *data, size_t size, long timeout_ms,
 		unsigned char retries, struct firefly_connection *conn)
 {
@@ -98,7 +98,7 @@ unsigned char firefly_resend_add(struct resend_queue *rq,
 }
 
 static inline struct resend_elem *firefly_resend_pop(
-		struct resend_queue *rq, unsigned char id)
+		struct resend_queue *rq, unsigned int id)
 {
 	struct resend_elem *re;
 
@@ -130,7 +130,7 @@ static inline struct resend_elem *firefly_resend_pop(
 	return NULL;
 }
 
-void firefly_resend_readd(struct resend_queue *rq, unsigned char id)
+void firefly_resend_readd(struct resend_queue *rq, unsigned int id)
 {
 	struct resend_elem *re;
 
@@ -157,7 +157,7 @@ void firefly_resend_readd(struct resend_queue *rq, unsigned char id)
 	semGive(rq->sig);
 }
 
-void firefly_resend_remove(struct resend_queue *rq, unsigned char id)
+void firefly_resend_remove(struct resend_queue *rq, unsigned int id)
 {
 	struct resend_elem *re;
 
@@ -197,7 +197,7 @@ static inline bool timespec_past(struct timespec *fixed, struct timespec *var)
 int firefly_resend_wait(struct resend_queue *rq,
 		unsigned char **data, size_t *size,
 		struct firefly_connection **conn,
-		unsigned char *id)
+		unsigned int *id)
 {
 	int result;
 	struct resend_elem *res = NULL;
@@ -256,7 +256,7 @@ void *firefly_resend_run(void *args)
 	unsigned char *data;
 	size_t size;
 	struct firefly_connection *conn;
-	unsigned char id;
+	unsigned int id;
 	int res;
 
 	largs = args;
@@ -273,6 +273,8 @@ void *firefly_resend_run(void *args)
 			conn->transport->write(data, size, conn, false, NULL);
 			free(data);
 			firefly_resend_readd(rq, id);
+			if (largs->on_resend)
+				largs->on_resend(conn);
 		}
 		taskUnsafe();
 	}
@@ -11,7 +11,7 @@
 struct resend_elem {
 	char *data;
 	size_t size;
-	unsigned char id;
+	unsigned int id;
 	struct timespec resend_at;
 	long timeout;
 	unsigned char num_retries;
@@ -27,7 +27,7 @@ struct resend_queue {
 	struct resend_elem *last;
 	SEM_ID lock;
 	SEM_ID sig;
-	unsigned char next_id;
+	unsigned int next_id;
 };
 
 /**
@@ -64,7 +64,7 @@ void firefly_resend_queue_free(struct resend_queue *rq);
  *
  * @return The id assigned to the created resend block.
  */
-unsigned char firefly_resend_add(struct resend_queue *rq,
+unsigned int firefly_resend_add(struct resend_queue *rq,
 		unsigned char *data, size_t size, long timeout_ms,
 		unsigned char retries, struct firefly_connection *conn);
 
@@ -75,7 +75,7 @@ unsigned char firefly_resend_add(struct resend_queue *rq,
  * @param id The id of the packet to remove as returned by firefly_resend_add()
  * @see firefly_resend_add()
  */
-void firefly_resend_remove(struct resend_queue *rq, unsigned char id);
+void firefly_resend_remove(struct resend_queue *rq, unsigned int id);
 
 /**
  * @brief Free's a packet including its data.
@@ -118,7 +118,7 @@ struct resend_elem *firefly_resend_top(struct resend_queue *rq);
  * @see #firefly_resend_readd()
  */
 int firefly_resend_wait(struct resend_queue *rq, unsigned char **data,
-		size_t *size, struct firefly_connection **conn, unsigned char *id);
+		size_t *size, struct firefly_connection **conn, unsigned int *id);
 
 /**
  * @brief Add a timeout to a packet already in the resend queue.
@@ -132,7 +132,7 @@ int firefly_resend_wait(struct resend_queue *rq, unsigned char **data,
  * push the packet to the back of the queue.
  * @see #firefly_resend_wait()
  */
-void firefly_resend_readd(struct resend_queue *rq, unsigned char id);
+void firefly_resend_readd(struct resend_queue *rq, unsigned int id);
 
 /**
  * @brief The argument to #firefly_resend_run.
@@ -142,6 +142,10 @@ struct firefly_resend_loop_args {
 	void (*on_no_ack)(struct firefly_connection *conn); /**< A callback called
 														  when a packet is not
 														  acked in time. */
+	void (*on_resend)(struct firefly_connection *conn); /**< A callback called
+														  when a packet is
+														  resent, may be
+														  NULL. */
 };
 
 /**